@@ -41,9 +41,11 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <wait.h>
 #include <err.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
 #include <stdio.h>
 #include <semaphore.h>
@@ -54,6 +56,7 @@
 #include <sys/time.h> /* For setitimer */
 #include <pmctrack_internal.h>
 #include <dirent.h>
+#include "symbols.h"
 
 #ifndef  _GNU_SOURCE
 #define _GNU_SOURCE
@@ -77,6 +80,33 @@
 #define CMD_FLAG_SYSTEM_WIDE_MODE	(1<<7)
 #define CMD_FLAG_SHOW_TIME_SECS	(1<<8)
 #define CMD_FLAG_SHOW_ELAPSED_TIME	(1<<9)
+#define CMD_FLAG_PERCPU_BUFFER	(1<<10)
+#define CMD_FLAG_DROP_NEWEST	(1<<11)
+#define CMD_FLAG_TIMELINE	(1<<12)
+
+/* Options that only have a long name */
+#define OPT_MAX_OVERHEAD	256
+#define OPT_SAMPLE_IP	257
+#define OPT_CALLCHAIN	258
+#define OPT_CGROUP	259
+#define OPT_MUX_WEIGHTS	260
+#define OPT_CPUS	261
+#define OPT_IDLE	262
+#define OPT_TIMELINE	263
+#define OPT_FILTER	264
+
+static const struct option long_options[]= {
+	{"max-overhead",required_argument,NULL,OPT_MAX_OVERHEAD},
+	{"ip",no_argument,NULL,OPT_SAMPLE_IP},
+	{"callchain",no_argument,NULL,OPT_CALLCHAIN},
+	{"cgroup",required_argument,NULL,OPT_CGROUP},
+	{"mux-weights",required_argument,NULL,OPT_MUX_WEIGHTS},
+	{"cpus",required_argument,NULL,OPT_CPUS},
+	{"idle",required_argument,NULL,OPT_IDLE},
+	{"timeline",no_argument,NULL,OPT_TIMELINE},
+	{"filter",required_argument,NULL,OPT_FILTER},
+	{NULL,0,NULL,0}
+};
 
 /* Monitoring modes supported */
 typedef enum {
@@ -85,6 +115,9 @@ typedef enum {
 	PMCTRACK_MODE_ATTACH
 } monitoring_mode_t;
 
+/* Max number of cgroups that can be monitored at once */
+#define MAX_CGROUPS 256
+
 /*
  * Structure to store information about command-line options
  * specified by the user
@@ -93,9 +126,21 @@ struct options {
 	/* Global switches */
 	int timeout_secs;
 	int msecs;
+	int usecs;	/* Sampling period in microseconds */
 	int max_samples;
 	int max_ebs_samples;
+	double max_overhead;	/* Sampling overhead budget in % (0 -> fixed sampling rate) */
+	int capture_ip;	/* 0: disabled, 1: IP in EBS samples, 2: IP + call chain */
+	char* mux_weights;	/* Relative share of time of each experiment (NULL -> round robin) */
+	char* sample_filter;	/* Predicates evaluated in the kernel to discard samples (NULL -> none) */
 	int kernel_buffer_size;
+	int sample_format;
+	int wakeup_samples;
+	/* Cgroups monitored in system-wide mode (--cgroup) */
+	char* cgroups[MAX_CGROUPS];
+	int nr_cgroups;
+	char* syswide_cpus;	/* CPUs monitored in system-wide mode (NULL -> all) */
+	int idle_policy;	/* What to do with idle CPUs in system-wide mode (-1 -> default) */
 #ifdef OLD_CPUMASK
 	unsigned long cpumask;
 #else
@@ -149,6 +194,15 @@ struct pid_ctrl {
 	unsigned long exp_mask;
 	/* To keep track of the number of samples accumulated */
 	unsigned int nr_samples_accum[MAX_COUNTER_CONFIGS];
+	/*
+	 * Time each experiment was enabled and running. Samples carry the
+	 * cumulative values for the thread, so the last ones seen are kept
+	 * (totals computed by the kernel are added up, though).
+	 */
+	uint64_t time_enabled[MAX_COUNTER_CONFIGS];
+	uint64_t time_running[MAX_COUNTER_CONFIGS];
+	/* The entry holds the totals of a process rather than those of a thread */
+	unsigned char process_totals;
 };
 
 void sigalarm_handler(int signo) {};
@@ -289,6 +343,53 @@ static inline void pmctrack_exit(int status)
 #endif
 }
 
+/*
+ * Parse the sampling period passed to -T. The value is expressed in seconds
+ * unless it carries a "ms" or "us" suffix (e.g., 0.5, 10ms, 200us).
+ * Returns the period in microseconds or -1 if the string is not valid.
+ */
+static int parse_sampling_period(const char* str)
+{
+	char* suffix;
+	double val=strtod(str,&suffix);
+	double scale;
+
+	if (suffix==str || val<=0)
+		return -1;
+
+	if (*suffix=='\0' || strcmp(suffix,"s")==0)
+		scale=1000000.0;
+	else if (strcmp(suffix,"ms")==0)
+		scale=1000.0;
+	else if (strcmp(suffix,"us")==0)
+		scale=1.0;
+	else
+		return -1;
+
+	if (val*scale<1.0 || val*scale>(double)INT_MAX)
+		return -1;
+
+	return (int)(val*scale);
+}
+
+/*
+ * Parse the argument of --max-overhead: a percentage with an optional
+ * '%' suffix (e.g., 1%, 0.5). Returns -1 if the string is not valid.
+ */
+static double parse_overhead_budget(const char* str)
+{
+	char* suffix;
+	double val=strtod(str,&suffix);
+
+	if (suffix==str || (*suffix!='\0' && strcmp(suffix,"%")!=0))
+		return -1;
+
+	if (val<=0 || val>100)
+		return -1;
+
+	return val;
+}
+
 /* Sets up a timer that fires after a certain number of msecs */
 static unsigned int alarm_ms(unsigned int mseconds)
 {
@@ -335,6 +436,22 @@ static void print_counter_mappings(FILE* fout,
 
 }
 
+/*
+ * Show the cgroup each index found in the "cgroup"
+ * column of the output corresponds to
+ */
+static void print_cgroup_mappings(FILE* fout, struct options* opts)
+{
+	int i;
+
+	if (!opts->nr_cgroups || (opts->flags & CMD_FLAG_LEGACY_OUTPUT))
+		return;
+
+	fprintf(fout,"[Monitored cgroups]\n");
+	for (i=0; i<opts->nr_cgroups; i++)
+		fprintf(fout,"cgroup%d=%s\n",i,opts->cgroups[i]);
+}
+
 
 /*
  *  Returns non-zero if the child process has been running longer
@@ -577,9 +694,43 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 		if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
 			pmctrack_exit(1);
 
+		/* Use per-CPU sample buffers in the kernel if requested */
+		if ((opts->flags & CMD_FLAG_PERCPU_BUFFER) && pmct_set_percpu_buffer(1))
+			pmctrack_exit(1);
+
+		if (opts->sample_format!=-1 && pmct_set_sample_format(opts->sample_format))
+			pmctrack_exit(1);
+
+		if ((opts->flags & CMD_FLAG_DROP_NEWEST) && pmct_set_buffer_policy(PMC_BUF_POLICY_DROP))
+			pmctrack_exit(1);
+
+		/*
+		 * -A: let the kernel add up the samples, unless -n/-N are used
+		 * (they are enforced as samples arrive). Upon failure,
+		 * samples are just aggregated here as usual.
+		 */
+		if ((opts->flags & CMD_FLAG_ACUM_SAMPLES) && opts->max_samples==-1 && opts->timeout_secs==-1)
+			pmct_set_kernel_aggregation(1);
+
+		if (opts->wakeup_samples>0 && pmct_set_wakeup_watermark(opts->wakeup_samples,0,opts->msecs))
+			pmctrack_exit(1);
+
 		if (opts->max_ebs_samples>0)
 			pmct_config_max_ebs_samples(opts->max_ebs_samples);
 
+		if (opts->max_overhead>0 && pmct_config_max_overhead(opts->max_overhead))
+			pmctrack_exit(1);
+
+		if (opts->capture_ip && pmct_config_capture_ip(opts->capture_ip))
+			pmctrack_exit(1);
+
+		if (opts->mux_weights && pmct_config_mux_weights(opts->mux_weights))
+			pmctrack_exit(1);
+
+		/* Must be set before the sample buffer gets allocated */
+		if (opts->sample_filter && pmct_config_sample_filter(opts->sample_filter))
+			pmctrack_exit(1);
+
 		/* Configure counters if there is something to configure */
 		if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0))
 			pmctrack_exit(1);
@@ -587,7 +738,7 @@ static void monitoring_counters(struct options* opts,int optind,char** argv)
 		/* Set up sampling period
 			(check whether the kernel control the counters or not)
 		*/
-		if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
+		if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0)))
 			pmctrack_exit(1);
 
 		if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,0))
@@ -638,6 +789,7 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	pmc_sample_t** acum_samples=NULL;
 	struct pid_ctrl* pid_ctrl_vector=NULL;
 	unsigned int nr_experiments;
+	int i;
 
 	child_status = 0;
 	nr_virtual_counters=opts->nr_virtual_counters;
@@ -676,6 +828,21 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	if (opts->kernel_buffer_size!=-1 && pmct_set_kernel_buffer_size(opts->kernel_buffer_size))
 		pmctrack_exit(1);
 
+	if (opts->sample_format!=-1 && pmct_set_sample_format(opts->sample_format))
+		pmctrack_exit(1);
+
+	if ((opts->flags & CMD_FLAG_DROP_NEWEST) && pmct_set_buffer_policy(PMC_BUF_POLICY_DROP))
+		pmctrack_exit(1);
+
+	if (opts->wakeup_samples>0 && pmct_set_wakeup_watermark(opts->wakeup_samples,0,opts->msecs))
+		pmctrack_exit(1);
+
+	if (opts->mux_weights && pmct_config_mux_weights(opts->mux_weights))
+		pmctrack_exit(1);
+
+	if (opts->idle_policy!=-1 && pmct_syswide_set_idle_policy(opts->idle_policy))
+		pmctrack_exit(1);
+
 	/* Configure counters if there is something to configure */
 	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,PMCT_CONFIG_SYSWIDE))
 		pmctrack_exit(1);
@@ -683,7 +850,7 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	/* Set up sampling period
 		(check whether the kernel control the counters or not)
 	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0)))
+	if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0)))
 		pmctrack_exit(1);
 
 	if (opts->virtcfg && pmct_config_virtual_counters(opts->virtcfg,PMCT_CONFIG_SYSWIDE))
@@ -698,6 +865,15 @@ void monitoring_counters_syswide(struct options* opts,int optind,char** argv)
 	child_finished=0;
 	stop_profiling = 0;
 
+	/* Samples are gathered per cgroup if any was selected */
+	for (i=0; i<opts->nr_cgroups; i++) {
+		if (pmct_syswide_add_cgroup(opts->cgroups[i]))
+			pmctrack_exit(1);
+	}
+
+	if (opts->syswide_cpus && pmct_syswide_set_cpus(opts->syswide_cpus))
+		pmctrack_exit(1);
+
 	/* Enable profiling !! */
 	if (pmct_syswide_start_counting())
 		pmctrack_exit(1);
@@ -969,6 +1145,33 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 		goto free_up_pid_set;
 	}
 
+	/* Use per-CPU sample buffers in the kernel if requested */
+	if ((opts->flags & CMD_FLAG_PERCPU_BUFFER) && pmct_set_percpu_buffer(1)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	if (opts->sample_format!=-1 && pmct_set_sample_format(opts->sample_format)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	if ((opts->flags & CMD_FLAG_DROP_NEWEST) && pmct_set_buffer_policy(PMC_BUF_POLICY_DROP)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	if (opts->wakeup_samples>0 && pmct_set_wakeup_watermark(opts->wakeup_samples,0,opts->msecs)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	/* Must be set before the sample buffer gets allocated */
+	if (opts->sample_filter && pmct_config_sample_filter(opts->sample_filter)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
 	/* Configure counters if there is something to configure */
 	if (opts->strcfg[0] && pmct_config_counters((const char**)opts->strcfg,0)) {
 		exit_val=1;
@@ -978,7 +1181,23 @@ static void monitoring_counters_attach(struct options* opts,int optind,char** ar
 	/* Set up sampling period
 		(check whether the kernel control the counters or not)
 	*/
-	if (pmct_config_timeout(opts->msecs,(!(opts->strcfg)[0] && npmcs!=0))) {
+	if (pmct_config_timeout_us(opts->usecs,(!(opts->strcfg)[0] && npmcs!=0))) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	/* Attached threads inherit the overhead budget from the monitor */
+	if (opts->max_overhead>0 && pmct_config_max_overhead(opts->max_overhead)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	if (opts->capture_ip && pmct_config_capture_ip(opts->capture_ip)) {
+		exit_val=1;
+		goto free_up_pid_set;
+	}
+
+	if (opts->mux_weights && pmct_config_mux_weights(opts->mux_weights)) {
 		exit_val=1;
 		goto free_up_pid_set;
 	}
@@ -1011,6 +1230,177 @@ free_up_pid_set:
 	exit(exit_val);
 }
 
+/*
+ * Add up a sample into the accumulated values of its thread (-A option).
+ * Totals computed by the kernel are added as is: they are extrapolated
+ * (if event multiplexing is in use) by print_accumulated_samples().
+ */
+static int accumulate_sample(pmc_sample_t* cur, struct pid_ctrl* pid_ctrl_vector,
+                             pmc_sample_t** acum_samples, int* nr_pids, int nr_experiments,
+                             unsigned int pmcmask, unsigned int virtual_mask)
+{
+	int j=0;
+	unsigned char copy_metadata=0;
+	unsigned char process_totals=(cur->type==PMC_PROCESS_TOTAL_SAMPLE);
+	unsigned char kernel_totals=(process_totals || cur->type==PMC_THREAD_TOTAL_SAMPLE);
+
+	/* Search PID in set */
+	while (j<(*nr_pids) && (pid_ctrl_vector[j].pid!=cur->pid || pid_ctrl_vector[j].process_totals!=process_totals))
+		j++;
+
+	/* PID not found */
+	if (j==(*nr_pids)) {
+		/* Add new item to set */
+		pid_ctrl_vector[j].pid=cur->pid;
+		pid_ctrl_vector[j].exp_mask=0;
+		pid_ctrl_vector[j].process_totals=process_totals;
+		(*nr_pids)++;
+		acum_samples[j]=malloc(sizeof(pmc_sample_t)*nr_experiments);
+
+		if (!acum_samples[j]) {
+			fprintf(stderr,"Couldn't reserve memory for cummulative counters");
+			return 1;
+		}
+	}
+
+	if (! (pid_ctrl_vector[j].exp_mask & (1<<cur->exp_idx))) {
+		/* Time to copy metadata ... */
+		copy_metadata=1;
+		pid_ctrl_vector[j].exp_mask|=1<<cur->exp_idx;
+		pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]=0;
+		pid_ctrl_vector[j].time_enabled[cur->exp_idx]=0;
+		pid_ctrl_vector[j].time_running[cur->exp_idx]=0;
+		memset(&acum_samples[j][cur->exp_idx],0,sizeof(pmc_sample_t));
+	}
+
+	if (kernel_totals) {
+		/* Needed to extrapolate the counts of multiplexed experiments */
+		pid_ctrl_vector[j].time_enabled[cur->exp_idx]+=cur->time_enabled;
+		pid_ctrl_vector[j].time_running[cur->exp_idx]+=cur->time_running;
+		pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]+=cur->nr_samples;
+		pmct_accumulate_sample (1,pmcmask,virtual_mask,copy_metadata,cur,&acum_samples[j][cur->exp_idx]);
+	} else {
+		pid_ctrl_vector[j].time_enabled[cur->exp_idx]=cur->time_enabled;
+		pid_ctrl_vector[j].time_running[cur->exp_idx]=cur->time_running;
+		pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]++;
+		pmct_accumulate_sample (nr_experiments,pmcmask,virtual_mask,copy_metadata,cur,&acum_samples[j][cur->exp_idx]);
+	}
+
+	return 0;
+}
+
+/* Print the values accumulated for the various threads (or processes) */
+static void print_accumulated_samples(FILE* fo, unsigned char process_totals, struct pid_ctrl* pid_ctrl_vector,
+                                      pmc_sample_t** acum_samples, int nr_pids, int nr_experiments,
+                                      unsigned int pmcmask, unsigned int virtual_mask, unsigned int show_elapsed_time)
+{
+	int i,j;
+	int header_printed=0;
+
+	for (i=0; i<nr_pids; i++) {
+		if (pid_ctrl_vector[i].process_totals!=process_totals)
+			continue;
+
+		if (process_totals && !header_printed) {
+			fprintf(fo,"# Per-process totals\n");
+			header_printed=1;
+		}
+
+		for (j=0; j<nr_experiments; j++) {
+			if ( pid_ctrl_vector[i].exp_mask & (1<<j)) {
+				pmct_scale_sample(&acum_samples[i][j],pid_ctrl_vector[i].time_enabled[j],pid_ctrl_vector[i].time_running[j]);
+				pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask,
+				                   extended_output, show_elapsed_time, pid_ctrl_vector[i].nr_samples_accum[j], &acum_samples[i][j]);
+			}
+		}
+	}
+}
+
+/*
+ * Reorder buffer for the timeline output (--timeline). Samples from
+ * different threads and CPUs may be retrieved slightly out of order
+ * (e.g., from different per-CPU buffers), so they are held back
+ * for a while and then printed in timestamp order.
+ */
+struct timeline {
+	pmc_sample_t* samples;
+	unsigned int nr_samples;
+	unsigned int capacity;
+	uint64_t window_ns;	/* How long samples are held back */
+	uint64_t last_ts;	/* Most recent timestamp seen so far */
+	int nsample;		/* Samples printed so far */
+};
+
+static int compare_sample_timestamps(const void* a, const void* b)
+{
+	const pmc_sample_t* sa=a;
+	const pmc_sample_t* sb=b;
+
+	if (sa->timestamp!=sb->timestamp)
+		return sa->timestamp<sb->timestamp?-1:1;
+
+	return sa->cpu-sb->cpu;
+}
+
+static int timeline_add(struct timeline* tl, pmc_sample_t* sample)
+{
+	pmc_sample_t* samples;
+	unsigned int capacity;
+
+	if (tl->nr_samples==tl->capacity) {
+		capacity=tl->capacity?2*tl->capacity:256;
+
+		if ((samples=realloc(tl->samples,capacity*sizeof(pmc_sample_t)))==NULL) {
+			warnx("Couldn't reserve memory for the timeline\n");
+			return 1;
+		}
+
+		tl->samples=samples;
+		tl->capacity=capacity;
+	}
+
+	tl->samples[tl->nr_samples++]=(*sample);
+
+	if (sample->timestamp>tl->last_ts)
+		tl->last_ts=sample->timestamp;
+
+	return 0;
+}
+
+/*
+ * Print the samples that are older than the reorder window
+ * (or all of them if flush_all is set)
+ */
+static void timeline_print(FILE* fo, struct timeline* tl, int flush_all, int nr_experiments,
+                           unsigned int pmcmask, unsigned int virtual_mask, unsigned int show_elapsed_time)
+{
+	pmc_sample_t* cur;
+	unsigned int i;
+
+	qsort(tl->samples,tl->nr_samples,sizeof(pmc_sample_t),compare_sample_timestamps);
+
+	for (i=0; i<tl->nr_samples; i++) {
+		cur=&tl->samples[i];
+
+		if (!flush_all && cur->timestamp+tl->window_ns>tl->last_ts)
+			break;
+
+		fprintf(fo,"%10llu.%09llu ",
+		        (unsigned long long)(cur->timestamp/1000000000ULL),
+		        (unsigned long long)(cur->timestamp%1000000000ULL));
+
+		if (cur->cpu<0)
+			fprintf(fo,"%4s ","-");
+		else
+			fprintf(fo,"%4d ",cur->cpu);
+
+		pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, show_elapsed_time, ++tl->nsample, cur);
+	}
+
+	tl->nr_samples-=i;
+	memmove(tl->samples,&tl->samples[i],tl->nr_samples*sizeof(pmc_sample_t));
+}
+
 static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned int pmcmask,
                                unsigned int virtual_mask,struct pid_ctrl* pid_ctrl_vector,
                                pmc_sample_t** acum_samples, monitoring_mode_t mode, pid_set_t* set)
@@ -1022,11 +1412,22 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 	int nr_samples;
 	unsigned int max_buffer_samples;
 	int detached=1;
+	int shared_region=0;
 	unsigned int show_elapsed_time=(opts->flags & CMD_FLAG_SHOW_ELAPSED_TIME);
+	uint64_t nr_lost_samples=0;
+	pid_t root_pid=(mode==PMCTRACK_MODE_ATTACH)?opts->target_pid:pid;
+	/* Second column of the output: pid, cpu or cgroup */
+	int syswide_column=(mode==PMCTRACK_MODE_SYSWIDE)?(opts->nr_cgroups?2:1):0;
+	int timeline=(opts->flags & CMD_FLAG_TIMELINE);
+	/* Samples are held back for two sampling periods at most */
+	struct timeline tl= {NULL,0,0,2000ULL*opts->usecs,0,0};
 
 	if (mode==PMCTRACK_MODE_ATTACH)
 		detached=0;
 
+	if (opts->capture_ip && !ebs_on)
+		warnx("--ip/--callchain only have an effect in EBS mode\n");
+
 	profile_started=1;
 
 	if ( (fd = pmct_open_monitor_entry())<0 )
@@ -1036,6 +1437,10 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 		/* Request shared memory region */
 		if ((samples=pmct_request_shared_memory_region(fd,&max_buffer_samples))==NULL)
 			goto error_path;
+		shared_region=1;
+	} else if ((samples=pmct_request_sample_ring(fd,(opts->kernel_buffer_size+4095)/4096,&max_buffer_samples))) {
+		/* Samples will be stored directly in a ring as big as the kernel buffer */
+		shared_region=1;
 	} else {
 		/* Reserve a big buffer from the heap directly */
 		max_buffer_samples=opts->kernel_buffer_size/sizeof(pmc_sample_t);
@@ -1045,7 +1450,10 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 	/* Print header if necessary */
 	if (!(opts->flags & CMD_FLAG_ACUM_SAMPLES)) {
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, show_elapsed_time);
+		print_cgroup_mappings(fo,opts);
+		if (timeline)
+			fprintf(fo,"%20s %4s ","timestamp","cpu");
+		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, syswide_column, show_elapsed_time);
 	}
 	/* Print child counters */
 	while(!stop_profiling) {
@@ -1053,14 +1461,26 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 		 * Do this while !child_finished
 		 * Note that in the ATTACH mode, child_finished is always false
 		 */
-		if (!child_finished) {
+		if (child_finished || (shared_region && pmct_ring_samples_available(fd))) {
+			/* Samples ready */
+		} else if (opts->wakeup_samples>0) {
+			/* The kernel notifies us once enough samples are buffered */
+			pmct_poll_samples(fd,-1);
+		} else {
 			alarm_ms(opts->msecs);
 			pause();
 		}
 
 		/* Check if Ctrl+C was pressed */
 		if(!stop_profiling) {
-			nr_samples=pmct_read_samples(fd,samples,max_buffer_samples);
+			/* The address space of the process vanishes once it exits */
+			if (opts->capture_ip && (mode==PMCTRACK_MODE_ATTACH || !child_finished))
+				symbols_update_maps(root_pid);
+
+			if (shared_region)
+				nr_samples=pmct_read_samples_mmap(fd,&samples,max_buffer_samples);
+			else
+				nr_samples=pmct_read_samples(fd,samples,max_buffer_samples);
 
 			if (nr_samples < 0)
 				goto error_path;
@@ -1080,37 +1500,36 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 			for (i=0; i<nr_samples; i++) {
 				pmc_sample_t* cur=&samples[i];
 
-				if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
-					int j=0;
-					unsigned char copy_metadata=0;
-
-					/* Search PID in set */
-					while (j<nr_pids && pid_ctrl_vector[j].pid!=cur->pid)
-						j++;
-
-					/* PID not found */
-					if (j==nr_pids) {
-						/* Add new item to set */
-						pid_ctrl_vector[j].pid=cur->pid;
-						pid_ctrl_vector[j].exp_mask=0;
-						nr_pids++;
-						acum_samples[j]=malloc(sizeof(pmc_sample_t)*nr_experiments);
-
-						if (!acum_samples[j]) {
-							fprintf(stderr,"Couldn't reserve memory for cummulative counters");
+				/* The kernel could not deliver some samples */
+				if (cur->type==PMC_LOST_SAMPLE) {
+					nr_lost_samples+=cur->pmc_counts[PMC_LOST_DROPPED]+cur->pmc_counts[PMC_LOST_OVERWRITTEN];
+					if (timeline) {
+						if (timeline_add(&tl,cur))
 							goto error_path;
-						}
-					}
+					} else if (!(opts->flags & CMD_FLAG_ACUM_SAMPLES))
+						pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, show_elapsed_time, cont, cur);
+					continue;
+				}
 
-					if (! (pid_ctrl_vector[j].exp_mask & (1<<cur->exp_idx))) {
-						/* Time to copy metadata ... */
-						copy_metadata=1;
-						pid_ctrl_vector[j].exp_mask|=1<<cur->exp_idx;
-						pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]=1;
-					} else
-						pid_ctrl_vector[j].nr_samples_accum[cur->exp_idx]++;
+				/* The CPU stayed idle during the whole period (system-wide mode) */
+				if (cur->type==PMC_IDLE_SAMPLE) {
+					if (timeline) {
+						if (timeline_add(&tl,cur))
+							goto error_path;
+					} else if (!(opts->flags & CMD_FLAG_ACUM_SAMPLES))
+						pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, show_elapsed_time, cont, cur);
+					continue;
+				}
 
-					pmct_accumulate_sample (nr_experiments,pmcmask,virtual_mask,copy_metadata,cur,&acum_samples[j][cur->exp_idx]);
+				if (opts->capture_ip)
+					symbols_account_sample(cur,root_pid);
+
+				if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
+					if (accumulate_sample(cur,pid_ctrl_vector,acum_samples,&nr_pids,nr_experiments,pmcmask,virtual_mask))
+						goto error_path;
+				} else if (timeline) {
+					if (timeline_add(&tl,cur))
+						goto error_path;
 				} else {
 					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask, extended_output, show_elapsed_time, cont, cur);
 				}
@@ -1133,27 +1552,39 @@ static void process_pmc_counts(struct options* opts, int nr_experiments,unsigned
 					}
 				}
 			}
+
+			if (timeline)
+				timeline_print(fo,&tl,0,nr_experiments,pmcmask,virtual_mask,show_elapsed_time);
 		}
 	}//end while
 
+	if (timeline)
+		timeline_print(fo,&tl,1,nr_experiments,pmcmask,virtual_mask,show_elapsed_time);
+
+	if (nr_lost_samples)
+		fprintf(stderr, "Warning: %llu samples were lost (kernel buffer full). Consider increasing its size with -k\n",
+		        (unsigned long long)nr_lost_samples);
+
 	/* Generate output from accumulated values */
 	if (opts->flags & CMD_FLAG_ACUM_SAMPLES) {
 
 		print_counter_mappings(fo,opts,nr_experiments);
-		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, mode==PMCTRACK_MODE_SYSWIDE, show_elapsed_time);
-
-		/* Generate samples for the various threads */
-		for (i=0; i<nr_pids; i++) {
-			int j=0;
-			for (j=0; j<nr_experiments; j++) {
-				if ( pid_ctrl_vector[i].exp_mask & (1<<j))
-					pmct_print_sample (fo,nr_experiments, pmcmask, virtual_mask,
-					                   extended_output, show_elapsed_time, pid_ctrl_vector[i].nr_samples_accum[j], &acum_samples[i][j]);
-			}
-		}
+		print_cgroup_mappings(fo,opts);
+		pmct_print_header(fo,nr_experiments,pmcmask,virtual_mask,extended_output, syswide_column, show_elapsed_time);
+
+		/* Generate samples for the various threads (and processes) */
+		print_accumulated_samples(fo,0,pid_ctrl_vector,acum_samples,nr_pids,nr_experiments,pmcmask,virtual_mask,show_elapsed_time);
+		print_accumulated_samples(fo,1,pid_ctrl_vector,acum_samples,nr_pids,nr_experiments,pmcmask,virtual_mask,show_elapsed_time);
+	}
+
+	if (opts->capture_ip) {
+		symbols_print_report(fo);
+		symbols_destroy();
 	}
 
 error_path:
+	free(tl.samples);
+
 	if (!detached)
 		detach_pid_set(set,opts->target_pid);
 
@@ -1204,6 +1635,7 @@ void init_options( struct options* opts)
 	unsigned int i;
 
 	opts->msecs = 1000;
+	opts->usecs = 1000000;
 	opts->virtcfg = NULL;
 	opts->nr_virtual_counters=opts->virtual_mask=0;
 
@@ -1220,9 +1652,18 @@ void init_options( struct options* opts)
 #endif
 	opts->max_samples = -1;
 	opts->max_ebs_samples= -1;
+	opts->max_overhead=0;
+	opts->capture_ip=0;
+	opts->mux_weights=NULL;
+	opts->sample_filter=NULL;
 	opts->flags=0;
 	opts->target_pid=-1;
 	opts->kernel_buffer_size = -1;
+	opts->sample_format = -1;
+	opts->wakeup_samples = 0;
+	opts->nr_cgroups = 0;
+	opts->syswide_cpus = NULL;
+	opts->idle_policy = -1;
 	opts->user_nr_configs=0;
 	opts->pmu_id=0;
 	memset(opts->event_mapping,0,sizeof(counter_mapping_t)*MAX_PERFORMANCE_COUNTERS);
@@ -1318,6 +1759,18 @@ int check_options(struct options* opts,char *argv[],int optind)
 	} else if ( (opts->flags & CMD_FLAG_SHOW_CHILD_TIMES) && opts->target_pid!=-1 ) {
 		warnx("Attach mode (-p) not compatible with -t option\n");
 		return 4;
+	} else if ( (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) && opts->max_overhead>0 ) {
+		warnx("System wide mode (-S) not compatible with --max-overhead\n");
+		return 5;
+	} else if ( (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) && opts->capture_ip ) {
+		warnx("System wide mode (-S) not compatible with --ip/--callchain\n");
+		return 6;
+	} else if ( (opts->flags & CMD_FLAG_TIMELINE) && (opts->flags & CMD_FLAG_ACUM_SAMPLES) ) {
+		warnx("Aggregate count mode (-A) not compatible with --timeline\n");
+		return 7;
+	} else if ( (opts->flags & CMD_FLAG_SYSTEM_WIDE_MODE) && opts->sample_filter ) {
+		warnx("System wide mode (-S) not compatible with --filter\n");
+		return 8;
 	}
 	return 0;
 }
@@ -1331,16 +1784,24 @@ static void usage(const char* program_name,int status)
 		printf ("Available oprions:");
 		printf ("\n\t-c\t<config-string>\n\t\tset up a performance monitoring experiment using either raw or mnemonic-based PMC string");
 		printf ("\n\t-o\t<output>\n\t\toutput: set output file for the results. (default = stdout.)");
-		printf ("\n\t-T\t<Time>\n\t\tTime: elapsed time in seconds between two consecutive counter samplings. (default = 1 sec.)");
+		printf ("\n\t-T\t<Time>\n\t\tTime: elapsed time in seconds between two consecutive counter samplings. (default = 1 sec.)\n\t\tThe \"ms\" and \"us\" suffixes can be used to specify the period in milliseconds or microseconds (e.g., 10ms, 200us)");
 		printf ("\n\t-b\t<cpu or mask>\n\t\tbind launched program to the specified cpu o cpumask.");
 		printf ("\n\t-n\t<max-samples>\n\t\tRun command until a given number of samples are collected");
 		printf ("\n\t-N\t<secs>\n\t\tRun command for secs seconds only");
 		printf ("\n\t-e\n\t\tEnable extended output");
 		printf ("\n\t-E\n\t\tShow additional column with elapsed time between samples");
-		printf ("\n\t-A\n\t\tEnable aggregate count mode");
+		printf ("\n\t--timeline\n\t\tPrint samples from all threads and CPUs in timestamp order, with two extra columns:\n\t\tthe CLOCK_MONOTONIC time when each sample was gathered and the CPU it comes from");
+		printf ("\n\t-A\n\t\tEnable aggregate count mode (samples are added up in the kernel when launching a command without -n or -N)");
 		printf ("\n\t-k\t<kernel_buffer_size>\n\t\tSpecify the size of the kernel buffer used for the PMC samples");
+		printf ("\n\t-R\n\t\tUse per-CPU lock-free sample buffers in the kernel (per-thread monitoring modes)");
+		printf ("\n\t-D\n\t\tDrop new samples when the kernel buffer is full (the oldest ones are overwritten by default)");
+		printf ("\n\t-W\t<nsamples>\n\t\tRetrieve samples from the kernel in batches of nsamples (or once per sampling period at least)");
+		printf ("\n\t-F\t<format>\n\t\tFormat of the samples transferred from the kernel: full (default), compact or varint");
 		printf ("\n\t-b\t<cpu or mask>\n\t\tbind monitor program to the specified cpu o cpumask.");
 		printf ("\n\t-S\n\t\tEnable system-wide monitoring mode (per-CPU)");
+		printf ("\n\t--cgroup\t<path>\n\t\tGather samples per cgroup in system-wide mode (path in the cgroup v2 hierarchy; can be used several times).\n\t\tThe etime_us column shows the CPU time used by the cgroup");
+		printf ("\n\t--cpus\t<cpu list>\n\t\tRestrict system-wide monitoring to a list of CPUs (e.g., 0-15,64-79)");
+		printf ("\n\t--idle\t<policy>\n\t\tWhat to do with CPUs that stay idle during a sampling period in system-wide mode: sample (default), skip or mark.\n\t\tTheir counts are reported in the next regular sample of the CPU");
 		printf ("\n\t-r\t\n\t\tAccept pmc configuration strings in the RAW format");
 		printf ("\n\t-P\t<pmu>\n\t\tSpecify the PMU id to use for the event configuration");
 		printf ("\n\t-L\n\t\tLegacy-mode: do not show counter-to-event mapping");
@@ -1348,6 +1809,11 @@ static void usage(const char* program_name,int status)
 		printf ("\n\t-st\n\t\tDisplay real time in seconds (when -t option is enabled)");
 		printf ("\n\t-p\t<pid>\n\t\tAttach to existing process with given pid");
 		printf ("\n\t-K\t<nsamples>\n\t\tSetup maximum number of samples (in EBS mode) that the application will actually execute");
+		printf ("\n\t--max-overhead\t<pct>[%%]\n\t\tAdjust the sampling period (TBS) or the EBS reset value at runtime to keep the sampling overhead below pct percent");
+		printf ("\n\t--ip\n\t\tRecord the instruction pointer in EBS samples and report the hottest functions at the end");
+		printf ("\n\t--callchain\n\t\tLike --ip, but also record the user-space call chain (requires code built with frame pointers)");
+		printf ("\n\t--mux-weights\t<w0,w1,...>\n\t\tGive each multiplexed experiment a share of time proportional to its weight (round robin by default).\n\t\tCounts reported with -A are extrapolated to the whole monitoring time");
+		printf ("\n\t--filter\t<predicates>\n\t\tOnly deliver samples for which any of the predicates holds (e.g., pmc1/pmc0<0.5,1000*pmc3/pmc1>20).\n\t\tFiltered-out samples are added up in per-thread totals, reported when each thread exits");
 		printf ("\nPROG + ARGS:\n\t\tCommand line for the program to be monitored.\n");
 		break;
 	case -2:
@@ -1368,7 +1834,7 @@ static void usage(const char* program_name,int status)
 int main(int argc, char *argv[])
 {
 	fo = stdout;
-	char optc;
+	int optc;
 	static struct options opts;
 
 	init_options(&opts);
@@ -1377,7 +1843,7 @@ int main(int argc, char *argv[])
 		usage(argv[0],0);
 
 	/* Process command-line options ... */
-	while ((optc = getopt(argc, argv, "+hc:T:o:b:n:V:B:eAk:SrP:LtN:p:sEK:")) != (char)-1) {
+	while ((optc = getopt_long(argc, argv, "+hc:T:o:b:n:V:B:eAk:SrP:LtN:p:sEK:RF:W:D", long_options, NULL)) != -1) {
 		switch (optc) {
 		case 'o':
 			if((fo = fopen(optarg, "w")) == NULL)
@@ -1395,7 +1861,12 @@ int main(int argc, char *argv[])
 				exit(1);
 			break;
 		case 'T':
-			opts.msecs = (int)1000.0*atof(optarg);
+			if ((opts.usecs=parse_sampling_period(optarg))<0) {
+				warnx("Invalid sampling period: %s",optarg);
+				exit(1);
+			}
+			/* The millisecond period is used for timers in user space */
+			opts.msecs = opts.usecs>=1000 ? opts.usecs/1000 : 1;
 			break;
 		case 'b':
 			str_to_cpuset(optarg,&opts.cpumask);
@@ -1447,6 +1918,69 @@ int main(int argc, char *argv[])
 		case 'K':
 			opts.max_ebs_samples=atoi(optarg);
 			break;
+		case 'R':
+			opts.flags|=CMD_FLAG_PERCPU_BUFFER;
+			break;
+		case 'D':
+			opts.flags|=CMD_FLAG_DROP_NEWEST;
+			break;
+		case 'W':
+			opts.wakeup_samples=atoi(optarg);
+			break;
+		case 'F':
+			if ((opts.sample_format=pmct_parse_sample_format(optarg))<0) {
+				warnx("Unknown sample format: %s\n",optarg);
+				exit(1);
+			}
+			break;
+		case OPT_SAMPLE_IP:
+			if (!opts.capture_ip)
+				opts.capture_ip=1;
+			break;
+		case OPT_CALLCHAIN:
+			opts.capture_ip=2;
+			break;
+		case OPT_CGROUP:
+			if (opts.nr_cgroups==MAX_CGROUPS) {
+				warnx("Too many cgroups (%d at most)\n",MAX_CGROUPS);
+				exit(1);
+			}
+			opts.cgroups[opts.nr_cgroups++]=optarg;
+			/* Cgroup-scoped monitoring is a flavor of the system-wide mode */
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
+		case OPT_MUX_WEIGHTS:
+			opts.mux_weights=optarg;
+			break;
+		case OPT_TIMELINE:
+			opts.flags|=CMD_FLAG_TIMELINE;
+			break;
+		case OPT_FILTER:
+			opts.sample_filter=optarg;
+			break;
+		case OPT_CPUS:
+			opts.syswide_cpus=optarg;
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
+		case OPT_IDLE:
+			if (strcmp(optarg,"sample")==0)
+				opts.idle_policy=PMC_SYSWIDE_IDLE_SAMPLE;
+			else if (strcmp(optarg,"skip")==0)
+				opts.idle_policy=PMC_SYSWIDE_IDLE_SKIP;
+			else if (strcmp(optarg,"mark")==0)
+				opts.idle_policy=PMC_SYSWIDE_IDLE_MARK;
+			else {
+				warnx("Unknown idle policy: %s\n",optarg);
+				exit(1);
+			}
+			opts.flags|=CMD_FLAG_SYSTEM_WIDE_MODE;
+			break;
+		case OPT_MAX_OVERHEAD:
+			if ((opts.max_overhead=parse_overhead_budget(optarg))<0) {
+				warnx("Invalid overhead budget: %s\n",optarg);
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Wrong option: %c\n", optc);
 			exit(1);
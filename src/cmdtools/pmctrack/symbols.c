@@ -0,0 +1,534 @@
+/*
+ * symbols.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * Instruction pointers are first mapped to an executable mapping
+ * of the process (/proc/<pid>/maps), then translated into a virtual
+ * address of the ELF object backing that mapping, and finally looked up
+ * in the object's symbol table (.symtab, or .dynsym for stripped objects).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <link.h> /* For ElfW() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symbols.h"
+
+#define NATIVE_ELFCLASS	(__ELF_NATIVE_CLASS==64?ELFCLASS64:ELFCLASS32)
+
+struct dso;
+
+typedef struct {
+	uint64_t start;
+	uint64_t size;
+	char* name;
+	struct dso* dso;
+	uint64_t self;			/* Samples whose IP falls in this function */
+	uint64_t total;			/* Samples whose call chain includes this function */
+	unsigned long stamp;	/* Last sample accounted for in total */
+} symbol_t;
+
+/* PT_LOAD segment of an ELF object */
+typedef struct {
+	uint64_t offset;
+	uint64_t filesz;
+	uint64_t vaddr;
+} segment_t;
+
+/* ELF object (executable or shared library) */
+typedef struct dso {
+	char* path;
+	symbol_t* syms;			/* Sorted by start address */
+	unsigned int nr_syms;
+	segment_t* segments;
+	unsigned int nr_segments;
+	symbol_t unknown;		/* Addresses not covered by any symbol */
+	struct dso* next;
+} dso_t;
+
+/* Executable mapping of a process */
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	dso_t* dso;
+} mapping_t;
+
+typedef struct proc_maps {
+	pid_t pid;
+	mapping_t* maps;
+	unsigned int nr_maps;
+	unsigned long epoch;		/* Value of maps_epoch in the last read attempt (0=never) */
+	struct proc_maps* alias;	/* Maps used instead if ours could not be read */
+	struct proc_maps* next;
+} proc_maps_t;
+
+static dso_t* dso_list=NULL;
+static proc_maps_t* maps_list=NULL;
+static unsigned long maps_epoch=1;
+static unsigned long nr_samples=0;
+static symbol_t kernel_sym= {.name="[kernel]"};
+static symbol_t unknown_sym= {.name="[unknown]"};
+
+static int compare_symbols(const void* a, const void* b)
+{
+	const symbol_t* sa=a;
+	const symbol_t* sb=b;
+
+	if (sa->start<sb->start)
+		return -1;
+	else
+		return sa->start>sb->start;
+}
+
+/* Load the PT_LOAD segments and function symbols of the object */
+static void load_elf_object(dso_t* dso)
+{
+	int fd;
+	struct stat st;
+	char* base;
+	ElfW(Ehdr)* ehdr;
+	ElfW(Phdr)* phdr;
+	ElfW(Shdr)* shdr;
+	ElfW(Shdr)* symtab=NULL;
+	ElfW(Sym)* sym;
+	const char* strtab;
+	unsigned int i,j,nr_entries;
+
+	if ((fd=open(dso->path,O_RDONLY))==-1)
+		return;
+
+	if (fstat(fd,&st) || st.st_size<sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return;
+	}
+
+	base=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+
+	if (base==MAP_FAILED)
+		return;
+
+	ehdr=(ElfW(Ehdr)*)base;
+
+	if (memcmp(ehdr->e_ident,ELFMAG,SELFMAG) || ehdr->e_ident[EI_CLASS]!=NATIVE_ELFCLASS
+	    || ehdr->e_phoff+(uint64_t)ehdr->e_phnum*sizeof(ElfW(Phdr))>st.st_size
+	    || ehdr->e_shoff+(uint64_t)ehdr->e_shnum*sizeof(ElfW(Shdr))>st.st_size)
+		goto out_unmap;
+
+	phdr=(ElfW(Phdr)*)(base+ehdr->e_phoff);
+	shdr=(ElfW(Shdr)*)(base+ehdr->e_shoff);
+
+	if ((dso->segments=malloc(sizeof(segment_t)*(ehdr->e_phnum+1)))==NULL)
+		goto out_unmap;
+
+	for (i=0; i<ehdr->e_phnum; i++) {
+		if (phdr[i].p_type!=PT_LOAD)
+			continue;
+		dso->segments[dso->nr_segments].offset=phdr[i].p_offset;
+		dso->segments[dso->nr_segments].filesz=phdr[i].p_filesz;
+		dso->segments[dso->nr_segments].vaddr=phdr[i].p_vaddr;
+		dso->nr_segments++;
+	}
+
+	/* Prefer the full symbol table over the dynamic one */
+	for (i=0; i<ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type==SHT_SYMTAB)
+			symtab=&shdr[i];
+		else if (shdr[i].sh_type==SHT_DYNSYM && !symtab)
+			symtab=&shdr[i];
+	}
+
+	if (!symtab || symtab->sh_link>=ehdr->e_shnum || !symtab->sh_entsize
+	    || symtab->sh_offset+symtab->sh_size>st.st_size
+	    || shdr[symtab->sh_link].sh_offset+shdr[symtab->sh_link].sh_size>st.st_size)
+		goto out_unmap;
+
+	sym=(ElfW(Sym)*)(base+symtab->sh_offset);
+	strtab=base+shdr[symtab->sh_link].sh_offset;
+	nr_entries=symtab->sh_size/symtab->sh_entsize;
+
+	if ((dso->syms=malloc(sizeof(symbol_t)*(nr_entries+1)))==NULL)
+		goto out_unmap;
+
+	for (i=0; i<nr_entries; i++) {
+		if (ELF64_ST_TYPE(sym[i].st_info)!=STT_FUNC || sym[i].st_shndx==SHN_UNDEF
+		    || !sym[i].st_value || sym[i].st_name>=shdr[symtab->sh_link].sh_size)
+			continue;
+
+		memset(&dso->syms[dso->nr_syms],0,sizeof(symbol_t));
+		dso->syms[dso->nr_syms].start=sym[i].st_value;
+		dso->syms[dso->nr_syms].size=sym[i].st_size;
+		/* The string table may not be NUL-terminated */
+		dso->syms[dso->nr_syms].name=strndup(strtab+sym[i].st_name,
+		                                     shdr[symtab->sh_link].sh_size-sym[i].st_name);
+		if (!dso->syms[dso->nr_syms].name)
+			continue;
+		dso->syms[dso->nr_syms].dso=dso;
+		dso->nr_syms++;
+	}
+
+	qsort(dso->syms,dso->nr_syms,sizeof(symbol_t),compare_symbols);
+
+	/* Drop aliases and give symbols with no size the room up to the next one */
+	for (i=0,j=0; i<dso->nr_syms; i++) {
+		if (j>0 && dso->syms[j-1].start==dso->syms[i].start) {
+			free(dso->syms[i].name);
+			continue;
+		}
+		dso->syms[j++]=dso->syms[i];
+	}
+	dso->nr_syms=j;
+
+	for (i=0; i+1<dso->nr_syms; i++) {
+		if (!dso->syms[i].size)
+			dso->syms[i].size=dso->syms[i+1].start-dso->syms[i].start;
+	}
+
+out_unmap:
+	munmap(base,st.st_size);
+}
+
+/* Objects are shared by all processes */
+static dso_t* get_dso(const char* path)
+{
+	dso_t* dso;
+
+	for (dso=dso_list; dso!=NULL; dso=dso->next)
+		if (strcmp(dso->path,path)==0)
+			return dso;
+
+	if ((dso=malloc(sizeof(dso_t)))==NULL)
+		return NULL;
+
+	memset(dso,0,sizeof(dso_t));
+	dso->path=strdup(path);
+	dso->unknown.name="[unknown]";
+	dso->unknown.dso=dso;
+	load_elf_object(dso);
+	dso->next=dso_list;
+	dso_list=dso;
+	return dso;
+}
+
+/* (Re)read the executable mappings of a process */
+static int read_proc_maps(proc_maps_t* proc)
+{
+	char path[64];
+	char line[PATH_MAX+128];
+	FILE* fmaps;
+	mapping_t* maps=NULL;
+	mapping_t* tmp;
+	unsigned int nr_maps=0,max_maps=0;
+	uint64_t start,end,offset;
+	char perms[5];
+	char* file;
+	int n;
+
+	proc->epoch=maps_epoch;
+	sprintf(path,"/proc/%d/maps",proc->pid);
+
+	if ((fmaps=fopen(path,"r"))==NULL)
+		return -1;
+
+	while (fgets(line,sizeof(line),fmaps)) {
+		if (sscanf(line,"%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*u %n",
+		           &start,&end,perms,&offset,&n)!=4 || perms[2]!='x')
+			continue;
+
+		file=line+n;
+		file[strcspn(file,"\n")]='\0';
+
+		/* Anonymous and special mappings ([vdso], ...) are not backed by a file */
+		if (file[0]!='/')
+			continue;
+
+		if (nr_maps==max_maps) {
+			max_maps=max_maps?2*max_maps:32;
+			if ((tmp=realloc(maps,sizeof(mapping_t)*max_maps))==NULL)
+				break;
+			maps=tmp;
+		}
+
+		maps[nr_maps].start=start;
+		maps[nr_maps].end=end;
+		maps[nr_maps].offset=offset;
+		if ((maps[nr_maps].dso=get_dso(file))!=NULL)
+			nr_maps++;
+	}
+
+	fclose(fmaps);
+
+	/* A process that is gone leaves an empty file behind */
+	if (!nr_maps) {
+		free(maps);
+		return -1;
+	}
+
+	free(proc->maps);
+	proc->maps=maps;
+	proc->nr_maps=nr_maps;
+	return 0;
+}
+
+static proc_maps_t* lookup_proc_maps(pid_t pid)
+{
+	proc_maps_t* proc;
+
+	for (proc=maps_list; proc!=NULL; proc=proc->next)
+		if (proc->pid==pid)
+			return proc;
+
+	if ((proc=malloc(sizeof(proc_maps_t)))==NULL)
+		return NULL;
+
+	memset(proc,0,sizeof(proc_maps_t));
+	proc->pid=pid;
+	proc->next=maps_list;
+	maps_list=proc;
+	return proc;
+}
+
+/* Maps to resolve addresses of pid (loaded on first use) */
+static proc_maps_t* get_proc_maps(pid_t pid, pid_t pid_fallback)
+{
+	proc_maps_t* proc;
+
+	if ((proc=lookup_proc_maps(pid))==NULL)
+		return NULL;
+
+	if (proc->epoch==0 && read_proc_maps(proc) && pid!=pid_fallback) {
+		proc->alias=lookup_proc_maps(pid_fallback);
+
+		if (proc->alias && proc->alias->epoch==0)
+			read_proc_maps(proc->alias);
+	}
+
+	return proc->alias?proc->alias:proc;
+}
+
+static mapping_t* find_mapping(proc_maps_t* proc, uint64_t ip)
+{
+	unsigned int i;
+
+	for (i=0; i<proc->nr_maps; i++)
+		if (ip>=proc->maps[i].start && ip<proc->maps[i].end)
+			return &proc->maps[i];
+
+	return NULL;
+}
+
+static symbol_t* lookup_symbol(mapping_t* map, uint64_t ip)
+{
+	dso_t* dso=map->dso;
+	uint64_t file_offset=ip-map->start+map->offset;
+	uint64_t vaddr;
+	segment_t* seg=NULL;
+	unsigned int i;
+	int low,high,mid;
+
+	for (i=0; i<dso->nr_segments && !seg; i++)
+		if (file_offset>=dso->segments[i].offset
+		    && file_offset<dso->segments[i].offset+dso->segments[i].filesz)
+			seg=&dso->segments[i];
+
+	if (!seg)
+		return &dso->unknown;
+
+	vaddr=file_offset-seg->offset+seg->vaddr;
+
+	/* Find the last symbol that starts at or before vaddr */
+	low=0;
+	high=dso->nr_syms-1;
+
+	while (low<=high) {
+		mid=(low+high)/2;
+		if (dso->syms[mid].start<=vaddr)
+			low=mid+1;
+		else
+			high=mid-1;
+	}
+
+	if (high>=0 && vaddr<dso->syms[high].start+dso->syms[high].size)
+		return &dso->syms[high];
+
+	return &dso->unknown;
+}
+
+static symbol_t* resolve_address(pid_t pid, pid_t pid_fallback, uint64_t ip)
+{
+	proc_maps_t* proc;
+	mapping_t* map;
+
+	/* Kernel addresses live in the upper half of the address space */
+	if ((int64_t)ip<0)
+		return &kernel_sym;
+
+	if ((proc=get_proc_maps(pid,pid_fallback))==NULL)
+		return &unknown_sym;
+
+	map=find_mapping(proc,ip);
+
+	/* The process may have mapped new objects (e.g., dlopen()) */
+	if (!map && proc->epoch!=maps_epoch && !read_proc_maps(proc))
+		map=find_mapping(proc,ip);
+
+	return map?lookup_symbol(map,ip):&unknown_sym;
+}
+
+void symbols_update_maps(pid_t pid)
+{
+	proc_maps_t* proc=lookup_proc_maps(pid);
+
+	maps_epoch++;
+
+	if (proc)
+		read_proc_maps(proc);
+}
+
+void symbols_account_sample(pmc_sample_t* sample, pid_t pid_fallback)
+{
+	unsigned int i;
+	unsigned int nr=sample->nr_callchain;
+	symbol_t* sym;
+
+	if (nr==0)
+		return;
+
+	if (nr>PMC_MAX_CALLCHAIN)
+		nr=PMC_MAX_CALLCHAIN;
+
+	nr_samples++;
+
+	for (i=0; i<nr; i++) {
+		sym=resolve_address(sample->pid,pid_fallback,sample->callchain[i]);
+
+		if (i==0)
+			sym->self++;
+
+		/* Recursive calls count only once per sample */
+		if (sym->stamp!=nr_samples) {
+			sym->stamp=nr_samples;
+			sym->total++;
+		}
+	}
+}
+
+static int compare_hotspots(const void* a, const void* b)
+{
+	const symbol_t* sa=*(const symbol_t**)a;
+	const symbol_t* sb=*(const symbol_t**)b;
+
+	if (sa->self!=sb->self)
+		return sa->self<sb->self?1:-1;
+	if (sa->total!=sb->total)
+		return sa->total<sb->total?1:-1;
+	return 0;
+}
+
+void symbols_print_report(FILE* fo)
+{
+	dso_t* dso;
+	symbol_t** hotspots;
+	unsigned int nr_hotspots=0,max_hotspots=2;
+	unsigned int i;
+	const char* object;
+
+	fprintf(fo,"\n# Hotspots (%lu samples with IP)\n",nr_samples);
+
+	if (!nr_samples)
+		return;
+
+	for (dso=dso_list; dso!=NULL; dso=dso->next)
+		max_hotspots+=dso->nr_syms+1;
+
+	if ((hotspots=malloc(sizeof(symbol_t*)*max_hotspots))==NULL)
+		return;
+
+	if (kernel_sym.total)
+		hotspots[nr_hotspots++]=&kernel_sym;
+	if (unknown_sym.total)
+		hotspots[nr_hotspots++]=&unknown_sym;
+
+	for (dso=dso_list; dso!=NULL; dso=dso->next) {
+		if (dso->unknown.total)
+			hotspots[nr_hotspots++]=&dso->unknown;
+		for (i=0; i<dso->nr_syms; i++)
+			if (dso->syms[i].total)
+				hotspots[nr_hotspots++]=&dso->syms[i];
+	}
+
+	qsort(hotspots,nr_hotspots,sizeof(symbol_t*),compare_hotspots);
+
+	fprintf(fo,"#%8s %8s %10s  %s\n","self%","total%","samples","symbol");
+
+	for (i=0; i<nr_hotspots; i++) {
+		object=NULL;
+
+		if (hotspots[i]->dso) {
+			object=strrchr(hotspots[i]->dso->path,'/');
+			object=object?object+1:hotspots[i]->dso->path;
+		}
+
+		fprintf(fo,"%8.2f%% %7.2f%% %10" PRIu64 "  %s%s%s%s\n",
+		        100.0*hotspots[i]->self/nr_samples,
+		        100.0*hotspots[i]->total/nr_samples,
+		        hotspots[i]->self,
+		        hotspots[i]->name,
+		        object?" [":"",object?object:"",object?"]":"");
+	}
+
+	free(hotspots);
+}
+
+void symbols_destroy(void)
+{
+	dso_t* dso;
+	proc_maps_t* proc;
+	unsigned int i;
+
+	while ((dso=dso_list)!=NULL) {
+		dso_list=dso->next;
+		for (i=0; i<dso->nr_syms; i++)
+			free(dso->syms[i].name);
+		free(dso->syms);
+		free(dso->segments);
+		free(dso->path);
+		free(dso);
+	}
+
+	while ((proc=maps_list)!=NULL) {
+		maps_list=proc->next;
+		free(proc->maps);
+		free(proc);
+	}
+}
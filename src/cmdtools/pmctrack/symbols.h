@@ -0,0 +1,53 @@
+/*
+ * symbols.h
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * Resolution of the instruction pointers found in EBS samples to
+ * function symbols, and per-symbol aggregation of those samples.
+ */
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <pmc_user.h>
+
+/*
+ * Read /proc/<pid>/maps again. This must be done while the process
+ * is still alive, as the address space is gone by the time it is reaped.
+ */
+void symbols_update_maps(pid_t pid);
+
+/*
+ * Account for the IP and call chain of a sample. pid_fallback is used
+ * to resolve addresses of threads whose maps cannot be read anymore.
+ */
+void symbols_account_sample(pmc_sample_t* sample, pid_t pid_fallback);
+
+/* Print the per-symbol hotspot table (sorted by self samples) */
+void symbols_print_report(FILE* fo);
+
+/* Free up memory */
+void symbols_destroy(void);
+
+#endif
@@ -130,6 +130,14 @@ int pmct_config_virtual_counters(const char* virtcfg, unsigned long flags);
  */
 int pmct_config_timeout(int msecs, int kernel_control);
 
+/*
+ * Setup timeout for TBS or scheduler-driven monitoring mode (specified in us).
+ * The kernel module rejects periods shorter than 50us.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_timeout_us(int usecs, int kernel_control);
+
 
 /*
  * Setup maximum number of samples (in EBS mode) that the application
@@ -141,6 +149,49 @@ int pmct_config_timeout(int msecs, int kernel_control);
  */
 int pmct_config_max_ebs_samples(unsigned int max_ebs_samples);
 
+/*
+ * Setup the maximum sampling overhead (as a percentage of the execution time)
+ * for the calling thread and the threads it creates. The kernel adjusts
+ * the TBS period and the EBS reset value at runtime to honor the budget.
+ * A zero value disables the adaptive sampling-rate controller.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_max_overhead(double max_overhead_pct);
+
+/*
+ * Make EBS samples of the calling thread (and the threads it creates)
+ * carry the instruction pointer where the event overflowed (mode=1),
+ * or the IP plus the user-space call chain (mode=2).
+ * mode=0 disables the capture.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_capture_ip(int mode);
+
+/*
+ * Schedule the multiplexed experiments of the calling thread (and the
+ * threads it creates) so that each one gets a share of time proportional
+ * to its weight ("w0,w1,..."). "0" restores plain round-robin rotation.
+ * The enabled/running times reported in samples make it possible to
+ * extrapolate the counts in either case (see pmct_scale_sample()).
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_mux_weights(const char* weights);
+
+/*
+ * Install a sample filter for the calling thread (and the threads it
+ * creates). The filter is a comma-separated list of predicates of the form
+ * "[scale*]pmcN[/pmcM]{<,<=,>,>=}value" (e.g., "pmc1/pmc0<0.5"); a sample
+ * is delivered to user space if any predicate holds. Samples that are
+ * filtered out are still accounted for in the per-thread totals.
+ * "none" removes the filter. Must be invoked before configuring the counters.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_config_sample_filter(const char* filter);
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in per-thread mode
  *
@@ -159,7 +210,8 @@ int pmct_start_counting( void );
  * extended_output: Use a non-zero value if nr_experiments>1 or different
  *                  events sets are monitored in the various cores of
  *                  an asymmetric multicore system
- * syswide: Use a non-zero value if the system-wide mode is enabled.
+ * syswide: Use a non-zero value if the system-wide mode is enabled
+ *          (2 if samples are gathered per cgroup).
  * show_elapsed_time: Use a non-zero value to print additional column with the elapsed time
  * 					  relative to the previous sample
  */
@@ -217,6 +269,13 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
                              pmc_sample_t* sample,
                              pmc_sample_t* accum);
 
+/*
+ * Extrapolate the PMC counts of a sample gathered with event multiplexing:
+ * counts are multiplied by time_enabled/time_running, where time_running
+ * is the time the sample's experiment was actually active.
+ */
+void pmct_scale_sample(pmc_sample_t* sample, uint64_t time_enabled, uint64_t time_running);
+
 /*
  * Become the monitor process of another process with PID=pid.
  * Upon invocation to this function the monitor process will
@@ -256,6 +315,9 @@ int pmct_open_monitor_entry(void);
  * samples: Array used to store the retrieved samples
  * max_samples: Maximum capacity of the "samples" array
  *
+ * If a sample ring was mapped for fd, samples are copied out of it
+ * and read() is only invoked to wait for samples when the ring is empty.
+ *
  * The function returns 0 on success, and a non-zero value upon failure.
  *
  */
@@ -274,6 +336,39 @@ int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples);
  */
 pmc_sample_t* pmct_request_shared_memory_region(int monitor_fd, unsigned int* max_samples);
 
+/* Default number of data pages of the sample ring (see pmct_request_sample_ring()) */
+#define PMCT_MMAP_RING_DATA_PAGES 64
+
+/*
+ * Map a sample ring made up of a control page and nr_data_pages data pages,
+ * where the kernel writes samples directly. pmct_request_shared_memory_region()
+ * uses this mechanism if the kernel module supports it.
+ *
+ * The function returns a pointer to the first sample slot in the ring, and NULL upon failure.
+ */
+pmc_sample_t* pmct_request_sample_ring(int monitor_fd, unsigned int nr_data_pages, unsigned int* max_samples);
+
+/* Unmap the shared memory region associated with a monitor file descriptor */
+void pmct_release_shared_memory_region(int monitor_fd);
+
+/*
+ * Retrieve performance samples from the shared memory region associated with fd
+ * without copying them. Upon return, *samples points to an array of samples
+ * located in the shared region itself. These samples remain valid until the
+ * next call to this function (or pmct_read_samples()) for the same descriptor.
+ * When the sample ring is in use, read() is only invoked to block when the ring is empty.
+ *
+ * The function returns the number of samples available (0 when the monitored
+ * threads finished), and a negative value upon failure.
+ */
+int pmct_read_samples_mmap (int fd, pmc_sample_t** samples, int max_samples);
+
+/*
+ * Return the number of samples that can be retrieved right away
+ * from the sample ring associated with fd (0 if no ring was mapped).
+ */
+int pmct_ring_samples_available(int fd);
+
 /*
  * Set up the size of the kernel buffer used to store PMC and virtual
  * counter values
@@ -282,6 +377,72 @@ pmc_sample_t* pmct_request_shared_memory_region(int monitor_fd, unsigned int* ma
  */
 int pmct_set_kernel_buffer_size(unsigned int nr_bytes);
 
+/*
+ * Make the kernel store the samples of the next monitoring session
+ * in per-CPU lock-free buffers rather than in a single shared buffer.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_percpu_buffer(int enable);
+
+/*
+ * Make the kernel add up the samples of each thread in the next
+ * monitoring session, and deliver only per-thread and per-process
+ * totals (PMC_THREAD_TOTAL_SAMPLE/PMC_PROCESS_TOTAL_SAMPLE)
+ * when the threads exit.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_kernel_aggregation(int enable);
+
+/*
+ * Select the format used by the kernel to store samples in the
+ * next monitoring session: PMC_SAMPLE_FMT_FULL (default),
+ * PMC_SAMPLE_FMT_COMPACT (only the counts that are actually used) or
+ * PMC_SAMPLE_FMT_VARINT (compact, with varint-encoded values).
+ * Compact formats are not available with the multi-page sample ring.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_sample_format(int format);
+
+/*
+ * Make the kernel notify the monitor of new samples only once nr_samples
+ * samples or nr_bytes bytes are buffered, or max_latency_ms after the
+ * oldest sample not notified yet was collected. Zero values disable
+ * the corresponding watermark/latency bound.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_wakeup_watermark(unsigned int nr_samples, unsigned int nr_bytes, unsigned int max_latency_ms);
+
+/*
+ * Block until samples can be retrieved from the monitor file (fd) without
+ * blocking, taking the wakeup watermark into account. The monitor file
+ * descriptor can also be used with poll(), select() or epoll directly.
+ *
+ * The function returns a positive value if samples are ready (or the monitored
+ * threads finished), 0 if timeout_ms expired, and a negative value on error
+ * (including interruption by a signal).
+ */
+int pmct_poll_samples(int fd, int timeout_ms);
+
+/*
+ * Select what the kernel does with new samples when its buffer is full:
+ * PMC_BUF_POLICY_OVERWRITE (overwrite the oldest samples, default) or
+ * PMC_BUF_POLICY_DROP (drop the newest samples). Either way, losses are
+ * reported to the monitor by means of PMC_LOST_SAMPLE samples.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_set_buffer_policy(int policy);
+
+/*
+ * Translate a sample format name ("full", "compact" or "varint")
+ * into a PMC_SAMPLE_FMT_* value. Returns -1 if the name is not valid.
+ */
+int pmct_parse_sample_format(const char* name);
+
 /*
  * Tell PMCTrack's kernel module to start a monitoring session in system-wide mode
  *
@@ -289,6 +450,36 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes);
  */
 int pmct_syswide_start_counting( void );
 
+/*
+ * Select a cgroup (path relative to the root of the cgroup v2 hierarchy)
+ * to be monitored in the next system-wide session. Samples are then
+ * generated per cgroup (rather than per CPU), and their pid field holds
+ * the index of the cgroup in selection order.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_syswide_add_cgroup(const char* path);
+
+/*
+ * Restrict the next system-wide session to a list of CPUs
+ * (e.g., "0-15,64-79"). The PMCs of the remaining CPUs stay
+ * available for the per-thread monitoring modes.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_syswide_set_cpus(const char* cpus);
+
+/*
+ * Select what the kernel does in system-wide mode with the CPUs that
+ * stay idle during a whole sampling period: PMC_SYSWIDE_IDLE_SAMPLE
+ * (sample them anyway, default), PMC_SYSWIDE_IDLE_SKIP (no sample) or
+ * PMC_SYSWIDE_IDLE_MARK (PMC_IDLE_SAMPLE record). The counts of idle
+ * periods are reported in the next regular sample of each CPU.
+ *
+ * The function returns 0 on success, and a non-zero value upon failure.
+ */
+int pmct_syswide_set_idle_policy(int policy);
+
 /* PMCTrack PMU_INFO structures plus event mnemonic translation engine */
 
 #define MAX_CORE_TYPES 2
@@ -52,6 +52,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/types.h>
 #ifndef PAGE_SIZE
@@ -64,7 +66,61 @@ const char* pmc_monitor_entry="/proc/pmc/monitor";
 const char* pmc_config_entry="/proc/pmc/config";
 const char* pmc_props_entry="/proc/pmc/properties";
 
-static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self"};
+static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self","lost","thr_total","proc_total","idle"};
+
+/*
+ * Issue a control command on the monitor file using the binary interface.
+ * Returns 1 if the kernel module does not support it, in which case
+ * the caller must fall back to the string-based interface.
+ */
+static int pmct_monitor_ioctl(int fd, unsigned long cmd, void* arg)
+{
+	if (ioctl(fd,cmd,arg)==0)
+		return 0;
+
+	return (errno==ENOTTY)?1:-1;
+}
+
+/*
+ * Pass raw PMC (or virtual counter) configuration strings to the kernel
+ * via PMC_IOC_CONFIG. Returns 1 if the binary interface is not available.
+ */
+static int pmct_ioctl_config(const char* strcfg[], int virtual, unsigned long flags)
+{
+	pmc_ioc_config_t cfg;
+	int i=0;
+	int ret=0;
+	int fd;
+
+	if (strcfg[0]==NULL || (fd=open(pmc_monitor_entry, O_RDONLY))==-1)
+		return 1;
+
+	for (i=0; strcfg[i]!=NULL && ret==0; i++) {
+		cfg.flags=virtual?PMC_IOC_CFG_VIRTUAL:0;
+
+		if (flags & PMCT_CONFIG_SYSWIDE)
+			cfg.flags|=PMC_IOC_CFG_SYSWIDE;
+
+		/* Enable self monitoring along with the last configuration */
+		if ((flags & PMCT_FLAG_SELF_MONITORING) && strcfg[i+1]==NULL)
+			cfg.flags|=PMC_IOC_CFG_SELFMON;
+
+		cfg.len=strlen(strcfg[i]);
+		cfg.str=(uintptr_t)strcfg[i];
+
+		ret=pmct_monitor_ioctl(fd,PMC_IOC_CONFIG,&cfg);
+
+		/* Partial configurations are not retried with the other interface */
+		if (ret==1 && i>0)
+			ret=-1;
+	}
+
+	if (ret<0)
+		warnx("Can't configure counters: %s",strerror(errno));
+
+	close(fd);
+	return ret;
+}
 
 /*
  * Tell PMCTrack's kernel module which virtual counters
@@ -74,7 +130,14 @@ int pmct_config_virtual_counters(const char* virtcfg, unsigned long flags)
 {
 	int len=0;
 	char buf[MAX_CONFIG_STRING_SIZE+1+9];
-	int fd=open(pmc_config_entry, O_WRONLY);
+	const char* strcfg[2]= {virtcfg,NULL};
+	int fd;
+
+	/* Use the binary interface if available */
+	if ((len=pmct_ioctl_config(strcfg,1,flags))<=0)
+		return len;
+
+	fd=open(pmc_config_entry, O_WRONLY);
 
 	if(fd ==-1) {
 		warnx("Can't open %s\n",pmc_config_entry);
@@ -314,6 +377,40 @@ int pmct_config_timeout(int msecs, int kernel_control)
 	return 0;
 }
 
+/*
+ * Same as pmct_config_timeout() but the period is specified in microseconds.
+ * Sub-millisecond periods are only supported in TBS mode; the scheduler-driven
+ * mode is tick-based, so the period gets rounded to milliseconds.
+ */
+int pmct_config_timeout_us(int usecs, int kernel_control)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (kernel_control || usecs%1000==0)
+		return pmct_config_timeout(usecs>=1000?usecs/1000:1,kernel_control);
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"timeout_us %d\n",usecs);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s (unsupported sampling period?)\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
 /*
  * Setup maximum number of samples (in EBS mode) that the application
  * will actually execute. After those samples, the kernel will send a
@@ -342,6 +439,149 @@ int pmct_config_max_ebs_samples(unsigned int max_ebs_samples)
 	return 0;
 }
 
+/*
+ * Set an upper bound for the sampling overhead (percentage of the
+ * execution time). The kernel then adjusts the TBS period and the EBS
+ * reset value dynamically to stay within the budget.
+ * A value of 0 restores the fixed sampling rate.
+ */
+int pmct_config_max_overhead(double max_overhead_pct)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (max_overhead_pct<0 || max_overhead_pct>100) {
+		warnx("Invalid overhead budget: %.2f%%\n",max_overhead_pct);
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	/* The kernel expects hundredths of a percent */
+	len=sprintf(buf,"max_overhead %d\n",(int)(max_overhead_pct*100.0+0.5));
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Enable the capture of the instruction pointer in EBS samples
+ * (mode=1), or that of the IP along with the user-space
+ * call chain (mode=2). mode=0 disables the capture.
+ */
+int pmct_config_capture_ip(int mode)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (mode<0 || mode>2) {
+		warnx("Invalid IP capture mode: %d\n",mode);
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"capture_ip %d\n",mode);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Select how multiplexed experiments share the PMCs. weights is a
+ * comma-separated list with the relative share of time of each
+ * experiment (e.g., "2,1"); experiments are then scheduled based on
+ * the time each of them has been running so far. "0" restores
+ * round-robin rotation.
+ */
+int pmct_config_mux_weights(const char* weights)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (strlen(weights)>MAX_CONFIG_STRING_SIZE-32) {
+		warnx("Invalid multiplexing weights: %s\n",weights);
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"mux_weights_t %s\n",weights);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Invalid multiplexing weights: %s\n",weights);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int pmct_config_sample_filter(const char* filter)
+{
+	int len=0;
+	char buf[MAX_CONFIG_STRING_SIZE];
+	int fd;
+
+	if (strlen(filter)>MAX_CONFIG_STRING_SIZE-32) {
+		warnx("Invalid sample filter: %s\n",filter);
+		return -1;
+	}
+
+	fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"sample_filter_t %s\n",filter);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Invalid sample filter: %s\n",filter);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
 /*
  * Tell PMCTrack's kernel module which PMC events
  * must be monitored.
@@ -351,7 +591,13 @@ int pmct_config_counters(const char* strcfg[], unsigned long flags)
 	int len=0;
 	char buf[MAX_CONFIG_STRING_SIZE+1+9];
 	int i=0;
-	int fd=open(pmc_config_entry, O_WRONLY);
+	int fd;
+
+	/* Use the binary interface if available */
+	if ((len=pmct_ioctl_config(strcfg,0,flags))<=0)
+		return len;
+
+	fd=open(pmc_config_entry, O_WRONLY);
 
 	if(fd ==-1) {
 		warnx("Can't open %s\n",pmc_config_entry);
@@ -429,6 +675,95 @@ int pmct_syswide_start_counting( void )
 	return 0;
 }
 
+/*
+ * Select a cgroup (path relative to the root of the cgroup v2 hierarchy)
+ * to be monitored in the next system-wide session. Samples are then
+ * gathered per cgroup, identified by their selection order.
+ */
+int pmct_syswide_add_cgroup(const char* path)
+{
+	char str[256];
+	int siz;
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+
+	siz=snprintf(str,sizeof(str),"cgroup_add %s",path);
+
+	if(siz>=(int)sizeof(str) || write(fd, str, siz+1) < 0) {
+		warnx("Can't monitor cgroup %s\n",path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Restrict the next system-wide session to a list of CPUs
+ * (e.g., "0-15,64-79").
+ */
+int pmct_syswide_set_cpus(const char* cpus)
+{
+	char str[256];
+	int siz;
+	int fd = open(pmc_monitor_entry, O_WRONLY);
+
+	if(fd == -1) {
+		warnx("can't open %s\n",pmc_monitor_entry);
+		return -1;
+	}
+
+	siz=snprintf(str,sizeof(str),"cpus %s",cpus);
+
+	if(siz>=(int)sizeof(str) || write(fd, str, siz+1) < 0) {
+		warnx("Invalid CPU list: %s\n",cpus);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Select what the kernel does with the CPUs that stay idle
+ * during a whole sampling period in the next system-wide
+ * session (PMC_SYSWIDE_IDLE_*)
+ */
+int pmct_syswide_set_idle_policy(int policy)
+{
+	int len=0;
+	char buf[128];
+	int fd;
+
+	if (policy<PMC_SYSWIDE_IDLE_SAMPLE || policy>=PMC_NR_SYSWIDE_IDLE_POLICIES) {
+		warnx("Invalid idle policy: %d\n",policy);
+		return -1;
+	}
+
+	if((fd=open(pmc_config_entry, O_WRONLY))==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"syswide_idle_t %d\n",policy);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
 
 /*
  * Print a header in the "normalized" format for a table of
@@ -443,8 +778,8 @@ void pmct_print_header (FILE* fo, unsigned int nr_experiments,
                        )
 {
 	int i;
-	char* str[2]= {"pid","cpu"};
-	int index=syswide?1:0; /* To make sure it is in the allowed range */
+	char* str[3]= {"pid","cpu","cgroup"};
+	int index=(syswide==2)?2:(syswide?1:0); /* To make sure it is in the allowed range */
 
 	if (!extended_output && nr_experiments<2) {
 		/* Legacy mode */
@@ -491,6 +826,14 @@ void pmct_print_sample (FILE* fo, unsigned int nr_experiments,
 	int j,cnt=0;
 	unsigned int remaining_pmcmask=pmcmask;
 
+	/* Lost samples carry no counter values */
+	if (sample->type==PMC_LOST_SAMPLE) {
+		fprintf(fo, "%7d %6s %10s dropped=%llu overwritten=%llu\n", nsample, "-", sample_type_to_str[sample->type],
+		        (unsigned long long)sample->pmc_counts[PMC_LOST_DROPPED],
+		        (unsigned long long)sample->pmc_counts[PMC_LOST_OVERWRITTEN]);
+		return;
+	}
+
 	/* Max supported counters... */
 	for(j=0; (j<MAX_PERFORMANCE_COUNTERS) && (remaining_pmcmask); j++) {
 		if(sample->pmc_mask & (0x1<<j)) {
@@ -586,6 +929,24 @@ void pmct_accumulate_sample (unsigned int nr_experiments,
 
 }
 
+/*
+ * Extrapolate the PMC counts of a sample gathered with event multiplexing
+ * (virtual counters are not multiplexed)
+ */
+void pmct_scale_sample(pmc_sample_t* sample, uint64_t time_enabled, uint64_t time_running)
+{
+	int i;
+	double factor;
+
+	if (!time_running || time_enabled==time_running)
+		return;
+
+	factor=(double)time_enabled/time_running;
+
+	for (i=0; i<sample->nr_counts && i<MAX_PERFORMANCE_COUNTERS; i++)
+		sample->pmc_counts[i]=(uint64_t)(sample->pmc_counts[i]*factor+0.5);
+}
+
 /*
  * Obtain a file descriptor of the special file exported by
  * PMCTrack's kernel module file to retrieve performance samples
@@ -612,12 +973,20 @@ int pmct_attach_process (pid_t pid, int config_pmcs)
 {
 	char str[30];
 	int siz;
+	int32_t val=pid;
+	int ret;
 
 	int fd = open(pmc_monitor_entry, O_WRONLY);
 	if(fd == -1) {
 		warnx("can't open %s\n",pmc_monitor_entry);
 		return -1;
 	}
+
+	if (config_pmcs && (ret=pmct_monitor_ioctl(fd,PMC_IOC_ATTACH,&val))<=0) {
+		close(fd);
+		return ret;
+	}
+
 	if (config_pmcs)
 		siz=sprintf(str, "pid_attach %d", pid);
 	else
@@ -637,12 +1006,19 @@ int pmct_detach_process (pid_t pid)
 {
 	char str[30];
 	int siz;
+	int32_t val=pid;
+	int ret;
 
 	int fd = open(pmc_monitor_entry, O_WRONLY);
 	if(fd == -1) {
 		warnx("can't open %s\n",pmc_monitor_entry);
 		return -1;
 	}
+
+	if ((ret=pmct_monitor_ioctl(fd,PMC_IOC_DETACH,&val))<=0) {
+		close(fd);
+		return ret;
+	}
 	siz=sprintf(str, "pid_detach %d", pid);
 
 	if(write(fd, str, siz+1) < 0)
@@ -653,14 +1029,276 @@ int pmct_detach_process (pid_t pid)
 }
 
 /*
- * Retrieve performance samples from the special file exported by
- * PMCTrack's kernel module
+ * Shared memory regions mapped from the monitor file.
+ * A region is either a multi-page sample ring (ctl!=NULL)
+ * or a single shared page filled in by read() (ctl==NULL).
  */
-int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
+struct pmct_shared_region {
+	int fd;                 /* Monitor file descriptor */
+	void* base;             /* Address returned by mmap() */
+	size_t length;          /* Length of the mapping */
+	pmc_mmap_ctl_t* ctl;    /* Control page of the ring */
+	pmc_sample_t* slots;    /* First sample slot */
+	unsigned int nr_slots;  /* Capacity (# of samples) */
+	unsigned int pending;   /* Samples handed out by the last pmct_read_samples_mmap() call */
+	uint64_t reported_lost; /* Value of ctl->lost_samples when the last lost sample was generated */
+	pmc_sample_t lost_sample; /* PMC_LOST_SAMPLE handed out by pmct_read_samples_mmap() */
+};
+
+#define PMCT_MAX_SHARED_REGIONS 32
+static struct pmct_shared_region shared_regions[PMCT_MAX_SHARED_REGIONS];
+
+static struct pmct_shared_region* get_shared_region(int fd)
+{
+	int i;
+
+	for (i=0; i<PMCT_MAX_SHARED_REGIONS; i++)
+		if (shared_regions[i].base && shared_regions[i].fd==fd)
+			return &shared_regions[i];
+	return NULL;
+}
+
+static struct pmct_shared_region* register_shared_region(int fd, void* base, size_t length)
+{
+	int i;
+
+	for (i=0; i<PMCT_MAX_SHARED_REGIONS; i++) {
+		if (!shared_regions[i].base) {
+			shared_regions[i].fd=fd;
+			shared_regions[i].base=base;
+			shared_regions[i].length=length;
+			shared_regions[i].ctl=NULL;
+			shared_regions[i].slots=base;
+			shared_regions[i].nr_slots=length/sizeof(pmc_sample_t);
+			shared_regions[i].pending=0;
+			shared_regions[i].reported_lost=0;
+			return &shared_regions[i];
+		}
+	}
+	return NULL;
+}
+
+/* Number of samples available in the ring, and size of the contiguous run at the tail */
+static inline unsigned int ring_available(struct pmct_shared_region* region, unsigned int* run)
+{
+	uint32_t head=region->ctl->data_head;
+	uint32_t tail=region->ctl->data_tail;
+
+	/* Read the samples after the head (pairs with smp_wmb() in the kernel) */
+	__sync_synchronize();
+
+	if (head>=tail) {
+		(*run)=head-tail;
+		return head-tail;
+	} else {
+		(*run)=region->nr_slots-tail;
+		return region->nr_slots-tail+head;
+	}
+}
+
+/* Give nr_samples slots back to the kernel */
+static inline void ring_release(struct pmct_shared_region* region, unsigned int nr_samples)
+{
+	uint32_t tail=region->ctl->data_tail;
+
+	/* Make sure we are done with the samples before the kernel reuses the slots */
+	__sync_synchronize();
+	region->ctl->data_tail=(tail+nr_samples)%region->nr_slots;
+}
+
+/*
+ * Fill in region->lost_sample if the kernel discarded samples
+ * since the last call. Returns a non-zero value in that case.
+ */
+static int ring_lost_sample(struct pmct_shared_region* region)
+{
+	uint64_t lost=region->ctl->lost_samples;
+	pmc_sample_t* sample=&region->lost_sample;
+
+	if (lost==region->reported_lost)
+		return 0;
+
+	memset(sample,0,sizeof(pmc_sample_t));
+	sample->type=PMC_LOST_SAMPLE;
+	sample->coretype=-1;
+	sample->pid=-1;
+	sample->cpu=-1;
+	sample->nr_counts=PMC_LOST_NR_COUNTS;
+	sample->pmc_counts[PMC_LOST_DROPPED]=lost-region->reported_lost;
+	region->reported_lost=lost;
+	return 1;
+}
+
+/* Block until samples are available in the ring. Returns 0 on EOF */
+static int ring_wait(int fd, struct pmct_shared_region* region)
+{
+	int nbytes;
+
+	/* In ring mode, the kernel does not copy anything into the buffer */
+	if((nbytes = read(fd, region->slots, region->nr_slots*sizeof(pmc_sample_t))) < 0) {
+		if (errno!=EINTR)
+			warnx("Can't read from %s\n",pmc_monitor_entry);
+		return -1;
+	}
+
+	/* Reset read counter */
+	lseek(fd, 0, SEEK_SET);
+	return nbytes;
+}
+
+/*
+ * Compact records retrieved from the kernel that have not been
+ * decoded yet (a single read() may return more compact records
+ * than the number of samples requested by the caller).
+ */
+struct pmct_sample_stream {
+	int fd;                 /* Monitor file descriptor (-1 if the entry is free) */
+	unsigned char* data;    /* Raw records */
+	size_t capacity;        /* Size of the data buffer */
+	size_t start;           /* Offset of the first record not decoded yet */
+	size_t end;             /* End of valid data */
+	uint64_t last_timestamp; /* Base for delta-encoded timestamps (reset on every read()) */
+};
+
+#define PMCT_MAX_SAMPLE_STREAMS 32
+static struct pmct_sample_stream sample_streams[PMCT_MAX_SAMPLE_STREAMS];
+
+static struct pmct_sample_stream* get_sample_stream(int fd, int create)
+{
+	int i;
+
+	for (i=0; i<PMCT_MAX_SAMPLE_STREAMS; i++)
+		if (sample_streams[i].data && sample_streams[i].fd==fd)
+			return &sample_streams[i];
+
+	if (!create)
+		return NULL;
+
+	for (i=0; i<PMCT_MAX_SAMPLE_STREAMS; i++) {
+		if (!sample_streams[i].data) {
+			sample_streams[i].fd=fd;
+			sample_streams[i].start=sample_streams[i].end=0;
+			sample_streams[i].capacity=0;
+			return &sample_streams[i];
+		}
+	}
+	return NULL;
+}
+
+static void release_sample_stream(int fd)
+{
+	struct pmct_sample_stream* stream=get_sample_stream(fd,0);
+
+	if (stream) {
+		free(stream->data);
+		stream->data=NULL;
+		stream->capacity=0;
+	}
+}
+
+/* Decode up to max_samples compact records from the stream */
+static int decode_sample_stream(struct pmct_sample_stream* stream, pmc_sample_t* samples, int max_samples)
+{
+	int nr_samples=0;
+	unsigned int size;
+
+	while (nr_samples<max_samples && stream->start<stream->end) {
+		size=pmc_decode_sample(stream->data+stream->start,stream->end-stream->start,&samples[nr_samples],
+		                       &stream->last_timestamp);
+
+		if (!size) {
+			warnx("Malformed sample record retrieved from %s\n",pmc_monitor_entry);
+			stream->start=stream->end;
+			break;
+		}
+		stream->start+=size;
+		nr_samples++;
+	}
+
+	return nr_samples;
+}
+
+/*
+ * Turn the nbytes retrieved from the monitor file descriptor into samples
+ * in place. Compact records are expanded into pmc_sample_t structures
+ * (those that do not fit in max_samples are handed out by the next
+ * pmct_read_samples() call). Returns the number of samples.
+ */
+static int expand_sample_records(int fd, pmc_sample_t* samples, int nbytes, int max_samples)
+{
+	int max_buffer_size=sizeof(pmc_sample_t)*max_samples;
+	struct pmct_sample_stream* stream;
+
+	/* The kernel only returns whole records, so just check the first one */
+	if (nbytes<=0 || *((unsigned char*)samples)!=PMC_COMPACT_SAMPLE_MAGIC)
+		return nbytes/(int)sizeof(pmc_sample_t);
+
+	if (!(stream=get_sample_stream(fd,0)) && !(stream=get_sample_stream(fd,1))) {
+		warnx("Too many sample streams\n");
+		return -1;
+	}
+
+	if (stream->capacity<nbytes) {
+		unsigned char* data=realloc(stream->data,max_buffer_size);
+
+		if (!data) {
+			warnx("Can't allocate memory for the sample stream\n");
+			return -1;
+		}
+		stream->data=data;
+		stream->capacity=max_buffer_size;
+	}
+
+	/* The records are expanded in place, so move them out of the way */
+	memcpy(stream->data,samples,nbytes);
+	stream->start=0;
+	stream->end=nbytes;
+	stream->last_timestamp=0;
+	return decode_sample_stream(stream,samples,max_samples);
+}
+
+/*
+ * Retrieve performance samples from the special file exported by
+ * PMCTrack's kernel module. Samples in the compact formats are
+ * expanded into pmc_sample_t structures.
+ */
+int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
 {
 	int nr_samples = 0;
 	int nbytes = 0;
 	int max_buffer_size=sizeof(pmc_sample_t)*max_samples;
+	struct pmct_shared_region* region=get_shared_region(fd);
+	struct pmct_sample_stream* stream=get_sample_stream(fd,0);
+
+	/* Hand out the records left over from the previous read() first */
+	if (stream && stream->start<stream->end)
+		return decode_sample_stream(stream,samples,max_samples);
+
+	/* Copy samples out of the ring (read() is only used to wait for samples) */
+	if (region && region->ctl) {
+		unsigned int run;
+
+		if (region->pending) {
+			ring_release(region,region->pending);
+			region->pending=0;
+		}
+
+		/* Report samples the kernel could not write into the ring */
+		if (max_samples>0 && ring_lost_sample(region))
+			samples[nr_samples++]=region->lost_sample;
+
+		if (!nr_samples && !ring_available(region,&run) && (nbytes=ring_wait(fd,region))<=0)
+			return nbytes;
+
+		while (nr_samples<max_samples && ring_available(region,&run)) {
+			if (run>max_samples-nr_samples)
+				run=max_samples-nr_samples;
+			memcpy(&samples[nr_samples],&region->slots[region->ctl->data_tail],run*sizeof(pmc_sample_t));
+			ring_release(region,run);
+			nr_samples+=run;
+		}
+		return nr_samples;
+	}
 
 	if((nbytes = read(fd, samples, max_buffer_size)) < 0) {
 		if (errno!=EINTR)
@@ -671,8 +1309,73 @@ int pmct_read_samples (int fd, pmc_sample_t* samples, int max_samples)
 	/* Reset read counter */
 	lseek(fd, 0, SEEK_SET);
 
-	nr_samples=nbytes/sizeof(pmc_sample_t);
-	return nr_samples;
+	return expand_sample_records(fd,samples,nbytes,max_samples);
+}
+
+/*
+ * Return the number of samples that can be retrieved from the sample ring
+ * associated with fd without blocking (excluding those handed out in the
+ * last pmct_read_samples_mmap() call)
+ */
+int pmct_ring_samples_available(int fd)
+{
+	struct pmct_shared_region* region=get_shared_region(fd);
+	unsigned int run;
+
+	if (!region || !region->ctl)
+		return 0;
+
+	return ring_available(region,&run)-region->pending;
+}
+
+/*
+ * Retrieve performance samples from the shared memory region
+ * mapped with pmct_request_shared_memory_region() without copying them
+ */
+int pmct_read_samples_mmap (int fd, pmc_sample_t** samples, int max_samples)
+{
+	struct pmct_shared_region* region=get_shared_region(fd);
+	unsigned int run=0;
+	int nbytes;
+
+	if (!region) {
+		warnx("No shared memory region for this descriptor\n");
+		return -1;
+	}
+
+	/* Single shared page: the kernel copies the samples into it */
+	if (!region->ctl) {
+		if (max_samples>region->nr_slots)
+			max_samples=region->nr_slots;
+		(*samples)=region->slots;
+		return pmct_read_samples(fd,region->slots,max_samples);
+	}
+
+	/* Release the samples handed out in the previous call */
+	if (region->pending) {
+		ring_release(region,region->pending);
+		region->pending=0;
+	}
+
+	/* Report samples the kernel could not write into the ring (in a batch of their own) */
+	if (ring_lost_sample(region)) {
+		(*samples)=&region->lost_sample;
+		return 1;
+	}
+
+	/* Wait only if there is nothing in the ring */
+	if (!ring_available(region,&run)) {
+		if ((nbytes=ring_wait(fd,region))<=0)
+			return nbytes;
+		ring_available(region,&run);
+	}
+
+	if (run>max_samples)
+		run=max_samples;
+
+	(*samples)=&region->slots[region->ctl->data_tail];
+	region->pending=run;
+	return run;
 }
 
 /*
@@ -754,6 +1457,9 @@ int pmctrack_destroy(pmctrack_desc_t* desc)
 		return -1;
 
 	if (desc->fd_monitor!=-1) {
+		if (desc->flags & PMCT_FLAG_SHARED_REGION)
+			pmct_release_shared_memory_region(desc->fd_monitor);
+		release_sample_stream(desc->fd_monitor);
 		close(desc->fd_monitor);
 		desc->fd_monitor=-1;
 	}
@@ -944,8 +1650,19 @@ static inline int pmct_start_counters_gen(pmctrack_desc_t* desc,int syswide)
 {
 	char* key[2]= {"ON","syswide on"};
 	int index=syswide?1:0; /* To make sure it is in the allowed range */
+	int32_t on=1;
+	int ret;
+
+	if (syswide)
+		ret=pmct_monitor_ioctl(desc->fd_monitor,PMC_IOC_SYSWIDE,&on);
+	else
+		ret=pmct_monitor_ioctl(desc->fd_monitor,PMC_IOC_START,NULL);
 
-	if(write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0) {
+	/* Fall back to the string-based interface */
+	if (ret==1 && write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0)
+		ret=-1;
+
+	if (ret<0) {
 		warnx("Write error in %s\n",pmc_monitor_entry);
 		return -1;
 	}
@@ -962,19 +1679,56 @@ static inline int pmct_stop_counters_gen(pmctrack_desc_t* desc, int syswide)
 	char* key[2]= {"OFF","syswide off"};
 	int index=syswide?1:0; /* To make sure it is in the allowed range */
 	int nbytes=0;
+	int32_t off=0;
+	pmc_ioc_read_t rd;
+	int ret;
+
+	if (syswide) {
+		ret=pmct_monitor_ioctl(desc->fd_monitor,PMC_IOC_SYSWIDE,&off);
+	} else if (desc->flags & PMCT_FLAG_SHARED_REGION) {
+		ret=pmct_monitor_ioctl(desc->fd_monitor,PMC_IOC_STOP,NULL);
+	} else {
+		/* Stop the counters and retrieve the samples with a single system call */
+		rd.buf=(uintptr_t)desc->samples;
+		rd.size=sizeof(pmc_sample_t)*desc->max_nr_samples;
+		rd.nr_bytes=0;
+
+		if ((ret=pmct_monitor_ioctl(desc->fd_monitor,PMC_IOC_STOP_READ,&rd))==0) {
+			if ((nbytes=expand_sample_records(desc->fd_monitor,desc->samples,rd.nr_bytes,desc->max_nr_samples))<0)
+				return -1;
+			desc->nr_samples=nbytes;
+			return 0;
+		}
+	}
+
+	/* Disable self monitoring (fall back to the string-based interface) */
+	if (ret==1 && write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0)
+		ret=-1;
 
-	/* Disable self monitoring */
-	if(write(desc->fd_monitor,key[index], strlen(key[index])+1) < 0) {
+	if (ret<0) {
 		warnx("Write error in  %s:%s\n",pmc_monitor_entry,strerror(errno));
 		return -1;
 	}
+	/* Samples are retrieved in place from the shared region (if any) */
+	if (desc->flags & PMCT_FLAG_SHARED_REGION) {
+		if ((nbytes=pmct_read_samples_mmap(desc->fd_monitor,&desc->samples,desc->max_nr_samples))<0) {
+			perror("Read error in /proc/pmc/monitor\n");
+			return -1;
+		}
+		desc->nr_samples=nbytes;
+		return 0;
+	}
+
 	/* Read stuff */
 	if((nbytes = read(desc->fd_monitor, desc->samples, sizeof(pmc_sample_t)*desc->max_nr_samples)) < 0) {
 		perror("Read error in /proc/pmc/monitor\n");
 		return -1;
 	}
 
-	desc->nr_samples=nbytes/sizeof(pmc_sample_t);
+	if ((nbytes=expand_sample_records(desc->fd_monitor,desc->samples,nbytes,desc->max_nr_samples))<0)
+		return -1;
+
+	desc->nr_samples=nbytes;
 
 	return 0;
 }
@@ -1093,6 +1847,202 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes)
 	return 0;
 }
 
+/*
+ * Enable/disable per-CPU lock-free sample buffers in the kernel.
+ * When enabled, the kernel merges the samples collected on the various
+ * CPUs in chronological order when the monitor reads them.
+ */
+int pmct_set_percpu_buffer(int enable)
+{
+	int len=0;
+	char buf[128];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"percpu_buffer_t %d\n",enable?1:0);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Enable/disable the aggregation of samples in the kernel.
+ * When enabled, only per-thread and per-process totals are
+ * retrieved from the kernel (when the threads exit).
+ */
+int pmct_set_kernel_aggregation(int enable)
+{
+	int len=0;
+	char buf[128];
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"aggregate_t %d\n",enable?1:0);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Select the format of the samples retrieved from the kernel
+ * in the next monitoring session (PMC_SAMPLE_FMT_*).
+ * pmct_read_samples() decodes compact records transparently.
+ */
+int pmct_set_sample_format(int format)
+{
+	int len=0;
+	char buf[128];
+	int fd;
+
+	if (format<PMC_SAMPLE_FMT_FULL || format>=PMC_NR_SAMPLE_FMTS) {
+		warnx("Invalid sample format: %d\n",format);
+		return -1;
+	}
+
+	if((fd=open(pmc_config_entry, O_WRONLY))==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"sample_format_t %d\n",format);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Set up when the kernel notifies the monitor of new samples
+ * in the next monitoring session. Zero values disable the
+ * corresponding watermark.
+ */
+int pmct_set_wakeup_watermark(unsigned int nr_samples, unsigned int nr_bytes, unsigned int max_latency_ms)
+{
+	int len=0;
+	char buf[3][128];
+	int i;
+	int fd=open(pmc_config_entry, O_WRONLY);
+
+	if(fd ==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	sprintf(buf[0],"wakeup_samples_t %u\n",nr_samples);
+	sprintf(buf[1],"wakeup_bytes_t %u\n",nr_bytes);
+	sprintf(buf[2],"wakeup_latency_t %u\n",max_latency_ms);
+
+	for (i=0; i<3; i++) {
+		len=write(fd,buf[i],strlen(buf[i]));
+
+		if(len <= 0) {
+			warnx("Write error in %s\n",pmc_config_entry);
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Wait until samples can be retrieved from the monitor
+ * file without blocking (or until timeout_ms expires)
+ */
+int pmct_poll_samples(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+	int ret;
+	struct pmct_sample_stream* stream=get_sample_stream(fd,0);
+
+	/* Samples pending in user space already */
+	if (pmct_ring_samples_available(fd) || (stream && stream->start<stream->end))
+		return 1;
+
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+	pfd.revents=0;
+
+	if ((ret=poll(&pfd,1,timeout_ms))<0 && errno!=EINTR)
+		warnx("Can't poll %s\n",pmc_monitor_entry);
+
+	return ret;
+}
+
+/*
+ * Select what the kernel does with new samples when its buffer
+ * is full in the next monitoring session (PMC_BUF_POLICY_*)
+ */
+int pmct_set_buffer_policy(int policy)
+{
+	int len=0;
+	char buf[128];
+	int fd;
+
+	if (policy<PMC_BUF_POLICY_OVERWRITE || policy>=PMC_NR_BUF_POLICIES) {
+		warnx("Invalid buffer policy: %d\n",policy);
+		return -1;
+	}
+
+	if((fd=open(pmc_config_entry, O_WRONLY))==-1) {
+		warnx("Can't open %s\n",pmc_config_entry);
+		return -1;
+	}
+
+	len=sprintf(buf,"buffer_policy_t %d\n",policy);
+	len=write(fd,buf,len);
+
+	if(len <= 0) {
+		warnx("Write error in %s\n",pmc_config_entry);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Parse a sample format name ("full", "compact" or "varint") */
+int pmct_parse_sample_format(const char* name)
+{
+	static const char* sample_format_names[PMC_NR_SAMPLE_FMTS]= {"full","compact","varint"};
+	int i;
+
+	for (i=0; i<PMC_NR_SAMPLE_FMTS; i++)
+		if (strcmp(name,sample_format_names[i])==0)
+			return i;
+	return -1;
+}
+
 /*
  * Request a memory region shared between kernel and user space to
  * enable efficient communication between the monitor process and
@@ -1100,17 +2050,85 @@ int pmct_set_kernel_buffer_size(unsigned int nr_bytes)
  */
 pmc_sample_t* pmct_request_shared_memory_region(int monitor_fd, unsigned int* max_samples)
 {
-	pmc_sample_t* buf=(pmc_sample_t*)mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, monitor_fd, 0);
+	pmc_sample_t* buf;
+	struct pmct_shared_region* region;
+
+	/* Try with a multi-page ring first */
+	if ((buf=pmct_request_sample_ring(monitor_fd,PMCT_MMAP_RING_DATA_PAGES,max_samples)))
+		return buf;
+
+	/* Fall back to a single shared page */
+	buf=(pmc_sample_t*)mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, monitor_fd, 0);
 	if (buf == MAP_FAILED) {
 		perror("mmap");
 		return NULL;
 	}
 
+	if ((region=register_shared_region(monitor_fd,buf,PAGE_SIZE))==NULL) {
+		warnx("Too many shared memory regions\n");
+		munmap(buf,PAGE_SIZE);
+		return NULL;
+	}
+
 	//printf("Mmap Ok. Address:%p\n",buf);
 	(*max_samples)=PAGE_SIZE/sizeof(pmc_sample_t);
 	return buf;
 }
 
+/*
+ * Map a sample ring with nr_data_pages data pages, where the kernel
+ * stores samples directly. The function returns a pointer to the first sample
+ * slot of the ring, or NULL if the ring could not be mapped.
+ */
+pmc_sample_t* pmct_request_sample_ring(int monitor_fd, unsigned int nr_data_pages, unsigned int* max_samples)
+{
+	size_t length=(nr_data_pages+1)*PAGE_SIZE;
+	void* base;
+	pmc_mmap_ctl_t* ctl;
+	struct pmct_shared_region* region;
+
+	if (nr_data_pages==0)
+		return NULL;
+
+	base=mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, monitor_fd, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	ctl=(pmc_mmap_ctl_t*)base;
+
+	if (ctl->version!=PMC_MMAP_RING_VERSION || ctl->sample_size!=sizeof(pmc_sample_t)) {
+		warnx("Unsupported sample ring layout\n");
+		munmap(base,length);
+		return NULL;
+	}
+
+	if ((region=register_shared_region(monitor_fd,base,length))==NULL) {
+		warnx("Too many shared memory regions\n");
+		munmap(base,length);
+		return NULL;
+	}
+
+	region->ctl=ctl;
+	region->slots=(pmc_sample_t*)(((char*)base)+ctl->data_offset);
+	region->nr_slots=ctl->nr_slots;
+
+	(*max_samples)=region->nr_slots;
+	return region->slots;
+}
+
+/* Release a shared memory region obtained with pmct_request_shared_memory_region() */
+void pmct_release_shared_memory_region(int monitor_fd)
+{
+	struct pmct_shared_region* region=get_shared_region(monitor_fd);
+
+	if (!region)
+		return;
+
+	munmap(region->base,region->length);
+	region->base=NULL;
+}
+
 /*
  * Retrieve the event-to-PMC mapping information. The function should be used
  * only if pmctrack_config_counters_mnemonic() was used to configure performance
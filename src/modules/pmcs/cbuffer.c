@@ -178,6 +178,34 @@ void remove_items_cbuffer_t ( cbuffer_t* cbuffer, void* vitems, int nr_items)
 	cbuffer->size-=nr_items;
 }
 
+/* Copies the first nr_items in the buffer without removing them */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, void* vitems, int nr_items)
+{
+	char* items=(char*)vitems;
+	int items_copied=nr_items;
+
+	if (nr_items>cbuffer->size)
+		return;
+
+	if (cbuffer->head+nr_items > cbuffer->max_size)
+		items_copied=cbuffer->max_size-cbuffer->head;
+
+	memcpy(items,&cbuffer->data[cbuffer->head],items_copied);
+
+	if (nr_items>items_copied)
+		memcpy(items+items_copied,cbuffer->data,nr_items-items_copied);
+}
+
+/* Removes the first nr_items from the buffer (no copy is made) */
+void discard_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items)
+{
+	if (nr_items>cbuffer->size)
+		return;
+
+	cbuffer->head=(cbuffer->head+nr_items)%cbuffer->max_size;
+	cbuffer->size-=nr_items;
+}
+
 int remove_cbuffer_t_batch(cbuffer_t* cbuffer, void* items, int max_nr_items)
 {
 	/* Check the maximum number of bytes we can actually retrieve */
@@ -0,0 +1,215 @@
+/*
+ *  hl_events.c
+ *
+ *	Compilation and evaluation of high-level events (performance metrics)
+ *
+ *  Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+/*
+ * This file depends on <pmc/hl_events.h> only, so that the metric
+ * engine can also be built in user space (test/test_libpmctrack/metric-eval-bench).
+ */
+#include <pmc/hl_events.h>
+#include <linux/errno.h>
+
+/* Map a metric argument to a register of the metric program */
+static int metric_arg_to_reg(metric_experiment_t* m_exp, pmc_arg_t* arg, unsigned char* reg)
+{
+	switch (arg->type) {
+	case hw_event_arg:
+		if (arg->index>=MAX_PERFORMANCE_COUNTERS)
+			return -EINVAL;
+		(*reg)=METRIC_HW_REG(arg->index);
+
+		if (arg->index>=m_exp->nr_hw_regs)
+			m_exp->nr_hw_regs=arg->index+1;
+		return 0;
+	case metric_arg:
+		if (arg->index>=m_exp->size)
+			return -EINVAL;
+		(*reg)=METRIC_REG(arg->index);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Number of arguments used by each relation mode */
+static inline int nr_metric_args(pmc_relation_mode_t mode)
+{
+	switch (mode) {
+	case op_virtual:
+		return 0;
+	case op_none:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/*
+ * Returns a non-zero value if all the metrics the metric
+ * depends on are already in the program. Invalid references
+ * are reported as ready, so that metric_arg_to_reg() rejects them.
+ */
+static int metric_deps_ready(pmc_metric_t* metric, unsigned char* emitted)
+{
+	int nr_args=nr_metric_args(metric->mode);
+	pmc_arg_t* args[MAX_REL_ARGS]= {&metric->arg1,&metric->arg2};
+	int i;
+
+	for (i=0; i<nr_args; i++) {
+		if (args[i]->type==metric_arg && args[i]->index<MAX_METRICS_PER_SET
+		    && !emitted[args[i]->index])
+			return 0;
+	}
+	return 1;
+}
+
+int compile_metric_experiment_t(metric_experiment_t* m_exp)
+{
+	unsigned char emitted[MAX_METRICS_PER_SET];
+	unsigned int i;
+	int progress=1;
+	pmc_metric_t* metric;
+	pmc_metric_op_t* op;
+	int nr_args;
+
+	if (m_exp->size>MAX_METRICS_PER_SET)
+		return -EINVAL;
+
+	m_exp->nr_ops=0;
+	m_exp->nr_hw_regs=0;
+	memset(emitted,0,sizeof(emitted));
+
+	/*
+	 * Emit the metrics whose dependencies have been emitted already
+	 * until there is nothing left. Sets are small, so a quadratic
+	 * algorithm does the job.
+	 */
+	while (m_exp->nr_ops<m_exp->size && progress) {
+		progress=0;
+
+		for (i=0; i<m_exp->size; i++) {
+			metric=&m_exp->metrics[i];
+
+			if (emitted[i] || !metric_deps_ready(metric,emitted))
+				continue;
+
+			if (metric->mode>=_AVAILABLE_RELATIONS)
+				return -EINVAL;
+
+			op=&m_exp->ops[m_exp->nr_ops];
+			op->mode=metric->mode;
+			op->dst=METRIC_REG(i);
+			op->scale_factor=metric->scale_factor;
+			op->src1=op->src2=op->dst;
+			nr_args=nr_metric_args(metric->mode);
+
+			if (nr_args>=1 && metric_arg_to_reg(m_exp,&metric->arg1,&op->src1))
+				return -EINVAL;
+			if (nr_args==2 && metric_arg_to_reg(m_exp,&metric->arg2,&op->src2))
+				return -EINVAL;
+
+			/* op_rate2 would divide by zero: such metrics evaluate to zero */
+			if (metric->mode==op_rate2 && !metric->scale_factor)
+				op->mode=op_virtual;
+
+			emitted[i]=1;
+			m_exp->nr_ops++;
+			progress=1;
+		}
+	}
+
+	/* Cyclic dependencies */
+	if (m_exp->nr_ops<m_exp->size) {
+		m_exp->nr_ops=0;
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int compile_metric_experiment_set_t(metric_experiment_set_t* m_set)
+{
+	int i;
+	int error;
+
+	for (i=0; i<m_set->nr_exps; i++) {
+		if ((error=compile_metric_experiment_t(&m_set->exps[i])))
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Evaluate the metric program of an experiment. Divisions
+ * by zero yield zero, as do the metrics of the op_virtual type
+ * (their values are meant to be set up by the caller later).
+ */
+void compute_performance_metrics(uint64_t* hw_events, metric_experiment_t* metric_exp,
+                                 metric_values_t* values)
+{
+	uint64_t* regs=values->regs;
+	pmc_metric_op_t* op=metric_exp->ops;
+	pmc_metric_op_t* end=op+metric_exp->nr_ops;
+	uint64_t a,b,res;
+
+	memcpy(regs,hw_events,metric_exp->nr_hw_regs*sizeof(uint64_t));
+
+	for (; op<end; op++) {
+		a=regs[op->src1];
+		b=regs[op->src2];
+
+		switch (op->mode) {
+		case op_division:
+			res=a;
+			if (b)
+				pmc_do_div(res,b);
+			else
+				res=0;
+			break;
+		case op_multiplication:
+			res=a*b;
+			break;
+		case op_sum:
+			res=a+b;
+			break;
+		case op_substract:
+			res=(a>=b)?a-b:0;
+			break;
+		case op_rate:
+			res=a*op->scale_factor;
+			if (b)
+				pmc_do_div(res,b);
+			else
+				res=0;
+			break;
+		case op_rate2:
+			pmc_do_div(b,op->scale_factor);
+			res=a;
+			if (b)
+				pmc_do_div(res,b);
+			else
+				res=0;
+			break;
+		case op_none:
+			res=a*op->scale_factor;
+			break;
+		default:
+			res=0;
+			break;
+		}
+
+		regs[op->dst]=res;
+	}
+
+#ifdef DEBUG
+	for (op=metric_exp->ops; op<end; op++)
+		printk(KERN_ALERT "%s=%llu\n",metric_exp->metrics[op->dst-METRIC_REG(0)].id,regs[op->dst]);
+#endif
+}
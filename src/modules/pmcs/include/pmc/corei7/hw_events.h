@@ -120,6 +120,21 @@ struct hw_event {
 /* An additional initialization function is provided here */
 static inline   void init_hw_event ( struct hw_event* exp, ll_event_type type );
 
+/*
+ * Architectural perfmon v2+ makes it possible to freeze/unfreeze
+ * all the counters with a single write to IA32_PERF_GLOBAL_CTRL
+ */
+#define PMC_HAVE_GLOBAL_FREEZE
+
+/* Disable all the counters and return the previous value of IA32_PERF_GLOBAL_CTRL */
+static inline uint64_t __freeze_all_counters ( void );
+
+/* Restore IA32_PERF_GLOBAL_CTRL */
+static inline void __unfreeze_all_counters ( uint64_t global_ctrl );
+
+/* Read the HW event's PMC (rdpmc) and set it to its reset value (event selector untouched) */
+static inline void __read_and_clear_count_hw_event ( struct hw_event* exp );
+
 
 #ifdef _DEBUG_USER_MODE
 /* Debug functions for accessing to PMCs from User-mode */
@@ -421,4 +421,43 @@ static inline void __set_reset_value_hw_event ( struct hw_event* exp, uint64_t r
 
 
 
+/* Disable all the counters and return the previous value of IA32_PERF_GLOBAL_CTRL */
+static inline uint64_t __freeze_all_counters ( void )
+{
+	uint64_t global_ctrl;
+
+	rdmsrl ( MSR_PERF_GLOBAL_CTRL, global_ctrl );
+	wrmsrl ( MSR_PERF_GLOBAL_CTRL, 0 );
+	return global_ctrl;
+}
+
+/* Restore IA32_PERF_GLOBAL_CTRL */
+static inline void __unfreeze_all_counters ( uint64_t global_ctrl )
+{
+	wrmsrl ( MSR_PERF_GLOBAL_CTRL, global_ctrl );
+}
+
+/* Read the HW event's PMC (rdpmc) and set it to its reset value (event selector untouched) */
+static inline void __read_and_clear_count_hw_event ( struct hw_event* exp )
+{
+	simple_exp *s_exp=NULL;
+	fixed_count_exp *f_exp=NULL;
+
+	switch ( exp->type ) {
+	case _SIMPLE:
+		s_exp=& ( exp->g_event.s_exp );
+		readPMC ( &s_exp->pmc );
+		resetPMC ( &s_exp->pmc );
+		break;
+	case _FIXED:
+		f_exp=& ( exp->g_event.f_exp );
+		/* Fixed-function counters are selected by setting bit 30 in ECX */
+		f_exp->pmc.new_value=native_read_pmc ( ( 1U<<30 ) | ( f_exp->pmc.address-MSR_PERF_FIXED_CTR0 ) );
+		resetMSR ( &f_exp->pmc );
+		break;
+	default:
+		break;
+	}
+}
+
 #endif
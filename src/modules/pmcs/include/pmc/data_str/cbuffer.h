@@ -58,6 +58,12 @@ char remove_cbuffer_t ( cbuffer_t* cbuffer);
 /* Removes nr_items from the buffer and returns a copy of them */
 void remove_items_cbuffer_t ( cbuffer_t* cbuffer, void* items, int nr_items);
 
+/* Copies the first nr_items in the buffer without removing them */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, void* items, int nr_items);
+
+/* Removes the first nr_items from the buffer (no copy is made) */
+void discard_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items);
+
 /* Empty stuff from the buffer (whatever we've got inside) */
 int remove_cbuffer_t_batch(cbuffer_t* cbuffer, void* items, int max_nr_items);
 
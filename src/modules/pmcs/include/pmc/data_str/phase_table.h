@@ -18,12 +18,33 @@ typedef struct phase_table phase_table_t;
 phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*));
 void destroy_phase_table(phase_table_t* table);
 
+/*
+ * Create a phase table where lookups do not need to compare the key phase
+ * against every entry. key() maps a phase to a non-negative integer such that
+ * |key(a)-key(b)| never exceeds the value returned by compare() for a and b
+ * (e.g., the sum of the components of a metric vector when compare() returns
+ * the Manhattan distance). Phases are grouped in buckets of bucket_width
+ * consecutive key values.
+ *
+ * Lookups return a phase at the same minimum distance as a linear scan, but
+ * ties are not always broken the same way: the linear scan favors the most
+ * recently used phase in the whole table, whereas the indexed lookup favors
+ * the phase found first when visiting the buckets in increasing distance from
+ * the key phase's own bucket (only entries within a bucket are in MRU order).
+ */
+phase_table_t* create_indexed_phase_table(unsigned int max_phases, size_t phase_struct_size,
+        int (*compare)(void*,void*,void*),
+        unsigned int (*key)(void*), unsigned int bucket_width);
+
 /* Retrieve the most similar phase in a phase table */
 void* get_phase_from_table(phase_table_t* table, void* key_phase, void* priv_data, int* similarity, int* index);
 
 /* Move table entry in the index position to the beginning of the table */
 int promote_table_entry(phase_table_t* table, int index);
 
+/* Must be invoked after modifying a phase stored in the table (index position) */
+int rekey_table_entry(phase_table_t* table, int index);
+
 /* Insert a new phase into the phase table */
 void* insert_phase_in_table(phase_table_t* table, void* phase);
 
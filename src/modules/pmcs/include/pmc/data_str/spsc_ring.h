@@ -0,0 +1,150 @@
+/*
+ *  include/pmc/data_str/spsc_ring.h
+ *
+ * 	Lock-free single-producer/single-consumer byte ring
+ *
+ *  Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <asm/barrier.h>
+
+/*
+ * Ring buffer with free-running producer (head) and consumer (tail)
+ * positions. Only the producer updates head and only the consumer
+ * updates tail, so no lock is required as long as there is
+ * a single producer and a single consumer at any given time.
+ * The capacity must be a power of two.
+ */
+typedef struct {
+	char* data;				/* raw byte vector */
+	unsigned int mask;		/* Capacity - 1 */
+	unsigned long head;		/* Producer position */
+	unsigned int nesting;	/* Producer nesting level (to detect re-entry from NMI context) */
+	unsigned long dropped;	/* Number of records that did not fit in the ring */
+	unsigned long tail ____cacheline_aligned_in_smp;	/* Consumer position */
+}
+spsc_ring_t;
+
+/* Allocate the ring's storage (size is rounded up to a power of two) */
+static inline int init_spsc_ring_t(spsc_ring_t* ring, unsigned int size, int node)
+{
+	size=roundup_pow_of_two(size);
+
+	ring->data=kmalloc_node(size,GFP_KERNEL,node);
+
+	if (!ring->data)
+		return -ENOMEM;
+
+	ring->mask=size-1;
+	ring->head=0;
+	ring->tail=0;
+	ring->nesting=0;
+	ring->dropped=0;
+	return 0;
+}
+
+/* Release memory from the ring */
+static inline void destroy_spsc_ring_t(spsc_ring_t* ring)
+{
+	if (ring->data)
+		kfree(ring->data);
+	ring->data=NULL;
+	ring->mask=0;
+}
+
+/* Returns the ring's capacity in bytes */
+static inline unsigned int capacity_spsc_ring_t(spsc_ring_t* ring)
+{
+	return ring->mask+1;
+}
+
+/* Copy len bytes into the ring starting at position pos (handles wrap-around) */
+static inline void __copy_to_spsc_ring_t(spsc_ring_t* ring, unsigned long pos, const void* src, unsigned int len)
+{
+	unsigned int offset=pos & ring->mask;
+	unsigned int chunk=capacity_spsc_ring_t(ring)-offset;
+
+	if (chunk>len)
+		chunk=len;
+
+	memcpy(&ring->data[offset],src,chunk);
+
+	if (len>chunk)
+		memcpy(ring->data,((const char*)src)+chunk,len-chunk);
+}
+
+/* Copy len bytes out of the ring starting at position pos (handles wrap-around) */
+static inline void __copy_from_spsc_ring_t(spsc_ring_t* ring, unsigned long pos, void* dst, unsigned int len)
+{
+	unsigned int offset=pos & ring->mask;
+	unsigned int chunk=capacity_spsc_ring_t(ring)-offset;
+
+	if (chunk>len)
+		chunk=len;
+
+	memcpy(dst,&ring->data[offset],chunk);
+
+	if (len>chunk)
+		memcpy(((char*)dst)+chunk,ring->data,len-chunk);
+}
+
+/*
+ * Producer side: insert a record made up of a header and a payload.
+ * The record is published atomically (the consumer sees either all of
+ * it or nothing). Returns -ENOSPC if the record does not fit.
+ */
+static inline int insert_record_spsc_ring_t(spsc_ring_t* ring,
+        const void* hdr, unsigned int hdr_len,
+        const void* payload, unsigned int len)
+{
+	unsigned long head=ring->head;
+	/* Pairs with smp_store_release() in consume_spsc_ring_t() */
+	unsigned long tail=smp_load_acquire(&ring->tail);
+
+	if (capacity_spsc_ring_t(ring)-(head-tail) < hdr_len+len)
+		return -ENOSPC;
+
+	__copy_to_spsc_ring_t(ring,head,hdr,hdr_len);
+	__copy_to_spsc_ring_t(ring,head+hdr_len,payload,len);
+
+	/* Make the data visible before the new head */
+	smp_store_release(&ring->head,head+hdr_len+len);
+	return 0;
+}
+
+/* Consumer side: number of bytes available */
+static inline unsigned long used_spsc_ring_t(spsc_ring_t* ring)
+{
+	/* Pairs with smp_store_release() in insert_record_spsc_ring_t() */
+	return smp_load_acquire(&ring->head)-ring->tail;
+}
+
+/* Consumer side: returns a non-zero value when the ring is empty */
+static inline int is_empty_spsc_ring_t(spsc_ring_t* ring)
+{
+	return used_spsc_ring_t(ring)==0;
+}
+
+/* Consumer side: copy len bytes located at 'offset' bytes from the tail */
+static inline void peek_spsc_ring_t(spsc_ring_t* ring, unsigned int offset, void* dst, unsigned int len)
+{
+	__copy_from_spsc_ring_t(ring,ring->tail+offset,dst,len);
+}
+
+/* Consumer side: release len bytes to the producer */
+static inline void consume_spsc_ring_t(spsc_ring_t* ring, unsigned int len)
+{
+	smp_store_release(&ring->tail,ring->tail+len);
+}
+
+#endif
@@ -15,8 +15,18 @@
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <pmc/common/pmc_const.h>
+#include <pmc/pmc_user.h>
 #define MAX_REL_ARGS 2
 
+/* Divide in 32bit mode */
+#ifndef pmc_do_div
+#if defined(__i386__) || defined(__arm__)
+#define pmc_do_div(a,b) do_div(a,b)
+#else
+#define pmc_do_div(a,b) (a)=(a)/(b)
+#endif
+#endif
+
 
 /*
  * This enum allows the definition of diferents relations
@@ -57,34 +67,14 @@ typedef struct {
 	pmc_arg_t arg2;			/* Relation's second component */
 	/* Extra parameters: */
 	unsigned long scale_factor; 	/* Fixed point management field (rate) */
-	uint64_t count;			/* Last computed value */
 }
 pmc_metric_t;
 
 /* Helper macros to build simple metric sets */
 #define PMC_ARG(arg) {.type=hw_event_arg,.index=(arg)}
-#define PMC_METRIC(id,op,arg1,arg2,scale_factor) {id,op,PMC_ARG(arg1),PMC_ARG(arg2),scale_factor,0}
+#define PMC_METRIC(id,op,arg1,arg2,scale_factor) {id,op,PMC_ARG(arg1),PMC_ARG(arg2),scale_factor}
 #define PMC_VIRTUAL_METRIC(id) {id,op_virtual}
 
-/* Helper type for evaluating the value of hl_events */
-typedef struct {
-	arg_type_t type;
-	uint64_t value;
-} operand_t;
-
-
-/* Compute the value of a performance metric */
-void compute_value(pmc_metric_t* metric, uint64_t* hw_events, pmc_metric_t* metric_vector);
-
-/* Retrieve operands of to compute the value of a performance metric */
-void get_operands(pmc_metric_t* metric,
-                  uint64_t* hw_events,
-                  pmc_metric_t* metric_vector,
-                  operand_t* operands,
-                  unsigned int num_ops
-                 );
-
-
 
 /* Initialization function for performance metrics */
 static inline void init_pmc_metric ( pmc_metric_t* metric,
@@ -94,24 +84,64 @@ static inline void init_pmc_metric ( pmc_metric_t* metric,
                                      unsigned long scale_factor )
 {
 	strcpy(metric->id,name);
-	metric->count=0;
 	metric->mode=mode;
 	metric->arg1=arguments[0];
 	metric->arg2=arguments[1];
 	metric->scale_factor=scale_factor;
 }
 
-#define MAX_METRICS_PER_SET 8
+#define MAX_METRICS_PER_SET 32
 #define MAX_MULTIPLEX_EXP_PER_CORETYPE 4
 
+/*
+ * Metrics are evaluated over a register file: the first registers
+ * hold the HW event counts of the sample, and the remaining ones
+ * the values of the metrics (in the order they were defined).
+ */
+#define METRIC_HW_REG(idx)	(idx)
+#define METRIC_REG(idx)	(MAX_PERFORMANCE_COUNTERS+(idx))
+#define MAX_METRIC_REGS	(MAX_PERFORMANCE_COUNTERS+MAX_METRICS_PER_SET)
+
+/* Compiled form of a metric definition */
+typedef struct {
+	unsigned char mode;		/* pmc_relation_mode_t */
+	unsigned char dst;		/* Register where the result is stored */
+	unsigned char src1;		/* Registers holding the operands */
+	unsigned char src2;
+	unsigned long scale_factor;
+} pmc_metric_op_t;
+
 /* Set of metrics associated with a experiment set */
 typedef struct {
 	pmc_metric_t	metrics[MAX_METRICS_PER_SET];	/* HW counters opaque descriptor */
 	unsigned int	size;		/* Number of HW counters used for this event*/
 	int 		exp_idx;
+	/* Filled in by compile_metric_experiment_t() */
+	pmc_metric_op_t	ops[MAX_METRICS_PER_SET];	/* Metrics in evaluation (topological) order */
+	unsigned int	nr_ops;
+	unsigned int	nr_hw_regs;	/* Number of HW event counts used by the metrics */
 }
 metric_experiment_t;
 
+/*
+ * Values of the metrics of an experiment. Metric definitions
+ * are read-only and can be shared, so only this is per-thread.
+ */
+typedef struct {
+	uint64_t regs[MAX_METRIC_REGS];
+} metric_values_t;
+
+/* Value of the idx-th metric of an experiment */
+static inline uint64_t get_metric_value(metric_values_t* values, int idx)
+{
+	return values->regs[METRIC_REG(idx)];
+}
+
+static inline void init_metric_values_t(metric_values_t* values)
+{
+	memset(values,0,sizeof(metric_values_t));
+}
+
 /*
  * Makes it possible to define various performance
  * metrics in a scenario where event multiplexing is
@@ -128,6 +158,8 @@ static inline void init_metric_experiment_t(metric_experiment_t* m_exp,int exp_i
 {
 	m_exp->size = 0;   		/* Empty set (no nodes)*/
 	m_exp->exp_idx=exp_idx;
+	m_exp->nr_ops = 0;
+	m_exp->nr_hw_regs = 0;
 }
 
 static inline void clone_metric_experiment_t(metric_experiment_t* dst,
@@ -136,9 +168,14 @@ static inline void clone_metric_experiment_t(metric_experiment_t* dst,
 	int i=0;
 	dst->size = orig->size;
 	dst->exp_idx = orig->exp_idx;
+	dst->nr_ops = orig->nr_ops;
+	dst->nr_hw_regs = orig->nr_hw_regs;
 
 	for (i=0; i<orig->size; i++)
 		dst->metrics[i]=orig->metrics[i];
+
+	for (i=0; i<orig->nr_ops; i++)
+		dst->ops[i]=orig->ops[i];
 }
 
 /* Init a set of performance metrics */
@@ -159,6 +196,18 @@ static inline void clone_metric_experiment_set_t(metric_experiment_set_t* dst,
 		clone_metric_experiment_t(&dst->exps[i],&orig->exps[i]);
 }
 
+/*
+ * Translate the metric definitions of an experiment into a flat array
+ * of operations sorted so that each metric is computed after the metrics
+ * it depends on. This must be done once, after the last metric has been
+ * added to the experiment and before computing any values.
+ * Returns -EINVAL if a definition is invalid or there are cyclic dependencies.
+ */
+int compile_metric_experiment_t(metric_experiment_t* m_exp);
+
+/* Compile all the experiments in a set */
+int compile_metric_experiment_set_t(metric_experiment_set_t* m_set);
+
 
 /* For SF-enabled monitoring modules */
 static inline int normalize_speedup_factor (int sf)
@@ -192,27 +241,8 @@ static inline int denormalize_speedup_factor (int sf)
  * Obtain the values for a set of performance metrics
  * from HW event counts collected via PMCs (hw_events array)
  */
-static inline void compute_performance_metrics(uint64_t* hw_events, metric_experiment_t* metric_exp)
-{
-	int i=0;
-
-#ifdef DEBUG
-	char buf[100]="";
-	char* dst=buf;
-#endif
-
-	for (i=0; i<metric_exp->size; i++) {
-		pmc_metric_t* metric=&metric_exp->metrics[i];
-		compute_value(metric,hw_events,metric_exp->metrics);
-#ifdef DEBUG
-		dst+=sprintf(dst,"%s=%llu ",metric->id,metric->count);
-#endif
-	}
-
-#ifdef DEBUG
-	printk(KERN_ALERT "%s\n",buf);
-#endif
-}
+void compute_performance_metrics(uint64_t* hw_events, metric_experiment_t* metric_exp,
+                                 metric_values_t* values);
 
 /*
  * Macros, data structures and functions to
@@ -324,7 +354,7 @@ static inline unsigned long get_cur_average_mst(metric_smoother_t* mt)
 /* Helper functions for monitoring modules */
 int estimate_sf_additive(uint64_t* metrics,int* adregression_spec,int correction_factor);
 int estimate_sf_regression(uint64_t* metrics,int* regression_spec);
-void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set,
+void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, metric_values_t* values,
                               uint64_t* sf_metric_vector,unsigned int* size);
 
 #endif
@@ -92,7 +92,7 @@ static inline void __set_reset_value_hw_event (struct hw_event* exp, uint64_t re
 
 /* A low level event is a HW event with an additional identifier*/
 typedef struct {
-	char id[MAX_EXP_ID]; 	/*Event ID*/
+	const char* id; 	/* Event ID (static string shared by all the threads) */
 	struct hw_event event;
 	unsigned int pmc_id;	/* Performance counter id associated with this event */
 }
@@ -102,14 +102,14 @@ low_level_exp;
 /*************** Available operations for low_level_events  ***************************/
 static inline void init_low_level_exp ( low_level_exp* exp,const char *name)
 {
-	strcpy ( exp->id,name );
+	exp->id=name;
 	exp->pmc_id=0;
 }
 
 
 static inline void init_low_level_exp_id ( low_level_exp* exp,const char *name, unsigned int pmc_id)
 {
-	strcpy ( exp->id,name );
+	exp->id=name;
 	exp->pmc_id=pmc_id;
 }
 
@@ -125,6 +125,9 @@ static inline void init_low_level_exp_id ( low_level_exp* exp,const char *name,
 #define __restore_context_event(p_exp) 	__restore_context_hw_event(&((p_exp)->event))
 #define __get_reset_value(p_exp) 	__get_reset_value_hw_event(&((p_exp)->event))
 #define __set_reset_value(p_exp,reset_val) 	__set_reset_value_hw_event(&((p_exp)->event),(reset_val))
+#ifdef PMC_HAVE_GLOBAL_FREEZE
+#define __read_and_clear_count(p_exp)	__read_and_clear_count_hw_event(&((p_exp)->event))
+#endif
 
 
 #endif
@@ -35,16 +35,10 @@
 //#define SAFETY_CODE     ((unsigned char *)"0x777")
 #endif
 
-/* Divide in 32bit mode */
-#if defined(__i386__) || defined(__arm__)
-#define pmc_do_div(a,b) do_div(a,b)
-#else
-#define pmc_do_div(a,b) (a)=(a)/(b)
-#endif
-
 #define MAX_32_B 0xffffffff
-#define AMP_MAX_EXP_CORETYPE	2
+#define AMP_MAX_EXP_CORETYPE	5	/* Same as MAX_COUNTER_CONFIGS in libpmctrack */
 #define AMP_MAX_CORETYPES	2
+#define PMC_MAX_MUX_WEIGHT	100	/* Upper bound for the weight of a multiplexed experiment */
 #define PMC_NEW_THREAD  (CLONE_FS| CLONE_FILES | CLONE_VM| \
 CLONE_SIGHAND| CLONE_THREAD )
 #define is_new_thread(flags) ((flags & PMC_NEW_THREAD)==PMC_NEW_THREAD)
@@ -56,17 +50,33 @@ CLONE_SIGHAND| CLONE_THREAD )
 #include <asm/atomic.h>
 #include <pmc/pmc_user.h> /*For the data type */
 #include <pmc/data_str/cbuffer.h>
+#include <pmc/data_str/spsc_ring.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/irq_work.h>
 #include <linux/spinlock.h>
 #include <linux/timer.h>
 #include <linux/version.h>
 
+/*
+ * TBS_USER_MODE sampling is driven by a high-resolution timer running in
+ * softirq context (HRTIMER_MODE_REL_SOFT is available as of Linux 4.16)
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#define TBS_HRTIMER
+#include <linux/hrtimer.h>
+#endif
+
+/* Shortest sampling period accepted via the "timeout_us" command */
+#define PMC_MIN_SAMPLING_PERIOD_US	50
+
 /**************** Monitoring experiments ********************************/
 
 /*
  * Structure to store platform-specific configuration for a set of hardware events
  */
 typedef struct {
-	low_level_exp	array[MAX_LL_EXPS];	/* HW counters opaque descriptor */
 	unsigned int	size;				/* Number of HW counters used for this event */
 	unsigned int	used_pmcs;			/* PMC mask used */
 	int 		ebs_idx;				/* A -1 value means that ebs is disabled.
@@ -83,9 +93,19 @@ typedef struct {
 											 * from a physical PMC id
 											 */
 	unsigned int nr_overflows[MAX_LL_EXPS];	/* Overflow counts for each low_level_exp */
+	low_level_exp	array[MAX_LL_EXPS];	/* HW counters opaque descriptor
+										 * (must be the last field, see below) */
 }
 core_experiment_t;
 
+/*
+ * Bytes actually used by a core_experiment_t with nr_events HW counters.
+ * Per-thread experiments built from a shared configuration are allocated
+ * with this size, since entries past 'size' in array[] are never accessed.
+ */
+#define core_experiment_bytes(nr_events) \
+	offsetof(core_experiment_t,array[nr_events])
+
 typedef struct {
 	pmc_usrcfg_t pmc_cfg[MAX_LL_EXPS];
 	unsigned int used_pmcs;
@@ -94,6 +114,27 @@ typedef struct {
 	int coretype;
 } pmc_config_set_t;
 
+/*
+ * Immutable PMC configuration of an experiment. It is created once
+ * when the experiment is added to a set, and then shared (reference
+ * counted) by the experiment sets of all the threads that inherit it.
+ *
+ * With the raw MSR backends, the hardware event descriptors keep
+ * per-thread state inline (saved counts, EBS reset values), so every
+ * thread still needs its own core_experiment_t. These are built from
+ * the pristine copy kept here rather than from the experiment of the
+ * parent thread, which may be in use on another CPU, and only hold
+ * the descriptors of the events in use (see core_experiment_bytes()).
+ */
+typedef struct {
+	atomic_t ref_counter;
+#ifdef CONFIG_PMC_PERF
+	pmc_config_set_t config;
+#else
+	core_experiment_t exp;
+#endif
+} pmc_shared_config_t;
+
 /*
  * Set of core_experiment_t structures.
  * This is the basic structure to support the event multiplexing feature:
@@ -103,10 +144,13 @@ typedef struct {
 	core_experiment_t* exps[AMP_MAX_EXP_CORETYPE];
 	int nr_exps;
 	int cur_exp;	/* Contador modular entre 0 y nr_exps */
-#ifdef CONFIG_PMC_PERF
-	pmc_config_set_t pmc_config[AMP_MAX_EXP_CORETYPE];
+	unsigned char fair_rotation;	/* Select the experiment that ran the least (relative to its weight)
+									 * rather than the next one in round-robin order */
+	unsigned int weights[AMP_MAX_EXP_CORETYPE];	/* Relative share of time of each experiment (fair rotation) */
+	u64 time_enabled;						/* Time the experiments of the set were enabled (ns) */
+	u64 time_running[AMP_MAX_EXP_CORETYPE];	/* Time each experiment was running (ns) */
+	pmc_shared_config_t* pmc_config[AMP_MAX_EXP_CORETYPE];	/* Used to create the experiments of child threads */
 	int nr_configs;
-#endif
 } core_experiment_set_t;
 
 
@@ -209,19 +253,134 @@ typedef enum {
 	EBS_SCHED_MODE		/* Scheduler-driven event-based sampling */
 } pmc_profiling_mode_t;
 
+/* Flags for allocate_pmc_samples_buffer() */
+#define PMC_BUF_PERCPU	0x1	/* Per-CPU lock-free rings instead of a single shared cbuffer_t */
+#define PMC_BUF_COMPACT	0x2	/* Store samples as compact records (pmc_compact_sample_t) */
+#define PMC_BUF_VARINT	0x4	/* Varint-encode the values of compact records */
+#define PMC_BUF_DROP_NEWEST	0x8	/* Drop new samples rather than overwriting old ones when full */
+#define PMC_BUF_AGGREGATE	0x10	/* Add up samples in the kernel and deliver totals only */
+
+/* Max. number of predicates in a sample filter */
+#define PMC_MAX_SAMPLE_PREDICATES	4
+#define PMC_MAX_PREDICATE_SCALE	1000000	/* Upper bound for the scale factor of predicates */
+
+/* Comparison operators for sample predicates */
+typedef enum {
+	PMC_PRED_LT=0,
+	PMC_PRED_LE,
+	PMC_PRED_GT,
+	PMC_PRED_GE
+} pmc_predicate_op_t;
+
+/*
+ * Comparison of a PMC count, or a ratio of two PMC counts, against
+ * a threshold: scale*pmc<num>[/pmc<den>] <op> threshold. Counters are
+ * identified by their PMC number, as in the configuration strings.
+ */
+typedef struct {
+	unsigned int num;		/* PMC in the numerator */
+	int den;				/* PMC in the denominator (-1 if none) */
+	pmc_predicate_op_t op;
+	u64 scale;				/* Scale factor for the numerator (e.g., 1000 for MPKI) */
+	u64 threshold;			/* In thousandths */
+} pmc_sample_predicate_t;
+
+/*
+ * Per-session filter for TBS and EBS samples. A sample is only delivered
+ * if any of the predicates holds for it; the rest are folded into the
+ * totals of the thread (see accumulate_sample_totals()), which the monitor
+ * gets when the thread exits. Samples of experiments whose counters are not
+ * referenced by any predicate are always delivered.
+ */
+typedef struct {
+	unsigned int nr_predicates;	/* 0: no filter */
+	pmc_sample_predicate_t predicates[PMC_MAX_SAMPLE_PREDICATES];
+} pmc_sample_filter_t;
+
+/*
+ * Header of each record stored in a per-CPU ring.
+ * The timestamp enables the reader to merge the
+ * various per-CPU streams in chronological order.
+ */
+typedef struct {
+	uint64_t timestamp;			/* Monotonic time (ns) when the record was pushed */
+	unsigned int size;			/* Payload size in bytes */
+	unsigned int reserved;
+} pmc_ring_record_t;
+
+/* Head record of a per-CPU ring (used by the merging reader) */
+typedef struct {
+	spsc_ring_t* ring;
+	pmc_ring_record_t rec;
+} pmc_ring_cursor_t;
+
+/*
+ * Sample ring mapped into the address space of the monitor program
+ * (see pmc_mmap_ctl_t in pmc_user.h). Samples are written directly
+ * into the data pages, so the monitor can consume them without
+ * read() calls or copies. The head index and the capacity are kept
+ * in kernel memory, since the control page is writable from user space.
+ */
+typedef struct {
+	void* base;				/* vmalloc_user() area: control page + data pages */
+	unsigned long size;		/* Size of the area in bytes */
+	pmc_mmap_ctl_t* ctl;	/* Control page */
+	pmc_sample_t* slots;	/* Data pages */
+	uint32_t nr_slots;		/* Ring capacity (# of samples) */
+	uint32_t head;			/* Next slot to write */
+	atomic_t ref_counter;	/* References from the monitor thread, the samples buffer and VMAs */
+} pmc_mmap_ring_t;
+
+/* Per-experiment totals, indexed by [coretype][exp_idx] */
+typedef struct {
+	pmc_sample_t sample[AMP_MAX_CORETYPES][AMP_MAX_EXP_CORETYPE];
+} pmc_sample_totals_t;
+
+/*
+ * Totals of a process in aggregation mode (PMC_BUF_AGGREGATE).
+ * Threads fold their own totals into this structure when they exit.
+ */
+typedef struct {
+	pid_t tgid;
+	unsigned int nr_threads;	/* Threads with totals that did not exit yet */
+	pmc_sample_totals_t totals;
+	struct list_head links;
+} pmc_proc_totals_t;
+
 /*
  * SMP-safe data structure to store
  * PMC samples and virtual counter values.
  *
  * The pmctrack program interacts with the kernel
  * by retrieving samples from this data structure.
+ *
+ * In per-CPU mode (PMC_BUF_PERCPU), each CPU pushes samples into
+ * its own single-producer/single-consumer ring without taking
+ * the buffer's lock, and the monitor program (the only consumer)
+ * merges the per-CPU streams when reading.
  */
 typedef struct {
-	cbuffer_t* pmc_samples; 		/* Ring buffer */
+	cbuffer_t* pmc_samples; 		/* Ring buffer (NULL in per-CPU mode) */
+	spsc_ring_t __percpu* cpu_rings; /* Per-CPU rings (NULL in shared mode) */
+	pmc_ring_cursor_t* cursors;		/* Scratch space for the merging reader (one entry per CPU) */
+	pmc_mmap_ring_t* mmap_ring;		/* Ring mapped by the monitor (if any). It replaces pmc_samples once attached */
+	unsigned int flags;				/* PMC_BUF_* flags */
 	spinlock_t lock;				/* Spin lock to serialize accesses to this data structure */
 	struct semaphore sem_queue;		/* Semaphore for blocking the monitor program */
 	volatile int monitor_waiting;	/* Flag to indicate that the monitor is waiting
 										for new samples */
+	wait_queue_head_t poll_queue;	/* Monitor processes blocked in poll()/select()/epoll_wait() */
+	volatile int wakeup_pending;	/* The monitor was notified but did not drain the buffer yet */
+	unsigned int wakeup_watermark;	/* Bytes to be buffered before notifying the monitor (0: every sample) */
+	unsigned long wakeup_latency;	/* Max. time (jiffies) a sample may wait for the watermark (0: no limit) */
+	struct timer_list wakeup_timer;	/* Notifies the monitor when wakeup_latency expires */
+	struct irq_work wakeup_work;	/* Notifies the monitor of samples pushed in NMI context */
+	unsigned long nr_dropped;		/* New samples discarded because the buffer was full */
+	unsigned long nr_overwritten;	/* Old samples overwritten by new ones */
+	unsigned long reported_dropped;	/* Value of the lost-sample counters in the last */
+	unsigned long reported_overwritten;	/* PMC_LOST_SAMPLE delivered to the monitor */
+	struct list_head proc_totals;	/* Per-process totals (PMC_BUF_AGGREGATE) */
+	pmc_sample_filter_t filter;		/* Samples that do not pass the filter are not delivered */
 	atomic_t ref_counter;			/*
 									 * Reference counter for this object. It reflects
 									 * the number of processes/threads that hold a
@@ -244,7 +403,8 @@ typedef struct {
 	int safety_control;
 	unsigned char prof_enabled;
 	struct perf_event *event;
-	struct list_head links; 			/* For the exited task list */
+	struct hlist_node links; 			/* For the exited-task hash table */
+	struct rcu_head rcu;				/* Deferred release (lockless lookups in the exited-task table) */
 #endif
 	uint64_t pmc_values[MAX_LL_EXPS]; 	/* Accumulator for PMC values */
 	struct task_struct *this_tsk;		/* Backwards pointer to the task struct of this thread */
@@ -253,6 +413,7 @@ typedef struct {
 	                                     */
 	unsigned int samples_counter;   	/* The number of PMC samples collected for the thread */
 	int pmc_jiffies_interval;			/* TBS sampling period length (in jiffies) */
+	unsigned int pmc_usecs_interval;	/* TBS sampling period length (in microseconds, 0 if not set) */
 	unsigned long pmc_jiffies_timeout;	/* Timestamp to read performance and virtual counters */
 	core_experiment_t* pmcs_config;		/* Current PMC configuration in use */
 	core_experiment_set_t pmcs_multiplex_cfg[AMP_MAX_CORETYPES]; /* Per-thread PMCs configuration
@@ -266,6 +427,10 @@ typedef struct {
 #ifdef TBS_TIMER
 	struct timer_list timer;				/* Timer used in TBS mode */
 #endif
+#ifdef TBS_HRTIMER
+	struct hrtimer hrtimer;					/* Drift-free sampling timer for TBS_USER_MODE */
+	ktime_t tbs_deadline;					/* Next sample (coalesced TBS mode) */
+#endif
 #ifdef CONFIG_PMC_PERF
 	struct work_struct read_counters_task;			/* Work to queue */
 #endif
@@ -277,14 +442,57 @@ typedef struct {
 	 								         */
 	pmc_sample_t* pmc_kernel_samples;		/* Shared memory region between user and kernel space!! */
 	pmc_samples_buffer_t* pmc_samples_buffer; /* Buffer shared between monitor process and threads being monitored */
+	pmc_sample_totals_t* totals;			/* Totals of the thread (NULL unless its buffer aggregates or filters samples) */
+	pmc_proc_totals_t* proc_totals;			/* Totals of its process in "pmc_samples_buffer" (NULL if not registered yet) */
+	pmc_mmap_ring_t* pmc_mmap_ring;			/* Multi-page sample ring mapped by the monitor process */
 	uint_t nticks_sampling_period;			/* Scheduler-mode tick-based sampling period */
 	uint_t  kernel_buffer_size;				/* Max capacity (in bytes) of the ring buffer in "pmc_samples_buffer" */
+	uint_t	samples_buffer_flags;			/* PMC_BUF_* flags used when allocating "pmc_samples_buffer" */
+	uint_t	wakeup_samples;					/* Wakeup watermark for "pmc_samples_buffer" (# of samples) */
+	uint_t	wakeup_bytes;					/* Wakeup watermark for "pmc_samples_buffer" (bytes) */
+	uint_t	wakeup_latency_ms;				/* Max. latency to notify the monitor when a watermark is set */
+	uint_t	syswide_idle_policy;			/* What to do with idle CPUs in system-wide mode (pmc_syswide_idle_policy_t) */
+	pmc_sample_filter_t sample_filter;		/* Filter for the samples of "pmc_samples_buffer" */
 	uint_t 	max_ebs_samples;				/* Max number of EBS samples to send kill signal to process */
+	uint_t	max_overhead;					/* Sampling overhead budget (in hundredths of a percent, 0=disabled) */
+	uint_t	period_shift;					/* The sampling period is scaled by 2^period_shift to honor max_overhead */
+	uint_t	overhead_nr_samples;			/* Samples gathered in the current overhead-control window */
+	u64		overhead_ns;					/* Time spent sampling in the current window */
+	u64		overhead_window_start;			/* Beginning of the current window (local_clock()) */
 	ktime_t	ref_time;		 			/* To add timestamps to the various samples */
 	struct monitoring_module* task_mod;		/* Pointer to the monitoring module assigned to this task */
 	void* 	monitoring_mod_priv_data;		/* Per-thread private data for current monitoring module */
 } pmon_prof_t;
 
+/*
+ * Sampling period for TBS_USER_MODE and system-wide mode (in nanoseconds).
+ * This is the effective period, which accounts for the scaling
+ * applied by the adaptive sampling-rate controller.
+ */
+static inline u64 tbs_sampling_period_ns(pmon_prof_t* prof)
+{
+	u64 period;
+
+	if (prof->pmc_usecs_interval)
+		period=(u64)prof->pmc_usecs_interval*NSEC_PER_USEC;
+	else if (prof->pmc_jiffies_interval>0)
+		period=(u64)jiffies_to_usecs(prof->pmc_jiffies_interval)*NSEC_PER_USEC;
+	else
+		period=NSEC_PER_SEC;
+
+	return period<<prof->period_shift;
+}
+
+/* Same as above for the jiffy-based TBS timer */
+static inline unsigned long tbs_sampling_period_jiffies(pmon_prof_t* prof)
+{
+	return ((unsigned long)prof->pmc_jiffies_interval)<<prof->period_shift;
+}
+
+/* Parameters of the adaptive sampling-rate controller */
+#define PMC_OVERHEAD_WINDOW_SAMPLES	8	/* Overhead is evaluated every 8 samples */
+#define PMC_MAX_PERIOD_SHIFT		6	/* The period may grow up to 64x */
+
 /* Global PMCTrack configuration parameters */
 typedef struct {
 	uint_t pmon_nticks;             /* Default sampling interval for the
@@ -293,6 +501,9 @@ typedef struct {
 	uint_t pmon_kernel_buffer_size;	 /* Default capacity for the kernel
 									  * buffer that stores PMC samples
 									  */
+	uint_t pmon_coalesced_tbs;		/* Use per-CPU sampling timers
+									 * in TBS_USER_MODE
+									 */
 } pmon_config_t;
 extern pmon_config_t pmcs_pmon_config;
 
@@ -303,6 +514,11 @@ extern pmon_config_t pmcs_pmon_config;
 #define PMCTRACK_SF_NOTIFICATIONS 0x4
 #define PMC_PREPARE_MULTIPLEXING	0x8
 #define PMC_READ_SELF_MONITORING 0x10
+#define PMC_COALESCED_TBS	0x20
+#define PMC_CAPTURE_IP	0x40		/* Record the IP in EBS samples */
+#define PMC_CAPTURE_CALLCHAIN	0x80	/* Record the user-space call chain as well */
+#define PMC_CAPTURE_KERNEL_IP	0x100	/* Kernel-mode IPs may be recorded (privileged monitors only) */
+#define PMC_CAPTURE_FLAGS	(PMC_CAPTURE_IP|PMC_CAPTURE_CALLCHAIN|PMC_CAPTURE_KERNEL_IP)
 
 
 /** Operations on core_experiment_t **/
@@ -323,6 +539,11 @@ static inline void mc_clear_all_counters(core_experiment_t* core_experiment) {}
 static inline void mc_save_all_counters(core_experiment_t* core_experiment) {}
 static inline void mc_restore_all_counters(core_experiment_t* core_experiment) {}
 static inline  void restore_context_perfregs ( core_experiment_t* core_experiment) {}
+static inline void mc_lazy_stop_all_counters(core_experiment_t* core_experiment) {}
+static inline void mc_lazy_restart_all_counters(core_experiment_t* core_experiment) {}
+static inline void mc_forget_loaded_exp(core_experiment_t* core_experiment) {}
+static inline void mc_init_loaded_exp_tracking(void) {}
+static inline void mc_sync_loaded_exp_tracking(void) {}
 #else
 
 /* Restart PMCs used by a core_experiment_t */
@@ -346,49 +567,135 @@ void mc_restore_all_counters(core_experiment_t* core_experiment);
  */
 void restore_context_perfregs ( core_experiment_t* core_experiment);
 
+/*
+ * Lazy PMU context switch for TBS modes: leave the counters running on
+ * switch out, and only clear them on switch in if the same experiment
+ * is still loaded on the CPU
+ */
+void mc_lazy_stop_all_counters(core_experiment_t* core_experiment);
+void mc_lazy_restart_all_counters(core_experiment_t* core_experiment);
+
+/*
+ * Stop the counters of core_experiment on any CPU where it is still
+ * loaded, and drop any reference to it kept by the lazy-switch logic
+ */
+void mc_forget_loaded_exp(core_experiment_t* core_experiment);
+void mc_init_loaded_exp_tracking(void);
+void mc_sync_loaded_exp_tracking(void);
+
+/* Invalidate the lazy-switch state of the current CPU (PMU reprogrammed) */
+DECLARE_PER_CPU(core_experiment_t*, pmc_loaded_exp);
+#define mc_invalidate_loaded_exp() this_cpu_write(pmc_loaded_exp,NULL)
+
 #endif
 
 /**** Operations on core experiment set_t ****/
 
-/* Free up memory from a set of PMC experiments */
-static inline void free_experiment_set(core_experiment_set_t* cset)
+/* Increment the reference counter of a shared PMC configuration */
+static inline pmc_shared_config_t* get_pmc_shared_config(pmc_shared_config_t* shcfg)
+{
+	atomic_inc(&shcfg->ref_counter);
+	return shcfg;
+}
+
+/* Decrement the reference counter of a shared PMC configuration */
+static inline void put_pmc_shared_config(pmc_shared_config_t* shcfg)
+{
+	if (atomic_dec_and_test(&shcfg->ref_counter))
+		kfree(shcfg);
+}
+
+/* Free up memory from a PMC experiment */
+static inline void free_core_experiment(core_experiment_t* exp)
 {
-	int i=0;
 #ifdef CONFIG_PMC_PERF
 	int j=0;
+
+	/* Recorrer contadores del low_level_exp */
+	for(j=0; j<exp->size; ++j) {
+		if (exp->array[j].event.event)
+			perf_event_release_kernel(exp->array[j].event.event);
+	}
+#else
+	mc_forget_loaded_exp(exp);
 #endif
+	exp->size=0; /* set to zero */
+	kfree(exp);
+}
+
+/* Free up memory from a set of PMC experiments */
+static inline void free_experiment_set(core_experiment_set_t* cset)
+{
+	int i=0;
 
 	for (i=0; i<cset->nr_exps; i++) {
 		if (!cset->exps[i])
 			continue;
 
-#ifdef CONFIG_PMC_PERF
-		/* Recorrer contadores del low_level_exp */
-		for(j=0; j<cset->exps[i]->size; ++j) {
-			if (cset->exps[i]->array[j].event.event)
-				perf_event_release_kernel(cset->exps[i]->array[j].event.event);
-		}
-#endif
-		cset->exps[i]->size=0; /* set to zero */
-		kfree(cset->exps[i]);
+		free_core_experiment(cset->exps[i]);
 		cset->exps[i]=NULL;
 	}
 
 	cset->nr_exps=0;
+
+	for (i=0; i<cset->nr_configs; i++) {
+		put_pmc_shared_config(cset->pmc_config[i]);
+		cset->pmc_config[i]=NULL;
+	}
+
+	cset->nr_configs=0;
 }
 
-/* Add one PMC experiment to a given experiment set */
-static inline void add_experiment_to_set(core_experiment_set_t* cset, core_experiment_t* exp, pmc_config_set_t* config)
+/*
+ * Add one PMC experiment to a given experiment set.
+ * This function may be invoked with the prof lock held.
+ */
+static inline int add_experiment_to_set(core_experiment_set_t* cset, core_experiment_t* exp, pmc_config_set_t* config)
 {
+	pmc_shared_config_t* shcfg;
+	int k;
+
+#ifndef CONFIG_PMC_PERF
+	/* The raw backends build the experiments of child threads from a copy of exp */
+	if (!exp)
+		return -EINVAL;
+#endif
+
+	if (cset->nr_configs==AMP_MAX_EXP_CORETYPE || (exp && cset->nr_exps==AMP_MAX_EXP_CORETYPE))
+		return -ENOSPC;
+
+	/* Snapshot of the configuration to be shared with child threads */
+	shcfg=kmalloc(sizeof(pmc_shared_config_t),GFP_ATOMIC);
+
+	if (!shcfg)
+		return -ENOMEM;
+
+	atomic_set(&shcfg->ref_counter,1);
+
 	/* When using the perf backend, a NULL value can be passed just to copy the low-level configuration structure */
 	if (exp) {
 		/* Modifies the exp_idx with the position in the vector !!! */
 		exp->exp_idx=cset->nr_exps;
 		cset->exps[cset->nr_exps++]=exp;
 	}
+
 #ifdef CONFIG_PMC_PERF
-	memcpy(&cset->pmc_config[cset->nr_configs++],config,sizeof(pmc_config_set_t));
+	memcpy(&shcfg->config,config,sizeof(pmc_config_set_t));
+
+	/* Child threads inherit the events forcefully */
+	for (k=0; k<MAX_LL_EXPS; k++) {
+		if (config->used_pmcs & (0x1<<k))
+			shcfg->config.pmc_cfg[k].cfg_force_enable=1;
+	}
+#else
+	memcpy(&shcfg->exp,exp,sizeof(core_experiment_t));
+	shcfg->exp.need_setup=1;
+
+	for (k=0; k<MAX_LL_EXPS; k++)
+		shcfg->exp.nr_overflows[k]=0;
 #endif
+	cset->pmc_config[cset->nr_configs++]=shcfg;
+	return 0;
 }
 
 /* Rewind the pointer for event multiplexing */
@@ -401,15 +708,61 @@ static inline core_experiment_t* rewind_experiments_in_set(core_experiment_set_t
 /* Select the next PMC experiment from the multiplexing event set */
 static inline core_experiment_t* get_next_experiment_in_set(core_experiment_set_t* cset)
 {
-	if (cset->nr_exps>1) {
+	int i,idx,best;
+
+	if (cset->nr_exps<=1)
+		return cset->exps[cset->cur_exp];
+
+	if (!cset->fair_rotation) {
 		cset->cur_exp++;
 
 		if (cset->cur_exp==cset->nr_exps)
 			cset->cur_exp=0;
+		return cset->exps[cset->cur_exp];
+	}
+
+	/*
+	 * Pick the experiment with the lowest running time per unit of weight
+	 * (ties are broken in round-robin order, starting from the next one)
+	 */
+	best=-1;
+
+	for (i=1; i<=cset->nr_exps; i++) {
+		idx=(cset->cur_exp+i)%cset->nr_exps;
+
+		if (best==-1 || cset->time_running[idx]*cset->weights[best] < cset->time_running[best]*cset->weights[idx])
+			best=idx;
 	}
+
+	cset->cur_exp=best;
 	return cset->exps[cset->cur_exp];
 }
 
+/*
+ * Charge the interval covered by a sample to the experiment that was
+ * running, and record the enabled and running times of that experiment
+ * in the sample (so that counts can be extrapolated).
+ */
+static inline void account_experiment_time(core_experiment_set_t* cset, pmc_sample_t* sample)
+{
+	if (sample->exp_idx<0 || sample->exp_idx>=cset->nr_exps) {
+		sample->time_enabled=sample->time_running=0;
+		return;
+	}
+
+	cset->time_enabled+=sample->elapsed_time;
+	cset->time_running[sample->exp_idx]+=sample->elapsed_time;
+
+	/* Counts need no extrapolation (and times are not delivered) without multiplexing */
+	if (cset->nr_exps==1) {
+		sample->time_enabled=sample->time_running=0;
+		return;
+	}
+
+	sample->time_enabled=cset->time_enabled;
+	sample->time_running=cset->time_running[sample->exp_idx];
+}
+
 /* Return PMC configuration of the current event set being monitored */
 static inline core_experiment_t* get_cur_experiment_in_set(core_experiment_set_t* cset)
 {
@@ -421,26 +774,46 @@ static inline void init_core_experiment_set_t(core_experiment_set_t* cset)
 {
 	int i=0;
 
-	for (i=0; i<AMP_MAX_EXP_CORETYPE; i++)
+	for (i=0; i<AMP_MAX_EXP_CORETYPE; i++) {
 		cset->exps[i]=NULL;
+		cset->weights[i]=1;
+		cset->time_running[i]=0;
+	}
 
 	cset->nr_exps=0;
 	cset->cur_exp=0;
-#ifdef CONFIG_PMC_PERF
-	/* The actual pmc_config_set_t array requires no initialization */
+	cset->fair_rotation=0;
+	cset->time_enabled=0;
+	for (i=0; i<AMP_MAX_EXP_CORETYPE; i++)
+		cset->pmc_config[i]=NULL;
 	cset->nr_configs=0;
-#endif
 }
 
 /* Copy the configuration of a experiment set into another */
 int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src, struct task_struct* p);
 
+/* Inherit the multiplexing policy (running times start from zero) */
+static inline void clone_rotation_policy(core_experiment_set_t* dst,core_experiment_set_t* src)
+{
+	int i;
+
+	dst->fair_rotation=src->fair_rotation;
+
+	for (i=0; i<AMP_MAX_EXP_CORETYPE; i++) {
+		dst->weights[i]=src->weights[i];
+		dst->time_running[i]=0;
+	}
+
+	dst->time_enabled=0;
+}
+
 static inline int clone_core_experiment_set_t_noalloc(core_experiment_set_t* dst,core_experiment_set_t* src)
 {
 	int i=0,j=0;
 
 	dst->nr_exps=0;
 	dst->cur_exp=0;
+	clone_rotation_policy(dst,src);
 
 	for (i=0; i<src->nr_exps; i++) {
 		if (src->exps[i]!=NULL) {
@@ -453,6 +826,15 @@ static inline int clone_core_experiment_set_t_noalloc(core_experiment_set_t* dst
 		}
 
 	}
+
+	/* ... and move the references to the shared configurations */
+	for (i=0; i<src->nr_configs; i++) {
+		dst->pmc_config[i]=src->pmc_config[i];
+		src->pmc_config[i]=NULL;
+	}
+
+	dst->nr_configs=src->nr_configs;
+	src->nr_configs=0;
 	return 0;
 }
 
@@ -480,10 +862,14 @@ static inline void print_experiment_set_info(core_experiment_set_t* set, int nr_
 /**** Operations on a PMC sample buffer ****/
 
 /*
- * Allocate a buffer with capacity 'size_bytes'
+ * Allocate a buffer with capacity 'size_bytes' (per CPU if
+ * PMC_BUF_PERCPU is set in flags).
  * The function returns a non-null value on success.
  */
-pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes);
+pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes, unsigned int flags);
+
+/* Free up the memory associated with the buffer */
+void free_pmc_samples_buffer(pmc_samples_buffer_t* sbuf);
 
 /* Increment the buffer's reference counter */
 static inline void get_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
@@ -500,72 +886,379 @@ static inline int get_pmc_samples_buffer_refs(pmc_samples_buffer_t* sbuf)
 /* Decrement the buffer's reference counter */
 static inline void put_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
 {
-	if (atomic_dec_and_test(&sbuf->ref_counter)) {
-		destroy_cbuffer_t(sbuf->pmc_samples);
-		sbuf->pmc_samples=NULL;
-		kfree(sbuf);
-	}
+	if (atomic_dec_and_test(&sbuf->ref_counter))
+		free_pmc_samples_buffer(sbuf);
 }
 
 void pmc_samples_buffer_overflow(pmc_samples_buffer_t* sbuf);
 
 /*
- * Pushes a sample (PMC counts and virtual-counter values) into the buffer and
- * notifies the userspace program if necessary.
+ * Set up when producers notify the monitor program: once nr_samples
+ * samples or nr_bytes bytes are buffered (whatever comes first), and no later
+ * than max_latency_ms after the first sample not notified was pushed.
+ * Passing zero for both watermarks notifies the monitor on every sample.
+ */
+void set_wakeup_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, unsigned int nr_samples,
+                                   unsigned int nr_bytes, unsigned int max_latency_ms);
+
+/*
+ * Returns a non-zero value if the buffered data reached the
+ * wakeup watermark. In per-CPU mode, the watermark applies to each ring,
+ * and only the ring of the current CPU is checked if local_cpu is set.
+ *
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ */
+int pmc_samples_buffer_above_watermark(pmc_samples_buffer_t* sbuf, int local_cpu);
+
+/* Allocate a mmap-able sample ring with nr_data_pages data pages */
+pmc_mmap_ring_t* allocate_pmc_mmap_ring(unsigned int nr_data_pages);
+
+static inline void get_pmc_mmap_ring(pmc_mmap_ring_t* ring)
+{
+	atomic_inc(&ring->ref_counter);
+}
+
+void put_pmc_mmap_ring(pmc_mmap_ring_t* ring);
+
+/*
+ * Make the producers of a (shared-mode) buffer write samples into the ring
+ * mapped by the monitor. Samples already present in the buffer are moved to the ring.
  *
  * The function must be invoked with the buffer's lock held.
  */
-static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+int __attach_pmc_mmap_ring(pmc_samples_buffer_t* sbuf, pmc_mmap_ring_t* ring);
+
+/* Number of samples in the ring not yet consumed by the monitor */
+static inline uint32_t pmc_mmap_ring_used(pmc_mmap_ring_t* ring)
 {
-	if (is_full_cbuffer_t(sbuf->pmc_samples))
-		pmc_samples_buffer_overflow(sbuf);
+	uint32_t tail=READ_ONCE(ring->ctl->data_tail);
 
-	insert_items_cbuffer_t (sbuf->pmc_samples, sample, sizeof(pmc_sample_t));
+	/* The tail is controlled by user space: do not trust it */
+	if (tail>=ring->nr_slots)
+		return 0;
 
-	if (sbuf->monitor_waiting) {
-		sbuf->monitor_waiting=0;
-		up(&sbuf->sem_queue);
+	return ring->head>=tail ? ring->head-tail : ring->nr_slots-tail+ring->head;
+}
+
+/*
+ * Most samples do not carry a call chain. Clear the unused entries
+ * before copying a whole pmc_sample_t to user space, so that no
+ * stale kernel stack contents are exposed.
+ */
+static inline void pmc_clear_unused_callchain(pmc_sample_t* sample)
+{
+	if (sample->nr_callchain<PMC_MAX_CALLCHAIN)
+		memset(&sample->callchain[sample->nr_callchain],0,
+		       (PMC_MAX_CALLCHAIN-sample->nr_callchain)*sizeof(uint64_t));
+}
+
+/* Write a sample into the ring (the buffer's lock must be held) */
+static inline void __push_sample_mmap_ring(pmc_mmap_ring_t* ring, pmc_sample_t* sample)
+{
+	uint32_t next=ring->head+1;
+
+	if (next==ring->nr_slots)
+		next=0;
+
+	/* Full ring: the slot cannot be reused until the monitor advances data_tail */
+	if (next==READ_ONCE(ring->ctl->data_tail)) {
+		ring->ctl->lost_samples++;
+		return;
 	}
+
+	pmc_clear_unused_callchain(sample);
+	/* Order the read of data_tail with the write of the slot */
+	smp_mb();
+	memcpy(&ring->slots[ring->head],sample,sizeof(pmc_sample_t));
+	/* Publish the sample before the new head */
+	smp_wmb();
+	ring->head=next;
+	WRITE_ONCE(ring->ctl->data_head,next);
 }
 
 /*
- * Pushes a sample (PMC counts and virtual-counter values) into the buffer.
+ * Encode a sample in the wire format selected for the buffer.
+ * Returns a pointer to the record (the sample itself in the full format,
+ * or scratch otherwise) and stores its size in *size.
+ * scratch must be able to hold PMC_COMPACT_SAMPLE_MAX_SIZE bytes.
+ */
+static inline const void* encode_sample_pmc_buffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample,
+        void* scratch, unsigned int* size)
+{
+	if (!(sbuf->flags & PMC_BUF_COMPACT)) {
+		pmc_clear_unused_callchain(sample);
+		(*size)=sizeof(pmc_sample_t);
+		return sample;
+	}
+
+	(*size)=pmc_encode_sample(sample,sbuf->flags & PMC_BUF_VARINT,scratch);
+	return scratch;
+}
+
+/*
+ * Insert an encoded sample into the shared ring buffer. If there is no
+ * room left, either the oldest records are overwritten as a whole or the
+ * new one is dropped (PMC_BUF_DROP_NEWEST). Losses are accounted for in
+ * the buffer's counters.
  *
  * The function must be invoked with the buffer's lock held.
  */
-static inline void __push_sample_cbuffer_nowakeup(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+void __insert_record_cbuffer(pmc_samples_buffer_t* sbuf, const void* rec, unsigned int size);
+
+/*
+ * Returns a non-zero value if there are no samples in the buffer.
+ *
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ */
+int is_empty_pmc_samples_buffer(pmc_samples_buffer_t* sbuf);
+
+/*
+ * Retrieve up to max_bytes worth of samples from the buffer.
+ * In per-CPU mode, samples from the various CPUs are merged
+ * in timestamp order. Compact records are never split across calls.
+ * If samples were lost since the last call, a PMC_LOST_SAMPLE
+ * is placed first. Returns the number of bytes copied into dst.
+ *
+ * The function must be invoked with the buffer's lock held
+ * (it serializes consumers in per-CPU mode).
+ */
+int remove_samples_pmc_buffer(pmc_samples_buffer_t* sbuf, void* dst, unsigned int max_bytes);
+
+/* CLOCK_MONOTONIC timestamp for samples and per-CPU ring records (safe to use from NMI context) */
+static inline uint64_t pmc_ring_timestamp(void)
 {
-	insert_items_cbuffer_t (sbuf->pmc_samples, (const char*) sample, sizeof(pmc_sample_t));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+	return ktime_get_mono_fast_ns();
+#else
+	return ktime_to_ns(ktime_get());
+#endif
 }
 
 /*
  * Wake up the userspace monitor process so that it can retrieve
  * values from the buffer of samples.
  *
- * The function must be invoked with the buffer's lock held.
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ * In per-CPU mode, the flag is cleared atomically since producers do
+ * not hold the lock.
  */
 static inline void __wake_up_monitor_program(pmc_samples_buffer_t* sbuf)
 {
-	if (sbuf->monitor_waiting) {
+	if (sbuf->cpu_rings) {
+		/* Order the ring update with the check of the flag (see proc_monitor_pmcs_read()) */
+		smp_mb();
+		if (sbuf->monitor_waiting && xchg(&sbuf->monitor_waiting,0))
+			up(&sbuf->sem_queue);
+	} else if (sbuf->monitor_waiting) {
 		sbuf->monitor_waiting=0;
 		up(&sbuf->sem_queue);
 	}
+
+	/* Wake up poll()/select() waiters (see proc_monitor_pmcs_poll()) */
+	sbuf->wakeup_pending=1;
+	if (waitqueue_active(&sbuf->poll_queue))
+		wake_up_interruptible(&sbuf->poll_queue);
 }
 
-/* SMP-safe version of __push_sample_cbuffer() */
-static inline void push_sample_cbuffer(pmon_prof_t* prof,pmc_sample_t* sample)
+/*
+ * Notify the monitor program of new samples once the wakeup watermark
+ * is reached. Below the watermark, the monitor will be notified when
+ * the latency timer expires (if set). The force parameter bypasses the
+ * watermark (e.g., to notify the monitor that a thread exited).
+ *
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ */
+static inline void __notify_monitor_program(pmc_samples_buffer_t* sbuf, int force)
 {
+	/*
+	 * Semaphores, waitqueues and timers cannot be used in NMI context
+	 * (EBS samples). Defer the notification to pmc_samples_buffer_wakeup_work().
+	 */
+	if (in_nmi()) {
+		if (!sbuf->wakeup_watermark || pmc_samples_buffer_above_watermark(sbuf,1))
+			sbuf->wakeup_pending=1;
+		irq_work_queue(&sbuf->wakeup_work);
+		return;
+	}
 
+	if (force || !sbuf->wakeup_watermark || pmc_samples_buffer_above_watermark(sbuf,1)) {
+		__wake_up_monitor_program(sbuf);
+		return;
+	}
+
+	if (sbuf->wakeup_latency && !timer_pending(&sbuf->wakeup_timer))
+		mod_timer(&sbuf->wakeup_timer,jiffies+sbuf->wakeup_latency);
+}
+
+/*
+ * Pushes a sample into the ring of the current CPU.
+ * This only disables local interrupts: a re-entrant producer
+ * on the same CPU (e.g., an NMI) drops its sample instead of
+ * corrupting the ring.
+ */
+static inline void __push_sample_percpu_ring(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample, int wakeup)
+{
 	unsigned long flags;
+	spsc_ring_t* ring;
+	pmc_ring_record_t rec;
+	char scratch[PMC_COMPACT_SAMPLE_MAX_SIZE];
+	const void* payload;
+
+	local_irq_save(flags);
+	ring=this_cpu_ptr(sbuf->cpu_rings);
+
+	if (ring->nesting++==0) {
+		barrier();
+		rec.timestamp=pmc_ring_timestamp();
+		rec.reserved=0;
+		payload=encode_sample_pmc_buffer(sbuf,sample,scratch,&rec.size);
+
+		if (insert_record_spsc_ring_t(ring,&rec,sizeof(rec),payload,rec.size)) {
+			ring->dropped++;
+			pmc_samples_buffer_overflow(sbuf);
+		}
+		barrier();
+	} else {
+		ring->dropped++;
+	}
+
+	ring->nesting--;
+	local_irq_restore(flags);
+
+	if (wakeup)
+		__notify_monitor_program(sbuf,sample->type==PMC_EXIT_SAMPLE);
+}
+
+/*
+ * Pushes a sample (PMC counts and virtual-counter values) into the buffer and
+ * notifies the userspace program if necessary.
+ *
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ */
+static inline void __push_sample_cbuffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+{
+	char scratch[PMC_COMPACT_SAMPLE_MAX_SIZE];
+	const void* rec;
+	unsigned int size;
+
+	if (sbuf->cpu_rings) {
+		__push_sample_percpu_ring(sbuf,sample,1);
+		return;
+	}
+
+	if (sbuf->mmap_ring) {
+		__push_sample_mmap_ring(sbuf->mmap_ring,sample);
+		__notify_monitor_program(sbuf,sample->type==PMC_EXIT_SAMPLE);
+		return;
+	}
+
+	rec=encode_sample_pmc_buffer(sbuf,sample,scratch,&size);
+
+	if (nr_gaps_cbuffer_t(sbuf->pmc_samples)<size)
+		pmc_samples_buffer_overflow(sbuf);
+
+	__insert_record_cbuffer(sbuf,rec,size);
+
+	__notify_monitor_program(sbuf,sample->type==PMC_EXIT_SAMPLE);
+}
+
+/*
+ * Pushes a sample (PMC counts and virtual-counter values) into the buffer.
+ *
+ * In shared mode, the function must be invoked with the buffer's lock held.
+ */
+static inline void __push_sample_cbuffer_nowakeup(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+{
+	char scratch[PMC_COMPACT_SAMPLE_MAX_SIZE];
+	const void* rec;
+	unsigned int size;
+
+	if (sbuf->cpu_rings)
+		__push_sample_percpu_ring(sbuf,sample,0);
+	else if (sbuf->mmap_ring)
+		__push_sample_mmap_ring(sbuf->mmap_ring,sample);
+	else {
+		rec=encode_sample_pmc_buffer(sbuf,sample,scratch,&size);
+		__insert_record_cbuffer(sbuf,rec,size);
+	}
+}
+
+/*
+ * Pushes a sample into the buffer, taking care of the necessary
+ * synchronization. The buffer's lock is only acquired in shared mode.
+ */
+static inline void push_sample_pmc_buffer(pmc_samples_buffer_t* sbuf, pmc_sample_t* sample)
+{
+	unsigned long flags;
+
+	if (sbuf->cpu_rings) {
+		__push_sample_percpu_ring(sbuf,sample,1);
+		return;
+	}
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	__push_sample_cbuffer(sbuf,sample);
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+}
+
+/*
+ * Add up a sample into the totals of the thread (aggregation mode).
+ * Returns a non-zero value if the sample could not be accounted for.
+ *
+ * The function must be invoked with the thread's lock held.
+ */
+int accumulate_sample_totals(pmon_prof_t* prof, pmc_sample_t* sample);
+
+/*
+ * Allocate the totals of a thread if its samples buffer needs them
+ * (PMC_BUF_AGGREGATE or a sample filter). Totals are allocated in advance
+ * because EBS samples may be gathered in NMI context.
+ *
+ * The function may be invoked with the thread's lock held.
+ */
+int alloc_sample_totals(pmon_prof_t* prof);
+
+/*
+ * Deliver the totals of a thread to its samples buffer, along with those
+ * of its process if this is the last thread of the process with totals.
+ *
+ * The function must be invoked with the thread's lock held.
+ */
+void flush_sample_totals(pmon_prof_t* prof);
+
+/*
+ * Parse a comma-separated list of predicates (e.g., "pmc1/pmc0<0.5,1000*pmc3/pmc1>20")
+ * or "none" (no filter).
+ */
+int parse_sample_filter(char* str, pmc_sample_filter_t* filter);
+
+/* Returns a non-zero value if a sample must be delivered to the monitor */
+int sample_passes_filter(pmc_sample_filter_t* filter, pmc_sample_t* sample);
+
+/* SMP-safe version of __push_sample_cbuffer() */
+static inline void push_sample_cbuffer(pmon_prof_t* prof,pmc_sample_t* sample)
+{
+	/* Enabled/running times are tracked even if samples are not delivered */
+	if (sample->coretype>=0 && sample->coretype<AMP_MAX_CORETYPES)
+		account_experiment_time(&prof->pmcs_multiplex_cfg[sample->coretype],sample);
 
 	/* Make sure that the user allocated a buffer */
 	if (!prof->pmc_samples_buffer)
 		return;
 
+	/* Samples that cannot be aggregated are delivered as is */
+	if ((prof->pmc_samples_buffer->flags & PMC_BUF_AGGREGATE) && !accumulate_sample_totals(prof,sample))
+		return;
+
+	/* Filtered-out samples are summarized in the totals of the thread */
+	if (prof->pmc_samples_buffer->filter.nr_predicates
+	    && (sample->type==PMC_TICK_SAMPLE || sample->type==PMC_EBS_SAMPLE)
+	    && !sample_passes_filter(&prof->pmc_samples_buffer->filter,sample)
+	    && !accumulate_sample_totals(prof,sample))
+		return;
+
 	/* Push current counter values into the buffer */
-	spin_lock_irqsave(&prof->pmc_samples_buffer->lock,flags);
-	__push_sample_cbuffer(prof->pmc_samples_buffer,sample);
-	spin_unlock_irqrestore(&prof->pmc_samples_buffer->lock,flags);
+	push_sample_pmc_buffer(prof->pmc_samples_buffer,sample);
 }
 
 
@@ -754,7 +1447,9 @@ typedef struct proc_ops pmctrack_proc_ops_t;
 #define PMCT_PROC_LSEEK proc_lseek
 #define PMCT_PROC_RELEASE proc_release
 #define PMCT_PROC_IOCTL proc_ioctl
+#define PMCT_PROC_COMPAT_IOCTL proc_compat_ioctl
 #define PMCT_PROC_MMAP proc_mmap
+#define PMCT_PROC_POLL proc_poll
 #else
 typedef struct file_operations pmctrack_proc_ops_t;
 #define PMCT_PROC_OPEN open
@@ -762,8 +1457,16 @@ typedef struct file_operations pmctrack_proc_ops_t;
 #define PMCT_PROC_WRITE write
 #define PMCT_PROC_LSEEK llseek
 #define PMCT_PROC_RELEASE release
-#define PMCT_PROC_IOCTL ioctl
+#define PMCT_PROC_IOCTL unlocked_ioctl
+#define PMCT_PROC_COMPAT_IOCTL compat_ioctl
 #define PMCT_PROC_MMAP mmap
+#define PMCT_PROC_POLL poll
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+typedef __poll_t pmctrack_poll_t;
+#else
+typedef unsigned int pmctrack_poll_t;
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,17,0)
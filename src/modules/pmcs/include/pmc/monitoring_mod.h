@@ -122,6 +122,10 @@ typedef struct monitoring_module {
 																					counts in system-wide monitoring mode */
 	/* 	Invoked on each CPU to dump virtual-counter values into a pmc_sample_t structure */
 	void 	(*on_syswide_dump_virtual_counters)(int cpu, unsigned int virtual_mask, pmc_sample_t* sample);
+	size_t	thread_data_size;		/*	Size of the per-thread private data. If non-zero, the mm_manager creates
+										a slab cache for it when the module is loaded, and the private data
+										must be allocated/freed with mm_alloc_thread_data()/mm_free_thread_data() */
+	struct kmem_cache* thread_data_cache;	/*	Slab cache for per-thread private data (managed by the mm_manager) */
 } monitoring_module_t;
 
 
@@ -135,6 +139,9 @@ void destroy_mm_manager(struct proc_dir_entry* pmc_dir);
 int load_monitoring_module(monitoring_module_t* module);
 /* Unload a monitoring module with associated ID */
 int unload_monitoring_module(int module_id);
+/* Allocate/free per-thread private data for a monitoring module */
+void* mm_alloc_thread_data(monitoring_module_t* module);
+void mm_free_thread_data(monitoring_module_t* module, void* data);
 /* Get security code associated with current monitoring module */
 int current_monitoring_module_security_id(void);
 /* Get pointer to descriptor to current monitoring module */
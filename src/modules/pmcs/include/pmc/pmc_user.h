@@ -10,9 +10,13 @@
 #define PMC_USER_H
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/string.h>
+#include <linux/ioctl.h>
 #else
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <stdint.h>
+#include <string.h>
 #endif
 
 #ifndef MAX_PERFORMANCE_COUNTERS
@@ -23,6 +27,9 @@
 #define MAX_VIRTUAL_COUNTERS 3
 #endif
 
+/* Max number of entries in the call chain of an EBS sample (IP included) */
+#define PMC_MAX_CALLCHAIN 8
+
 /* Available sample types */
 typedef enum {
 	PMC_TICK_SAMPLE=0,
@@ -30,9 +37,55 @@ typedef enum {
 	PMC_EXIT_SAMPLE,
 	PMC_MIGRATION_SAMPLE,
 	PMC_SELF_SAMPLE,
+	PMC_LOST_SAMPLE,		/* Samples lost since the previous PMC_LOST_SAMPLE (see below) */
+	PMC_THREAD_TOTAL_SAMPLE,	/* Totals of a thread in aggregation mode (see below) */
+	PMC_PROCESS_TOTAL_SAMPLE,	/* Totals of all the monitored threads of a process */
+	PMC_IDLE_SAMPLE,		/* CPU idle during the last period in system-wide mode (see below) */
 	PMC_NR_SAMPLE_TYPES
 } sample_type_t;
 
+/*
+ * A PMC_LOST_SAMPLE carries no PMC values (pmc_mask and virt_mask are 0).
+ * Instead, pmc_counts[] holds the number of samples that the kernel
+ * could not deliver since the previous lost-sample record.
+ */
+#define PMC_LOST_DROPPED	0	/* Newest samples discarded because the buffer was full */
+#define PMC_LOST_OVERWRITTEN	1	/* Oldest samples overwritten by newer ones */
+#define PMC_LOST_NR_COUNTS	2
+
+/*
+ * In aggregation mode, the kernel adds up the samples of each thread
+ * rather than delivering them. Only one PMC_THREAD_TOTAL_SAMPLE
+ * per experiment is delivered when the thread exits (or is detached),
+ * followed by the PMC_PROCESS_TOTAL_SAMPLEs of its process when
+ * the last monitored thread of the process is gone. In these records,
+ * pid holds the thread (process) id, nr_samples the number of samples
+ * folded into the record and elapsed_time the time the experiment was
+ * running. The sum of elapsed_time over the experiments of a thread
+ * or process is the time monitoring was enabled.
+ */
+
+/*
+ * In system-wide mode, the counters of a CPU that stayed idle during a whole
+ * sampling period may be left alone. A PMC_IDLE_SAMPLE (if requested) only
+ * carries the CPU in the pid field: the counts of the idle periods are
+ * reported in the next regular sample of the CPU, whose elapsed_time covers
+ * those periods as well.
+ */
+typedef enum {
+	PMC_SYSWIDE_IDLE_SAMPLE=0,	/* Sample idle CPUs as any other CPU (default) */
+	PMC_SYSWIDE_IDLE_SKIP,		/* Generate no sample for idle CPUs */
+	PMC_SYSWIDE_IDLE_MARK,		/* Generate a PMC_IDLE_SAMPLE for idle CPUs */
+	PMC_NR_SYSWIDE_IDLE_POLICIES
+} pmc_syswide_idle_policy_t;
+
+/* What to do with new samples when the kernel buffer is full */
+typedef enum {
+	PMC_BUF_POLICY_OVERWRITE=0,	/* Overwrite the oldest samples (default) */
+	PMC_BUF_POLICY_DROP,		/* Drop the newest samples */
+	PMC_NR_BUF_POLICIES
+} pmc_buffer_policy_t;
+
 /* Structure to store PMC and virtual-counter values */
 typedef struct pmc_sample {
 	sample_type_t type;     /* Sample type */
@@ -40,12 +93,415 @@ typedef struct pmc_sample {
 	int exp_idx;            /* Index of the experiment set related to this counter setup */
 	pid_t pid;              /* To store a process id (per-thread mode) or CPU (system-wide mode) */
 	uint64_t elapsed_time;	/* Reference (from the time the previous sample was gathered) */
+	uint64_t sampling_period;	/* Effective sampling period (ns for TBS samples, events for EBS samples, 0 if n/a) */
 	unsigned int pmc_mask;  /* PMC mask for this sample */
 	unsigned int nr_counts; /* Number of performance counts associated with this sample */
 	uint64_t pmc_counts[MAX_PERFORMANCE_COUNTERS]; /* Raw PMC counts */
 	unsigned int virt_mask;  /* Virtual counter mask for this sample */
 	unsigned int nr_virt_counts; /* NUmber of virtual counts associated with this sample */
 	uint64_t virtual_counts[MAX_VIRTUAL_COUNTERS];	/* Raw virtual-counter values */
+	unsigned int nr_callchain;	/* Number of valid entries in callchain[] (0 if not captured) */
+	unsigned int nr_samples;	/* Samples folded into a total (PMC_*_TOTAL_SAMPLE only, 0 otherwise) */
+	uint64_t callchain[PMC_MAX_CALLCHAIN];	/* IP where the event overflowed followed by user-space return addresses */
+	uint64_t time_enabled;	/* Time the event set of this core type was enabled so far (ns, 0 if unknown) */
+	uint64_t time_running;	/* Time this experiment was running so far (ns, 0 if unknown) */
+	uint64_t timestamp;		/* CLOCK_MONOTONIC time when the sample was gathered (ns, 0 if unknown) */
+	int cpu;				/* CPU where the sample was gathered (-1 if it combines several CPUs) */
 } pmc_sample_t;
 
+/*
+ * timestamp and cpu make it possible to merge samples from several threads
+ * and CPUs (or from other sources using CLOCK_MONOTONIC) into a timeline,
+ * without adding up elapsed_time. Totals and per-cgroup samples carry the
+ * time they were delivered.
+ */
+
+/*
+ * When several experiments are multiplexed, the counts gathered for an
+ * experiment only cover a fraction of the time. An estimate of the
+ * number of events for the whole time monitoring was enabled is given by
+ * count*time_enabled/time_running (see pmct_scale_sample()).
+ */
+
+/*
+ * Control page of the sample ring exported by /proc/pmc/monitor
+ * when mmap() is invoked with a length of (1+N) pages. The control page
+ * is followed by the data pages, which hold an array of nr_slots samples.
+ * The kernel writes samples in place and advances data_head, whereas the
+ * monitor program advances data_tail once it is done with a sample.
+ * Both indexes are in [0,nr_slots), and the ring is empty when they match.
+ */
+typedef struct pmc_mmap_ctl {
+	uint32_t version;				/* Layout version (PMC_MMAP_RING_VERSION) */
+	uint32_t sample_size;			/* Size of each slot in bytes */
+	uint32_t data_offset;			/* Offset of the first slot from the beginning of the mapping */
+	uint32_t nr_slots;				/* Ring capacity (# of samples) */
+	volatile uint32_t data_head;	/* Next slot to be written by the kernel */
+	volatile uint32_t data_tail;	/* Next slot to be consumed by the monitor */
+	volatile uint64_t lost_samples;	/* Samples discarded because the ring was full */
+} pmc_mmap_ctl_t;
+
+#define PMC_MMAP_RING_VERSION 1
+
+/* Wire formats for the samples retrieved from /proc/pmc/monitor */
+typedef enum {
+	PMC_SAMPLE_FMT_FULL=0,		/* Array of pmc_sample_t (default) */
+	PMC_SAMPLE_FMT_COMPACT,		/* Compact records with 64-bit values */
+	PMC_SAMPLE_FMT_VARINT,		/* Compact records with varint-encoded values */
+	PMC_NR_SAMPLE_FMTS
+} pmc_sample_format_t;
+
+/*
+ * Header of a compact sample record. The header is followed by
+ * the timestamp and cpu+1 (only if PMC_COMPACT_TIMESTAMP is set),
+ * elapsed_time, the sampling period (only if PMC_COMPACT_PERIOD is set),
+ * the nr_counts PMC counts, the nr_virt_counts virtual counts and
+ * the call chain (only if PMC_COMPACT_CALLCHAIN is set, preceded by
+ * its length), nr_samples (only if PMC_COMPACT_NR_SAMPLES is set) and
+ * time_enabled and time_running (only if PMC_COMPACT_MUX_TIMES is set,
+ * i.e., if several experiments are multiplexed), in that order.
+ * Each of them is stored either as a 64-bit word or as a LEB128 varint
+ * (PMC_COMPACT_VARINT). Counts and elapsed_time are deltas with respect
+ * to the previous sample already, so most values fit in a few bytes.
+ * The timestamp is turned into a delta with respect to the previous
+ * record of the same read() (PMC_COMPACT_TIMESTAMP_DELTA) when records
+ * are retrieved from the kernel (see pmc_delta_encode_timestamp()).
+ *
+ * The first byte of a record is always PMC_COMPACT_SAMPLE_MAGIC,
+ * which never matches the first byte of a pmc_sample_t. This makes
+ * it possible to tell both formats apart when decoding a stream.
+ */
+typedef struct pmc_compact_sample {
+	uint8_t magic;			/* PMC_COMPACT_SAMPLE_MAGIC */
+	uint8_t flags;			/* PMC_COMPACT_* flags */
+	uint16_t size;			/* Record size in bytes (header included) */
+	uint8_t type;			/* Sample type */
+	int8_t coretype;		/* Core type where this sample was registered */
+	uint8_t exp_idx;		/* Index of the experiment set */
+	uint8_t nr_counts;		/* Number of PMC counts in the record */
+	uint16_t pmc_mask;		/* PMC mask for this sample */
+	uint8_t virt_mask;		/* Virtual counter mask for this sample */
+	uint8_t nr_virt_counts;	/* Number of virtual counts in the record */
+	int32_t pid;			/* Process id (per-thread mode) or CPU (system-wide mode) */
+} pmc_compact_sample_t;
+
+#define PMC_COMPACT_SAMPLE_MAGIC 0xA5
+#define PMC_COMPACT_VARINT 0x1
+#define PMC_COMPACT_PERIOD 0x2
+#define PMC_COMPACT_CALLCHAIN 0x4
+#define PMC_COMPACT_NR_SAMPLES 0x8
+#define PMC_COMPACT_MUX_TIMES 0x10
+#define PMC_COMPACT_TIMESTAMP 0x20
+#define PMC_COMPACT_TIMESTAMP_DELTA 0x40
+
+/* Upper bound for the size of a compact record (a varint takes up to 10 bytes) */
+#define PMC_COMPACT_SAMPLE_MAX_SIZE \
+	(sizeof(pmc_compact_sample_t)+10*(8+MAX_PERFORMANCE_COUNTERS+MAX_VIRTUAL_COUNTERS+PMC_MAX_CALLCHAIN))
+
+static inline unsigned int pmc_put_value(uint8_t* dst, uint64_t val, int varint)
+{
+	unsigned int len=0;
+
+	if (!varint) {
+		memcpy(dst,&val,sizeof(uint64_t));
+		return sizeof(uint64_t);
+	}
+
+	while (val>=0x80) {
+		dst[len++]=(uint8_t)(val|0x80);
+		val>>=7;
+	}
+	dst[len++]=(uint8_t)val;
+	return len;
+}
+
+/* Returns the number of bytes consumed, or 0 if the value is truncated or malformed */
+static inline unsigned int pmc_get_value(const uint8_t* src, unsigned int avail, uint64_t* val, int varint)
+{
+	unsigned int len=0;
+	unsigned int shift=0;
+
+	if (!varint) {
+		if (avail<sizeof(uint64_t))
+			return 0;
+		memcpy(val,src,sizeof(uint64_t));
+		return sizeof(uint64_t);
+	}
+
+	(*val)=0;
+
+	while (len<avail && shift<64) {
+		(*val)|=((uint64_t)(src[len]&0x7f))<<shift;
+		if (!(src[len++]&0x80))
+			return len;
+		shift+=7;
+	}
+
+	return 0;
+}
+
+/*
+ * Encode a sample as a compact record. dst must be able to hold
+ * PMC_COMPACT_SAMPLE_MAX_SIZE bytes. Returns the size of the record.
+ */
+static inline unsigned int pmc_encode_sample(const pmc_sample_t* sample, int varint, void* dst)
+{
+	pmc_compact_sample_t hdr;
+	uint8_t* cur=((uint8_t*)dst)+sizeof(pmc_compact_sample_t);
+	unsigned int i;
+
+	hdr.magic=PMC_COMPACT_SAMPLE_MAGIC;
+	hdr.flags=varint?PMC_COMPACT_VARINT:0;
+	hdr.type=sample->type;
+	hdr.coretype=sample->coretype;
+	hdr.exp_idx=sample->exp_idx;
+	hdr.nr_counts=sample->nr_counts;
+	hdr.pmc_mask=sample->pmc_mask;
+	hdr.virt_mask=sample->virt_mask;
+	hdr.nr_virt_counts=sample->nr_virt_counts;
+	hdr.pid=sample->pid;
+
+	if (sample->timestamp) {
+		hdr.flags|=PMC_COMPACT_TIMESTAMP;
+		cur+=pmc_put_value(cur,sample->timestamp,varint);
+		cur+=pmc_put_value(cur,(uint64_t)(sample->cpu+1),varint);
+	}
+
+	cur+=pmc_put_value(cur,sample->elapsed_time,varint);
+
+	if (sample->sampling_period) {
+		hdr.flags|=PMC_COMPACT_PERIOD;
+		cur+=pmc_put_value(cur,sample->sampling_period,varint);
+	}
+
+	for (i=0; i<sample->nr_counts && i<MAX_PERFORMANCE_COUNTERS; i++)
+		cur+=pmc_put_value(cur,sample->pmc_counts[i],varint);
+
+	for (i=0; i<sample->nr_virt_counts && i<MAX_VIRTUAL_COUNTERS; i++)
+		cur+=pmc_put_value(cur,sample->virtual_counts[i],varint);
+
+	if (sample->nr_callchain) {
+		unsigned int nr=sample->nr_callchain<PMC_MAX_CALLCHAIN?sample->nr_callchain:PMC_MAX_CALLCHAIN;
+
+		hdr.flags|=PMC_COMPACT_CALLCHAIN;
+		cur+=pmc_put_value(cur,nr,varint);
+
+		for (i=0; i<nr; i++)
+			cur+=pmc_put_value(cur,sample->callchain[i],varint);
+	}
+
+	if (sample->nr_samples) {
+		hdr.flags|=PMC_COMPACT_NR_SAMPLES;
+		cur+=pmc_put_value(cur,sample->nr_samples,varint);
+	}
+
+	if (sample->time_enabled) {
+		hdr.flags|=PMC_COMPACT_MUX_TIMES;
+		cur+=pmc_put_value(cur,sample->time_enabled,varint);
+		cur+=pmc_put_value(cur,sample->time_running,varint);
+	}
+
+	hdr.size=cur-(uint8_t*)dst;
+	memcpy(dst,&hdr,sizeof(pmc_compact_sample_t));
+	return hdr.size;
+}
+
+/*
+ * Rewrite the timestamp of the compact record at rec (if any) as a delta
+ * with respect to *last_timestamp, which is then updated. The first
+ * timestamp (*last_timestamp==0) and those that go backwards are left
+ * as is. Returns the new size of the record, which never exceeds
+ * the original one.
+ */
+static inline unsigned int pmc_delta_encode_timestamp(void* rec, uint64_t* last_timestamp)
+{
+	pmc_compact_sample_t hdr;
+	uint8_t* cur=((uint8_t*)rec)+sizeof(pmc_compact_sample_t);
+	uint8_t delta[10];
+	uint64_t timestamp;
+	unsigned int len, delta_len;
+	int varint;
+
+	memcpy(&hdr,rec,sizeof(pmc_compact_sample_t));
+
+	if (!(hdr.flags & PMC_COMPACT_TIMESTAMP) || (hdr.flags & PMC_COMPACT_TIMESTAMP_DELTA))
+		return hdr.size;
+
+	varint=hdr.flags & PMC_COMPACT_VARINT;
+
+	if (!(len=pmc_get_value(cur,hdr.size-sizeof(pmc_compact_sample_t),&timestamp,varint)))
+		return hdr.size;
+
+	if ((*last_timestamp) && timestamp>=(*last_timestamp)) {
+		delta_len=pmc_put_value(delta,timestamp-(*last_timestamp),varint);
+		memmove(cur+delta_len,cur+len,((uint8_t*)rec)+hdr.size-(cur+len));
+		memcpy(cur,delta,delta_len);
+		hdr.flags|=PMC_COMPACT_TIMESTAMP_DELTA;
+		hdr.size-=len-delta_len;
+		memcpy(rec,&hdr,sizeof(pmc_compact_sample_t));
+	}
+
+	(*last_timestamp)=timestamp;
+	return hdr.size;
+}
+
+/*
+ * Decode the compact record found at src into a pmc_sample_t.
+ * *last_timestamp holds the timestamp of the previous record
+ * retrieved with the same read() (0 for the first one), and gets
+ * updated. Returns the size of the record, or 0 if the record
+ * is malformed or does not fit in the avail bytes.
+ */
+static inline unsigned int pmc_decode_sample(const void* src, unsigned int avail, pmc_sample_t* sample,
+        uint64_t* last_timestamp)
+{
+	pmc_compact_sample_t hdr;
+	const uint8_t* cur=((const uint8_t*)src)+sizeof(pmc_compact_sample_t);
+	const uint8_t* end;
+	int varint;
+	unsigned int i, len;
+
+	if (avail<sizeof(pmc_compact_sample_t))
+		return 0;
+
+	memcpy(&hdr,src,sizeof(pmc_compact_sample_t));
+
+	if (hdr.magic!=PMC_COMPACT_SAMPLE_MAGIC || hdr.size>avail || hdr.size<sizeof(pmc_compact_sample_t)
+	    || hdr.nr_counts>MAX_PERFORMANCE_COUNTERS || hdr.nr_virt_counts>MAX_VIRTUAL_COUNTERS)
+		return 0;
+
+	end=((const uint8_t*)src)+hdr.size;
+	varint=hdr.flags & PMC_COMPACT_VARINT;
+
+	sample->type=(sample_type_t)hdr.type;
+	sample->coretype=hdr.coretype;
+	sample->exp_idx=hdr.exp_idx;
+	sample->pid=hdr.pid;
+	sample->pmc_mask=hdr.pmc_mask;
+	sample->nr_counts=hdr.nr_counts;
+	sample->virt_mask=hdr.virt_mask;
+	sample->nr_virt_counts=hdr.nr_virt_counts;
+
+	sample->timestamp=0;
+	sample->cpu=-1;
+
+	if (hdr.flags & PMC_COMPACT_TIMESTAMP) {
+		uint64_t cpu;
+
+		if (!(len=pmc_get_value(cur,end-cur,&sample->timestamp,varint)))
+			return 0;
+		cur+=len;
+		if (!(len=pmc_get_value(cur,end-cur,&cpu,varint)))
+			return 0;
+		cur+=len;
+		sample->cpu=(int)cpu-1;
+
+		if (hdr.flags & PMC_COMPACT_TIMESTAMP_DELTA)
+			sample->timestamp+=(*last_timestamp);
+		(*last_timestamp)=sample->timestamp;
+	}
+
+	if (!(len=pmc_get_value(cur,end-cur,&sample->elapsed_time,varint)))
+		return 0;
+	cur+=len;
+
+	sample->sampling_period=0;
+
+	if (hdr.flags & PMC_COMPACT_PERIOD) {
+		if (!(len=pmc_get_value(cur,end-cur,&sample->sampling_period,varint)))
+			return 0;
+		cur+=len;
+	}
+
+	for (i=0; i<hdr.nr_counts; i++) {
+		if (!(len=pmc_get_value(cur,end-cur,&sample->pmc_counts[i],varint)))
+			return 0;
+		cur+=len;
+	}
+
+	for (i=0; i<hdr.nr_virt_counts; i++) {
+		if (!(len=pmc_get_value(cur,end-cur,&sample->virtual_counts[i],varint)))
+			return 0;
+		cur+=len;
+	}
+
+	sample->nr_callchain=0;
+
+	if (hdr.flags & PMC_COMPACT_CALLCHAIN) {
+		uint64_t nr;
+
+		if (!(len=pmc_get_value(cur,end-cur,&nr,varint)) || nr>PMC_MAX_CALLCHAIN)
+			return 0;
+		cur+=len;
+
+		for (i=0; i<nr; i++) {
+			if (!(len=pmc_get_value(cur,end-cur,&sample->callchain[i],varint)))
+				return 0;
+			cur+=len;
+		}
+		sample->nr_callchain=nr;
+	}
+
+	sample->nr_samples=0;
+
+	if (hdr.flags & PMC_COMPACT_NR_SAMPLES) {
+		uint64_t nr;
+
+		if (!(len=pmc_get_value(cur,end-cur,&nr,varint)))
+			return 0;
+		cur+=len;
+		sample->nr_samples=nr;
+	}
+
+	sample->time_enabled=sample->time_running=0;
+
+	if (hdr.flags & PMC_COMPACT_MUX_TIMES) {
+		if (!(len=pmc_get_value(cur,end-cur,&sample->time_enabled,varint)))
+			return 0;
+		cur+=len;
+		if (!(len=pmc_get_value(cur,end-cur,&sample->time_running,varint)))
+			return 0;
+		cur+=len;
+	}
+
+	return hdr.size;
+}
+
+/*
+ * Binary control interface for /proc/pmc/monitor.
+ * These commands are equivalent to the strings accepted by write()
+ * ("ON", "OFF", "pid_attach", "syswide on", ...), but save the
+ * formatting/parsing steps and let the monitor program stop the counters
+ * and retrieve the pending samples with a single system call.
+ * User pointers are carried in 64-bit fields so that the layout
+ * is the same for 32-bit and 64-bit programs.
+ */
+#define PMC_IOC_MAGIC 'p'
+
+/* Argument for PMC_IOC_CONFIG */
+typedef struct pmc_ioc_config {
+	uint32_t flags;		/* PMC_IOC_CFG_* flags */
+	uint32_t len;		/* Length of the configuration string */
+	uint64_t str;		/* User pointer to the configuration string ("pmc0=0xc0,pmc1=0x3c" or "virt0") */
+} pmc_ioc_config_t;
+
+#define PMC_IOC_CFG_VIRTUAL	0x1	/* The string specifies virtual counters */
+#define PMC_IOC_CFG_SYSWIDE	0x2	/* Configuration for system-wide mode */
+#define PMC_IOC_CFG_SELFMON	0x4	/* Enable self-monitoring mode as well */
+
+/* Argument for PMC_IOC_STOP_READ */
+typedef struct pmc_ioc_read {
+	uint64_t buf;		/* User pointer to the destination buffer */
+	uint32_t size;		/* Size of the destination buffer in bytes */
+	uint32_t nr_bytes;	/* (Output) Number of bytes copied into buf */
+} pmc_ioc_read_t;
+
+#define PMC_IOC_START		_IO(PMC_IOC_MAGIC,1)		/* Same as writing "ON" */
+#define PMC_IOC_STOP		_IO(PMC_IOC_MAGIC,2)		/* Same as writing "OFF" */
+#define PMC_IOC_STOP_READ	_IOWR(PMC_IOC_MAGIC,3,pmc_ioc_read_t) /* "OFF" followed by read() */
+#define PMC_IOC_ATTACH		_IOW(PMC_IOC_MAGIC,4,int32_t)	/* Same as writing "pid_attach <pid>" */
+#define PMC_IOC_DETACH		_IOW(PMC_IOC_MAGIC,5,int32_t)	/* Same as writing "pid_detach <pid>" */
+#define PMC_IOC_CONFIG		_IOW(PMC_IOC_MAGIC,6,pmc_ioc_config_t) /* Counter configuration */
+#define PMC_IOC_SYSWIDE		_IOW(PMC_IOC_MAGIC,7,int32_t)	/* Start (1) or stop (0) system-wide monitoring */
+
 #endif
@@ -326,13 +326,13 @@ typedef struct migration_data {
 } migration_data_t;
 
 typedef struct running_avg_metrics {
-	unsigned long value[MAX_MULTIPLEX_EXP_PER_CORETYPE];
+	unsigned long value[MAX_METRICS_PER_SET];
 	unsigned int count; /* Total sample count */
 } running_avg_metrics_t;
 
 typedef struct pmcsched_thread_data {
 
-	metric_experiment_set_t metric_set[AMP_CORE_TYPES];                 /* Two core types */
+	metric_values_t metric_values[AMP_CORE_TYPES][MAX_MULTIPLEX_EXP_PER_CORETYPE];	/* Two core types */
 	unsigned int runnable;
 	unsigned int actually_runnable;         /* For low-level tracing */
 
@@ -436,7 +436,7 @@ typedef struct pmcsched_counter_config {
 	/* Counter config to expose configuration for PMCTrack */
 	monitoring_module_counter_usage_t counter_usage;
 	core_experiment_set_t* pmcs_descr;
-	metric_experiment_set_t* metric_descr[AMP_CORE_TYPES];
+	metric_experiment_set_t* metric_descr[AMP_CORE_TYPES];	/* Compiled (see compile_metric_experiment_set_t()) */
 	pmc_profiling_mode_t profiling_mode;
 } pmcsched_counter_config_t;
 
@@ -688,6 +688,7 @@ static inline int pmct_calculate_running_average(int cur_value, int last_avg, in
 
 void pmct_update_running_avg_metrics(
     metric_experiment_t* metric_set,
+    metric_values_t* values,
     running_avg_metrics_t* running_avgs,
     int new_factor
 );
@@ -10,6 +10,13 @@
 #define SYSWIDE_H
 
 #include <linux/proc_fs.h>
+#include <linux/version.h>
+
+/* Cgroup-scoped mode requires cgroup v2 (unified hierarchy) support */
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define SYSWIDE_CGROUPS
+#endif
+#define SYSWIDE_MAX_CGROUPS	256
 
 /* Global init/cleanup functions */
 int syswide_monitoring_init(void);
@@ -38,6 +45,22 @@ int syswide_monitoring_stop(void);
 int syswide_monitoring_pause(void);
 int syswide_monitoring_resume(void);
 
+/*
+ * Select a cgroup (path in the unified hierarchy) to be monitored.
+ * When the process that selects cgroups starts system-wide monitoring,
+ * samples are generated per cgroup (the pid field holds the index of the
+ * cgroup in selection order) rather than per CPU.
+ */
+int syswide_monitoring_add_cgroup(const char* path);
+void syswide_monitoring_clear_cgroups(void);
+
+/*
+ * Restrict the next system-wide session started by the calling process
+ * to a list of CPUs (e.g., "0-15,64-79"). The PMCs of the other CPUs
+ * remain available for the per-thread monitoring modes.
+ */
+int syswide_monitoring_set_cpus(const char* list);
+
 
 #endif
 
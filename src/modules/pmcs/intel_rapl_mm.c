@@ -14,6 +14,8 @@
 #include <pmc/monitoring_mod.h>
 #include <pmc/intel_rapl.h>
 
+extern monitoring_module_t intel_rapl_mm;
+
 #define INTEL_RAPL_MODULE_STR "PMCtrack module that supports Intel RAPL"
 
 
@@ -98,7 +100,7 @@ static int intel_rapl_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 		return 0;
 
 
-	data= kmalloc(sizeof (intel_rapl_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&intel_rapl_mm);
 	if (data == NULL)
 		return -ENOMEM;
 
@@ -164,7 +166,7 @@ static int intel_rapl_on_new_sample(pmon_prof_t* prof, int cpu, pmc_sample_t* sa
 static void intel_rapl_on_free_task(pmon_prof_t* prof)
 {
 	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+		mm_free_thread_data(&intel_rapl_mm,prof->monitoring_mod_priv_data);
 }
 
 /* on switch_in callback */
@@ -303,5 +305,6 @@ monitoring_module_t intel_rapl_mm= {
 	.module_counter_usage=intel_rapl_module_counter_usage,
 	.on_syswide_start_monitor=intel_rapl_on_syswide_start_monitor,
 	.on_syswide_refresh_monitor=intel_rapl_on_syswide_refresh_monitor,
-	.on_syswide_dump_virtual_counters=intel_rapl_on_syswide_dump_virtual_counters
+	.on_syswide_dump_virtual_counters=intel_rapl_on_syswide_dump_virtual_counters,
+	.thread_data_size=sizeof(intel_rapl_thread_data_t)
 };
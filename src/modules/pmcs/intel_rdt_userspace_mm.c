@@ -32,6 +32,8 @@
 #include <linux/sched/task.h> /* for get_task_struct()/put_task_struct() */
 #endif
 
+extern monitoring_module_t intel_rdt_userspace_mm;
+
 #define INTEL_RDT_MODULE_STR "User-space control of Intel RDT features"
 
 
@@ -460,7 +462,7 @@ static int intel_cmt_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	if (prof->monitoring_mod_priv_data!=NULL)
 		return 0;
 
-	data= kmalloc(sizeof (intel_cmt_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&intel_rdt_userspace_mm);
 
 	if (data == NULL)
 		return -ENOMEM;
@@ -484,7 +486,7 @@ static int intel_cmt_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 		error=clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[0],userspace_rdt_info.pmc_configuration,prof->this_tsk);
 
 		if (error) {
-			kfree(data);
+			mm_free_thread_data(&intel_rdt_userspace_mm,data);
 			return error;
 		}
 
@@ -594,7 +596,7 @@ static void intel_cmt_on_exit(pmon_prof_t* prof)
 static void intel_cmt_on_free_task(pmon_prof_t* prof)
 {
 	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+		mm_free_thread_data(&intel_rdt_userspace_mm,prof->monitoring_mod_priv_data);
 }
 
 /* on switch_in callback */
@@ -817,5 +819,6 @@ monitoring_module_t intel_rdt_userspace_mm= {
 	.on_switch_in=intel_cmt_on_switch_in,
 	.on_switch_out=intel_cmt_on_switch_out,
 	.get_current_metric_value=intel_cmt_get_current_metric_value,
-	.module_counter_usage=intel_cmt_module_counter_usage
+	.module_counter_usage=intel_cmt_module_counter_usage,
+	.thread_data_size=sizeof(intel_cmt_thread_data_t)
 };
@@ -27,6 +27,8 @@
 #include <linux/schedctl.h>
 #endif
 
+extern monitoring_module_t ipc_sampling_sf_mm;
+
 #define IPC_MODEL_STRING "IPC sampling SF estimation module"
 
 /* Global PMC configuration for both core types */
@@ -37,7 +39,7 @@ metric_experiment_set_t ipc_sampling_metric_set[AMP_CORE_TYPES];
 
 /* Per-thread private data for this monitoring module */
 typedef struct {
-	metric_experiment_set_t metric_set[AMP_CORE_TYPES]; /* Performance-metric descriptors */
+	metric_values_t metric_values[AMP_CORE_TYPES][MAX_MULTIPLEX_EXP_PER_CORETYPE]; /* Values of the performance metrics */
 	pmon_change_history_t ipc_history[AMP_CORE_TYPES];	/* Control of IPC phase changes */
 	int cur_speedup_factor;								/* Store current SF (normalized) */
 	metric_smoother_t sf_smoother;						/* Data structure to smooth SF values */
@@ -85,7 +87,7 @@ static void ipc_sampling_module_counter_usage(monitoring_module_counter_usage_t*
 }
 
 /* Create a simple set of performance metric descriptors (IPC) */
-static void init_ipc_metric(metric_experiment_set_t* metric_set)
+static int init_ipc_metric(metric_experiment_set_t* metric_set)
 {
 	pmc_metric_t* metric=NULL;
 	metric_experiment_t* metricExp;
@@ -104,6 +106,8 @@ static void init_ipc_metric(metric_experiment_set_t* metric_set)
 	arguments[1].type=hw_event_arg;
 
 	init_pmc_metric(metric,"IPC",op_rate,arguments,1000);
+
+	return compile_metric_experiment_set_t(metric_set);
 }
 
 /* MM initialization function */
@@ -116,8 +120,14 @@ static int ipc_sampling_enable_module(void)
 		return -EINVAL;
 	}
 
-	for (i=0; i<AMP_CORE_TYPES; i++)
-		init_ipc_metric(&ipc_sampling_metric_set[i]);
+	for (i=0; i<AMP_CORE_TYPES; i++) {
+		if (init_ipc_metric(&ipc_sampling_metric_set[i])) {
+			printk("Can't set up the performance metrics of the module");
+			for (i=0; i<AMP_CORE_TYPES; i++)
+				free_experiment_set(&ipc_sampling_pmc_configuration[i]);
+			return -EINVAL;
+		}
+	}
 
 	/* init configuration parameters */
 	ipc_sampling_sfmodel_config.sfmodel_running_average_factor=35; 	/* Percentage of the previous moving average of
@@ -197,7 +207,7 @@ static int ipc_sampling_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 		prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
 	}
 
-	data= kmalloc(sizeof (ipc_sampling_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&ipc_sampling_sf_mm);
 
 	if (data == NULL) {
 		error=-ENOMEM;
@@ -205,10 +215,10 @@ static int ipc_sampling_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 	}
 
 	/* Initialization */
-	/* Clone metric metainfo */
-	memcpy(&data->metric_set[0],&ipc_sampling_metric_set[0],sizeof(metric_experiment_set_t)*2);
-
 	for(i=0; i<AMP_CORE_TYPES; i++) {
+		for (j=0; j<MAX_MULTIPLEX_EXP_PER_CORETYPE; j++)
+			init_metric_values_t(&data->metric_values[i][j]);
+
 		init_pmon_change_history(&data->ipc_history[i]);
 		data->ipc_history[i].running_average=1000;
 		data->ipc_samples_cnt[i]=0;
@@ -245,11 +255,12 @@ static int ipc_sampling_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sa
 
 	if (sfdata!=NULL) {
 
-		metric_experiment_t* metric_exp=&sfdata->metric_set[cur_coretype].exps[sample->exp_idx];
+		metric_experiment_t* metric_exp=&ipc_sampling_metric_set[cur_coretype].exps[sample->exp_idx];
+		metric_values_t* values=&sfdata->metric_values[cur_coretype][sample->exp_idx];
 		pmon_change_history_t *ipc_history=&sfdata->ipc_history[cur_coretype];
 		/* Compute hl_metrics */
-		compute_performance_metrics(sample->pmc_counts,metric_exp);
-		ipc=metric_exp->metrics[0].count;
+		compute_performance_metrics(sample->pmc_counts,metric_exp,values);
+		ipc=get_metric_value(values,0);
 
 		/* Update running average */
 		pmon_update_running_average(ipc_history,ipc,
@@ -321,7 +332,7 @@ static void ipc_sampling_on_free_task(pmon_prof_t* prof)
 {
 	ipc_sampling_thread_data_t* data=(ipc_sampling_thread_data_t*)prof->monitoring_mod_priv_data;
 	if (data)
-		kfree(data);
+		mm_free_thread_data(&ipc_sampling_sf_mm,data);
 }
 
 /* Return current SF value for this thread */
@@ -357,5 +368,6 @@ monitoring_module_t ipc_sampling_sf_mm= {
 	.on_migrate=ipc_sampling_on_migrate,
 	.on_free_task=ipc_sampling_on_free_task,
 	.get_current_metric_value=ipc_sampling_get_current_metric_value,
-	.module_counter_usage=ipc_sampling_module_counter_usage
+	.module_counter_usage=ipc_sampling_module_counter_usage,
+	.thread_data_size=sizeof(ipc_sampling_thread_data_t)
 };
@@ -15,7 +15,10 @@
 #include <pmc/hl_events.h>
 #include <linux/module.h>
 #include <pmc/pmu_config.h>
-#include <pmc/data_str/phase_table.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/hardirq.h>
 
 #if defined(_DEBUG_USER_MODE)
 #include <printk.h>
@@ -49,11 +52,20 @@ void init_core_experiment_t(core_experiment_t* c_exp,int exp_idx)
 }
 
 #ifndef CONFIG_PMC_PERF
+/*
+ * Experiment whose event selectors were left enabled on this CPU
+ * when its thread was switched out (TBS modes only). NULL if the PMU
+ * has been reprogrammed since then.
+ */
+DEFINE_PER_CPU(core_experiment_t*, pmc_loaded_exp)=NULL;
+
 /* Monitor resets the Global PMU context (per CPU) ==> for 'old' events */
 void restore_context_perfregs ( core_experiment_t* ce )
 {
 	unsigned int j;
 
+	mc_invalidate_loaded_exp();
+
 	for ( j=0; j<ce->size; j++ ) {
 		low_level_exp* lle=&ce->array[j];
 		__stop_count ( lle );
@@ -72,6 +84,8 @@ void mc_restart_all_counters(core_experiment_t* core_experiment)
 		return;
 	}
 
+	mc_invalidate_loaded_exp();
+
 	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
@@ -88,6 +102,8 @@ void mc_stop_all_counters(core_experiment_t* core_experiment)
 {
 	unsigned int j;
 
+	mc_invalidate_loaded_exp();
+
 	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
@@ -129,6 +145,8 @@ void mc_restore_all_counters(core_experiment_t* core_experiment)
 {
 	unsigned int j;
 
+	mc_invalidate_loaded_exp();
+
 	/* Counters Reset action (new hardware events)*/
 	for(j=0; j<core_experiment->size; j++) {
 		low_level_exp* lle = &core_experiment->array[j];
@@ -141,6 +159,102 @@ void mc_restore_all_counters(core_experiment_t* core_experiment)
 
 	reset_overflow_status();
 }
+
+/*
+ * Lazy counterpart of mc_stop_all_counters() for TBS modes (context
+ * switch out). The counters are left running, and the current CPU
+ * remembers that the event selectors of core_experiment are still
+ * programmed.
+ */
+void mc_lazy_stop_all_counters(core_experiment_t* core_experiment)
+{
+	this_cpu_write(pmc_loaded_exp,core_experiment);
+}
+
+/*
+ * Start counting from zero (context switch in). If core_experiment
+ * is still loaded on the current CPU, clearing the counters is enough;
+ * otherwise the event selectors have to be reprogrammed.
+ */
+void mc_lazy_restart_all_counters(core_experiment_t* core_experiment)
+{
+	mc_clear_all_counters(core_experiment);
+
+	if (this_cpu_read(pmc_loaded_exp)!=core_experiment || core_experiment->need_setup)
+		mc_restart_all_counters(core_experiment);
+}
+
+/*
+ * Private copy of an experiment that is about to be freed while its
+ * event selectors are still enabled on a remote CPU. The remote CPU
+ * stops the counters from an irq_work handler using this copy, since
+ * the original core_experiment_t may be gone by then.
+ */
+static DEFINE_PER_CPU(core_experiment_t, pmc_orphan_exp);
+static DEFINE_PER_CPU(struct irq_work, pmc_orphan_work);
+/* Serializes updates to the per-CPU orphan copies */
+static DEFINE_SPINLOCK(pmc_orphan_lock);
+
+static void pmc_stop_orphan_exp(struct irq_work* work)
+{
+	core_experiment_t* orphan=this_cpu_ptr(&pmc_orphan_exp);
+
+	if (this_cpu_read(pmc_loaded_exp)==orphan)
+		mc_stop_all_counters(orphan);
+}
+
+void mc_init_loaded_exp_tracking(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		init_irq_work(&per_cpu(pmc_orphan_work,cpu),pmc_stop_orphan_exp);
+}
+
+void mc_sync_loaded_exp_tracking(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		irq_work_sync(&per_cpu(pmc_orphan_work,cpu));
+}
+
+/*
+ * Stop the counters on every CPU that still has core_experiment loaded,
+ * so that no CPU considers a soon-to-be-freed experiment as loaded.
+ * The local CPU is handled right away; remote CPUs get an irq_work
+ * (this may be invoked with IRQs disabled, so no synchronous IPIs).
+ */
+void mc_forget_loaded_exp(core_experiment_t* core_experiment)
+{
+	int cpu;
+	int this_cpu=get_cpu();
+	unsigned long flags;
+	core_experiment_t* orphan;
+
+	if (per_cpu(pmc_loaded_exp,this_cpu)==core_experiment)
+		mc_stop_all_counters(core_experiment);
+
+	spin_lock_irqsave(&pmc_orphan_lock,flags);
+
+	for_each_online_cpu(cpu) {
+		if (cpu==this_cpu || per_cpu(pmc_loaded_exp,cpu)!=core_experiment)
+			continue;
+
+		orphan=&per_cpu(pmc_orphan_exp,cpu);
+		memcpy(orphan,core_experiment,core_experiment_bytes(core_experiment->size));
+
+		if (cmpxchg(&per_cpu(pmc_loaded_exp,cpu),core_experiment,orphan)==core_experiment)
+			irq_work_queue_on(&per_cpu(pmc_orphan_work,cpu),cpu);
+	}
+
+	/* Offline CPUs reprogram the PMU when they come back */
+	for_each_possible_cpu(cpu)
+		cmpxchg(&per_cpu(pmc_loaded_exp,cpu),core_experiment,NULL);
+
+	spin_unlock_irqrestore(&pmc_orphan_lock,flags);
+	put_cpu();
+}
 #endif
 
 
@@ -157,6 +271,7 @@ int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t
 
 	/* Clean up */
 	init_core_experiment_set_t(dst);
+	clone_rotation_policy(dst,src);
 
 	/* Just memory allocation */
 	for (i=0; i<src->nr_configs; i++) {
@@ -167,28 +282,20 @@ int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t
 		}
 		dst->exps[i]=exp;
 		dst->nr_exps++;
-		/* Copy configuration */
-		memcpy(&dst->pmc_config[dst->nr_configs++],&src->pmc_config[i],sizeof(pmc_config_set_t));
-
+		/* Share configuration (read only) */
+		dst->pmc_config[dst->nr_configs++]=get_pmc_shared_config(src->pmc_config[i]);
 	}
 
 	/* No need to check user-provided configuration */
 	/* Now proceed to setup config */
 	for (i=0; i<dst->nr_configs; i++) {
-		config=&dst->pmc_config[i];
+		config=&dst->pmc_config[i]->config;
 
 		if (config->coretype==-1) {
 			error=-ENOTSUPP;
 			goto free_perf_events;
 		}
 
-		for (k=0; k<MAX_LL_EXPS; k++) {
-			if ( config->used_pmcs & (0x1<<k)) {
-				/* Update force enable flag */
-				config->pmc_cfg[k].cfg_force_enable=1;
-			}
-		}
-
 		error=do_setup_pmcs(config,config->used_pmcs,dst->exps[i],get_any_cpu_coretype(config->coretype),i,p);
 
 		if (error)
@@ -210,208 +317,129 @@ free_allocated_experiments:
 		kfree(dst->exps[i]);
 		dst->exps[i]=NULL;
 	}
+	dst->nr_exps=0;
+
+	for (i=0; i<dst->nr_configs; i++) {
+		put_pmc_shared_config(dst->pmc_config[i]);
+		dst->pmc_config[i]=NULL;
+	}
+	dst->nr_configs=0;
 	return error;
 }
 #else
 int clone_core_experiment_set_t(core_experiment_set_t* dst,core_experiment_set_t* src, struct task_struct* p)
 {
-	int i=0,j=0;
+	int i=0;
 	core_experiment_t* exp=NULL;
+	core_experiment_t* tmpl;
 
 	dst->nr_exps=0;
 	dst->cur_exp=0;
 
 	/* Clean up just in case */
 	init_core_experiment_set_t(dst);
+	clone_rotation_policy(dst,src);
 
-	for (i=0; i<src->nr_exps; i++) {
-		if (src->exps[i]!=NULL) {
-			exp= (core_experiment_t*) kmalloc(sizeof(core_experiment_t), GFP_KERNEL);
-			if (!exp)
-				goto free_allocated_experiments;
-			memcpy(exp,src->exps[i],sizeof(core_experiment_t));
-			/* Do not inherit overflow counters */
-			for (j=0; j<MAX_LL_EXPS; j++)
-				exp->nr_overflows[j]=0;
-			dst->exps[i]=exp;
-			dst->nr_exps++;
+	/* Per-thread instances built from the shared configuration (read only) */
+	for (i=0; i<src->nr_configs; i++) {
+		tmpl=&src->pmc_config[i]->exp;
+		exp= (core_experiment_t*) kmalloc(core_experiment_bytes(tmpl->size), GFP_KERNEL);
+		if (!exp) {
+			free_experiment_set(dst);
+			return -ENOMEM;
 		}
-
+		memcpy(exp,tmpl,core_experiment_bytes(tmpl->size));
+		dst->exps[i]=exp;
+		dst->nr_exps++;
+		dst->pmc_config[dst->nr_configs++]=get_pmc_shared_config(src->pmc_config[i]);
 	}
 
 	return 0;
-free_allocated_experiments:
-	for (i=0; i<dst->nr_exps; i++) {
-		kfree(dst->exps[i]);
-		dst->exps[i]=NULL;
-	}
-	return -ENOMEM;
 }
 #endif
 
 #if !defined(CONFIG_PMCTRACK) && !defined(CONFIG_MINIMAL_PMCTRACK)
-DEFINE_RWLOCK(gone_tasks_lock);
-LIST_HEAD(gone_tasks);
+/*
+ * Exited tasks whose task_struct has not been freed yet, hashed by
+ * task_struct address. Lookups are lockless (RCU); insertions and
+ * removals only serialize on the bucket's lock.
+ */
+#define GONE_TASKS_HASH_BITS	8
+#define GONE_TASKS_HASH_SIZE	(1<<GONE_TASKS_HASH_BITS)
+
+struct gone_tasks_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+} ____cacheline_aligned_in_smp;
+
+static struct gone_tasks_bucket gone_tasks[GONE_TASKS_HASH_SIZE];
+
+static inline struct gone_tasks_bucket* gone_tasks_bucket(struct task_struct* p)
+{
+	return &gone_tasks[hash_ptr(p,GONE_TASKS_HASH_BITS)];
+}
 
 void init_prof_exited_tasks(void)
 {
-	INIT_LIST_HEAD(&gone_tasks);
+	int i;
+
+	for (i=0; i<GONE_TASKS_HASH_SIZE; i++) {
+		spin_lock_init(&gone_tasks[i].lock);
+		INIT_HLIST_HEAD(&gone_tasks[i].head);
+	}
 }
 
 void add_prof_exited_task(pmon_prof_t *prof)
 {
 	unsigned long flags;
+	struct gone_tasks_bucket* bucket=gone_tasks_bucket(prof->this_tsk);
 
-	write_lock_irqsave(&gone_tasks_lock,flags);
-	list_add_tail(&prof->links,&gone_tasks);
-	write_unlock_irqrestore(&gone_tasks_lock,flags);
+	spin_lock_irqsave(&bucket->lock,flags);
+	hlist_add_head_rcu(&prof->links,&bucket->head);
+	spin_unlock_irqrestore(&bucket->lock,flags);
 }
 
 pmon_prof_t * get_prof_exited_task(struct task_struct* p)
 {
-	unsigned long flags;
 	pmon_prof_t * prof=NULL;
 	pmon_prof_t * next;
+	struct gone_tasks_bucket* bucket=gone_tasks_bucket(p);
 
-	read_lock_irqsave(&gone_tasks_lock,flags);
+	rcu_read_lock();
 
-	list_for_each_entry(next,&gone_tasks,links) {
+	hlist_for_each_entry_rcu(next,&bucket->head,links) {
 		if (next->this_tsk==p) {
 			prof=next;
 			break;
 		}
 	}
-	read_unlock_irqrestore(&gone_tasks_lock,flags);
+	rcu_read_unlock();
 
 	return prof;
 }
 
+/*
+ * The caller must defer the release of prof by one RCU grace period,
+ * since concurrent lookups may still be traversing the node.
+ */
 void del_prof_exited_task(pmon_prof_t *prof)
 {
 	unsigned long flags;
+	struct gone_tasks_bucket* bucket=gone_tasks_bucket(prof->this_tsk);
+
+	/* Tolerate tasks that never made it into the table */
+	if (hlist_unhashed(&prof->links))
+		return;
 
-	write_lock_irqsave(&gone_tasks_lock,flags);
-	list_del(&prof->links);
-	write_unlock_irqrestore(&gone_tasks_lock,flags);
+	spin_lock_irqsave(&bucket->lock,flags);
+	hlist_del_init_rcu(&prof->links);
+	spin_unlock_irqrestore(&bucket->lock,flags);
 }
 
 #endif
 
 /******************** Functions related to the computation of high-level performance metrics **************************/
-
-/*
- * This function computes the value of a performance metric (pmc_metric_t) according to its definition
- * and the values of the related events (operands)
- */
-void compute_value(pmc_metric_t* metric, uint64_t* hw_events, pmc_metric_t* metric_vector)
-{
-	operand_t operands[2];
-	uint64_t big_buffer = 0;
-	uint64_t aux;
-
-	switch(metric->mode) {
-	case op_division:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		if(operands[1].value != 0) {
-			metric->count = operands[0].value;
-			pmc_do_div(metric->count,operands[1].value);
-		} else {
-			/*Division by zero*/
-			metric->count = 0;
-		}
-		break;
-	case op_multiplication:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		metric->count = operands[0].value*operands[1].value;
-		break;
-	case op_sum:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		metric->count = operands[0].value+operands[1].value;
-		break;
-	case op_substract:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		if(operands[0].value >= operands[1].value ) {
-			metric->count = operands[0].value-operands[1].value;
-		}
-		metric->count=0;
-		break;
-	case op_rate:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		if(operands[1].value != 0) {
-			big_buffer = operands[0].value ;
-			big_buffer *= metric->scale_factor;
-			pmc_do_div(big_buffer,operands[1].value); /* big_buffer/=operands[1].value; */
-			metric->count = big_buffer;
-		} else {
-			/*Division by zero*/
-			metric->count=0;
-		}
-		break;
-	case op_rate2:
-		get_operands(metric, hw_events, metric_vector, operands, 2);
-		if(operands[1].value != 0) {
-			aux=operands[1].value;
-			pmc_do_div(aux,metric->scale_factor);
-			if (aux == 0) {
-				metric->count=0;
-			} else {
-				big_buffer=operands[0].value;
-				pmc_do_div(big_buffer,aux);
-				metric->count = big_buffer;
-			}
-		} else {
-			/*Division by zero*/
-			metric->count=0;
-		}
-		break;
-	case op_none:
-		get_operands(metric, hw_events, metric_vector, operands, 1);
-
-		if(operands[1].value != 0) {
-			big_buffer = operands[0].value ;
-			big_buffer *= metric->scale_factor;
-			metric->count = big_buffer;
-		} else {
-			/*Division by zero*/
-			metric->count=0;
-		}
-		break;
-	case op_virtual: /* In this case the user should set up the metric values later */
-	default:
-		metric->count = 0;
-		break;
-	}
-}
-
-/* This function builds a structure with the descriptors
-	of hardware events and metrics related to a given metric (hle)  */
-void get_operands(pmc_metric_t* metric,
-                  uint64_t* hw_events,
-                  pmc_metric_t* metric_vector,
-                  operand_t* operands,
-                  unsigned int num_ops
-                 )
-{
-	unsigned int i, ref = 0;
-	pmc_arg_t* argument = &metric->arg1;
-
-	for(i=0; i<num_ops; i++) {
-		ref=argument->index;
-		switch(argument->type) {
-		case hw_event_arg:
-			operands[i].type = hw_event_arg;
-			operands[i].value = hw_events[ref];
-			break;
-		case metric_arg:
-			operands[i].type = metric_arg;
-			operands[i].value = metric_vector[ref].count;
-			break;
-
-		}
-		argument=&metric->arg2;
-	}
-
-}
+/* (The metric engine itself lives in hl_events.c) */
 
 /* Returns whether there has been a change or not in the average before updating */
 int pmon_update_running_average(pmon_change_history_t* task_history, unsigned int last_value, int ra_factor,int ra_threshold, int percentage)
@@ -485,24 +513,105 @@ void noinline pmc_samples_buffer_overflow(pmc_samples_buffer_t* sbuf)
 	asm(" ");
 }
 
+/* The wakeup latency expired before the watermark was reached */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+static void pmc_samples_buffer_wakeup_timer(unsigned long data)
+{
+	pmc_samples_buffer_t* sbuf=(pmc_samples_buffer_t*)data;
+#else
+static void pmc_samples_buffer_wakeup_timer(struct timer_list *t)
+{
+	pmc_samples_buffer_t* sbuf=container_of(t, pmc_samples_buffer_t, wakeup_timer);
+#endif
+	unsigned long flags;
+
+	spin_lock_irqsave(&sbuf->lock,flags);
+	if (!is_empty_pmc_samples_buffer(sbuf))
+		__wake_up_monitor_program(sbuf);
+	spin_unlock_irqrestore(&sbuf->lock,flags);
+}
+
+/* Deferred notification of samples pushed in NMI context */
+static void pmc_samples_buffer_wakeup_work(struct irq_work* work)
+{
+	pmc_samples_buffer_t* sbuf=container_of(work, pmc_samples_buffer_t, wakeup_work);
+	unsigned long flags;
+
+	if (sbuf->cpu_rings) {
+		__notify_monitor_program(sbuf,0);
+	} else {
+		spin_lock_irqsave(&sbuf->lock,flags);
+		__notify_monitor_program(sbuf,0);
+		spin_unlock_irqrestore(&sbuf->lock,flags);
+	}
+}
+
 /* Allocate a buffer with capacity 'size_bytes' */
-pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes)
+pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes, unsigned int flags)
 {
 	pmc_samples_buffer_t* pmc_samples_buf=NULL;
+	int cpu;
 
 	pmc_samples_buf=kmalloc(sizeof(pmc_samples_buffer_t),GFP_KERNEL);
 
 	if (!pmc_samples_buf)
 		return NULL;
 
-	pmc_samples_buf->pmc_samples=create_cbuffer_t(size_bytes);
+	pmc_samples_buf->pmc_samples=NULL;
+	pmc_samples_buf->cpu_rings=NULL;
+	pmc_samples_buf->cursors=NULL;
+	pmc_samples_buf->mmap_ring=NULL;
+	pmc_samples_buf->flags=flags;
+	pmc_samples_buf->wakeup_pending=0;
+	pmc_samples_buf->wakeup_watermark=0;
+	pmc_samples_buf->nr_dropped=0;
+	pmc_samples_buf->nr_overwritten=0;
+	pmc_samples_buf->reported_dropped=0;
+	pmc_samples_buf->reported_overwritten=0;
+	pmc_samples_buf->wakeup_latency=0;
+	INIT_LIST_HEAD(&pmc_samples_buf->proc_totals);
+	pmc_samples_buf->filter.nr_predicates=0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	init_timer(&pmc_samples_buf->wakeup_timer);
+	pmc_samples_buf->wakeup_timer.data=(unsigned long)pmc_samples_buf;
+	pmc_samples_buf->wakeup_timer.function=pmc_samples_buffer_wakeup_timer;
+#else
+	timer_setup(&pmc_samples_buf->wakeup_timer, pmc_samples_buffer_wakeup_timer, 0);
+#endif
+	init_irq_work(&pmc_samples_buf->wakeup_work, pmc_samples_buffer_wakeup_work);
 
-	if (!pmc_samples_buf->pmc_samples) {
-		kfree(pmc_samples_buf);
-		return NULL;
+	if (flags & PMC_BUF_PERCPU) {
+		pmc_samples_buf->cpu_rings=alloc_percpu(spsc_ring_t);
+		pmc_samples_buf->cursors=kmalloc(sizeof(pmc_ring_cursor_t)*nr_cpu_ids,GFP_KERNEL);
+
+		if (!pmc_samples_buf->cpu_rings || !pmc_samples_buf->cursors) {
+			free_pmc_samples_buffer(pmc_samples_buf);
+			return NULL;
+		}
+
+		/* Make sure that each ring can hold at least one sample */
+		if (size_bytes<sizeof(pmc_ring_record_t)+sizeof(pmc_sample_t))
+			size_bytes=sizeof(pmc_ring_record_t)+sizeof(pmc_sample_t);
+
+		for_each_possible_cpu(cpu) {
+			spsc_ring_t* ring=per_cpu_ptr(pmc_samples_buf->cpu_rings,cpu);
+
+			if (init_spsc_ring_t(ring,size_bytes,cpu_to_node(cpu))) {
+				free_pmc_samples_buffer(pmc_samples_buf);
+				return NULL;
+			}
+		}
+	} else {
+		pmc_samples_buf->pmc_samples=create_cbuffer_t(size_bytes);
+
+		if (!pmc_samples_buf->pmc_samples) {
+			kfree(pmc_samples_buf);
+			return NULL;
+		}
 	}
 
 	sema_init(&pmc_samples_buf->sem_queue,0);
+	init_waitqueue_head(&pmc_samples_buf->poll_queue);
 	spin_lock_init(&pmc_samples_buf->lock);
 	atomic_set(&pmc_samples_buf->ref_counter,1);
 
@@ -511,6 +620,757 @@ pmc_samples_buffer_t* allocate_pmc_samples_buffer(unsigned int size_bytes)
 	return pmc_samples_buf;
 }
 
+/* Free up the memory associated with the buffer */
+void free_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	int cpu;
+	pmc_proc_totals_t* proc;
+	pmc_proc_totals_t* next;
+
+	/* The deferred notification may arm the timer */
+	irq_work_sync(&sbuf->wakeup_work);
+	del_timer_sync(&sbuf->wakeup_timer);
+
+	list_for_each_entry_safe(proc,next,&sbuf->proc_totals,links) {
+		list_del(&proc->links);
+		kfree(proc);
+	}
+
+	if (sbuf->cpu_rings) {
+		/* alloc_percpu() returns zeroed memory, so this is safe on partial init */
+		for_each_possible_cpu(cpu)
+			destroy_spsc_ring_t(per_cpu_ptr(sbuf->cpu_rings,cpu));
+		free_percpu(sbuf->cpu_rings);
+		sbuf->cpu_rings=NULL;
+	}
+
+	if (sbuf->cursors) {
+		kfree(sbuf->cursors);
+		sbuf->cursors=NULL;
+	}
+
+	if (sbuf->mmap_ring) {
+		put_pmc_mmap_ring(sbuf->mmap_ring);
+		sbuf->mmap_ring=NULL;
+	}
+
+	if (sbuf->pmc_samples) {
+		destroy_cbuffer_t(sbuf->pmc_samples);
+		sbuf->pmc_samples=NULL;
+	}
+
+	kfree(sbuf);
+}
+
+/*
+ * Parse an unsigned decimal number with up to three fractional digits
+ * (further digits are ignored). The value is stored in thousandths if
+ * milli is set, and no fractional part is accepted otherwise.
+ * Returns a pointer to the first character after the number,
+ * or NULL if there is no number.
+ */
+static const char* parse_filter_number(const char* s, u64* val, int milli)
+{
+	u64 v=0;
+	int nr_digits=0;
+	int frac=-1;	/* Fractional digits so far (-1: no decimal point) */
+
+	for (;; s++) {
+		if (*s>='0' && *s<='9') {
+			if (frac<3) {
+				v=v*10+(*s-'0');
+				if (frac>=0)
+					frac++;
+			}
+			nr_digits++;
+		} else if (*s=='.' && milli && frac<0) {
+			frac=0;
+		} else {
+			break;
+		}
+	}
+
+	if (!nr_digits)
+		return NULL;
+
+	if (milli) {
+		for (frac=(frac<0?0:frac); frac<3; frac++)
+			v*=10;
+	}
+
+	(*val)=v;
+	return s;
+}
+
+/* Parse "pmc<N>". Returns a pointer to the next character or NULL */
+static const char* parse_filter_counter(const char* s, unsigned int* pmc)
+{
+	u64 val;
+
+	if (strncmp(s,"pmc",3))
+		return NULL;
+
+	if (!(s=parse_filter_number(s+3,&val,0)) || val>=MAX_PERFORMANCE_COUNTERS)
+		return NULL;
+
+	(*pmc)=val;
+	return s;
+}
+
+/* Parse a predicate such as "1000*pmc3/pmc1>20" */
+static int parse_sample_predicate(const char* s, pmc_sample_predicate_t* pred)
+{
+	unsigned int pmc;
+
+	pred->scale=1;
+	pred->den=-1;
+
+	/* Optional scale factor */
+	if (*s>='0' && *s<='9') {
+		if (!(s=parse_filter_number(s,&pred->scale,0)) || *s++!='*' || !pred->scale
+		    || pred->scale>PMC_MAX_PREDICATE_SCALE)
+			return -EINVAL;
+	}
+
+	if (!(s=parse_filter_counter(s,&pred->num)))
+		return -EINVAL;
+
+	if (*s=='/') {
+		if (!(s=parse_filter_counter(s+1,&pmc)))
+			return -EINVAL;
+		pred->den=pmc;
+	}
+
+	if (*s=='<')
+		pred->op=(*++s=='=')?PMC_PRED_LE:PMC_PRED_LT;
+	else if (*s=='>')
+		pred->op=(*++s=='=')?PMC_PRED_GE:PMC_PRED_GT;
+	else
+		return -EINVAL;
+
+	if (*s=='=')
+		s++;
+
+	if (!(s=parse_filter_number(s,&pred->threshold,1)) || *s!='\0')
+		return -EINVAL;
+
+	return 0;
+}
+
+int parse_sample_filter(char* str, pmc_sample_filter_t* filter)
+{
+	pmc_sample_filter_t new_filter;
+	char* tok;
+
+	str=strim(str);
+	new_filter.nr_predicates=0;
+
+	if (strcmp(str,"none")) {
+		while ((tok=strsep(&str,","))!=NULL) {
+			if (new_filter.nr_predicates==PMC_MAX_SAMPLE_PREDICATES ||
+			    parse_sample_predicate(strim(tok),&new_filter.predicates[new_filter.nr_predicates]))
+				return -EINVAL;
+			new_filter.nr_predicates++;
+		}
+	}
+
+	(*filter)=new_filter;
+	return 0;
+}
+
+/*
+ * Retrieve the count of a given PMC from a sample. Counts are stored
+ * in the order of the PMCs in pmc_mask. Returns -1 if the sample
+ * has no count for that PMC.
+ */
+static inline int get_sample_count(pmc_sample_t* sample, unsigned int pmc, u64* count)
+{
+	unsigned int idx;
+
+	if (!(sample->pmc_mask & (1U<<pmc)))
+		return -1;
+
+	idx=hweight32(sample->pmc_mask & ((1U<<pmc)-1));
+
+	if (idx>=sample->nr_counts)
+		return -1;
+
+	(*count)=sample->pmc_counts[idx];
+	return 0;
+}
+
+/* 128-bit product of two 64-bit values */
+static inline void mul_u64_u64_128(u64 a, u64 b, u64* hi, u64* lo)
+{
+	u64 a_lo=(u32)a,a_hi=a>>32;
+	u64 b_lo=(u32)b,b_hi=b>>32;
+	u64 p0=a_lo*b_lo;
+	u64 p1=a_lo*b_hi;
+	u64 p2=a_hi*b_lo;
+	u64 mid=(p0>>32)+(u32)p1+(u32)p2;
+
+	(*lo)=(mid<<32)|(u32)p0;
+	(*hi)=a_hi*b_hi+(p1>>32)+(p2>>32)+(mid>>32);
+}
+
+/*
+ * Compare a*b with c*d. Counts may be large enough for the products
+ * to overflow 64 bits. Returns a negative value, zero or a positive value.
+ */
+static int compare_products(u64 a, u64 b, u64 c, u64 d)
+{
+	u64 ab_hi,ab_lo,cd_hi,cd_lo;
+
+	mul_u64_u64_128(a,b,&ab_hi,&ab_lo);
+	mul_u64_u64_128(c,d,&cd_hi,&cd_lo);
+
+	if (ab_hi!=cd_hi)
+		return ab_hi<cd_hi?-1:1;
+	if (ab_lo!=cd_lo)
+		return ab_lo<cd_lo?-1:1;
+	return 0;
+}
+
+int sample_passes_filter(pmc_sample_filter_t* filter, pmc_sample_t* sample)
+{
+	pmc_sample_predicate_t* pred;
+	u64 num,den;
+	int cmp;
+	int evaluated=0;
+	int i;
+
+	for (i=0; i<filter->nr_predicates; i++) {
+		pred=&filter->predicates[i];
+
+		if (get_sample_count(sample,pred->num,&num))
+			continue;
+
+		if (pred->den==-1)
+			den=1;
+		else if (get_sample_count(sample,pred->den,&den))
+			continue;
+
+		evaluated=1;
+
+		/* Undefined ratio */
+		if (!den)
+			continue;
+
+		/* Compare scale*num/den with threshold/1000 without dividing */
+		cmp=compare_products(pred->scale*1000,num,pred->threshold,den);
+
+		switch (pred->op) {
+		case PMC_PRED_LT:
+			if (cmp<0)
+				return 1;
+			break;
+		case PMC_PRED_LE:
+			if (cmp<=0)
+				return 1;
+			break;
+		case PMC_PRED_GT:
+			if (cmp>0)
+				return 1;
+			break;
+		case PMC_PRED_GE:
+			if (cmp>=0)
+				return 1;
+			break;
+		}
+	}
+
+	return !evaluated;
+}
+
+/* Set up when producers notify the monitor program */
+void set_wakeup_pmc_samples_buffer(pmc_samples_buffer_t* sbuf, unsigned int nr_samples,
+                                   unsigned int nr_bytes, unsigned int max_latency_ms)
+{
+	unsigned int record_size;
+	unsigned int watermark=nr_bytes;
+
+	/*
+	 * Translate the sample watermark into bytes. The size of compact
+	 * records varies, so take the smallest possible one: the monitor
+	 * may be notified before nr_samples are buffered, but never later.
+	 */
+	if (sbuf->flags & PMC_BUF_COMPACT)
+		record_size=sizeof(pmc_compact_sample_t)+1;
+	else
+		record_size=sizeof(pmc_sample_t);
+
+	if (sbuf->cpu_rings)
+		record_size+=sizeof(pmc_ring_record_t);
+
+	if (nr_samples && (!watermark || nr_samples*record_size<watermark))
+		watermark=nr_samples*record_size;
+
+	sbuf->wakeup_watermark=watermark;
+	sbuf->wakeup_latency=watermark?msecs_to_jiffies(max_latency_ms):0;
+}
+
+/* Returns a non-zero value if the buffered data reached the wakeup watermark */
+int pmc_samples_buffer_above_watermark(pmc_samples_buffer_t* sbuf, int local_cpu)
+{
+	int cpu;
+
+	if (sbuf->mmap_ring)
+		return pmc_mmap_ring_used(sbuf->mmap_ring)*sizeof(pmc_sample_t)>=sbuf->wakeup_watermark;
+
+	if (!sbuf->cpu_rings)
+		return size_cbuffer_t(sbuf->pmc_samples)>=sbuf->wakeup_watermark;
+
+	/* The producer may have migrated already, but this is just a hint */
+	if (local_cpu)
+		return used_spsc_ring_t(raw_cpu_ptr(sbuf->cpu_rings))>=sbuf->wakeup_watermark;
+
+	for_each_possible_cpu(cpu) {
+		if (used_spsc_ring_t(per_cpu_ptr(sbuf->cpu_rings,cpu))>=sbuf->wakeup_watermark)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns a non-zero value if there are no samples in the buffer */
+int is_empty_pmc_samples_buffer(pmc_samples_buffer_t* sbuf)
+{
+	int cpu;
+
+	if (sbuf->mmap_ring)
+		return pmc_mmap_ring_used(sbuf->mmap_ring)==0;
+
+	if (!sbuf->cpu_rings)
+		return is_empty_cbuffer_t(sbuf->pmc_samples);
+
+	for_each_possible_cpu(cpu) {
+		if (!is_empty_spsc_ring_t(per_cpu_ptr(sbuf->cpu_rings,cpu)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Merge the records in the per-CPU rings in timestamp order
+ * (the timestamps of compact records are delta-encoded on the way out).
+ * The head record of every non-empty ring is cached, so that
+ * only the ring that has just been consumed needs to be peeked again.
+ */
+static int merge_percpu_rings(pmc_samples_buffer_t* sbuf, char* dst, unsigned int max_bytes)
+{
+	pmc_ring_cursor_t* heads=sbuf->cursors;
+	int nr_heads=0;
+	int cpu, i, min;
+	unsigned int copied=0;
+	uint64_t last_timestamp=0;
+
+	/* Gather the head record of the non-empty rings */
+	for_each_possible_cpu(cpu) {
+		spsc_ring_t* ring=per_cpu_ptr(sbuf->cpu_rings,cpu);
+
+		if (is_empty_spsc_ring_t(ring))
+			continue;
+
+		heads[nr_heads].ring=ring;
+		peek_spsc_ring_t(ring,0,&heads[nr_heads].rec,sizeof(pmc_ring_record_t));
+		nr_heads++;
+	}
+
+	while (nr_heads>0) {
+		/* Pick the oldest record */
+		min=0;
+		for (i=1; i<nr_heads; i++)
+			if (heads[i].rec.timestamp<heads[min].rec.timestamp)
+				min=i;
+
+		if (copied+heads[min].rec.size>max_bytes)
+			break;
+
+		peek_spsc_ring_t(heads[min].ring,sizeof(pmc_ring_record_t),dst+copied,heads[min].rec.size);
+		consume_spsc_ring_t(heads[min].ring,sizeof(pmc_ring_record_t)+heads[min].rec.size);
+
+		if (sbuf->flags & PMC_BUF_COMPACT)
+			copied+=pmc_delta_encode_timestamp(dst+copied,&last_timestamp);
+		else
+			copied+=heads[min].rec.size;
+
+		/* Refresh the head of this ring */
+		if (is_empty_spsc_ring_t(heads[min].ring))
+			heads[min]=heads[--nr_heads];
+		else
+			peek_spsc_ring_t(heads[min].ring,0,&heads[min].rec,sizeof(pmc_ring_record_t));
+	}
+
+	return copied;
+}
+
+/* Insert an encoded sample into the shared ring buffer */
+void __insert_record_cbuffer(pmc_samples_buffer_t* sbuf, const void* rec, unsigned int size)
+{
+	cbuffer_t* cbuf=sbuf->pmc_samples;
+	pmc_compact_sample_t hdr;
+
+	if (nr_gaps_cbuffer_t(cbuf)<size) {
+		if ((sbuf->flags & PMC_BUF_DROP_NEWEST) || size>cbuf->max_size) {
+			sbuf->nr_dropped++;
+			return;
+		}
+
+		/* Make room by discarding the oldest records as a whole */
+		while (nr_gaps_cbuffer_t(cbuf)<size) {
+			if (sbuf->flags & PMC_BUF_COMPACT) {
+				peek_items_cbuffer_t(cbuf,&hdr,sizeof(pmc_compact_sample_t));
+				discard_items_cbuffer_t(cbuf,hdr.size);
+			} else
+				discard_items_cbuffer_t(cbuf,sizeof(pmc_sample_t));
+			sbuf->nr_overwritten++;
+		}
+	}
+
+	insert_items_cbuffer_t(cbuf,rec,size);
+}
+
+/*
+ * Place a PMC_LOST_SAMPLE in dst if samples were lost since the
+ * last report. Returns the number of bytes written into dst.
+ */
+static unsigned int report_lost_samples(pmc_samples_buffer_t* sbuf, char* dst, unsigned int max_bytes)
+{
+	unsigned long dropped=sbuf->nr_dropped;
+	unsigned long overwritten=sbuf->nr_overwritten;
+	char scratch[PMC_COMPACT_SAMPLE_MAX_SIZE];
+	pmc_sample_t sample;
+	const void* rec;
+	unsigned int size;
+	int cpu;
+
+	if (sbuf->cpu_rings) {
+		for_each_possible_cpu(cpu)
+			dropped+=READ_ONCE(per_cpu_ptr(sbuf->cpu_rings,cpu)->dropped);
+	}
+
+	if (dropped==sbuf->reported_dropped && overwritten==sbuf->reported_overwritten)
+		return 0;
+
+	memset(&sample,0,sizeof(pmc_sample_t));
+	sample.type=PMC_LOST_SAMPLE;
+	sample.coretype=-1;
+	sample.pid=-1;
+	sample.cpu=-1;
+	sample.timestamp=pmc_ring_timestamp();
+	sample.nr_counts=PMC_LOST_NR_COUNTS;
+	sample.pmc_counts[PMC_LOST_DROPPED]=dropped-sbuf->reported_dropped;
+	sample.pmc_counts[PMC_LOST_OVERWRITTEN]=overwritten-sbuf->reported_overwritten;
+
+	rec=encode_sample_pmc_buffer(sbuf,&sample,scratch,&size);
+
+	/* Try again on the next read */
+	if (size>max_bytes)
+		return 0;
+
+	memcpy(dst,rec,size);
+	sbuf->reported_dropped=dropped;
+	sbuf->reported_overwritten=overwritten;
+	return size;
+}
+
+/*
+ * Remove whole compact records from the shared ring buffer.
+ * Timestamps are delta-encoded on the way out.
+ */
+static int remove_compact_records_cbuffer(cbuffer_t* cbuf, char* dst, unsigned int max_bytes)
+{
+	pmc_compact_sample_t hdr;
+	unsigned int copied=0;
+	uint64_t last_timestamp=0;
+
+	while (size_cbuffer_t(cbuf)>=sizeof(pmc_compact_sample_t)) {
+		peek_items_cbuffer_t(cbuf,&hdr,sizeof(pmc_compact_sample_t));
+
+		if (copied+hdr.size>max_bytes)
+			break;
+
+		remove_items_cbuffer_t(cbuf,dst+copied,hdr.size);
+		copied+=pmc_delta_encode_timestamp(dst+copied,&last_timestamp);
+	}
+
+	return copied;
+}
+
+/* Retrieve up to max_bytes worth of samples from the buffer */
+int remove_samples_pmc_buffer(pmc_samples_buffer_t* sbuf, void* dst, unsigned int max_bytes)
+{
+	unsigned int copied=report_lost_samples(sbuf,dst,max_bytes);
+	char* cur=((char*)dst)+copied;
+
+	max_bytes-=copied;
+
+	if (sbuf->cpu_rings)
+		return copied+merge_percpu_rings(sbuf,cur,max_bytes);
+	else if (sbuf->flags & PMC_BUF_COMPACT)
+		return copied+remove_compact_records_cbuffer(sbuf->pmc_samples,cur,max_bytes);
+	else
+		return copied+remove_cbuffer_t_batch(sbuf->pmc_samples,cur,max_bytes);
+}
+
+
+/* Allocate a mmap-able sample ring with nr_data_pages data pages */
+pmc_mmap_ring_t* allocate_pmc_mmap_ring(unsigned int nr_data_pages)
+{
+	pmc_mmap_ring_t* ring;
+
+	if (nr_data_pages==0)
+		return NULL;
+
+	ring=kmalloc(sizeof(pmc_mmap_ring_t),GFP_KERNEL);
+
+	if (!ring)
+		return NULL;
+
+	ring->size=(nr_data_pages+1)*PAGE_SIZE;
+
+	/* Zeroed memory suitable for remap_vmalloc_range() */
+	ring->base=vmalloc_user(ring->size);
+
+	if (!ring->base) {
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->ctl=(pmc_mmap_ctl_t*)ring->base;
+	ring->slots=(pmc_sample_t*)(((char*)ring->base)+PAGE_SIZE);
+	ring->nr_slots=(nr_data_pages*PAGE_SIZE)/sizeof(pmc_sample_t);
+	ring->head=0;
+	atomic_set(&ring->ref_counter,1);
+
+	ring->ctl->version=PMC_MMAP_RING_VERSION;
+	ring->ctl->sample_size=sizeof(pmc_sample_t);
+	ring->ctl->data_offset=PAGE_SIZE;
+	ring->ctl->nr_slots=ring->nr_slots;
+	ring->ctl->data_head=0;
+	ring->ctl->data_tail=0;
+	ring->ctl->lost_samples=0;
+
+	return ring;
+}
+
+/* Decrement the ring's reference counter */
+void put_pmc_mmap_ring(pmc_mmap_ring_t* ring)
+{
+	if (atomic_dec_and_test(&ring->ref_counter)) {
+		vfree(ring->base);
+		kfree(ring);
+	}
+}
+
+/* Attach the ring mapped by the monitor to a samples buffer */
+int __attach_pmc_mmap_ring(pmc_samples_buffer_t* sbuf, pmc_mmap_ring_t* ring)
+{
+	pmc_sample_t sample;
+
+	if (sbuf->mmap_ring==ring)
+		return 0;
+
+	/*
+	 * Per-CPU rings are not drained into the mmap'ed ring,
+	 * whose slots can only hold samples in the full format
+	 */
+	if (sbuf->cpu_rings || sbuf->mmap_ring || (sbuf->flags & PMC_BUF_COMPACT))
+		return -EINVAL;
+
+	/* Move samples gathered so far */
+	while (size_cbuffer_t(sbuf->pmc_samples)>=sizeof(pmc_sample_t)) {
+		remove_items_cbuffer_t(sbuf->pmc_samples,&sample,sizeof(pmc_sample_t));
+		__push_sample_mmap_ring(ring,&sample);
+	}
+
+	get_pmc_mmap_ring(ring);
+	sbuf->mmap_ring=ring;
+	return 0;
+}
+
+/* Add the values of a sample (that accounts for nr_samples samples) to a total */
+static void add_sample_to_total(pmc_sample_t* total, pmc_sample_t* sample, unsigned int nr_samples)
+{
+	int i;
+
+	if (!total->nr_samples) {
+		total->coretype=sample->coretype;
+		total->exp_idx=sample->exp_idx;
+		total->pmc_mask=sample->pmc_mask;
+		total->nr_counts=sample->nr_counts;
+	}
+
+	for (i=0; i<sample->nr_counts && i<MAX_PERFORMANCE_COUNTERS; i++)
+		total->pmc_counts[i]+=sample->pmc_counts[i];
+
+	/* Virtual counters are not necessarily present in every sample */
+	if (sample->nr_virt_counts) {
+		total->virt_mask=sample->virt_mask;
+		total->nr_virt_counts=sample->nr_virt_counts;
+
+		for (i=0; i<sample->nr_virt_counts && i<MAX_VIRTUAL_COUNTERS; i++)
+			total->virtual_counts[i]+=sample->virtual_counts[i];
+	}
+
+	total->elapsed_time+=sample->elapsed_time;
+	total->nr_samples+=nr_samples;
+
+	/* Enabled/running times are cumulative for a thread, but add up across threads */
+	if (sample->type==PMC_THREAD_TOTAL_SAMPLE) {
+		total->time_enabled+=sample->time_enabled;
+		total->time_running+=sample->time_running;
+	} else {
+		total->time_enabled=sample->time_enabled;
+		total->time_running=sample->time_running;
+	}
+}
+
+/*
+ * Find the totals of a process in the buffer (or create them) and
+ * register a new contributing thread. Invoked with the buffer's lock held.
+ */
+static pmc_proc_totals_t* __get_proc_totals(pmc_samples_buffer_t* sbuf, pid_t tgid)
+{
+	pmc_proc_totals_t* proc;
+
+	list_for_each_entry(proc,&sbuf->proc_totals,links) {
+		if (proc->tgid==tgid) {
+			proc->nr_threads++;
+			return proc;
+		}
+	}
+
+	if ((proc=kzalloc(sizeof(pmc_proc_totals_t),GFP_ATOMIC))==NULL)
+		return NULL;
+
+	proc->tgid=tgid;
+	proc->nr_threads=1;
+	list_add_tail(&proc->links,&sbuf->proc_totals);
+	return proc;
+}
+
+int alloc_sample_totals(pmon_prof_t* prof)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+
+	if (prof->totals || !sbuf)
+		return 0;
+
+	if (!(sbuf->flags & PMC_BUF_AGGREGATE) && !sbuf->filter.nr_predicates)
+		return 0;
+
+	if ((prof->totals=kzalloc(sizeof(pmc_sample_totals_t),GFP_ATOMIC))==NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+int accumulate_sample_totals(pmon_prof_t* prof, pmc_sample_t* sample)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+	unsigned long flags;
+
+	if (sample->coretype<0 || sample->coretype>=AMP_MAX_CORETYPES
+	    || sample->exp_idx<0 || sample->exp_idx>=AMP_MAX_EXP_CORETYPE)
+		return -EINVAL;
+
+	/* No memory can be allocated in NMI context */
+	if (!prof->totals && (in_nmi() || alloc_sample_totals(prof) || !prof->totals))
+		return -ENOMEM;
+
+	/*
+	 * Register the thread with its process. EBS samples may be
+	 * gathered in NMI context, where no memory can be allocated,
+	 * so registration is deferred to flush_sample_totals() then.
+	 */
+	if (!prof->proc_totals && !in_nmi()) {
+		spin_lock_irqsave(&sbuf->lock,flags);
+		prof->proc_totals=__get_proc_totals(sbuf,prof->this_tsk->tgid);
+		spin_unlock_irqrestore(&sbuf->lock,flags);
+	}
+
+	add_sample_to_total(&prof->totals->sample[sample->coretype][sample->exp_idx],sample,1);
+	return 0;
+}
+
+void flush_sample_totals(pmon_prof_t* prof)
+{
+	pmc_samples_buffer_t* sbuf=prof->pmc_samples_buffer;
+	pmc_proc_totals_t* proc=prof->proc_totals;
+	pmc_sample_t* total;
+	unsigned long flags;
+	int i,j;
+	int empty=1;
+
+	if (!prof->totals)
+		return;
+
+	/* Nothing to deliver */
+	for (i=0; i<AMP_MAX_CORETYPES && empty; i++)
+		for (j=0; j<AMP_MAX_EXP_CORETYPE && empty; j++)
+			empty=!prof->totals->sample[i][j].nr_samples;
+
+	if (empty)
+		return;
+
+	if (sbuf) {
+		spin_lock_irqsave(&sbuf->lock,flags);
+
+		/*
+		 * Late registration. If other threads of the process
+		 * exited in the meantime, the process totals will be
+		 * delivered in several pieces, which must be added up.
+		 */
+		if (!proc)
+			proc=__get_proc_totals(sbuf,prof->this_tsk->tgid);
+
+		for (i=0; i<AMP_MAX_CORETYPES; i++) {
+			for (j=0; j<AMP_MAX_EXP_CORETYPE; j++) {
+				total=&prof->totals->sample[i][j];
+
+				if (!total->nr_samples)
+					continue;
+
+				total->type=PMC_THREAD_TOTAL_SAMPLE;
+				total->pid=prof->this_tsk->pid;
+				total->timestamp=pmc_ring_timestamp();
+				total->cpu=-1;
+				__push_sample_cbuffer_nowakeup(sbuf,total);
+
+				if (proc)
+					add_sample_to_total(&proc->totals.sample[i][j],total,total->nr_samples);
+			}
+		}
+
+		if (proc && --proc->nr_threads==0) {
+			for (i=0; i<AMP_MAX_CORETYPES; i++) {
+				for (j=0; j<AMP_MAX_EXP_CORETYPE; j++) {
+					total=&proc->totals.sample[i][j];
+
+					if (!total->nr_samples)
+						continue;
+
+					total->type=PMC_PROCESS_TOTAL_SAMPLE;
+					total->pid=proc->tgid;
+					total->timestamp=pmc_ring_timestamp();
+					total->cpu=-1;
+					__push_sample_cbuffer_nowakeup(sbuf,total);
+				}
+			}
+
+			list_del(&proc->links);
+			kfree(proc);
+		}
+
+		__wake_up_monitor_program(sbuf);
+		spin_unlock_irqrestore(&sbuf->lock,flags);
+	}
+
+	memset(prof->totals,0,sizeof(pmc_sample_totals_t));
+	prof->proc_totals=NULL;
+}
+
 
 int estimate_sf_additive(uint64_t* metrics,int* adregression_spec,int correction_factor)
 {
@@ -572,7 +1432,8 @@ int estimate_sf_regression(uint64_t* metrics,int* regression_spec)
 }
 
 
-void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, uint64_t* sf_metric_vector,unsigned int* size)
+void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, metric_values_t* values,
+                              uint64_t* sf_metric_vector,unsigned int* size)
 {
 	int i,j;
 	unsigned int acum_ipc=0;
@@ -581,9 +1442,9 @@ void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, uint64_t* sf_
 
 	for (i=0; i<metric_set->nr_exps; i++) {
 		mex=&metric_set->exps[i];
-		acum_ipc+=mex->metrics[0].count; //Acum ipc (it's always metric zero )
+		acum_ipc+=get_metric_value(&values[i],0); //Acum ipc (it's always metric zero )
 		for (j=1; j<mex->size; j++)
-			sf_metric_vector[dst_idx++]=mex->metrics[j].count;
+			sf_metric_vector[dst_idx++]=get_metric_value(&values[i],j);
 	}
 
 	sf_metric_vector[0]=acum_ipc/metric_set->nr_exps;
@@ -591,187 +1452,7 @@ void fill_in_sf_metric_vector(metric_experiment_set_t* metric_set, uint64_t* sf_
 
 }
 
-/********* Implementation of operations on the phase table ************/
-#include <linux/list.h>
-#include <linux/vmalloc.h>
-
-/* Generic nodes for the doubly linked list used in the table  */
-typedef struct {
-	struct list_head links; 	/* for the linked list */
-	int idx;					/* Index for the allocator */
-	void* data; 				/* Phase object */
-} phase_node_t;
-
-struct phase_table {
-	struct list_head phases;	/* List of phases */
-	int nr_phases;				/* Current number of phases */
-	int max_phases;				/* Max phases to be stored on the list */
-	size_t phase_struct_size;	/* Size of the phase structure */
-	void* phase_pool;			/* Memory pool (pre-allocated table entries) */
-	phase_node_t* node_pool;	/* Memory pool (pre-allocated table entries) */
-	unsigned long bitmap;		/* bitmask to keep track of free and occupied entries (1 means free, 0 -> occupied) */
-	int (*compare)(void*,void*,void*); /* Comparison operation (returns 0 if equals or Manhatan distance) */
-};
-
-/* Create a phase table */
-phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*))
-{
-	phase_table_t* table=NULL;
-	const unsigned int max_bits=sizeof(unsigned long)*8;
-	void* phase_pool=NULL;
-	void* node_pool=NULL;
-	int i=0;
-
-	/* Make sure we can keep track of everything on the bitmap */
-	if (max_phases>max_bits)
-		return NULL;
-
-	/* Allocate memory */
-	if ((phase_pool=kmalloc(phase_struct_size*max_phases,GFP_KERNEL))==NULL)
-		goto free_up_resources;
-
-	if ((node_pool=kmalloc(sizeof(phase_node_t)*max_phases,GFP_KERNEL))==NULL)
-		goto free_up_resources;
-
-	if ((table=kmalloc(sizeof(phase_table_t),GFP_KERNEL))==NULL)
-		goto free_up_resources;
-
-	/* Initialize phase table */
-	INIT_LIST_HEAD(&table->phases);
-	table->nr_phases=0;
-	table->max_phases=max_phases;
-	table->phase_struct_size=phase_struct_size;
-	table->phase_pool=phase_pool;
-	table->node_pool=node_pool;
-	if (max_phases==max_bits)
-		table->bitmap=~(0); /* All 1s */
-	else
-		table->bitmap=(1<<max_phases)-1; /* 2^max_phases -1 */
-	table->compare=compare;
-
-	/* Prepare pointers (Dark pointer arithmetic operation */
-	for (i=0; i<max_phases; i++) {
-		table->node_pool[i].data=(((char*)phase_pool) + i*phase_struct_size);
-		table->node_pool[i].idx=i;
-	}
-
-	return table;
-free_up_resources:
-	if (node_pool)
-		kfree(node_pool);
-	if (phase_pool)
-		kfree(phase_pool);
-	if (table)
-		kfree(table);
-	return NULL;
-}
-
-/* Free up resources associated with a phase table */
-void destroy_phase_table(phase_table_t* table)
-{
-	if (table->node_pool)
-		kfree(table->node_pool);
-	if (table->phase_pool)
-		kfree(table->phase_pool);
-	kfree(table);
-}
-
-/* Retrieve the most similar phase in a phase table */
-void* get_phase_from_table(phase_table_t* table, void* key_phase, void* priv_data, int* similarity, int* index)
-{
-	phase_node_t* cur_phase;
-	phase_node_t* selected_phase=NULL;
-
-	struct list_head* p;
-	int sim_test=0;
-	int sim_min=INT_MAX;
-
-	list_for_each(p,&table->phases) {
-		cur_phase=list_entry(p,phase_node_t,links);
-
-		/* Invoke comparator function */
-		sim_test=table->compare(cur_phase->data,key_phase,priv_data);
-
-		if (sim_test<sim_min) {
-			sim_min=sim_test;
-			selected_phase=cur_phase;
-
-			/* Exact match found */
-			if (sim_test==0)
-				break;
-		}
-	}
-
-	if (!selected_phase)
-		return NULL;
-
-	(*similarity)=sim_min;
-	(*index)=selected_phase->idx;
-	return selected_phase->data;
-}
-
-/* Move table entry in the index position to the beginning of the linked list */
-int promote_table_entry(phase_table_t* table, int index)
-{
-
-	struct list_head* node;
-
-	/* Check if index is valid and corresponds to a valid entry */
-	if ((index<0) || (index>=table->max_phases) || ((1<<index) & table->bitmap))
-		return -ENOENT;
-
-	/* Point to the phase's node by accessing the node pool */
-	node=&table->node_pool[index].links;
-
-	/* If it is not the first one already, make this entry the first one */
-	if (table->phases.next!=node) {
-		list_del(node);
-		list_add(node,&table->phases);
-	}
-
-	return 0;
-}
-
-/* Find a free entry in the phase table */
-static phase_node_t* get_free_phase_loc(phase_table_t* table)
-{
-	int i=0;
-
-	if (table->bitmap==0)
-		return NULL;
-
-	/* Locate first 1 in here */
-	for (i=0; i<table->max_phases && !((1<<i) & table->bitmap); i++ ) {}
-
-	if (i==table->max_phases)
-		return NULL;
-	else
-		return &table->node_pool[i];
-}
-
-/* Insert a new phase into the phase table */
-void* insert_phase_in_table(phase_table_t* table, void* phase)
-{
-	phase_node_t* free_phase_loc;
-
-	/* Get free location */
-	free_phase_loc=get_free_phase_loc(table);
-
-	/* If it is full -> reuse tail (oldest phase is evicted) */
-	if (free_phase_loc==NULL) {
-		free_phase_loc=list_entry(table->phases.prev,phase_node_t,links);
-	} else {
-		table->bitmap&=~(1<<free_phase_loc->idx); /* Clear bit */
-		table->nr_phases++;
-		/* Newer phases inserted at the beginning */
-		list_add(&free_phase_loc->links,&table->phases);
-	}
-
-	/* Copy data */
-	memcpy(free_phase_loc->data,phase,table->phase_struct_size);
-	return free_phase_loc->data;
-}
-
+/* (The phase table lives in phase_table.c) */
 
 extern struct pid *find_pid_ns(int nr, struct pid_namespace *ns);
 extern struct task_struct *pid_task(struct pid *pid, enum pid_type type);
@@ -36,9 +36,12 @@
 #include <linux/vmalloc.h>
 #include <asm-generic/errno.h>
 #include <linux/mm.h>  /* mmap related stuff */
+#include <linux/poll.h>
+#include <linux/compat.h>
 #include <pmc/monitoring_mod.h>
 #include <pmc/syswide.h>
 #include <linux/sched.h>
+#include <linux/capability.h> /* For capable() */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
 #include <linux/uaccess.h>
 #else
@@ -48,6 +51,11 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
 #include <linux/sched/task.h> /* for get_task_struct()/put_task_struct() */
 #include <linux/sched/signal.h> /* For send_sig_info() */
+#include <linux/sched/clock.h> /* For local_clock() */
+#endif
+#include <linux/math64.h>
+#if defined(CONFIG_X86) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+#include <asm/tlbflush.h> /* For nmi_uaccess_okay() */
 #endif
 
 #include <asm/siginfo.h>
@@ -89,7 +97,7 @@ static inline int prof_uses_timer(pmon_prof_t* prof)
 #else
 static inline int prof_uses_timer(pmon_prof_t* prof)
 {
-	return (prof->profiling_mode==TBS_SCHED_MODE);
+	return (prof->profiling_mode==TBS_USER_MODE);
 }
 #endif
 
@@ -100,6 +108,9 @@ static void cancel_pmctrack_timer(pmon_prof_t* prof);
 /* Default per-CPU set of PMC events */
 static DEFINE_PER_CPU(core_experiment_t, cpu_exp);
 
+/* Slab cache for per-thread pmon_prof_t structures */
+static struct kmem_cache* pmon_prof_cache=NULL;
+
 pmon_config_t pmcs_pmon_config;
 
 /* Initialize global configuration parameters */
@@ -128,6 +139,9 @@ static void tbs_mode_fire_timer(unsigned long data);
 #else
 static void tbs_mode_fire_timer(struct timer_list *t);
 #endif
+#ifdef TBS_HRTIMER
+static enum hrtimer_restart tbs_mode_fire_hrtimer(struct hrtimer *t);
+#endif
 #ifdef CONFIG_PMC_PERF
 static void deferred_read_function(struct work_struct *work);
 #endif
@@ -187,11 +201,21 @@ static const pmctrack_proc_ops_t proc_pmc_info_fops = {
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off);
 static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size_t len, loff_t *off);
 static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma);
+static pmctrack_poll_t proc_monitor_pmcs_poll(struct file *filp, struct poll_table_struct *wait);
+static long proc_monitor_pmcs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+#ifdef CONFIG_COMPAT
+static long proc_monitor_pmcs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+#endif
 
 static const pmctrack_proc_ops_t proc_monitor_pmcs_fops = {
 	.PMCT_PROC_READ = proc_monitor_pmcs_read,
 	.PMCT_PROC_WRITE = proc_monitor_pmcs_write,
 	.PMCT_PROC_MMAP=proc_monitor_pmcs_mmap,
+	.PMCT_PROC_POLL=proc_monitor_pmcs_poll,
+	.PMCT_PROC_IOCTL=proc_monitor_pmcs_ioctl,
+#ifdef CONFIG_COMPAT
+	.PMCT_PROC_COMPAT_IOCTL=proc_monitor_pmcs_compat_ioctl,
+#endif
 	.PMCT_PROC_OPEN = proc_generic_open,
 	.PMCT_PROC_RELEASE = proc_generic_close,
 	.PMCT_PROC_LSEEK = default_llseek
@@ -213,6 +237,133 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 /* Initialization of platform-independent per-CPU structures */
 static void init_percpu_structures(void);
 
+/* Allocate a samples buffer with the parameters selected for a thread */
+static pmc_samples_buffer_t* allocate_samples_buffer_prof(pmon_prof_t* prof)
+{
+	pmc_samples_buffer_t* pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size,prof->samples_buffer_flags);
+
+	if (pmc_buf) {
+		set_wakeup_pmc_samples_buffer(pmc_buf,prof->wakeup_samples,prof->wakeup_bytes,prof->wakeup_latency_ms);
+		pmc_buf->filter=prof->sample_filter;
+	}
+
+	return pmc_buf;
+}
+
+#ifdef TBS_HRTIMER
+/*
+ * Coalesced TBS mode: rather than using a timer per monitored thread,
+ * each CPU has a single sampling timer that gathers samples for
+ * the monitored thread running on that CPU (if any). Threads that
+ * hit their sampling deadline while descheduled are sampled on switch-out
+ * (or as soon as they run again with the perf backend).
+ */
+static DEFINE_PER_CPU(struct hrtimer, tbs_cpu_timer);
+/* Monitored thread currently running on the CPU (coalesced mode) */
+static DEFINE_PER_CPU(pmon_prof_t*, tbs_cpu_prof);
+
+/* Compute the next sampling deadline without accumulating drift */
+static inline void advance_tbs_deadline(pmon_prof_t* prof, ktime_t now)
+{
+	u64 period=tbs_sampling_period_ns(prof);
+
+	prof->tbs_deadline=ktime_add_ns(prof->tbs_deadline,period);
+
+	/* Skip the periods missed while the thread was not running */
+	if (!ktime_after(prof->tbs_deadline,now))
+		prof->tbs_deadline=ktime_add_ns(now,period);
+}
+
+/* Must be invoked on the CPU where prof->this_tsk is running (preemption disabled) */
+static void tbs_cpu_switch_in(pmon_prof_t* prof)
+{
+	struct hrtimer* timer=this_cpu_ptr(&tbs_cpu_timer);
+
+	this_cpu_write(tbs_cpu_prof,prof);
+
+	/* A timer armed for an earlier deadline will re-arm itself if needed */
+	if (!hrtimer_is_queued(timer) ||
+	    ktime_before(prof->tbs_deadline,hrtimer_get_expires(timer)))
+		hrtimer_start(timer,prof->tbs_deadline,HRTIMER_MODE_ABS_PINNED_SOFT);
+}
+
+static inline void tbs_cpu_switch_out(pmon_prof_t* prof)
+{
+	this_cpu_cmpxchg(tbs_cpu_prof,prof,NULL);
+}
+
+/*
+ * Make sure no CPU refers to prof anymore (offline
+ * CPUs included, as their pointer is not cleared)
+ */
+static void tbs_cpu_forget_prof(pmon_prof_t* prof)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		cmpxchg(per_cpu_ptr(&tbs_cpu_prof,cpu),prof,NULL);
+}
+
+static enum hrtimer_restart tbs_cpu_fire_hrtimer(struct hrtimer *t)
+{
+	pmon_prof_t* prof;
+	unsigned long flags;
+	enum hrtimer_restart ret=HRTIMER_NORESTART;
+	ktime_t now=hrtimer_cb_get_time(t);
+
+	rcu_read_lock();
+	prof=this_cpu_read(tbs_cpu_prof);
+
+	/* The timer may be handled by ksoftirqd, after the thread was switched out */
+	if (!prof || prof->this_tsk!=current)
+		goto out;
+
+	spin_lock_irqsave(&prof->lock,flags);
+
+	if (get_prof_enabled(prof) && prof->pmcs_config &&
+	    (prof->flags & PMC_COALESCED_TBS)) {
+		/* sample_counters_user_tbs() advances the deadline */
+		if (!ktime_before(now,prof->tbs_deadline))
+			sample_counters_user_tbs(prof,prof->pmcs_config,PMC_TIMER_TICK_EVT,smp_processor_id());
+		if (!ktime_after(prof->tbs_deadline,now))
+			advance_tbs_deadline(prof,now);
+		hrtimer_set_expires(t,prof->tbs_deadline);
+		ret=HRTIMER_RESTART;
+	}
+
+	spin_unlock_irqrestore(&prof->lock,flags);
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+static void init_tbs_cpu_timers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct hrtimer* timer=per_cpu_ptr(&tbs_cpu_timer,cpu);
+
+		hrtimer_init(timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS_PINNED_SOFT);
+		timer->function=tbs_cpu_fire_hrtimer;
+		per_cpu(tbs_cpu_prof,cpu)=NULL;
+	}
+}
+
+static void destroy_tbs_cpu_timers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(per_cpu_ptr(&tbs_cpu_timer,cpu));
+}
+#else
+static inline void tbs_cpu_switch_in(pmon_prof_t* prof) {}
+static inline void tbs_cpu_switch_out(pmon_prof_t* prof) {}
+static inline void init_tbs_cpu_timers(void) {}
+static inline void destroy_tbs_cpu_timers(void) {}
+#endif
+
 /*
  * Perform 'del_timer_sync' functionality.
  * In CONFIG_PMC_PERF path, also removes work task from work queue.
@@ -223,10 +374,196 @@ static void cancel_pmctrack_timer(pmon_prof_t* prof)
 #ifdef CONFIG_PMC_PERF
 	/* Delete task from Linux default workqueue */
 	flush_work(&prof->read_counters_task);
+#endif
+#ifdef TBS_HRTIMER
+	if (prof->flags & PMC_COALESCED_TBS)
+		tbs_cpu_forget_prof(prof);
+	hrtimer_cancel(&prof->hrtimer);
 #endif
 	del_timer_sync(&prof->timer);
 }
 
+/* Set the TBS sampling period (in microseconds) */
+static inline void set_tbs_sampling_period(pmon_prof_t* prof, unsigned int usecs)
+{
+	prof->pmc_usecs_interval=usecs;
+	/* Jiffy-based periods are still used for tick-driven sampling */
+	prof->pmc_jiffies_interval=usecs_to_jiffies(usecs);
+	if (prof->pmc_jiffies_interval==0)
+		prof->pmc_jiffies_interval=1;
+	prof->nticks_sampling_period=prof->pmc_jiffies_interval;
+}
+
+/* Start a new evaluation window for the adaptive sampling-rate controller */
+static inline void reset_sampling_overhead(pmon_prof_t* prof, u64 now)
+{
+	prof->overhead_nr_samples=0;
+	prof->overhead_ns=0;
+	prof->overhead_window_start=now;
+}
+
+/*
+ * Adaptive sampling-rate controller. Account for the time spent gathering
+ * a sample (since 'start') and, every PMC_OVERHEAD_WINDOW_SAMPLES samples,
+ * compare the fraction of time spent sampling on behalf of the thread
+ * with its overhead budget. Returns 1 if the sampling period has to be
+ * doubled, -1 if it can be halved (without going below the period
+ * requested by the user) and 0 otherwise. The caller updates period_shift
+ * once the change has been applied.
+ */
+static int update_sampling_overhead(pmon_prof_t* prof, u64 start)
+{
+	u64 now=local_clock();
+	u64 window,overhead;
+
+	prof->overhead_ns+=now-start;
+
+	if (++prof->overhead_nr_samples<PMC_OVERHEAD_WINDOW_SAMPLES)
+		return 0;
+
+	/* Overhead in hundredths of a percent */
+	window=now-prof->overhead_window_start;
+	overhead=window?div64_u64(prof->overhead_ns*10000,window):0;
+
+	reset_sampling_overhead(prof,now);
+
+	if (overhead>prof->max_overhead && prof->period_shift<PMC_MAX_PERIOD_SHIFT)
+		return 1;
+
+	/* Leave some slack to prevent oscillations */
+	if (overhead*4<prof->max_overhead && prof->period_shift>0)
+		return -1;
+
+	return 0;
+}
+
+#ifndef CONFIG_PMC_PERF
+/*
+ * Apply a change in the sampling rate to the EBS reset values
+ * of all the experiments of a thread. Returns 1 if they were scaled,
+ * and 0 if the period of any of them cannot be scaled any further
+ * (in which case none is modified).
+ */
+static int scale_ebs_reset_values(pmon_prof_t* prof, int delta)
+{
+	int coretype,i,pass;
+	core_experiment_set_t* set;
+	core_experiment_t* exp;
+	pmu_props_t* props;
+	uint64_t period;
+
+	/* Check all the experiments first, then update them */
+	for (pass=0; pass<2; pass++) {
+		for (coretype=0; coretype<get_nr_coretypes(); coretype++) {
+			set=&prof->pmcs_multiplex_cfg[coretype];
+			props=get_pmu_props_coretype(coretype);
+
+			for (i=0; i<set->nr_exps; i++) {
+				exp=set->exps[i];
+
+				if (!exp || exp->ebs_idx==-1)
+					continue;
+
+				period=(-__get_reset_value(&exp->array[exp->ebs_idx])) & props->pmc_width_mask;
+				period=delta>0?period<<1:period>>1;
+
+				if (period==0 || period>=props->pmc_width_mask)
+					return 0;
+
+				if (pass)
+					__set_reset_value(&exp->array[exp->ebs_idx],(-period) & props->pmc_width_mask);
+			}
+		}
+	}
+
+	return 1;
+}
+#endif
+
+/* Arm the TBS_USER_MODE timer (pmc_jiffies_timeout must be up to date) */
+static void start_tbs_timer(pmon_prof_t* prof)
+{
+#ifdef TBS_HRTIMER
+	u64 period=tbs_sampling_period_ns(prof);
+
+	if (pmcs_pmon_config.pmon_coalesced_tbs) {
+		prof->flags|=PMC_COALESCED_TBS;
+		prof->tbs_deadline=ktime_add_ns(ktime_get(),period);
+
+		/* Otherwise the timer gets armed when the thread is switched in */
+		if (prof->this_tsk==current) {
+			preempt_disable();
+			tbs_cpu_switch_in(prof);
+			preempt_enable();
+		}
+		return;
+	}
+
+	prof->flags&=~PMC_COALESCED_TBS;
+	hrtimer_start(&prof->hrtimer,ns_to_ktime(period),HRTIMER_MODE_REL_SOFT);
+#else
+	mod_timer(&prof->timer, prof->pmc_jiffies_timeout);
+#endif
+}
+
+/*
+ * Returns a non-zero value when the sampling deadline has elapsed.
+ * With per-thread high-resolution timers, TBS_USER_MODE samples
+ * are driven by the hrtimer exclusively.
+ */
+static inline int tbs_jiffies_timeout_expired(pmon_prof_t* prof)
+{
+#ifdef TBS_HRTIMER
+	if (prof->flags & PMC_COALESCED_TBS)
+		return !ktime_before(ktime_get(),prof->tbs_deadline);
+	if (prof->profiling_mode==TBS_USER_MODE)
+		return 0;
+#endif
+	return prof->pmc_jiffies_interval>0 && time_after_eq(jiffies,prof->pmc_jiffies_timeout);
+}
+
+/* Re-arm the TBS_USER_MODE timer after a sample (hrtimers re-arm themselves) */
+static inline void rearm_tbs_timer(pmon_prof_t* prof)
+{
+#ifdef TBS_HRTIMER
+	if (prof->flags & PMC_COALESCED_TBS)
+		advance_tbs_deadline(prof,ktime_get());
+#else
+	mod_timer(&prof->timer, prof->pmc_jiffies_timeout);
+#endif
+}
+
+/*
+ * Gather PMC values for all the counters in core_experiment
+ * (stop, read and reset). If the PMU can freeze all counters at once,
+ * counters are read while frozen, which yields a consistent snapshot
+ * and saves the per-counter stop/restart MSR writes.
+ */
+static inline void read_and_reset_counters(core_experiment_t* core_experiment,
+        pmu_props_t* pmu_props)
+{
+	unsigned int i;
+#ifdef PMC_HAVE_GLOBAL_FREEZE
+	uint64_t global_ctrl;
+
+	if (pmu_props->pmu_model>=2) {
+		global_ctrl=__freeze_all_counters();
+
+		for(i=0; i<core_experiment->size; i++)
+			__read_and_clear_count(&core_experiment->array[i]);
+
+		__unfreeze_all_counters(global_ctrl);
+		return;
+	}
+#endif
+	for(i=0; i<core_experiment->size; i++) {
+		low_level_exp* lle = &core_experiment->array[i];
+		__stop_count(lle);
+		__read_count(lle);
+		__restart_count(lle);
+	}
+}
+
 /*
  * Read performance counters associated with the PMC configuration
  * described by core_experiment, and update counters
@@ -245,13 +582,10 @@ int do_count_mc_experiment(pmon_prof_t* prof,
 		mc_restart_all_counters(core_experiment);
 		return 1;
 	} else {
+		read_and_reset_counters(core_experiment,pmu_props);
 
 		for(i=0; i<core_experiment->size; i++) {
 			low_level_exp* lle = &core_experiment->array[i];
-			/* Gather PMC values (stop,read and reset) */
-			__stop_count(lle);
-			__read_count(lle);
-			__restart_count(lle);
 
 			/* get Last value */
 			last_value = __get_last_value(lle);
@@ -293,12 +627,10 @@ int do_count_mc_experiment_buffer(core_experiment_t* core_experiment,
 		return 1;
 	} else {
 		/*Monitoring Procedure*/
+		read_and_reset_counters(core_experiment,pmu_props);
+
 		for(i=0; i<core_experiment->size; i++) {
 			low_level_exp* lle = &core_experiment->array[i];
-			/* Gather PMC values (stop,read and reset) */
-			__stop_count(lle);
-			__read_count(lle);
-			__restart_count(lle);
 
 			/* get Last value */
 			samples[i] = __get_last_value(lle);
@@ -417,7 +749,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 		return -ENOTSUPP;
 
 	/* Allocate memory for pmon_prof_t structure */
-	prof = (pmon_prof_t*) kmalloc(sizeof(pmon_prof_t), GFP_KERNEL);
+	prof = (pmon_prof_t*) kmem_cache_alloc(pmon_prof_cache, GFP_KERNEL);
 
 	if(prof == NULL) {
 		printk(KERN_INFO "Can't allocate memory for pmon_prof_t.\n");
@@ -433,7 +765,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	if (!create_pmctrack_task_event(p,prof)) {
 		printk(KERN_INFO "Can't create pmctrack task event in perf\n");
-		kfree(prof);
+		kmem_cache_free(pmon_prof_cache,prof);
 		return -ENOMEM;
 	}
 
@@ -444,10 +776,14 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	prof->samples_counter = 0;
 
 	prof->pmc_jiffies_interval=-1;	/* TBS disabled */
+	prof->pmc_usecs_interval=0;
 
 	prof->pmc_jiffies_timeout=jiffies+3000*250;	/* Just in case: make sure it doesn't expire soon */
 
 	prof->this_tsk=p;
+#if !defined(CONFIG_PMCTRACK) && !defined(CONFIG_MINIMAL_PMCTRACK)
+	INIT_HLIST_NODE(&prof->links);
+#endif
 
 	for(i=0; i<MAX_LL_EXPS; i++)
 		prof->pmc_values[i]=0;
@@ -463,6 +799,8 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	/* PMC Samples buffer for this thread */
 	prof->pmc_samples_buffer=NULL;	/* Allocate on demand */
+	prof->totals=NULL;	/* Allocate on demand */
+	prof->proc_totals=NULL;
 
 	prof->profiling_mode=TBS_SCHED_MODE;
 
@@ -476,10 +814,22 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 	prof->pmc_kernel_samples=NULL;
 
+	prof->pmc_mmap_ring=NULL;
+
 	prof->nticks_sampling_period=pmcs_pmon_config.pmon_nticks;
 
 	prof->kernel_buffer_size=pmcs_pmon_config.pmon_kernel_buffer_size;
 
+	prof->samples_buffer_flags=0;	/* Shared buffer by default */
+
+	/* Notify the monitor on every sample by default */
+	prof->wakeup_samples=0;
+	prof->wakeup_bytes=0;
+	prof->wakeup_latency_ms=0;
+
+	prof->syswide_idle_policy=PMC_SYSWIDE_IDLE_SAMPLE;
+	prof->sample_filter.nr_predicates=0;
+
 	spin_lock_init(&prof->lock);
 
 	prof->pid_monitor=-1;
@@ -487,6 +837,9 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	prof->ref_time=ktime_get();
 
 	prof->max_ebs_samples=0; /* Disabled by default */
+	prof->max_overhead=0; /* Fixed sampling rate by default */
+	prof->period_shift=0;
+	reset_sampling_overhead(prof,0);
 
 #ifdef TBS_TIMER
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
@@ -499,6 +852,10 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	timer_setup(&prof->timer, tbs_mode_fire_timer, 0);
 #endif
 #endif
+#ifdef TBS_HRTIMER
+	hrtimer_init(&prof->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	prof->hrtimer.function=tbs_mode_fire_hrtimer;
+#endif
 #ifdef CONFIG_PMC_PERF
 	/* Initialize deferred task for safe reading of PMCs using perf events's kernel API */
 	INIT_WORK(&prof->read_counters_task, deferred_read_function);
@@ -514,6 +871,9 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	if (is_new_thread(clone_flags) && par_prof && get_prof_enabled(par_prof)) {
 		/* Inherit ebs cap */
 		prof->max_ebs_samples=par_prof->max_ebs_samples;
+		prof->max_overhead=par_prof->max_overhead;
+		prof->period_shift=par_prof->period_shift;
+		prof->flags|=(par_prof->flags & PMC_CAPTURE_FLAGS);
 
 		if (!(par_prof->flags & PMC_SELF_MONITORING)) {
 			prof->profiling_mode=par_prof->profiling_mode;
@@ -529,12 +889,16 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 				if ((ret=clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[0],&par_prof->pmcs_multiplex_cfg[0],p))) {
 					if (prof->pmc_samples_buffer)
 						put_pmc_samples_buffer(prof->pmc_samples_buffer);
-					kfree(prof);
+					kmem_cache_free(pmon_prof_cache,prof);
 					return ret;
 				}
 #else
 				for(i=0; i<AMP_MAX_CORETYPES; i++)
 					clone_core_experiment_set_t(&prof->pmcs_multiplex_cfg[i],&par_prof->pmcs_multiplex_cfg[i],p);
+
+				/* Experiments start from the configured period: apply the inherited scaling */
+				for (i=0; i<prof->period_shift; i++)
+					scale_ebs_reset_values(prof,1);
 #endif
 				/* For now start with slow core events */
 				prof->pmcs_config=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[0]);
@@ -544,6 +908,7 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 
 			/* Inherit intervals from the parent process (sibling actually :-)) */
 			prof->pmc_jiffies_interval=par_prof->pmc_jiffies_interval;
+			prof->pmc_usecs_interval=par_prof->pmc_usecs_interval;
 			prof->nticks_sampling_period=par_prof->nticks_sampling_period;
 			prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
 			/* Inherit monitor from the "parent thread" as well */
@@ -551,11 +916,16 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 			set_prof_enabled(prof,1);
 #ifdef TBS_TIMER
 			if (prof->profiling_mode==TBS_USER_MODE)
-				mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+				start_tbs_timer(prof);
 #endif
 		} else {
 			/* Inherit buffer size */
 			prof->kernel_buffer_size=par_prof->kernel_buffer_size;
+			prof->samples_buffer_flags=par_prof->samples_buffer_flags;
+			prof->wakeup_samples=par_prof->wakeup_samples;
+			prof->wakeup_bytes=par_prof->wakeup_bytes;
+			prof->wakeup_latency_ms=par_prof->wakeup_latency_ms;
+			prof->sample_filter=par_prof->sample_filter;
 		}
 
 	}
@@ -563,10 +933,13 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 	if ((ret=mm_on_fork(clone_flags,prof))) {
 		if (prof->pmc_samples_buffer)
 			put_pmc_samples_buffer(prof->pmc_samples_buffer);
-		kfree(prof);
+		kmem_cache_free(pmon_prof_cache,prof);
 		return ret;
 	}
 
+	/* Failure is not fatal: samples are delivered as is then */
+	alloc_sample_totals(prof);
+
 #if defined(CONFIG_PMCTRACK) || defined(CONFIG_MINIMAL_PMCTRACK)
 	p->pmc=prof;
 #endif
@@ -588,13 +961,13 @@ static int mod_alloc_per_thread_data(unsigned long clone_flags, struct task_stru
 static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, pmc_sampling_event_t event, int cpu)
 {
 	int i=0;
-	unsigned long flags;
 	pmc_sample_t sample;
 	core_experiment_t* next;
 	int ebs_idx=-1;
 	int cur_coretype=get_coretype_cpu(cpu);
 	pmu_props_t* props=get_pmu_props_cpu(cpu);
 	ktime_t now;
+	u64 start=prof->max_overhead?local_clock():0;
 
 #ifdef DEBUG
 	char strout[256];
@@ -610,7 +983,7 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 		callback_flags|=MM_SAVE;
 	}
 
-	if (event==PMC_MIGRATION_EVT || event==PMC_SELF_EVT || event== PMC_TIMER_TICK_EVT || (prof->pmc_jiffies_interval>0 && prof->pmc_jiffies_timeout <=jiffies)) {
+	if (event==PMC_MIGRATION_EVT || event==PMC_SELF_EVT || event== PMC_TIMER_TICK_EVT || tbs_jiffies_timeout_expired(prof)) {
 		/* In tick() only read on demand */
 		if (event==PMC_TICK_EVT || (event==PMC_TIMER_TICK_EVT && (prof->this_tsk==current))) {
 #ifdef DEBUG
@@ -621,10 +994,10 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 		}
 
 		/* Prepare next timeout */
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+		prof->pmc_jiffies_timeout=jiffies+tbs_sampling_period_jiffies(prof);
 #ifdef TBS_TIMER
 		if (prof->profiling_mode==TBS_USER_MODE && get_prof_enabled(prof))
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+			rearm_tbs_timer(prof);
 #endif
 		/* Initialize sample*/
 		switch(event) {
@@ -651,8 +1024,14 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
+		sample.nr_callchain=0;
+		sample.nr_samples=0;
+		sample.time_enabled=sample.time_running=0;
+		sample.timestamp=raw_ktime(now);
+		sample.cpu=cpu;
 		sample.pid=prof->this_tsk->pid;
 		sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+		sample.sampling_period=(sample.type==PMC_TICK_SAMPLE)?tbs_sampling_period_ns(prof):0;
 		prof->ref_time=now;
 
 		/* This is to handle migration samples correctly !! */
@@ -671,15 +1050,8 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 		//if (prof->virt_counter_mask)
 		mm_on_new_sample(prof,cpu,&sample,callback_flags,NULL);
 
-		if (prof->pmc_samples_buffer) {
-			/* Push current counter values into the buffer */
-			spin_lock_irqsave(&prof->pmc_samples_buffer->lock,flags);
-			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-			spin_unlock_irqrestore(&prof->pmc_samples_buffer->lock,flags);
-		}
-
-		if (event==PMC_SAVE_EVT)
-			mc_stop_all_counters(core_exp);
+		/* Push current counter values into the buffer */
+		push_sample_cbuffer(prof,&sample);
 
 		/* Engage multiplexation */
 		next=get_next_experiment_in_set(&prof->pmcs_multiplex_cfg[cur_coretype]);
@@ -696,22 +1068,28 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 				prof->flags|=PMC_PREPARE_MULTIPLEXING;
 			}
 		}
+
+		/* The new period takes effect when the timer is re-armed */
+		if (prof->max_overhead && sample.type==PMC_TICK_SAMPLE)
+			prof->period_shift+=update_sampling_overhead(prof,start);
 	}
 }
 #else
 static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_exp, pmc_sampling_event_t event, int cpu)
 {
 	int i=0;
-	unsigned long flags;
 	pmc_sample_t sample;
 	int ebs_idx=-1;
 	int cur_coretype=get_coretype_cpu(cpu);
 	ktime_t now;
 	int callback_flags=MM_TICK;
+	u64 start;
 
 	if (!(event==PMC_TIMER_TICK_EVT || event==PMC_SELF_EVT))
 		return;
 
+	start=prof->max_overhead?local_clock():0;
+
 	do_count_mc_experiment(prof,core_exp,1);
 
 	if ((event==PMC_TIMER_TICK_EVT) && (prof->this_tsk!=current))
@@ -719,8 +1097,8 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 
 	if (prof->profiling_mode==TBS_USER_MODE && get_prof_enabled(prof)) {
 		/* Prepare next timeout */
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
-		mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+		prof->pmc_jiffies_timeout=jiffies+tbs_sampling_period_jiffies(prof);
+		rearm_tbs_timer(prof);
 	}
 
 	/* Initialize sample*/
@@ -747,8 +1125,14 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 	sample.nr_counts=core_exp->size;
 	sample.virt_mask=0;
 	sample.nr_virt_counts=0;
+	sample.nr_callchain=0;
+	sample.nr_samples=0;
+	sample.time_enabled=sample.time_running=0;
+	sample.timestamp=raw_ktime(now);
+	sample.cpu=cpu;
 	sample.pid=prof->this_tsk->pid;
 	sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+	sample.sampling_period=(sample.type==PMC_TICK_SAMPLE)?tbs_sampling_period_ns(prof):0;
 	prof->ref_time=now;
 
 	/* Copy and clear samples in prof */
@@ -760,12 +1144,12 @@ static void sample_counters_user_tbs(pmon_prof_t* prof, core_experiment_t* core_
 	/* Call the monitoring module  */
 	mm_on_new_sample(prof,cpu,&sample,callback_flags,NULL);
 
-	if (prof->pmc_samples_buffer) {
-		/* Push current counter values into the buffer */
-		spin_lock_irqsave(&prof->pmc_samples_buffer->lock,flags);
-		__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-		spin_unlock_irqrestore(&prof->pmc_samples_buffer->lock,flags);
-	}
+	/* Push current counter values into the buffer */
+	push_sample_cbuffer(prof,&sample);
+
+	/* The new period takes effect when the timer is re-armed */
+	if (prof->max_overhead && sample.type==PMC_TICK_SAMPLE)
+		prof->period_shift+=update_sampling_overhead(prof,start);
 }
 #endif
 
@@ -804,8 +1188,14 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 			sample.nr_counts=core_exp->size;
 			sample.virt_mask=0;
 			sample.nr_virt_counts=0;
+			sample.nr_callchain=0;
+			sample.nr_samples=0;
+			sample.time_enabled=sample.time_running=0;
+			sample.timestamp=raw_ktime(now);
+			sample.cpu=cpu;
 			sample.pid=prof->this_tsk->pid;
 			sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+			sample.sampling_period=(u64)jiffies_to_usecs(prof->nticks_sampling_period)*NSEC_PER_USEC;
 			prof->ref_time=now;
 
 			/* Copy and clear samples in prof */
@@ -833,6 +1223,11 @@ static inline void sample_counters_sched_tbs(pmon_prof_t* prof, core_experiment_
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
+		sample.nr_callchain=0;
+		sample.nr_samples=0;
+		sample.time_enabled=sample.time_running=0;
+		sample.timestamp=raw_ktime(ktime_get());
+		sample.cpu=cpu;
 		sample.pid=prof->this_tsk->pid;
 		ebs_idx=core_exp->ebs_idx;
 
@@ -870,6 +1265,9 @@ static void mod_save_callback_gen(void* v_prof, int cpu, int lock)
 	if (!get_prof_enabled(prof))
 		return;
 
+	if (prof->flags & PMC_COALESCED_TBS)
+		tbs_cpu_switch_out(prof);
+
 	mm_on_switch_out(prof);
 
 	/* Update last CPU if it's not the first time */
@@ -911,13 +1309,19 @@ static void mod_save_callback_gen(void* v_prof, int cpu, int lock)
 		   - This function sets performance counters to the reset value
 		*/
 		do_count_mc_experiment(prof,core_exp,1);
-		mc_stop_all_counters(core_exp);
+		/* Leave counters running (they will be cleared on switch in) */
+		mc_lazy_stop_all_counters(core_exp);
 		break;
 	case TBS_USER_MODE:
 		sample_counters_user_tbs(prof,core_exp,PMC_SAVE_EVT,cpu);
+		/* The experiment may have changed due to multiplexing */
+		mc_lazy_stop_all_counters(prof->pmcs_config?prof->pmcs_config:core_exp);
 		break;
 	}
 
+	if (prof->flags & PMC_COALESCED_TBS)
+		tbs_cpu_switch_out(prof);
+
 	mm_on_switch_out(prof);
 
 	/* Update last CPU if it's not the first time */
@@ -950,6 +1354,9 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 	if (prof->last_cpu!=cpu)
 		mm_on_migrate(prof, prof->last_cpu, cpu);
 
+	if (prof->flags & PMC_COALESCED_TBS)
+		tbs_cpu_switch_in(prof);
+
 	/* Update last context switch timestamp */
 	prof->context_switch_timestamp=jiffies;
 	prof->last_cpu=cpu; /* Update CPU */
@@ -1006,8 +1413,8 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 					sample_counters_sched_tbs(prof,core_exp,PMC_MIGRATION_EVT,prof->last_cpu);
 			}
 
-			/* Always engage multiplexation and clear counts (start from the beginning) */
-			next=rewind_experiments_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
+			/* Resume the rotation of this core type where it was left off */
+			next=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
 
 			/* If configuration is enabled */
 			if ((next && prof->pmcs_config!=next) ||
@@ -1037,7 +1444,7 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 			}
 
 			/* Point to the right set of experiments for this core type */
-			next=rewind_experiments_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
+			next=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
 
 			/* If configuration is enabled and there are events on the new core type */
 			if ((next && prof->pmcs_config!=next) ||
@@ -1052,14 +1459,12 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 
 #ifdef TBS_TIMER
 			if (!refresh_event_multiplexing_cpu(prof,this_coretype)) {
-				/* Reprogram all the counters safely from here */
-				mc_clear_all_counters(core_exp);
-				mc_restart_all_counters(core_exp);
+				/* Reprogram the counters (unless they are still loaded) */
+				mc_lazy_restart_all_counters(core_exp);
 			}
 #else
-			/* Reprogram all the counters safely from here */
-			mc_clear_all_counters(core_exp);
-			mc_restart_all_counters(core_exp);
+			/* Reprogram the counters (unless they are still loaded) */
+			mc_lazy_restart_all_counters(core_exp);
 #endif
 		}
 
@@ -1075,8 +1480,8 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 			if (prof->last_cpu!=-1)
 				sample_counters_user_tbs(prof,core_exp,PMC_MIGRATION_EVT,prof->last_cpu);
 
-			/* Always engage multiplexation and clear counts (start from the beginning) */
-			next=rewind_experiments_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
+			/* Resume the rotation of this core type where it was left off */
+			next=get_cur_experiment_in_set(&prof->pmcs_multiplex_cfg[this_coretype]);
 
 			/* If configuration is enabled */
 			if ((next && prof->pmcs_config!=next) ||
@@ -1088,13 +1493,15 @@ static inline void mod_restore_callback_gen(void* v_prof, int cpu, int lock)
 				mc_restart_all_counters(prof->pmcs_config);
 			}
 		} else {
-			/* Reprogram all the counters safely from here */
-			mc_clear_all_counters(core_exp);
-			mc_restart_all_counters(core_exp);
+			/* Reprogram the counters (unless they are still loaded) */
+			mc_lazy_restart_all_counters(core_exp);
 		}
 		break;
 	}
 
+	if (prof->flags & PMC_COALESCED_TBS)
+		tbs_cpu_switch_in(prof);
+
 	/* Update last context switch timestamp */
 	prof->context_switch_timestamp=jiffies;
 	prof->last_cpu=cpu; /* Update CPU */
@@ -1188,31 +1595,26 @@ static int sample_counters_user_tbs_task(void *vprof)
 
 	spin_lock_irqsave(&prof->lock,flags);
 	core_exp = prof->pmcs_config;
+#ifdef TBS_HRTIMER
+	/* The hrtimer already enforces the sampling period */
+	if (get_prof_enabled(prof) && prof->pmcs_config)
+#else
 	if (get_prof_enabled(prof) && prof->pmcs_config && prof->pmc_jiffies_timeout<=jiffies)
+#endif
 		sample_counters_user_tbs(prof,core_exp,PMC_TIMER_TICK_EVT,smp_processor_id());
 	spin_unlock_irqrestore(&prof->lock,flags);
 	return 0;
 }
 #endif
 
-/* Function associated with the kernel timer used for TBS mode */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-static void tbs_mode_fire_timer(unsigned long data)
-{
-	pmon_prof_t* prof=(pmon_prof_t*) data;
-#else
-static void tbs_mode_fire_timer(struct timer_list *t)
+/* Gather a TBS sample for the task associated with prof (timer context) */
+static void tbs_mode_sample(pmon_prof_t* prof)
 {
-	pmon_prof_t* prof=container_of(t, pmon_prof_t, timer);
-#endif
 	struct task_struct* p;
 	int cpu_task;
 #ifdef CONFIG_PMC_PERF
 	int this_cpu=smp_processor_id();
 #endif
-	if (!prof)
-		return;
-
 	p=prof->this_tsk;
 	cpu_task=task_cpu_safe(p);
 
@@ -1254,6 +1656,40 @@ static void tbs_mode_fire_timer(struct timer_list *t)
 	}
 #endif
 }
+
+/* Function associated with the kernel timer used for TBS mode */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+static void tbs_mode_fire_timer(unsigned long data)
+{
+	pmon_prof_t* prof=(pmon_prof_t*) data;
+#else
+static void tbs_mode_fire_timer(struct timer_list *t)
+{
+	pmon_prof_t* prof=container_of(t, pmon_prof_t, timer);
+#endif
+	if (prof)
+		tbs_mode_sample(prof);
+}
+
+#ifdef TBS_HRTIMER
+/*
+ * High-resolution timer used for TBS_USER_MODE. The expiry is advanced
+ * from the previous one (rather than from the current time),
+ * so the sampling period does not drift.
+ */
+static enum hrtimer_restart tbs_mode_fire_hrtimer(struct hrtimer *t)
+{
+	pmon_prof_t* prof=container_of(t, pmon_prof_t, hrtimer);
+
+	tbs_mode_sample(prof);
+
+	if (!get_prof_enabled(prof) || prof->profiling_mode!=TBS_USER_MODE)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward(t,hrtimer_cb_get_time(t),ns_to_ktime(tbs_sampling_period_ns(prof)));
+	return HRTIMER_RESTART;
+}
+#endif
 #endif
 
 
@@ -1417,8 +1853,14 @@ static void mod_exit_thread(struct task_struct* tsk)
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
+		sample.nr_callchain=0;
+		sample.nr_samples=0;
+		sample.time_enabled=sample.time_running=0;
+		sample.timestamp=raw_ktime(now);
+		sample.cpu=cpu;
 		sample.pid=prof->this_tsk->pid;
 		sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+		sample.sampling_period=0;
 		prof->ref_time=now;
 
 		/* Copy and clear samples in prof */
@@ -1432,15 +1874,11 @@ static void mod_exit_thread(struct task_struct* tsk)
 			mm_on_new_sample(prof,cpu,&sample,MM_EXIT,NULL);
 
 		if (prof->pmc_samples_buffer) {
-			/* Push current counter values into the buffer */
-			spin_lock(&prof->pmc_samples_buffer->lock);
-
 			//Common for everything
 			prof->flags|=PMC_EXITING;
 
-			__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-
-			spin_unlock(&prof->pmc_samples_buffer->lock);
+			/* Push current counter values into the buffer */
+			push_sample_cbuffer(prof,&sample);
 		}
 
 		break;
@@ -1463,6 +1901,12 @@ static void mod_exit_thread(struct task_struct* tsk)
 	default:
 		break;
 	}
+
+	/* Deliver the totals gathered in aggregation mode */
+	flush_sample_totals(prof);
+	kfree(prof->totals);
+	prof->totals=NULL;
+
 	/* Notify that thread is now exiting */
 	mm_on_exit(prof);
 
@@ -1517,6 +1961,13 @@ static int mod_get_current_metric_value(struct task_struct* task, int key, uint6
 		return mm_get_current_metric_value(prof,key,value);
 }
 
+#if !defined(CONFIG_PMCTRACK) && !defined(CONFIG_MINIMAL_PMCTRACK)
+static void free_prof_rcu(struct rcu_head* head)
+{
+	kmem_cache_free(pmon_prof_cache,container_of(head,pmon_prof_t,rcu));
+}
+#endif
+
 /* Invoked when the kernel frees up the process descriptor */
 static void mod_free_per_thread_data(struct task_struct* tsk)
 {
@@ -1568,19 +2019,82 @@ static void mod_free_per_thread_data(struct task_struct* tsk)
 		prof->pmc_kernel_samples=NULL;
 	}
 
+	if (prof->pmc_mmap_ring) {
+		put_pmc_mmap_ring(prof->pmc_mmap_ring);
+		prof->pmc_mmap_ring=NULL;
+	}
+
 
 #if !defined(CONFIG_PMCTRACK) && !defined(CONFIG_MINIMAL_PMCTRACK)
 	del_prof_exited_task(prof);
+	/* Lockless lookups in the exited-task table may still see prof */
+	call_rcu(&prof->rcu,free_prof_rcu);
 #else
 	tsk->pmc = NULL;
+	kmem_cache_free(pmon_prof_cache,prof);
 #endif
-
-	kfree(prof);
 }
 
 
 /*** Implementation of /proc/pmc/- callback functions **/
 
+/*
+ * Parse a comma-separated list of experiment weights ("2,1")
+ * and enable the fair rotation policy for every core type.
+ * A single 0 restores plain round-robin rotation.
+ */
+static int set_multiplexing_weights(pmon_prof_t* prof, char* str)
+{
+	unsigned int weights[AMP_MAX_EXP_CORETYPE];
+	unsigned long flags;
+	char* tok;
+	int nr_weights=0;
+	int i,j;
+	unsigned int val;
+
+	str=strim(str);
+
+	while ((tok=strsep(&str,","))!=NULL) {
+		if (nr_weights==AMP_MAX_EXP_CORETYPE || kstrtouint(tok,0,&val) || val>PMC_MAX_MUX_WEIGHT)
+			return -EINVAL;
+		weights[nr_weights++]=val;
+	}
+
+	if (nr_weights==0)
+		return -EINVAL;
+
+	/* Experiments not listed get a weight of 1 */
+	for (i=nr_weights; i<AMP_MAX_EXP_CORETYPE; i++)
+		weights[i]=1;
+
+	spin_lock_irqsave(&prof->lock,flags);
+
+	for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		core_experiment_set_t* cset=&prof->pmcs_multiplex_cfg[i];
+
+		cset->fair_rotation=!(nr_weights==1 && weights[0]==0);
+
+		for (j=0; j<AMP_MAX_EXP_CORETYPE; j++)
+			cset->weights[j]=(weights[j]==0)?1:weights[j];
+	}
+
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return 0;
+}
+
+/*
+ * Kernel-mode IPs reveal the layout of the kernel (KASLR base),
+ * so only privileged monitors may record them
+ */
+static inline int pmc_kernel_ips_allowed(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	return perfmon_capable();
+#else
+	return capable(CAP_SYS_ADMIN);
+#endif
+}
+
 /* Write callback for /proc/pmc/config */
 static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
 {
@@ -1603,6 +2117,13 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 
 	if(sscanf(kbuf,"sched_sampling_period %i",&val)==1 && val>0) {
 		pmcs_pmon_config.pmon_nticks = msecs_to_jiffies(val);
+	} else if(sscanf(kbuf,"coalesced_tbs %i",&val)==1) {
+#ifdef TBS_HRTIMER
+		/* Only affects threads that start monitoring afterwards */
+		pmcs_pmon_config.pmon_coalesced_tbs=(val!=0);
+#else
+		ret=-ENOTSUPP;
+#endif
 	} else if(sscanf(kbuf,"kernel_buffer_size %i",&val)==1 && val>0) {
 		unsigned int new_size=(val/sizeof(pmc_sample_t))*sizeof(pmc_sample_t);
 		if (new_size == 0)
@@ -1648,14 +2169,20 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 		if (prof) {
 			prof->nticks_sampling_period=msecs_to_jiffies(val);
 			prof->pmc_jiffies_interval=msecs_to_jiffies(val);
+			prof->pmc_usecs_interval=0;
 		}
-	} else if (sscanf(kbuf, "timeout %i",&val)==1 && val>0) {
+	} else if (sscanf(kbuf, "timeout_us %i",&val)==1 && val>0) {
 		pmon_prof_t* prof = get_prof(current);
 
-		if (prof) {
-			prof->pmc_jiffies_interval=msecs_to_jiffies(val);
-			prof->nticks_sampling_period=msecs_to_jiffies(val);
-		}
+		if (val<PMC_MIN_SAMPLING_PERIOD_US)
+			ret=-EINVAL;
+		else if (prof)
+			set_tbs_sampling_period(prof,val);
+	} else if (sscanf(kbuf, "timeout %i",&val)==1 && val>0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof)
+			set_tbs_sampling_period(prof,val*USEC_PER_MSEC);
 	} else if(sscanf(kbuf,"kernel_buffer_size_t %i",&val)==1 && val>0) {
 		pmon_prof_t* prof = get_prof(current);
 
@@ -1666,6 +2193,121 @@ static ssize_t proc_pmc_config_write(struct file *filp, const char __user *buff,
 			else
 				prof->kernel_buffer_size=new_size;
 		}
+	} else if (sscanf(kbuf, "percpu_buffer_t %i",&val)==1) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof) {
+			if (val)
+				prof->samples_buffer_flags|=PMC_BUF_PERCPU;
+			else
+				prof->samples_buffer_flags&=~PMC_BUF_PERCPU;
+		}
+	} else if (sscanf(kbuf, "max_overhead %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		/* Budget in hundredths of a percent (0 disables the controller) */
+		if (val>10000)
+			ret=-EINVAL;
+		else if (prof) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&prof->lock,flags);
+#ifndef CONFIG_PMC_PERF
+			/*
+			 * Bring the EBS reset values back to the period requested
+			 * by the user (the new value is loaded on the next overflow)
+			 */
+			for (; prof->period_shift>0; prof->period_shift--)
+				scale_ebs_reset_values(prof,-1);
+#endif
+			prof->max_overhead=val;
+			prof->period_shift=0;
+			reset_sampling_overhead(prof,local_clock());
+			spin_unlock_irqrestore(&prof->lock,flags);
+		}
+	} else if (sscanf(kbuf, "capture_ip %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		/* 0: disabled, 1: IP only, 2: IP + user-space call chain */
+		if (val>2)
+			ret=-EINVAL;
+		else if (prof) {
+			prof->flags&=~PMC_CAPTURE_FLAGS;
+			if (val>=1)
+				prof->flags|=PMC_CAPTURE_IP;
+			if (val==2)
+				prof->flags|=PMC_CAPTURE_CALLCHAIN;
+			if (val>=1 && pmc_kernel_ips_allowed())
+				prof->flags|=PMC_CAPTURE_KERNEL_IP;
+		}
+	} else if (sscanf(kbuf, "wakeup_samples_t %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof)
+			prof->wakeup_samples=val;
+	} else if (sscanf(kbuf, "wakeup_bytes_t %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof)
+			prof->wakeup_bytes=val;
+	} else if (sscanf(kbuf, "wakeup_latency_t %i",&val)==1 && val>=0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof)
+			prof->wakeup_latency_ms=val;
+	} else if (sscanf(kbuf, "aggregate_t %i",&val)==1) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof) {
+			if (val)
+				prof->samples_buffer_flags|=PMC_BUF_AGGREGATE;
+			else
+				prof->samples_buffer_flags&=~PMC_BUF_AGGREGATE;
+		}
+	} else if (sscanf(kbuf, "buffer_policy_t %i",&val)==1) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (val<PMC_BUF_POLICY_OVERWRITE || val>=PMC_NR_BUF_POLICIES)
+			ret=-EINVAL;
+		else if (prof) {
+			if (val==PMC_BUF_POLICY_DROP)
+				prof->samples_buffer_flags|=PMC_BUF_DROP_NEWEST;
+			else
+				prof->samples_buffer_flags&=~PMC_BUF_DROP_NEWEST;
+		}
+	} else if (sscanf(kbuf, "sample_format_t %i",&val)==1) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (val<PMC_SAMPLE_FMT_FULL || val>=PMC_NR_SAMPLE_FMTS)
+			ret=-EINVAL;
+		else if (prof) {
+			prof->samples_buffer_flags&=~(PMC_BUF_COMPACT|PMC_BUF_VARINT);
+
+			if (val==PMC_SAMPLE_FMT_COMPACT)
+				prof->samples_buffer_flags|=PMC_BUF_COMPACT;
+			else if (val==PMC_SAMPLE_FMT_VARINT)
+				prof->samples_buffer_flags|=PMC_BUF_COMPACT|PMC_BUF_VARINT;
+		}
+	} else if (sscanf(kbuf, "syswide_idle_t %i",&val)==1) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (val<PMC_SYSWIDE_IDLE_SAMPLE || val>=PMC_NR_SYSWIDE_IDLE_POLICIES)
+			ret=-EINVAL;
+		else if (prof)
+			prof->syswide_idle_policy=val;
+	} else if (strncmp(kbuf, "sample_filter_t ",16)==0) {
+		pmon_prof_t* prof = get_prof(current);
+		pmc_sample_filter_t filter;
+
+		if ((val=parse_sample_filter(kbuf+16,&filter)))
+			ret=val;
+		else if (prof)
+			prof->sample_filter=filter;
+	} else if (strncmp(kbuf, "mux_weights_t ",14)==0) {
+		pmon_prof_t* prof = get_prof(current);
+
+		if (prof && (val=set_multiplexing_weights(prof,kbuf+14)))
+			ret=val;
 	} else if (sscanf(kbuf, "max_ebs_samples %i",&val)==1 && val>0) {
 		pmon_prof_t* prof = get_prof(current);
 
@@ -1706,6 +2348,9 @@ static ssize_t proc_pmc_config_read(struct file *filp, char __user *buf, size_t
 	dst+=sprintf(dst,"kernel_buffer_size = %u bytes (%zu samples)\n",
 	             pmcs_pmon_config.pmon_kernel_buffer_size,
 	             pmcs_pmon_config.pmon_kernel_buffer_size/sizeof(pmc_sample_t));
+#ifdef TBS_HRTIMER
+	dst+=sprintf(dst,"coalesced_tbs = %u\n",pmcs_pmon_config.pmon_coalesced_tbs);
+#endif
 
 	err=mm_on_read_config(dst,PAGE_SIZE-(dst-kbuf-1));
 
@@ -1729,7 +2374,8 @@ err_config_read:
 	return err;
 }
 
-#define MAX_STR_CONFIG_LEN 100
+/* Long enough to hold cgroup paths of containers */
+#define MAX_STR_CONFIG_LEN 256
 
 struct attach_arg {
 	pmon_prof_t* monitor;
@@ -1759,6 +2405,7 @@ static int set_up_monitoring_task(void *data)
 	if (monitor->pmc_samples_buffer) {
 		get_pmc_samples_buffer(monitor->pmc_samples_buffer);
 		target->pmc_samples_buffer=monitor->pmc_samples_buffer;
+		alloc_sample_totals(target);
 	}
 
 	/* Clone pmcs */
@@ -1776,11 +2423,14 @@ static int set_up_monitoring_task(void *data)
 
 	/* Inherit intervals from the monitor process  */
 	target->pmc_jiffies_interval=monitor->pmc_jiffies_interval;
+	target->pmc_usecs_interval=monitor->pmc_usecs_interval;
+	target->max_overhead=monitor->max_overhead;
+	target->flags|=(monitor->flags & PMC_CAPTURE_FLAGS);
 	target->nticks_sampling_period=monitor->nticks_sampling_period;
 	target->pmc_jiffies_timeout=jiffies+target->pmc_jiffies_interval;
 #ifdef TBS_TIMER
 	if (target->profiling_mode==TBS_USER_MODE)
-		mod_timer( &target->timer, target->pmc_jiffies_timeout);
+		start_tbs_timer(target);
 #endif
 	smp_mb();
 	set_prof_enabled(target, 1);
@@ -1875,6 +2525,7 @@ static int pmctrack_pid_attach(pid_t pid)
 	if (monitor->pmc_samples_buffer) {
 		get_pmc_samples_buffer(monitor->pmc_samples_buffer);
 		monitored->pmc_samples_buffer=monitor->pmc_samples_buffer;
+		alloc_sample_totals(monitored);
 	}
 
 	/* For now start with slow core events */
@@ -1885,11 +2536,14 @@ static int pmctrack_pid_attach(pid_t pid)
 
 	/* Inherit intervals from the monitor process  */
 	monitored->pmc_jiffies_interval=monitor->pmc_jiffies_interval;
+	monitored->pmc_usecs_interval=monitor->pmc_usecs_interval;
+	monitored->max_overhead=monitor->max_overhead;
+	monitored->flags|=(monitor->flags & PMC_CAPTURE_FLAGS);
 	monitored->nticks_sampling_period=monitor->nticks_sampling_period;
 	monitored->pmc_jiffies_timeout=jiffies+monitored->pmc_jiffies_interval;
 #ifdef TBS_TIMER
 	if (monitored->profiling_mode==TBS_USER_MODE)
-		mod_timer( &monitored->timer, monitored->pmc_jiffies_timeout);
+		start_tbs_timer(monitored);
 #endif
 	smp_mb();
 
@@ -1968,6 +2622,7 @@ static int disable_monitoring_task(void *data)
 
 	/* Remove reference to the buffer */
 	if (target->pmc_samples_buffer) {
+		flush_sample_totals(target);
 		put_pmc_samples_buffer(target->pmc_samples_buffer);
 		target->pmc_samples_buffer=NULL;
 	}
@@ -2009,6 +2664,7 @@ static int disable_monitoring_task(void *data)
 
 	/* Remove reference to the buffer */
 	if (target->pmc_samples_buffer) {
+		flush_sample_totals(target);
 		put_pmc_samples_buffer(target->pmc_samples_buffer);
 		target->pmc_samples_buffer=NULL;
 	}
@@ -2082,6 +2738,7 @@ static noinline int pmctrack_pid_detach(pid_t pid)
 
 	/* Remove reference to the buffer */
 	if (monitored->pmc_samples_buffer) {
+		flush_sample_totals(monitored);
 		put_pmc_samples_buffer(monitored->pmc_samples_buffer);
 		monitored->pmc_samples_buffer=NULL;
 	}
@@ -2209,6 +2866,84 @@ static noinline int pmctrack_task_detach_force(struct task_struct* target, pid_t
 }
 
 
+/* Start a self-monitoring session for the current thread ("ON" command) */
+static int self_monitoring_start(void)
+{
+	pmon_prof_t* prof = get_prof(current);
+	pmc_samples_buffer_t* pmc_buf=NULL;
+	unsigned long flags;
+
+	if (!prof)
+		return -EINVAL;
+
+	/* Allocate memory for the buffer sample */
+	if (!prof->pmc_samples_buffer) {
+		pmc_buf=allocate_samples_buffer_prof(prof);
+		if (pmc_buf == NULL) {
+			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irqsave(&prof->lock,flags);
+	/* Assign newly created data */
+	if (!prof->pmc_samples_buffer)
+		prof->pmc_samples_buffer=pmc_buf;
+	alloc_sample_totals(prof);
+
+	prof->flags|=PMC_READ_SELF_MONITORING;
+
+	/* Set up jiffies interval if it wasn't set previously */
+	if (prof->pmc_jiffies_interval<0)
+		prof->pmc_jiffies_interval=HZ; /* Default one second */
+
+	prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
+
+	prof->ref_time=ktime_get();
+
+#ifdef TBS_TIMER
+	if (prof->profiling_mode==TBS_USER_MODE)
+		start_tbs_timer(prof);
+#endif
+	set_prof_enabled(prof, 1);
+#ifdef CONFIG_PMC_PERF
+	/* Enable perf_counters */
+	perf_enable_counters(prof->pmcs_config);
+#endif
+	mod_restore_callback_gen(prof,smp_processor_id(),0);
+
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return 0;
+}
+
+/* Stop the self-monitoring session of the current thread ("OFF" command) */
+static int self_monitoring_stop(void)
+{
+	pmon_prof_t* prof = get_prof(current);
+	unsigned long flags;
+
+	if (!prof)
+		return -EINVAL;
+#ifdef TBS_TIMER
+	/* Cancel per-thread timer if in TBS mode */
+	if (prof_uses_timer(prof) && get_prof_enabled(prof))
+		cancel_pmctrack_timer(prof);
+#endif
+	spin_lock_irqsave(&prof->lock,flags);
+	/* Clear the prof_enabled flag prior to invoking
+	 * sample_counters_user_tbs() so that the
+	 * timer does not get reloaded()
+	 * */
+	set_prof_enabled(prof, 0);
+#ifdef CONFIG_PMC_PERF
+	/* Disable PERF counters */
+	perf_disable_counters(prof->pmcs_config);
+#endif
+	sample_counters_user_tbs(prof,prof->pmcs_config,PMC_SELF_EVT,raw_smp_processor_id());
+	spin_unlock_irqrestore(&prof->lock,flags);
+	return 0;
+}
+
 /* Write callback for /proc/pmc/monitor */
 static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
@@ -2217,9 +2952,6 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 	struct task_struct* tsM;
 	pmon_prof_t* monitor;
 	pmon_prof_t* monitored;
-	pmon_prof_t* prof;
-	unsigned long flags;
-	pmc_samples_buffer_t* pmc_buf=NULL;
 	char kbuf[MAX_STR_CONFIG_LEN]="";
 
 	if (len>=MAX_STR_CONFIG_LEN)
@@ -2261,68 +2993,11 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 	} else if (sscanf(kbuf,"pid_detach %i", &val)==1 && val>0) {
 		return pmctrack_pid_detach(val);
 	} else if (strncmp(kbuf,"ON",2)==0) {
-		prof = get_prof(current);
-		if (!prof)
-			return -EINVAL;
-
-		/* Allocate memory for the buffer sample */
-		if (!prof->pmc_samples_buffer) {
-			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
-			if (pmc_buf == NULL) {
-				printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
-				return -1;
-			}
-		}
-
-		spin_lock_irqsave(&prof->lock,flags);
-		/* Assign newly created data */
-		if (!prof->pmc_samples_buffer)
-			prof->pmc_samples_buffer=pmc_buf;
-
-		prof->flags|=PMC_READ_SELF_MONITORING;
-
-		/* Set up jiffies interval if it wasn't set previously */
-		if (prof->pmc_jiffies_interval<0)
-			prof->pmc_jiffies_interval=HZ; /* Default one second */
-
-		prof->pmc_jiffies_timeout=jiffies+prof->pmc_jiffies_interval;
-
-		prof->ref_time=ktime_get();
-
-#ifdef TBS_TIMER
-		if (prof->profiling_mode==TBS_USER_MODE)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
-#endif
-		set_prof_enabled(prof, 1);
-#ifdef CONFIG_PMC_PERF
-		/* Enable perf_counters */
-		perf_enable_counters(prof->pmcs_config);
-#endif
-		mod_restore_callback_gen(prof,smp_processor_id(),0);
-
-		spin_unlock_irqrestore(&prof->lock,flags);
+		if ((val=self_monitoring_start()))
+			return val;
 	} else if (strncmp(kbuf,"OFF",3)==0) {
-		prof = get_prof(current);
-
-		if (!prof)
-			return -EINVAL;
-#ifdef TBS_TIMER
-		/* Cancel per-thread timer if in TBS mode */
-		if (prof_uses_timer(prof) && get_prof_enabled(prof))
-			cancel_pmctrack_timer(prof);
-#endif
-		spin_lock_irqsave(&prof->lock,flags);
-		/* Clear the prof_enabled flag prior to invoking
-		 * sample_counters_user_tbs() so that the
-		 * timer does not get reloaded()
-		 * */
-		set_prof_enabled(prof, 0);
-#ifdef CONFIG_PMC_PERF
-		/* Disable PERF counters */
-		perf_disable_counters(prof->pmcs_config);
-#endif
-		sample_counters_user_tbs(prof,prof->pmcs_config,PMC_SELF_EVT,raw_smp_processor_id());
-		spin_unlock_irqrestore(&prof->lock,flags);
+		if ((val=self_monitoring_stop()))
+			return val;
 	}
 	/* Syswide monitoring can be started/stopped using this /proc entry as well
 		 to simplify libpmctrack implementation */
@@ -2332,6 +3007,18 @@ static ssize_t proc_monitor_pmcs_write(struct file *filp, const char __user *buf
 	} else if (strcmp(kbuf,"syswide off")==0) {
 		if ((val=syswide_monitoring_stop()))
 			return val;
+	}
+	/* Select cgroups for the cgroup-scoped flavor of the syswide mode */
+	else if (strncmp(kbuf,"cgroup_add ",11)==0) {
+		if ((val=syswide_monitoring_add_cgroup(strim(kbuf+11))))
+			return val;
+	} else if (strcmp(kbuf,"cgroup_clear")==0) {
+		syswide_monitoring_clear_cgroups();
+	}
+	/* Restrict the system-wide mode to a subset of CPUs */
+	else if (strncmp(kbuf,"cpus ",5)==0) {
+		if ((val=syswide_monitoring_set_cpus(strim(kbuf+5))))
+			return val;
 	} else
 		return -EINVAL;
 	return len;
@@ -2358,6 +3045,23 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	if ((pmcbuf=prof_mon->pmc_samples_buffer)==NULL)
 		return -ENOENT;
 
+	/*
+	 * If the monitor mapped a multi-page ring, samples are written
+	 * straight into it. In that case, read() just waits for samples
+	 * and returns the number of bytes ready in the ring (nothing is copied).
+	 */
+	if (prof_mon->pmc_mmap_ring) {
+		spin_lock_irqsave(&pmcbuf->lock,flags);
+		retval=__attach_pmc_mmap_ring(pmcbuf,prof_mon->pmc_mmap_ring);
+		spin_unlock_irqrestore(&pmcbuf->lock,flags);
+
+		if (retval)
+			return retval;
+
+		/* Do not allocate any intermediate buffer */
+		goto lock_buffer;
+	}
+
 	/*
 	 * Use shared buffer between kernel and userspace if provided...
 	 * (The user must pass it as a parameter to the read call)
@@ -2380,6 +3084,7 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	if (dst_buffer_size>len)
 		dst_buffer_size=len;
 
+lock_buffer:
 	/* Prevent the perf interrupt to kick in when trying to do this */
 	spin_lock_irqsave(&pmcbuf->lock,flags);
 
@@ -2389,14 +3094,27 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 	}
 
 	/* EOF if all threads actually finished */
-	if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+	if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_pmc_samples_buffer(pmcbuf)) {
 		spin_unlock_irqrestore(&pmcbuf->lock,flags);
 		return 0;
 	}
 
-	while (is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+	while (is_empty_pmc_samples_buffer(pmcbuf)) {
 		pmcbuf->monitor_waiting=1;
 
+		/*
+		 * Producers do not take the lock in per-CPU mode,
+		 * so check again after raising the flag
+		 * (pairs with smp_mb() in __wake_up_monitor_program())
+		 */
+		if (pmcbuf->cpu_rings) {
+			smp_mb();
+			if (!is_empty_pmc_samples_buffer(pmcbuf)) {
+				pmcbuf->monitor_waiting=0;
+				break;
+			}
+		}
+
 		spin_unlock_irqrestore(&pmcbuf->lock,flags);
 
 		/* Wait until there are samples here */
@@ -2408,15 +3126,26 @@ static ssize_t proc_monitor_pmcs_read (struct file *filp, char __user *buf, size
 		spin_lock_irqsave(&pmcbuf->lock,flags);
 
 		/* EOF if all threads actually finished */
-		if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_cbuffer_t(pmcbuf->pmc_samples)) {
+		if (get_pmc_samples_buffer_refs(pmcbuf)<=1 && is_empty_pmc_samples_buffer(pmcbuf)) {
 			spin_unlock_irqrestore(&pmcbuf->lock,flags);
 			return 0;
 		}
 	}
 
 read_buffer_now:
+	if (pmcbuf->mmap_ring) {
+		/* Samples are already in place */
+		lentotal=pmc_mmap_ring_used(pmcbuf->mmap_ring)*sizeof(pmc_sample_t);
+		spin_unlock_irqrestore(&pmcbuf->lock,flags);
+		return lentotal;
+	}
+
 	/* Bytes to be copied to the user buffer */
-	lentotal=remove_cbuffer_t_batch(pmcbuf->pmc_samples,dst_buffer,dst_buffer_size);
+	lentotal=remove_samples_pmc_buffer(pmcbuf,dst_buffer,dst_buffer_size);
+
+	/* poll() blocks again once the monitor drained the buffer */
+	if (is_empty_pmc_samples_buffer(pmcbuf))
+		pmcbuf->wakeup_pending=0;
 
 	spin_unlock_irqrestore(&pmcbuf->lock,flags);
 
@@ -2439,6 +3168,156 @@ read_buffer_now:
 	return lentotal;
 }
 
+/*
+ * Poll callback for /proc/pmc/monitor. The file becomes readable once
+ * the amount of buffered data reaches the wakeup watermark, the wakeup
+ * latency expires, or all the monitored threads finished (EOF).
+ */
+static pmctrack_poll_t proc_monitor_pmcs_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	pmon_prof_t *prof_mon=get_prof(current);
+	pmc_samples_buffer_t* pmcbuf;
+	unsigned long flags;
+	pmctrack_poll_t mask=0;
+
+	if (prof_mon == NULL || (pmcbuf=prof_mon->pmc_samples_buffer)==NULL)
+		return POLLERR;
+
+	poll_wait(filp,&pmcbuf->poll_queue,wait);
+
+	spin_lock_irqsave(&pmcbuf->lock,flags);
+
+	if (is_empty_pmc_samples_buffer(pmcbuf)) {
+		pmcbuf->wakeup_pending=0;
+
+		if (get_pmc_samples_buffer_refs(pmcbuf)<=1)
+			mask=POLLIN | POLLRDNORM | POLLHUP;
+	} else if (pmcbuf->wakeup_pending || !pmcbuf->wakeup_watermark
+	           || pmc_samples_buffer_above_watermark(pmcbuf,0)
+	           || (prof_mon->flags & PMC_READ_SELF_MONITORING)) {
+		mask=POLLIN | POLLRDNORM;
+	}
+
+	spin_unlock_irqrestore(&pmcbuf->lock,flags);
+	return mask;
+}
+
+/* Handle PMC_IOC_CONFIG: configure PMCs or virtual counters for the current thread */
+static long pmc_ioctl_config(void __user* uarg)
+{
+	pmc_ioc_config_t cfg;
+	char* kbuf;
+	pmon_prof_t* prof;
+	int syswide;
+	long ret;
+
+	if (copy_from_user(&cfg,uarg,sizeof(cfg)))
+		return -EFAULT;
+
+	if (cfg.len==0 || cfg.len>=PAGE_SIZE)
+		return -EINVAL;
+
+	if ((kbuf=kmalloc(cfg.len+1,GFP_KERNEL))==NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(kbuf,(const char __user*)(unsigned long)cfg.str,cfg.len)) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+
+	kbuf[cfg.len]='\0';
+	syswide=(cfg.flags & PMC_IOC_CFG_SYSWIDE)?1:0;
+
+	if (cfg.flags & PMC_IOC_CFG_VIRTUAL)
+		ret=configure_virtual_counters_thread(kbuf,current,syswide);
+	else
+		ret=configure_performance_counters_thread(kbuf,current,syswide);
+
+	kfree(kbuf);
+
+	if (ret)
+		return ret;
+
+	if (cfg.flags & PMC_IOC_CFG_SELFMON) {
+		if ((prof=get_prof(current))==NULL)
+			return -EINVAL;
+		prof->flags|=PMC_SELF_MONITORING;
+	}
+
+	return 0;
+}
+
+/*
+ * Ioctl callback for /proc/pmc/monitor (binary counterpart of
+ * proc_monitor_pmcs_write(); see PMC_IOC_* in pmc_user.h)
+ */
+static long proc_monitor_pmcs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	void __user* uarg=(void __user*)arg;
+	pmc_ioc_read_t rd;
+	int32_t val;
+	ssize_t nbytes;
+	loff_t pos=0;
+	long ret;
+
+	switch (cmd) {
+	case PMC_IOC_START:
+		return self_monitoring_start();
+	case PMC_IOC_STOP:
+		return self_monitoring_stop();
+	case PMC_IOC_STOP_READ:
+		if (copy_from_user(&rd,uarg,sizeof(rd)))
+			return -EFAULT;
+
+		if ((ret=self_monitoring_stop()))
+			return ret;
+
+		/* The read does not block, since PMC_READ_SELF_MONITORING is set */
+		nbytes=proc_monitor_pmcs_read(filp,(char __user*)(unsigned long)rd.buf,rd.size,&pos);
+
+		if (nbytes<0)
+			return nbytes;
+
+		rd.nr_bytes=nbytes;
+
+		if (copy_to_user(uarg,&rd,sizeof(rd)))
+			return -EFAULT;
+		return 0;
+	case PMC_IOC_ATTACH:
+	case PMC_IOC_DETACH:
+		if (get_user(val,(int32_t __user*)uarg))
+			return -EFAULT;
+
+		if (val<=0)
+			return -EINVAL;
+
+		if (cmd==PMC_IOC_ATTACH)
+			return pmctrack_pid_attach(val);
+		else
+			return pmctrack_pid_detach(val);
+	case PMC_IOC_CONFIG:
+		return pmc_ioctl_config(uarg);
+	case PMC_IOC_SYSWIDE:
+		if (get_user(val,(int32_t __user*)uarg))
+			return -EFAULT;
+
+		if (val)
+			return syswide_monitoring_start();
+		else
+			return syswide_monitoring_stop();
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+/* All the arguments have the same layout for 32-bit programs */
+static long proc_monitor_pmcs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return proc_monitor_pmcs_ioctl(filp,cmd,(unsigned long)compat_ptr(arg));
+}
+#endif
+
 /*
  * Operations to allocate a shared page between
  * the monitor process (user-space program) and the
@@ -2494,13 +3373,76 @@ static struct vm_operations_struct mmap_vm_ops = {
 	.fault =   mmap_nopage,
 };
 
+/*
+ * Operations for the multi-page sample ring. Each VMA holds
+ * a reference to the ring, so the memory stays around
+ * until the monitor process unmaps it.
+ */
+static void mmap_ring_open(struct vm_area_struct *vma)
+{
+	get_pmc_mmap_ring((pmc_mmap_ring_t*)vma->vm_private_data);
+}
+
+static void mmap_ring_close(struct vm_area_struct *vma)
+{
+	put_pmc_mmap_ring((pmc_mmap_ring_t*)vma->vm_private_data);
+}
+
+static struct vm_operations_struct mmap_ring_vm_ops = {
+	.open =    mmap_ring_open,
+	.close =   mmap_ring_close,
+};
+
+/*
+ * Map a sample ring made up of a control page and
+ * (vma_size/PAGE_SIZE)-1 data pages.
+ */
+static int proc_monitor_pmcs_mmap_ring(pmon_prof_t* prof, struct vm_area_struct *vma)
+{
+	unsigned long vma_size=vma->vm_end-vma->vm_start;
+	pmc_mmap_ring_t* ring;
+	int err;
+
+	if (vma->vm_pgoff!=0 || (vma_size & ~PAGE_MASK) || prof->pmc_mmap_ring)
+		return -EINVAL;
+
+	/* Samples are written directly into the ring only in shared mode (and full format) */
+	if (prof->samples_buffer_flags & (PMC_BUF_PERCPU|PMC_BUF_COMPACT))
+		return -EINVAL;
+
+	if ((ring=allocate_pmc_mmap_ring(vma_size/PAGE_SIZE-1))==NULL) {
+		printk(KERN_ALERT "Can't allocate the sample ring");
+		return -ENOMEM;
+	}
+
+	if ((err=remap_vmalloc_range(vma,ring->base,0))) {
+		put_pmc_mmap_ring(ring);
+		return err;
+	}
+
+	vma->vm_ops = &mmap_ring_vm_ops;
+	vma->vm_private_data = ring;
+	/* The VMA and the monitor thread hold a reference each */
+	mmap_ring_open(vma);
+	prof->pmc_mmap_ring=ring;
+
+	return 0;
+}
+
 /* mmap() operation for /proc/pmc/monitor */
 static int proc_monitor_pmcs_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	pmc_sample_t *handler;
 	pmon_prof_t* prof=get_prof(current);
 
-	if (!prof || prof->pmc_kernel_samples) /* NULL or shared page already reserved */
+	if (!prof)
+		return -EINVAL;
+
+	/* More than one page: the monitor requests a sample ring */
+	if (vma->vm_end-vma->vm_start > PAGE_SIZE)
+		return proc_monitor_pmcs_mmap_ring(prof,vma);
+
+	if (prof->pmc_kernel_samples) /* Shared page already reserved */
 		return -EINVAL;
 
 	vma->vm_ops = &mmap_vm_ops;	/* Set up callbacks for this entry*/
@@ -2554,7 +3496,7 @@ static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff,
 #endif
 		/* Allocate memory for the buffer sample if necessary */
 		if (!prof->pmc_samples_buffer) {
-			pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+			pmc_buf=allocate_samples_buffer_prof(prof);
 			if (pmc_buf == NULL) {
 				printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 				return -1;
@@ -2567,6 +3509,7 @@ static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff,
 		/* Assign newly created data */
 		if (!prof->pmc_samples_buffer)
 			prof->pmc_samples_buffer=pmc_buf;
+		alloc_sample_totals(prof);
 
 		/* Set up jiffies interval if it wasn't set previously */
 		if (prof->pmc_jiffies_interval<0)
@@ -2578,7 +3521,7 @@ static ssize_t proc_pmc_enable_write(struct file *filp, const char __user *buff,
 
 #ifdef TBS_TIMER
 		if (prof->profiling_mode==TBS_USER_MODE)
-			mod_timer( &prof->timer, prof->pmc_jiffies_timeout);
+			start_tbs_timer(prof);
 #endif
 		set_prof_enabled(prof, 1);
 
@@ -2755,7 +3698,7 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 		if (system_wide)
 			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids; /* Number of possible CPUs */
 
-		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+		pmc_buf=allocate_samples_buffer_prof(prof);
 		if (pmc_buf == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 			return -1;
@@ -2775,6 +3718,7 @@ static int configure_virtual_counters_thread(const char *buf,struct task_struct*
 	/* Assign newly created data if necessary */
 	if (!prof->pmc_samples_buffer)
 		prof->pmc_samples_buffer=pmc_buf;
+	alloc_sample_totals(prof);
 
 	prof->virt_counter_mask=used_virt;
 
@@ -2796,6 +3740,7 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 	pmc_samples_buffer_t* pmc_buf=NULL;
 	unsigned long flags=0;
 	int i=0,j=0;
+	int nr_exps=1,nr_added=0;
 #ifdef CONFIG_PMC_PERF
 	int k=0;
 #endif
@@ -2841,7 +3786,7 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 		if (system_wide)
 			prof->kernel_buffer_size=sizeof(pmc_sample_t)*nr_cpu_ids; /* Number of possible CPUs */
 
-		pmc_buf=allocate_pmc_samples_buffer(prof->kernel_buffer_size);
+		pmc_buf=allocate_samples_buffer_prof(prof);
 		if (pmc_buf == NULL) {
 			printk(KERN_INFO "Can't allocate memory to store buffer samples\n");
 			return -ENOMEM;
@@ -2936,22 +3881,33 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 
 	/* Add to set */
 	if (cfg_set.coretype==-1) {
-		for (i=0; i<AMP_MAX_CORETYPES; i++) {
+		nr_exps=AMP_MAX_CORETYPES;
+		for (i=0; i<nr_exps && !error; i++) {
 			cfg_set.coretype=i;
-			add_experiment_to_set(&prof->pmcs_multiplex_cfg[i],exp[i],&cfg_set);
+			if (!(error=add_experiment_to_set(&prof->pmcs_multiplex_cfg[i],exp[i],&cfg_set)))
+				nr_added++;
 		}
 	} else {
-		add_experiment_to_set(&prof->pmcs_multiplex_cfg[cfg_set.coretype],exp[0],&cfg_set);
+		if (!(error=add_experiment_to_set(&prof->pmcs_multiplex_cfg[cfg_set.coretype],exp[0],&cfg_set)))
+			nr_added++;
 	}
 
 	/* Assign newly created data */
 	if (!prof->pmc_samples_buffer)
 		prof->pmc_samples_buffer=pmc_buf;
-	if (!prof->pmcs_config)
+	alloc_sample_totals(prof);
+	if (!prof->pmcs_config && nr_added)
 		prof->pmcs_config=exp[0];
 
 	spin_unlock_irqrestore(&prof->lock,flags);
 
+	/* Release the experiments that could not be added to the set */
+	for (i=nr_added; i<nr_exps; i++)
+		free_core_experiment(exp[i]);
+
+	if (error)
+		return error;
+
 #ifdef DEBUG
 	{
 		char log[256];
@@ -2969,16 +3925,16 @@ static int configure_performance_counters_thread(const char *buf,struct task_str
 }
 
 /*
- * Given a null-terminated array of raw-formatted PMC configuration
- * string, store the associated low-level information into an array of core_experiment_set_t.
+ * Actual implementation of configure_performance_counters_set().
+ * cfg_set must be able to hold AMP_MAX_EXP_CORETYPE items.
  */
-int configure_performance_counters_set(const char* strconfig[], core_experiment_set_t core_exp_set[], int nr_coretypes)
+static int __configure_performance_counters_set(const char* strconfig[], core_experiment_set_t core_exp_set[],
+        int nr_coretypes, pmc_config_set_t* cfg_set)
 {
 	int i=0,j=0;
-	pmc_config_set_t cfg_set[AMP_MAX_EXP_CORETYPE];
 	int nr_experiments=0;
-#ifndef CONFIG_PMC_PERF
 	int k=0;
+#ifndef CONFIG_PMC_PERF
 	core_experiment_t* exp[AMP_MAX_CORETYPES];
 #endif
 	int error=0;
@@ -3015,18 +3971,24 @@ int configure_performance_counters_set(const char* strconfig[], core_experiment_
 	nr_experiments=i;
 
 #ifdef CONFIG_PMC_PERF
-	for (i=0; i<nr_experiments; i++) {
+	for (i=0; i<nr_experiments && !error; i++) {
 		if (cfg_set[i].coretype!=-1) {
 			j=cfg_set[i].coretype;
 			/* Add just config to set */
-			add_experiment_to_set(&core_exp_set[j],NULL,&cfg_set[i]);
+			error=add_experiment_to_set(&core_exp_set[j],NULL,&cfg_set[i]);
 		} else {
 
 			/* Add just config to set */
-			for (j=0; j<nr_coretypes; j++)
-				add_experiment_to_set(&core_exp_set[j],NULL,&cfg_set[i]);
+			for (j=0; j<nr_coretypes && !error; j++)
+				error=add_experiment_to_set(&core_exp_set[j],NULL,&cfg_set[i]);
 		}
 	}
+
+	if (error) {
+		for (k=0; k<nr_coretypes; k++)
+			free_experiment_set(&core_exp_set[k]);
+		return error;
+	}
 #else
 	for (i=0; i<nr_experiments; i++) {
 		if (cfg_set[i].coretype!=-1) {
@@ -3045,7 +4007,12 @@ int configure_performance_counters_set(const char* strconfig[], core_experiment_
 				return error;
 
 			/* Add to set */
-			add_experiment_to_set(&core_exp_set[j],exp[j],&cfg_set[i]);
+			if ((error=add_experiment_to_set(&core_exp_set[j],exp[j],&cfg_set[i]))) {
+				kfree(exp[j]);
+				for (k=0; k<nr_coretypes; k++)
+					free_experiment_set(&core_exp_set[k]);
+				return error;
+			}
 		} else {
 
 			for (j=0; j<nr_coretypes; j++) {
@@ -3071,14 +4038,39 @@ int configure_performance_counters_set(const char* strconfig[], core_experiment_
 				memcpy(exp[j],exp[0],sizeof(core_experiment_t));
 
 			/* Add experiments to set */
-			for (j=0; j<nr_coretypes; j++)
-				add_experiment_to_set(&core_exp_set[j],exp[j],&cfg_set[i]);
+			for (j=0; j<nr_coretypes; j++) {
+				if ((error=add_experiment_to_set(&core_exp_set[j],exp[j],&cfg_set[i]))) {
+					for (k=j; k<nr_coretypes; k++)
+						kfree(exp[k]);
+					for (k=0; k<nr_coretypes; k++)
+						free_experiment_set(&core_exp_set[k]);
+					return error;
+				}
+			}
 		}
 	}
 #endif
 	return 0;
 }
 
+/*
+ * Given a null-terminated array of raw-formatted PMC configuration
+ * string, store the associated low-level information into an array of core_experiment_set_t.
+ */
+int configure_performance_counters_set(const char* strconfig[], core_experiment_set_t core_exp_set[], int nr_coretypes)
+{
+	/* Too big for the stack */
+	pmc_config_set_t* cfg_set=kmalloc(sizeof(pmc_config_set_t)*AMP_MAX_EXP_CORETYPE,GFP_KERNEL);
+	int error;
+
+	if (!cfg_set)
+		return -ENOMEM;
+
+	error=__configure_performance_counters_set(strconfig,core_exp_set,nr_coretypes,cfg_set);
+	kfree(cfg_set);
+	return error;
+}
+
 
 /* Initialize global parameters of the kernel module */
 void init_pmon_config_t(void)
@@ -3093,6 +4085,7 @@ void init_pmon_config_t(void)
 	pmcs_pmon_config.pmon_nticks = HZ; /* Set superhigh for testing purposes (one second) */
 #endif
 	pmcs_pmon_config.pmon_kernel_buffer_size=BUF_LEN_PMC_SAMPLES_EBS_KERNEL;
+	pmcs_pmon_config.pmon_coalesced_tbs=0;
 
 	buf=forced_small_cores;
 	/* Initialization of cpu_is_small parameter */
@@ -3431,6 +4424,109 @@ void pmctrack_terminate_process(struct task_struct* p)
 	send_signal(SIGPROF, p);
 }
 
+#if defined(CONFIG_X86_64)
+#define HAVE_PMC_USER_CALLCHAIN
+#define pmc_user_frame_pointer(regs)	((regs)->bp)
+#define pmc_user_64bit_mode(regs)	user_64bit_mode(regs)
+#elif defined(CONFIG_ARM64)
+#define HAVE_PMC_USER_CALLCHAIN
+#define pmc_user_frame_pointer(regs)	((regs)->regs[29])
+#define pmc_user_64bit_mode(regs)	(!compat_user_mode(regs))
+#endif
+
+#ifdef HAVE_PMC_USER_CALLCHAIN
+/*
+ * Copy data from user space in interrupt (or NMI) context.
+ * Returns the number of bytes that could not be copied.
+ */
+static unsigned long copy_from_user_nofault_pmc(void* dst, const void __user* src, unsigned long n)
+{
+	unsigned long ret;
+
+#if defined(CONFIG_X86) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	/* We may be in the middle of switch_mm() */
+	if (!nmi_uaccess_okay())
+		return n;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	if (!access_ok(src,n))
+#else
+	if (!access_ok(VERIFY_READ,src,n))
+#endif
+		return n;
+
+	pagefault_disable();
+	ret=__copy_from_user_inatomic(dst,src,n);
+	pagefault_enable();
+	return ret;
+}
+#endif
+
+/*
+ * Store the IP where the overflow took place into the sample and,
+ * if user_callchain is set, walk the user stack of the current task
+ * by following frame pointers. The walk gives up on the first frame
+ * that cannot be read without faulting, so applications built
+ * without frame pointers yield truncated (but harmless) call chains.
+ * Unless kernel_ip is set, overflows in kernel mode are attributed
+ * to the user-space IP of the task (or 0 for kernel threads).
+ */
+static void capture_sample_callchain(struct pt_regs* regs, pmc_sample_t* sample, int user_callchain,
+                                     int kernel_ip)
+{
+#ifdef HAVE_PMC_USER_CALLCHAIN
+	struct pt_regs* uregs;
+	unsigned long fp;
+	struct {
+		unsigned long next_fp;
+		unsigned long ret_addr;
+	} frame;
+#endif
+	int hide_kernel_ip=!user_mode(regs) && !kernel_ip;
+
+	if (!hide_kernel_ip)
+		sample->callchain[0]=instruction_pointer(regs);
+	else if (current->mm)
+		sample->callchain[0]=instruction_pointer(task_pt_regs(current));
+	else
+		sample->callchain[0]=0;
+	sample->nr_callchain=1;
+
+#ifdef HAVE_PMC_USER_CALLCHAIN
+	if (!user_callchain || !current->mm)
+		return;
+
+	if (user_mode(regs)) {
+		uregs=regs;
+	} else {
+		/* Overflow in kernel mode: continue from the user context of the task */
+		uregs=task_pt_regs(current);
+		if (!hide_kernel_ip)
+			sample->callchain[sample->nr_callchain++]=instruction_pointer(uregs);
+	}
+
+	if (!pmc_user_64bit_mode(uregs))
+		return;
+
+	fp=pmc_user_frame_pointer(uregs);
+
+	while (sample->nr_callchain<PMC_MAX_CALLCHAIN && fp && !(fp & (sizeof(unsigned long)-1))) {
+		if (copy_from_user_nofault_pmc(&frame,(const void __user*)fp,sizeof(frame)))
+			break;
+
+		if (!frame.ret_addr)
+			break;
+
+		sample->callchain[sample->nr_callchain++]=frame.ret_addr;
+
+		/* The stack grows downwards: anything else means a corrupted chain */
+		if (frame.next_fp<=fp)
+			break;
+
+		fp=frame.next_fp;
+	}
+#endif
+}
 
 /*
  * This function gets invoked from the platform-specific PMU code
@@ -3477,10 +4573,20 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 	sample.nr_counts=core_exp->size;
 	sample.virt_mask=0;
 	sample.nr_virt_counts=0;
+	sample.nr_callchain=0;
+	sample.nr_samples=0;
+	sample.time_enabled=sample.time_running=0;
+	sample.timestamp=raw_ktime(now);
+	sample.cpu=this_cpu;
 	sample.pid=p->pid;
 	sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+	sample.sampling_period=(core_exp->ebs_idx!=-1)?__get_reset_value(&core_exp->array[core_exp->ebs_idx]):0;
 	prof->ref_time=now;
 
+	if (regs && (prof->flags & PMC_CAPTURE_FLAGS))
+		capture_sample_callchain(regs,&sample,prof->flags & PMC_CAPTURE_CALLCHAIN,
+		                         prof->flags & PMC_CAPTURE_KERNEL_IP);
+
 	/* Read counters !! */
 	read_ok=!do_count_mc_experiment_buffer(core_exp,
 	                                       props,
@@ -3494,9 +4600,7 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 		if (prof && task_is_running(prof->this_tsk))
 			mm_on_new_sample(prof,this_cpu,&sample,MM_TICK,regs);
 
-		spin_lock(&prof->pmc_samples_buffer->lock);
-		__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-		spin_unlock(&prof->pmc_samples_buffer->lock);
+		push_sample_cbuffer(prof,&sample);
 	}
 
 	/* Handle signal submission to kill the application */
@@ -3525,10 +4629,13 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 	int cur_coretype=get_coretype_cpu(this_cpu);
 	core_experiment_t* next;
 	ktime_t now;
+	u64 start;
 
 	if (!prof)
 		return;
 
+	start=prof->max_overhead?local_clock():0;
+
 	spin_lock_irqsave(&prof->lock,flags);
 
 	if (!get_prof_enabled(prof)) {
@@ -3553,10 +4660,20 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 		sample.nr_counts=core_exp->size;
 		sample.virt_mask=0;
 		sample.nr_virt_counts=0;
+		sample.nr_callchain=0;
+		sample.nr_samples=0;
+		sample.time_enabled=sample.time_running=0;
+		sample.timestamp=raw_ktime(now);
+		sample.cpu=this_cpu;
 		sample.pid=p->pid;
 		sample.elapsed_time=raw_ktime(ktime_sub(now,prof->ref_time));
+		sample.sampling_period=0;
 		prof->ref_time=now;
 
+		if (regs && (prof->flags & PMC_CAPTURE_FLAGS))
+			capture_sample_callchain(regs,&sample,prof->flags & PMC_CAPTURE_CALLCHAIN,
+			                         prof->flags & PMC_CAPTURE_KERNEL_IP);
+
 		/* Read counters !! */
 		read_ok=!do_count_mc_experiment_buffer(core_exp,
 		                                       props,
@@ -3569,17 +4686,14 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 			if (ebs_idx!=-1) {
 				uint64_t reset_value=__get_reset_value(&(core_exp->array[ebs_idx]));
 				sample.pmc_counts[ebs_idx]+=( (-reset_value) & props->pmc_width_mask);
+				sample.sampling_period=(-reset_value) & props->pmc_width_mask;
 			}
 
 			/* Call the monitoring (This one controls multiplexation if necessary) !! */
 			if (prof)
 				mm_on_new_sample(prof,this_cpu,&sample,MM_TICK,regs);
 
-			if (prof->pmc_samples_buffer) {
-				spin_lock(&prof->pmc_samples_buffer->lock);
-				__push_sample_cbuffer(prof->pmc_samples_buffer,&sample);
-				spin_unlock(&prof->pmc_samples_buffer->lock);
-			}
+			push_sample_cbuffer(prof,&sample);
 
 			if (prof->profiling_mode==EBS_MODE) {
 				/* Engage multiplexation */
@@ -3593,6 +4707,18 @@ void do_count_on_overflow(struct pt_regs *regs, unsigned int overflow_mask)
 					mc_restart_all_counters(prof->pmcs_config);
 				}
 			}
+
+			/* Adjust the sampling rate to stay within the overhead budget */
+			if (prof->max_overhead && ebs_idx!=-1 && prof->pmcs_config) {
+				int delta=update_sampling_overhead(prof,start);
+
+				/* period_shift must match the scaling of the reset values (see fork) */
+				if (delta && scale_ebs_reset_values(prof,delta)) {
+					prof->period_shift+=delta;
+					/* Reload the counters with the new reset value */
+					mc_restart_all_counters(prof->pmcs_config);
+				}
+			}
 		}
 
 		/* Handle signal submission to kill the application */
@@ -3643,7 +4769,21 @@ static int __init pmctrack_module_init(void)
 	init_pmu_ok=1;
 
 	init_percpu_structures();
+	mc_init_loaded_exp_tracking();
 	init_prof_exited_tasks();
+	init_tbs_cpu_timers();
+
+	/*
+	 * pmon_prof_t structures are allocated on every fork and freed
+	 * on every exit, so they get their own cacheline-aligned cache
+	 */
+	pmon_prof_cache=kmem_cache_create("pmctrack_prof",sizeof(pmon_prof_t),0,SLAB_HWCACHE_ALIGN,NULL);
+
+	if (!pmon_prof_cache) {
+		printk("Can't create pmon_prof_t cache");
+		ret=-ENOMEM;
+		goto out_error;
+	}
 
 	if((ret = pmctrack_init()) != 0) {
 		printk("Can't load pmctrack stub");
@@ -3709,6 +4849,11 @@ out_error:
 		pmc_dir=NULL;
 		remove_proc_entry("pmc", NULL);
 	}
+	if (pmon_prof_cache) {
+		rcu_barrier();
+		kmem_cache_destroy(pmon_prof_cache);
+		pmon_prof_cache=NULL;
+	}
 
 	return ret;
 }
@@ -3727,8 +4872,13 @@ static void __exit pmctrack_module_exit(void)
 		destroy_mm_manager(pmc_dir);
 		destroy_proc_entries();
 		syswide_monitoring_cleanup();
+		destroy_tbs_cpu_timers();
+		mc_sync_loaded_exp_tracking();
 		if (pmc_dir)
 			remove_proc_entry("pmc", NULL);
+		/* Wait for pending free_prof_rcu() callbacks */
+		rcu_barrier();
+		kmem_cache_destroy(pmon_prof_cache);
 		printk(KERN_INFO "Module PMCs unloaded.\n");
 	} else {
 		printk(KERN_INFO "Module PMCs not unloaded.\n");
@@ -18,7 +18,7 @@
 #include <linux/uaccess.h>
 
 #ifdef DEBUG
-static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration"};
+static const char* sample_type_to_str[PMC_NR_SAMPLE_TYPES]= {"tick","ebs","exit","migration","self","lost","thr_total","proc_total","idle"};
 #endif
 
 
@@ -381,11 +381,21 @@ int init_mm_manager(struct proc_dir_entry* pmc_dir)
  */
 void destroy_mm_manager(struct proc_dir_entry* pmc_dir)
 {
+	monitoring_module_t* cur_entry=NULL;
+
 	/* Disable current modules */
 	if (mm_manager.cur_module) {
 		mm_manager.cur_module->disable_module();
 		mm_manager.cur_module=NULL;
 	}
+
+	/* No thread holds per-thread private data at this point */
+	list_for_each_entry(cur_entry,&mm_manager.modules,links) {
+		if (cur_entry->thread_data_cache) {
+			kmem_cache_destroy(cur_entry->thread_data_cache);
+			cur_entry->thread_data_cache=NULL;
+		}
+	}
 #ifdef CONFIG_SMART_POWER
 	spower_unregister_driver();
 #endif
@@ -599,6 +609,7 @@ monitoring_module_t* current_monitoring_module(void)
 int load_monitoring_module(monitoring_module_t* module)
 {
 	int ret=-EINVAL;
+	char cache_name[32];
 
 	/* Check possible errors */
 	if (module==NULL ||  module->id>0 ||
@@ -606,11 +617,40 @@ int load_monitoring_module(monitoring_module_t* module)
 		return ret;
 
 	module->id=mm_manager.nr_ids++;
+
+	/*
+	 * Per-thread private data is allocated on every fork, so it
+	 * comes from a dedicated cache (kmalloc() is used if creation fails)
+	 */
+	if (module->thread_data_size && !module->thread_data_cache) {
+		snprintf(cache_name,sizeof(cache_name),"pmctrack_mm%d_data",module->id);
+		module->thread_data_cache=kmem_cache_create(cache_name,module->thread_data_size,0,
+		                          SLAB_HWCACHE_ALIGN,NULL);
+	}
+
 	list_add_tail(&module->links,&mm_manager.modules);
 	mm_manager.nr_modules++;
 	return module->id;
 }
 
+/* Allocate per-thread private data for a monitoring module */
+void* mm_alloc_thread_data(monitoring_module_t* module)
+{
+	if (module->thread_data_cache)
+		return kmem_cache_alloc(module->thread_data_cache,GFP_KERNEL);
+	else
+		return kmalloc(module->thread_data_size,GFP_KERNEL);
+}
+
+/* Free up per-thread private data allocated with mm_alloc_thread_data() */
+void mm_free_thread_data(monitoring_module_t* module, void* data)
+{
+	if (module->thread_data_cache)
+		kmem_cache_free(module->thread_data_cache,data);
+	else
+		kfree(data);
+}
+
 /* Unload the monitoring module with associated ID */
 int unload_monitoring_module(int module_id)
 {
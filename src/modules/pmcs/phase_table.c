@@ -0,0 +1,341 @@
+/*
+ *  phase_table.c
+ *
+ *	Phase table generic data structure
+ *
+ *  Copyright (c) 2016 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ *  This code is licensed under the GNU GPL v2.
+ */
+
+/*
+ * This file only depends on a handful of generic kernel headers, so that
+ * the phase table can also be built in user space (test/test_libpmctrack/phase-table-check).
+ */
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <pmc/data_str/phase_table.h>
+
+/* Number of buckets of indexed phase tables */
+#define PHASE_TABLE_NR_BUCKETS	64
+
+/* Generic nodes for the doubly linked list used in the table  */
+typedef struct {
+	struct list_head links; 	/* for the linked list */
+	struct list_head bucket_links;	/* for the bucket list (indexed tables) */
+	unsigned int key;			/* Value of the key() function for the phase */
+	int idx;					/* Index for the allocator */
+	void* data; 				/* Phase object */
+} phase_node_t;
+
+struct phase_table {
+	struct list_head phases;	/* List of phases */
+	int nr_phases;				/* Current number of phases */
+	int max_phases;				/* Max phases to be stored on the list */
+	size_t phase_struct_size;	/* Size of the phase structure */
+	void* phase_pool;			/* Memory pool (pre-allocated table entries) */
+	phase_node_t* node_pool;	/* Memory pool (pre-allocated table entries) */
+	unsigned long* bitmap;		/* bitmask to keep track of free and occupied entries (1 means free, 0 -> occupied) */
+	int (*compare)(void*,void*,void*); /* Comparison operation (returns 0 if equals or Manhatan distance) */
+	/* Index (NULL key() if disabled) */
+	unsigned int (*key)(void*);	/* Lower bound of the distance between phases (see phase_table.h) */
+	unsigned int bucket_width;	/* Range of key values stored in each bucket */
+	struct list_head* buckets;	/* Phases grouped by key (most recently used first) */
+};
+
+static inline unsigned int phase_key_to_bucket(phase_table_t* table, unsigned int key)
+{
+	unsigned int bucket=key/table->bucket_width;
+
+	/* The last bucket holds all the phases with larger keys */
+	return bucket<PHASE_TABLE_NR_BUCKETS?bucket:PHASE_TABLE_NR_BUCKETS-1;
+}
+
+/* Link node to the bucket of its phase (indexed tables) */
+static inline void index_phase_node(phase_table_t* table, phase_node_t* node)
+{
+	node->key=table->key(node->data);
+	list_add(&node->bucket_links,&table->buckets[phase_key_to_bucket(table,node->key)]);
+}
+
+/* Create an indexed phase table */
+phase_table_t* create_indexed_phase_table(unsigned int max_phases, size_t phase_struct_size,
+        int (*compare)(void*,void*,void*),
+        unsigned int (*key)(void*), unsigned int bucket_width)
+{
+	phase_table_t* table=NULL;
+	void* phase_pool=NULL;
+	void* node_pool=NULL;
+	unsigned long* bitmap=NULL;
+	struct list_head* buckets=NULL;
+	int i=0;
+
+	if (max_phases==0 || (key && bucket_width==0))
+		return NULL;
+
+	/* Allocate memory */
+	if ((phase_pool=kmalloc(phase_struct_size*max_phases,GFP_KERNEL))==NULL)
+		goto free_up_resources;
+
+	if ((node_pool=kmalloc(sizeof(phase_node_t)*max_phases,GFP_KERNEL))==NULL)
+		goto free_up_resources;
+
+	if ((bitmap=kmalloc(BITS_TO_LONGS(max_phases)*sizeof(unsigned long),GFP_KERNEL))==NULL)
+		goto free_up_resources;
+
+	if (key && (buckets=kmalloc(sizeof(struct list_head)*PHASE_TABLE_NR_BUCKETS,GFP_KERNEL))==NULL)
+		goto free_up_resources;
+
+	if ((table=kmalloc(sizeof(phase_table_t),GFP_KERNEL))==NULL)
+		goto free_up_resources;
+
+	/* Initialize phase table */
+	INIT_LIST_HEAD(&table->phases);
+	table->nr_phases=0;
+	table->max_phases=max_phases;
+	table->phase_struct_size=phase_struct_size;
+	table->phase_pool=phase_pool;
+	table->node_pool=node_pool;
+	table->bitmap=bitmap;
+	bitmap_fill(table->bitmap,max_phases); /* All entries are free */
+	table->compare=compare;
+	table->key=key;
+	table->bucket_width=bucket_width;
+	table->buckets=buckets;
+
+	for (i=0; key && i<PHASE_TABLE_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&table->buckets[i]);
+
+	/* Prepare pointers (Dark pointer arithmetic operation */
+	for (i=0; i<max_phases; i++) {
+		table->node_pool[i].data=(((char*)phase_pool) + i*phase_struct_size);
+		table->node_pool[i].idx=i;
+	}
+
+	return table;
+free_up_resources:
+	if (buckets)
+		kfree(buckets);
+	if (bitmap)
+		kfree(bitmap);
+	if (node_pool)
+		kfree(node_pool);
+	if (phase_pool)
+		kfree(phase_pool);
+	if (table)
+		kfree(table);
+	return NULL;
+}
+
+/* Create a phase table */
+phase_table_t* create_phase_table(unsigned int max_phases, size_t phase_struct_size, int (*compare)(void*,void*,void*))
+{
+	return create_indexed_phase_table(max_phases,phase_struct_size,compare,NULL,0);
+}
+
+/* Free up resources associated with a phase table */
+void destroy_phase_table(phase_table_t* table)
+{
+	if (table->buckets)
+		kfree(table->buckets);
+	if (table->bitmap)
+		kfree(table->bitmap);
+	if (table->node_pool)
+		kfree(table->node_pool);
+	if (table->phase_pool)
+		kfree(table->phase_pool);
+	kfree(table);
+}
+
+/* Linear search (non-indexed tables) */
+static phase_node_t* __get_phase_from_list(phase_table_t* table, void* key_phase, void* priv_data, int* sim_min)
+{
+	phase_node_t* cur_phase;
+	phase_node_t* selected_phase=NULL;
+	struct list_head* p;
+	int sim_test=0;
+
+	list_for_each(p,&table->phases) {
+		cur_phase=list_entry(p,phase_node_t,links);
+
+		/* Invoke comparator function */
+		sim_test=table->compare(cur_phase->data,key_phase,priv_data);
+
+		if (sim_test<(*sim_min)) {
+			(*sim_min)=sim_test;
+			selected_phase=cur_phase;
+
+			/* Exact match found */
+			if (sim_test==0)
+				break;
+		}
+	}
+
+	return selected_phase;
+}
+
+/*
+ * Indexed search: buckets are visited in increasing distance from the
+ * bucket of the key phase. Phases in a bucket that is d positions away
+ * are at least (d-1)*bucket_width apart from the key phase, which
+ * makes it possible to stop as soon as no closer phase can be found.
+ */
+static phase_node_t* __get_phase_from_buckets(phase_table_t* table, void* key_phase, void* priv_data, int* sim_min)
+{
+	phase_node_t* cur_phase;
+	phase_node_t* selected_phase=NULL;
+	unsigned int key=table->key(key_phase);
+	int key_bucket=phase_key_to_bucket(table,key);
+	int bucket[2];
+	int sim_test=0;
+	unsigned long dist;
+	int d,i;
+
+	for (d=0; d<PHASE_TABLE_NR_BUCKETS; d++) {
+		if (d>0 && (unsigned long)(d-1)*table->bucket_width>=(unsigned long)(*sim_min))
+			break;
+
+		bucket[0]=key_bucket-d;
+		bucket[1]=(d>0)?key_bucket+d:-1;
+
+		if (bucket[0]<0 && bucket[1]>=PHASE_TABLE_NR_BUCKETS)
+			break;
+
+		for (i=0; i<2; i++) {
+			if (bucket[i]<0 || bucket[i]>=PHASE_TABLE_NR_BUCKETS)
+				continue;
+
+			list_for_each_entry(cur_phase,&table->buckets[bucket[i]],bucket_links) {
+				/* Cheaper bound based on the exact key */
+				dist=(cur_phase->key>key)?cur_phase->key-key:key-cur_phase->key;
+
+				if (dist>=(unsigned long)(*sim_min))
+					continue;
+
+				sim_test=table->compare(cur_phase->data,key_phase,priv_data);
+
+				if (sim_test<(*sim_min)) {
+					(*sim_min)=sim_test;
+					selected_phase=cur_phase;
+
+					/* Exact match found */
+					if (sim_test==0)
+						return selected_phase;
+				}
+			}
+		}
+	}
+
+	return selected_phase;
+}
+
+/* Retrieve the most similar phase in a phase table */
+void* get_phase_from_table(phase_table_t* table, void* key_phase, void* priv_data, int* similarity, int* index)
+{
+	phase_node_t* selected_phase;
+	int sim_min=INT_MAX;
+
+	if (table->key)
+		selected_phase=__get_phase_from_buckets(table,key_phase,priv_data,&sim_min);
+	else
+		selected_phase=__get_phase_from_list(table,key_phase,priv_data,&sim_min);
+
+	if (!selected_phase)
+		return NULL;
+
+	(*similarity)=sim_min;
+	(*index)=selected_phase->idx;
+	return selected_phase->data;
+}
+
+/* Check if index is valid and corresponds to a valid entry */
+static inline int valid_table_entry(phase_table_t* table, int index)
+{
+	return index>=0 && index<table->max_phases && !test_bit(index,table->bitmap);
+}
+
+/* Move table entry in the index position to the beginning of the linked list */
+int promote_table_entry(phase_table_t* table, int index)
+{
+
+	struct list_head* node;
+
+	if (!valid_table_entry(table,index))
+		return -ENOENT;
+
+	/* Point to the phase's node by accessing the node pool */
+	node=&table->node_pool[index].links;
+
+	/* If it is not the first one already, make this entry the first one */
+	if (table->phases.next!=node) {
+		list_del(node);
+		list_add(node,&table->phases);
+	}
+
+	/* Keep buckets in MRU order as well (tie breaking) */
+	if (table->key)
+		list_move(&table->node_pool[index].bucket_links,
+		          &table->buckets[phase_key_to_bucket(table,table->node_pool[index].key)]);
+
+	return 0;
+}
+
+/* Update the index after modifying the phase in the index position */
+int rekey_table_entry(phase_table_t* table, int index)
+{
+	if (!valid_table_entry(table,index))
+		return -ENOENT;
+
+	if (table->key) {
+		list_del(&table->node_pool[index].bucket_links);
+		index_phase_node(table,&table->node_pool[index]);
+	}
+
+	return 0;
+}
+
+/* Find a free entry in the phase table */
+static phase_node_t* get_free_phase_loc(phase_table_t* table)
+{
+	/* Locate first 1 in here */
+	int i=find_first_bit(table->bitmap,table->max_phases);
+
+	if (i>=table->max_phases)
+		return NULL;
+	else
+		return &table->node_pool[i];
+}
+
+/* Insert a new phase into the phase table */
+void* insert_phase_in_table(phase_table_t* table, void* phase)
+{
+	phase_node_t* free_phase_loc;
+
+	/* Get free location */
+	free_phase_loc=get_free_phase_loc(table);
+
+	/* If it is full -> reuse tail (oldest phase is evicted) */
+	if (free_phase_loc==NULL) {
+		free_phase_loc=list_entry(table->phases.prev,phase_node_t,links);
+		if (table->key)
+			list_del(&free_phase_loc->bucket_links);
+	} else {
+		clear_bit(free_phase_loc->idx,table->bitmap); /* Clear bit */
+		table->nr_phases++;
+		/* Newer phases inserted at the beginning */
+		list_add(&free_phase_loc->links,&table->phases);
+	}
+
+	/* Copy data */
+	memcpy(free_phase_loc->data,phase,table->phase_struct_size);
+
+	if (table->key)
+		index_phase_node(table,free_phase_loc);
+
+	return free_phase_loc->data;
+}
@@ -53,6 +53,8 @@
 
 #include <pmc/pmcsched.h>
 
+extern monitoring_module_t pmcsched_mm;
+
 #define DEBUG
 #define PMCSCHED_DEBUG
 //#define COS_MONITORING_BASE 1
@@ -2294,7 +2296,7 @@ noinline void trace_fork_container(struct task_struct* p, struct css_set* cgroup
 static inline void initialize_running_average_values(running_avg_metrics_t* ravg) {
 	int i=0;
 
-	for (i=0; i<MAX_MULTIPLEX_EXP_PER_CORETYPE; i++)
+	for (i=0; i<MAX_METRICS_PER_SET; i++)
 		ravg->value[i]=0;
 
 	ravg->count=0;
@@ -2312,7 +2314,7 @@ static int pmcsched_on_fork(unsigned long clone_flags, pmon_prof_t* prof) {
 	if (prof->monitoring_mod_priv_data!=NULL)
 		return 0;
 
-	data=kmalloc(sizeof (pmcsched_thread_data_t), GFP_KERNEL);
+	data=mm_alloc_thread_data(&pmcsched_mm);
 
 	if (data == NULL)
 		return -ENOMEM;
@@ -2337,8 +2339,9 @@ static int pmcsched_on_fork(unsigned long clone_flags, pmon_prof_t* prof) {
 					goto out_err;
 
 				if (cc->metric_descr[k]) {
-					/* Clone Metrics from the corresponding metric vectors */
-					clone_metric_experiment_set_t(&data->metric_set[k],cc->metric_descr[k]);
+					/* Metric definitions are shared, values are per thread */
+					for (j=0; j<MAX_MULTIPLEX_EXP_PER_CORETYPE; j++)
+						init_metric_values_t(&data->metric_values[k][j]);
 					initialize_running_average_values(&data->running_avg[k]);
 				}
 			}
@@ -2500,6 +2503,7 @@ out_err:
 	}
 	for (j=0; j<k; j++)
 		free_experiment_set(&prof->pmcs_multiplex_cfg[j]);
+	mm_free_thread_data(&pmcsched_mm,data);
 	return error;
 }
 
@@ -2686,7 +2690,7 @@ static void pmcsched_on_free_task(pmon_prof_t* prof) {
 	if (data->schedctl)
 		free_page((unsigned long)data->schedctl);
 
-	kfree(data);
+	mm_free_thread_data(&pmcsched_mm,data);
 
 }
 
@@ -2994,6 +2998,7 @@ monitoring_module_t pmcsched_mm= {
 	.module_counter_usage=pmcsched_module_counter_usage,
 	.on_switch_in=pmcsched_on_switch_in,
 	.on_switch_out=pmcsched_on_switch_out,
+	.thread_data_size=sizeof(pmcsched_thread_data_t),
 };
 
 /* ----------------------AUXILIARY FUNCTIONS ---------------------------------*/
@@ -3556,22 +3561,19 @@ void update_time_state_info(pmcsched_thread_data_t *t, unsigned char is_active,
 
 void pmct_update_running_avg_metrics(
     metric_experiment_t* metric_exp,
+    metric_values_t* values,
     running_avg_metrics_t* running_avgs,
     int new_factor
 ) {
 	int i=0;
-	pmc_metric_t* metric;
 
 	/* First time is copied */
 	if (running_avgs->count==0) {
-		for (i=0; i<metric_exp->size; i++) {
-			metric=&metric_exp->metrics[i];
-			running_avgs->value[i]=metric->count;
-		}
+		for (i=0; i<metric_exp->size; i++)
+			running_avgs->value[i]=get_metric_value(values,i);
 	} else {
 		for (i=0; i<metric_exp->size; i++) {
-			metric=&metric_exp->metrics[i];
-			pmct_calculate_running_average(metric->count,
+			pmct_calculate_running_average(get_metric_value(values,i),
 			                               running_avgs->value[i],
 			                               new_factor,
 			                               0);
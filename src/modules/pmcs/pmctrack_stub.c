@@ -18,8 +18,13 @@
 #include <linux/kernel.h>
 #include <linux/version.h>
 #include <linux/kallsyms.h>
-#include <linux/rwlock.h>
+#include <linux/mutex.h>
 #include <linux/rcupdate.h>
+#include <linux/jump_label.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+#include <linux/static_call.h>
+#define USE_STATIC_CALL
+#endif
 
 #include <linux/string.h>
 #include <linux/err.h>
@@ -168,7 +173,34 @@ struct tracepoints_table {
 
 static pmc_ops_t* pmc_ops_mod = NULL; /* No implementation is registered by default */
 static struct module* implementer = NULL;
-DEFINE_RWLOCK(pmc_ops_lock);
+static DEFINE_MUTEX(pmc_ops_mutex);	/* Serializes register/unregister */
+
+/*
+ * Enabled only while an implementation is registered, so that
+ * the hooks are a patched-out branch when PMCTrack is idle
+ */
+static DEFINE_STATIC_KEY_FALSE(pmc_ops_registered);
+
+#ifdef USE_STATIC_CALL
+static void pmcs_nop_callback(void* prof, int cpu)
+{
+}
+
+/* Direct calls for the context-switch and tick hooks */
+DEFINE_STATIC_CALL(pmcs_save_call, pmcs_nop_callback);
+DEFINE_STATIC_CALL(pmcs_restore_call, pmcs_nop_callback);
+DEFINE_STATIC_CALL(pmcs_tbs_tick_call, pmcs_nop_callback);
+
+static void update_pmcs_static_calls(pmc_ops_t* pmc_ops)
+{
+	static_call_update(pmcs_save_call,
+	                   (pmc_ops && pmc_ops->pmcs_save_callback)?pmc_ops->pmcs_save_callback:pmcs_nop_callback);
+	static_call_update(pmcs_restore_call,
+	                   (pmc_ops && pmc_ops->pmcs_restore_callback)?pmc_ops->pmcs_restore_callback:pmcs_nop_callback);
+	static_call_update(pmcs_tbs_tick_call,
+	                   (pmc_ops && pmc_ops->pmcs_tbs_tick)?pmc_ops->pmcs_tbs_tick:pmcs_nop_callback);
+}
+#endif
 
 /*
  * PMCTrack's kernel module invokes this function to register
@@ -177,19 +209,23 @@ DEFINE_RWLOCK(pmc_ops_lock);
 int register_pmc_module(pmc_ops_t* pmc_ops_module, struct module* module)
 {
 	int ret=0;
-	unsigned long flags;
 
-	write_lock_irqsave(&pmc_ops_lock,flags);
+	mutex_lock(&pmc_ops_mutex);
 
 	/* Module has been installed already */
 	if (implementer!=NULL) {
 		ret=-EPERM;
 	} else {
-		implementer = module;
+#ifdef USE_STATIC_CALL
+		update_pmcs_static_calls(pmc_ops_module);
+#endif
 		rcu_assign_pointer(pmc_ops_mod,pmc_ops_module);
+		/* Publish the implementer after pmc_ops_mod (see pmcs_get_implementer()) */
+		smp_store_release(&implementer,module);
+		static_branch_enable(&pmc_ops_registered);
 	}
 
-	write_unlock_irqrestore(&pmc_ops_lock,flags);
+	mutex_unlock(&pmc_ops_mutex);
 	return ret;
 }
 
@@ -197,25 +233,31 @@ int register_pmc_module(pmc_ops_t* pmc_ops_module, struct module* module)
 int unregister_pmc_module(pmc_ops_t* pmc_ops_module, struct module* module)
 {
 	int ret=0;
-	unsigned long flags;
 
-	write_lock_irqsave(&pmc_ops_lock,flags);
+	mutex_lock(&pmc_ops_mutex);
 
 	if(implementer!=module) {
 		ret=-EPERM;
 	} else {
-		implementer=NULL;
+		static_branch_disable(&pmc_ops_registered);
+		WRITE_ONCE(implementer,NULL);
 		rcu_assign_pointer(pmc_ops_mod,NULL);
+#ifdef USE_STATIC_CALL
+		update_pmcs_static_calls(NULL);
+#endif
+		/*
+		 * Wait for all readers to complete. This covers the
+		 * context-switch and tick hooks too, since they always
+		 * run with preemption disabled.
+		 */
+		synchronize_rcu();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+		/* RCU flavors were not consolidated back then */
+		synchronize_sched();
+#endif
 	}
-	write_unlock_irqrestore(&pmc_ops_lock,flags);
 
-	/*
-	 * If the operation succeeded wait for all readers to complete.
-	 * Since synchronize_rcu() may block, this has to be done
-	 * without the spin lock held
-	 */
-	if (ret==0)
-		synchronize_rcu();
+	mutex_unlock(&pmc_ops_mutex);
 
 	return ret;
 }
@@ -227,28 +269,43 @@ EXPORT_SYMBOL(unregister_pmc_module);
  * Wrapper function for the various pmc_ops_t operations
  */
 
+/*
+ * Pin the implementer module so that its operations can be invoked
+ * from a context that may block. Returns NULL if there is no
+ * implementer or if it is being removed.
+ */
+static inline struct module* pmcs_get_implementer(void)
+{
+	struct module* module;
+
+	rcu_read_lock();
+	module=smp_load_acquire(&implementer);
+	if (module && !try_module_get(module))
+		module=NULL;
+	rcu_read_unlock();
+
+	return module;
+}
+
 /* Invoked when forking a process/thread */
 int pmcs_alloc_per_thread_data(unsigned long clone_flags, struct task_struct *p)
 {
 	int ret=0;
 	pmc_ops_t* pmc_ops= NULL;
-	unsigned long flags;
+	struct module* module;
 
-	read_lock_irqsave(&pmc_ops_lock,flags);
+	if (!static_branch_unlikely(&pmc_ops_registered))
+		return 0;
 
 	/*
 	 * If there is no implementer module or it's being removed
 	 * from the kernel, return immediately.
 	 */
-	if (!implementer || !try_module_get(implementer)) {
-		read_unlock_irqrestore(&pmc_ops_lock,flags);
+	if (!(module=pmcs_get_implementer()))
 		return 0;
-	}
-
-	read_unlock_irqrestore(&pmc_ops_lock,flags);
 
 	/* Now it's safe to dereference pmc_ops_mod */
-	pmc_ops=pmc_ops_mod;
+	pmc_ops=READ_ONCE(pmc_ops_mod);
 
 	/* Invoke the allocation operation (may block) */
 	if(pmc_ops!=NULL && pmc_ops->pmcs_alloc_per_thread_data!=NULL) {
@@ -256,7 +313,7 @@ int pmcs_alloc_per_thread_data(unsigned long clone_flags, struct task_struct *p)
 	}
 
 	/* Allow the module to be removed now */
-	module_put(implementer);
+	module_put(module);
 
 	return ret;
 }
@@ -264,55 +321,65 @@ int pmcs_alloc_per_thread_data(unsigned long clone_flags, struct task_struct *p)
 /* Invoked when a context switch out takes place */
 void pmcs_save_callback(struct task_struct* tsk, int cpu)
 {
+#ifndef USE_STATIC_CALL
 	pmc_ops_t* pmc_ops= NULL;
+#endif
 
-	if (!implementer)
+	if (!static_branch_unlikely(&pmc_ops_registered))
 		return;
 
-	rcu_read_lock();
-
-	pmc_ops=rcu_dereference(pmc_ops_mod);
+	/*
+	 * Called with preemption disabled, so unregister_pmc_module()'s
+	 * synchronize_rcu() also waits for us.
+	 */
+#ifdef USE_STATIC_CALL
+	static_call(pmcs_save_call)(get_prof(tsk), cpu);
+#else
+	pmc_ops=rcu_dereference_sched(pmc_ops_mod);
 
 	if(pmc_ops!=NULL && pmc_ops->pmcs_save_callback!=NULL)
 		pmc_ops->pmcs_save_callback(get_prof(tsk), cpu);
-
-	rcu_read_unlock();
+#endif
 }
 
 /* Invoked when a context switch in takes place */
 void pmcs_restore_callback(struct task_struct* tsk, int cpu)
 {
+#ifndef USE_STATIC_CALL
 	pmc_ops_t* pmc_ops= NULL;
+#endif
 
-	if (!implementer)
+	if (!static_branch_unlikely(&pmc_ops_registered))
 		return;
 
-	rcu_read_lock();
-
-	pmc_ops=rcu_dereference(pmc_ops_mod);
+#ifdef USE_STATIC_CALL
+	static_call(pmcs_restore_call)(get_prof(tsk), cpu);
+#else
+	pmc_ops=rcu_dereference_sched(pmc_ops_mod);
 
 	if(pmc_ops!=NULL && pmc_ops->pmcs_restore_callback!=NULL)
 		pmc_ops->pmcs_restore_callback(get_prof(tsk), cpu);
-
-	rcu_read_unlock();
+#endif
 }
 
 /* Invoked from scheduler_tick() */
 void pmcs_tbs_tick(struct task_struct* tsk, int cpu)
 {
+#ifndef USE_STATIC_CALL
 	pmc_ops_t* pmc_ops= NULL;
+#endif
 
-	if (!implementer)
+	if (!static_branch_unlikely(&pmc_ops_registered))
 		return;
 
-	rcu_read_lock();
-
-	pmc_ops=rcu_dereference(pmc_ops_mod);
+#ifdef USE_STATIC_CALL
+	static_call(pmcs_tbs_tick_call)(get_prof(tsk), cpu);
+#else
+	pmc_ops=rcu_dereference_sched(pmc_ops_mod);
 
 	if(pmc_ops!=NULL && pmc_ops->pmcs_tbs_tick!=NULL)
 		pmc_ops->pmcs_tbs_tick(get_prof(tsk), cpu);
-
-	rcu_read_unlock();
+#endif
 }
 
 /* Invoked when a process calls exec() */
@@ -320,7 +387,7 @@ void pmcs_exec_thread(struct task_struct* tsk)
 {
 	pmc_ops_t* pmc_ops= NULL;
 
-	if (!implementer)
+	if (!static_branch_unlikely(&pmc_ops_registered))
 		return;
 
 	rcu_read_lock();
@@ -337,58 +404,52 @@ void pmcs_exec_thread(struct task_struct* tsk)
 void pmcs_free_per_thread_data(struct task_struct* tsk)
 {
 	pmc_ops_t* pmc_ops= NULL;
-	unsigned long flags;
+	struct module* module;
 
-	read_lock_irqsave(&pmc_ops_lock,flags);
+	if (!static_branch_unlikely(&pmc_ops_registered))
+		return;
 
 	/*
 	 * If there is no implementer module or it's being removed
 	 * from the kernel, return immediately.
 	 */
-	if (!implementer || !try_module_get(implementer)) {
-		read_unlock_irqrestore(&pmc_ops_lock,flags);
+	if (!(module=pmcs_get_implementer()))
 		return;
-	}
-
-	read_unlock_irqrestore(&pmc_ops_lock,flags);
 
 	/* Now it's safe to dereference pmc_ops_mod */
-	pmc_ops=pmc_ops_mod;
+	pmc_ops=READ_ONCE(pmc_ops_mod);
 
 	if(pmc_ops!=NULL && pmc_ops->pmcs_free_per_thread_data!=NULL)
 		pmc_ops->pmcs_free_per_thread_data(tsk);
 
 	/* Allow the module to be removed now */
-	module_put(implementer);
+	module_put(module);
 }
 
 /* Invoked when a process exits */
 void pmcs_exit_thread(struct task_struct* tsk)
 {
 	pmc_ops_t* pmc_ops= NULL;
-	unsigned long flags;
+	struct module* module;
 
-	read_lock_irqsave(&pmc_ops_lock,flags);
+	if (!static_branch_unlikely(&pmc_ops_registered))
+		return;
 
 	/*
 	 * If there is no implementer module or it's being removed
 	 * from the kernel, return immediately.
 	 */
-	if (!implementer || !try_module_get(implementer)) {
-		read_unlock_irqrestore(&pmc_ops_lock,flags);
+	if (!(module=pmcs_get_implementer()))
 		return;
-	}
-
-	read_unlock_irqrestore(&pmc_ops_lock,flags);
 
 	/* Now it's safe to dereference pmc_ops_mod */
-	pmc_ops=pmc_ops_mod;
+	pmc_ops=READ_ONCE(pmc_ops_mod);
 
 	if(pmc_ops!=NULL && pmc_ops->pmcs_exit_thread!=NULL)
 		pmc_ops->pmcs_exit_thread(tsk);
 
 	/* Allow the module to be removed now */
-	module_put(implementer);
+	module_put(module);
 }
 
 /*
@@ -401,7 +462,7 @@ int pmcs_get_current_metric_value(struct task_struct* task, int key, uint64_t* v
 	int ret=-1;
 	pmc_ops_t* pmc_ops= NULL;
 
-	if (!implementer)
+	if (!static_branch_unlikely(&pmc_ops_registered))
 		return ret;
 
 	rcu_read_lock();
@@ -22,6 +22,8 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
 // for signal_pending
 #include <linux/sched/signal.h>
+
+extern monitoring_module_t spower2_mm;
 #endif
 
 #define SPOWER2_MODULE_STR "Odroid Smart Power 2"
@@ -178,7 +180,7 @@ static int spower2_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 		return 0;
 
 
-	data= kmalloc(sizeof (spower2_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&spower2_mm);
 	if (data == NULL)
 		return -ENOMEM;
 
@@ -396,7 +398,7 @@ static int spower2_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,
 static void spower2_on_free_task(pmon_prof_t* prof)
 {
 	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+		mm_free_thread_data(&spower2_mm,prof->monitoring_mod_priv_data);
 }
 
 /* Implementation of the monitoring_module_t interface */
@@ -411,4 +413,5 @@ monitoring_module_t spower2_mm= {
 	.on_new_sample=spower2_on_new_sample,
 	.on_free_task=spower2_on_free_task,
 	.module_counter_usage=spower2_module_counter_usage,
+	.thread_data_size=sizeof(spower2_thread_data_t),
 };
@@ -14,6 +14,8 @@
 #include <pmc/monitoring_mod.h>
 #include <pmc/smart_power.h>
 
+extern monitoring_module_t spower_mm;
+
 #define SPOWER_MODULE_STR "Odroid Smart Power"
 
 /* Per-thread private data for this monitoring module */
@@ -99,7 +101,7 @@ static int spower_on_fork(unsigned long clone_flags, pmon_prof_t* prof)
 		return 0;
 
 
-	data= kmalloc(sizeof (spower_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&spower_mm);
 	if (data == NULL)
 		return -ENOMEM;
 
@@ -158,7 +160,7 @@ static int spower_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t* sample,i
 static void spower_on_free_task(pmon_prof_t* prof)
 {
 	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+		mm_free_thread_data(&spower_mm,prof->monitoring_mod_priv_data);
 }
 
 /* Support for system-wide power measurement (Reuse per-thread info as is) */
@@ -269,5 +271,6 @@ monitoring_module_t spower_mm= {
 	.module_counter_usage=spower_module_counter_usage,
 	.on_syswide_start_monitor=spower_on_syswide_start_monitor,
 	.on_syswide_refresh_monitor=spower_on_syswide_refresh_monitor,
-	.on_syswide_dump_virtual_counters=spower_on_syswide_dump_virtual_counters
+	.on_syswide_dump_virtual_counters=spower_on_syswide_dump_virtual_counters,
+	.thread_data_size=sizeof(spower_thread_data_t)
 };
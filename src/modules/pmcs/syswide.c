@@ -15,12 +15,26 @@
 #include <linux/mm.h>  /* mmap related stuff */
 #include <asm/uaccess.h>
 #include <pmc/monitoring_mod.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h>
+#endif
+#ifdef SYSWIDE_CGROUPS
+#include <linux/cgroup.h>
+#include <linux/hashtable.h>
+#endif
 
 
 #define SYSWIDE_MONITORING_DISABLED -3
 #define SYSWIDE_MONITORING_STOPPING -2
 #define SYSWIDE_MONITORING_STARTING -1
 
+/* Counts gathered for a monitored cgroup on a given CPU */
+typedef struct {
+	uint64_t pmc_values[MAX_LL_EXPS];
+	u64 runtime;	/* Time the cgroup's tasks ran on the CPU (ns) */
+} cgroup_slot_t;
 
 /*
  * Per-CPU structure to hold the necessary
@@ -34,6 +48,15 @@ typedef struct {
 	uint64_t pmc_values[MAX_LL_EXPS];
 	pmc_sample_t last_sample;
 	ktime_t ref_time;
+	cgroup_slot_t* cgroup_slots;	/* One per monitored cgroup (cgroup-scoped mode only) */
+	u64 last_refresh;				/* local_clock() value when counts were last read */
+	unsigned int busy;				/* Set when a task other than the idle task ran since the last sample */
+	/* Sampling timer of this CPU (always fires on this CPU) */
+#ifdef TBS_HRTIMER
+	struct hrtimer timer;
+#else
+	struct timer_list timer;
+#endif
 	spinlock_t lock;
 } cpu_syswide_t;
 
@@ -41,19 +64,46 @@ typedef struct {
 typedef struct {
 	/* PID of the monitor (-1 means syswide disabled) */
 	volatile pid_t syswide_monitor;
-	/* Buffer shared between monitor and kernel timer.
-		It must be big enough to store a sample per-CPU */
+	/* Buffer shared between monitor and the per-CPU timers.
+		Each CPU has its own ring in it, except in cgroup-scoped mode */
 	pmc_samples_buffer_t* pmc_samples_buffer;
-	/* kernel timer to engage collection of PMC events */
-	struct timer_list syswide_timer;
 	/* To serialize accesses the various fields.
 		Note that pmc_samples_buffer has its own spinlock
 	*/
+#ifdef TBS_HRTIMER
+	u64 syswide_timer_period; /* In nanoseconds (inherit from monitor thread) */
+#else
 	unsigned long syswide_timer_period; /* Inherit from monitor thread */
+#endif
 	unsigned int pause_syswide_monitor; /* Global pause flag */
+	/* Cgroup-scoped mode: counts are reported per monitored cgroup */
+	unsigned int nr_cgroups;
+	pid_t cgroup_owner;	/* Process that selected the cgroups */
+	cgroup_slot_t* cgroup_slots;	/* Per-CPU slots (nr_cpu_ids*nr_cgroups) */
+	pmc_sample_t* cgroup_samples;	/* Per-coretype samples (AMP_MAX_CORETYPES*nr_cgroups) */
+	int cgroup_leader;	/* CPU whose timer delivers the per-cgroup samples (-1 if none is online) */
+	spinlock_t cgroup_lock;	/* Protects cgroup_samples */
+	/* CPUs monitored in the session (all of them unless selected by cpus_owner) */
+	struct cpumask cpus;
+	pid_t cpus_owner;	/* Process that selected the CPUs */
+	unsigned int idle_policy;	/* pmc_syswide_idle_policy_t (inherit from monitor thread) */
 	spinlock_t lock;
 } syswide_ctl_t;
 
+#ifdef SYSWIDE_CGROUPS
+/* Monitored cgroup, indexed by its cgroup pointer */
+typedef struct {
+	struct cgroup* cgrp;
+	int idx;	/* Slot index (reported in the pid field of samples) */
+	struct hlist_node links;
+} syswide_cgroup_t;
+
+static syswide_cgroup_t syswide_cgroups[SYSWIDE_MAX_CGROUPS];
+static DEFINE_HASHTABLE(syswide_cgroup_table,8);
+#endif
+/* Serializes changes in the set of monitored cgroups and CPUs */
+static DEFINE_MUTEX(syswide_cgroup_mutex);
+
 
 
 /* Global data
@@ -62,6 +112,39 @@ typedef struct {
 syswide_ctl_t syswide_ctl= {.syswide_monitor=SYSWIDE_MONITORING_DISABLED};
 static DEFINE_PER_CPU(cpu_syswide_t, cpu_syswide);
 
+#ifdef SYSWIDE_CGROUPS
+/*
+ * Return the slot of the monitored cgroup "p" belongs to, or NULL if
+ * there is none. Tasks in nested cgroups are accounted to their closest
+ * monitored ancestor.
+ */
+static cgroup_slot_t* get_cgroup_slot(cpu_syswide_t* cpudata, struct task_struct* p)
+{
+	struct cgroup* cgrp;
+	syswide_cgroup_t* entry;
+	cgroup_slot_t* slot=NULL;
+
+	rcu_read_lock();
+
+	for (cgrp=task_dfl_cgroup(p); cgrp && !slot; cgrp=cgroup_parent(cgrp)) {
+		hash_for_each_possible(syswide_cgroup_table,entry,links,(unsigned long)cgrp) {
+			if (entry->cgrp==cgrp) {
+				slot=&cpudata->cgroup_slots[entry->idx];
+				break;
+			}
+		}
+	}
+
+	rcu_read_unlock();
+	return slot;
+}
+#else
+static inline cgroup_slot_t* get_cgroup_slot(cpu_syswide_t* cpudata, struct task_struct* p)
+{
+	return NULL;
+}
+#endif
+
 
 /*
  * Read performance counters and update statistics
@@ -72,6 +155,27 @@ static int __refresh_counts_cpu(cpu_syswide_t* cpudata)
 	core_experiment_t* core_experiment=cpudata->cur_config;
 	int i=0;
 	uint64_t last_value;
+	uint64_t* pmc_values=cpudata->pmc_values;
+	cgroup_slot_t* slot;
+	u64 now;
+
+	if (!is_idle_task(current))
+		cpudata->busy=1;
+
+	/*
+	 * Cgroup-scoped mode: counts go to the cgroup of the task
+	 * that was running since the last refresh (or get discarded)
+	 */
+	if (cpudata->cgroup_slots) {
+		slot=get_cgroup_slot(cpudata,current);
+		now=local_clock();
+
+		if (slot)
+			slot->runtime+=now-cpudata->last_refresh;
+
+		cpudata->last_refresh=now;
+		pmc_values=slot?slot->pmc_values:NULL;
+	}
 
 	/* Nothing to do if no counters have been configured */
 	if (core_experiment) {
@@ -84,7 +188,8 @@ static int __refresh_counts_cpu(cpu_syswide_t* cpudata)
 
 			/* get Last value */
 			last_value = __get_last_value(lle);
-			cpudata->pmc_values[i]+=last_value;
+			if (pmc_values)
+				pmc_values[i]+=last_value;
 		}
 
 		reset_overflow_status();
@@ -114,14 +219,96 @@ static int refresh_counts_cpu(cpu_syswide_t* cpudata)
 }
 
 
+/*
+ * Add the counts gathered for the various cgroups on
+ * the current CPU to the per-cgroup samples
+ */
+static void fold_cgroup_slots(cpu_syswide_t* cur, core_experiment_t* core_exp, int coretype)
+{
+	pmc_sample_t* samples=&syswide_ctl.cgroup_samples[coretype*syswide_ctl.nr_cgroups];
+	pmc_sample_t* sample;
+	cgroup_slot_t* slot;
+	int i,j;
+
+	spin_lock(&syswide_ctl.cgroup_lock);
+
+	for (i=0; i<syswide_ctl.nr_cgroups; i++) {
+		slot=&cur->cgroup_slots[i];
+
+		if (!slot->runtime)
+			continue;
+
+		sample=&samples[i];
+		sample->exp_idx=core_exp?core_exp->exp_idx:0;
+		sample->pmc_mask=core_exp?core_exp->used_pmcs:0;
+		sample->nr_counts=core_exp?core_exp->size:0;
+
+		for (j=0; j<sample->nr_counts; j++)
+			sample->pmc_counts[j]+=slot->pmc_values[j];
+
+		sample->elapsed_time+=slot->runtime;
+		memset(slot,0,sizeof(cgroup_slot_t));
+	}
+
+	spin_unlock(&syswide_ctl.cgroup_lock);
+}
+
+/*
+ * Deliver the samples of the cgroups that ran during the last
+ * sampling period (the buffer's lock must be held in shared mode).
+ * Samples are just discarded if sbuf is NULL.
+ */
+static void __push_cgroup_samples(pmc_samples_buffer_t* sbuf)
+{
+	pmc_sample_t* sample;
+	unsigned long flags;
+	ktime_t now=ktime_get();
+	int i;
+
+	spin_lock_irqsave(&syswide_ctl.cgroup_lock,flags);
+
+	for (i=0; i<AMP_MAX_CORETYPES*syswide_ctl.nr_cgroups; i++) {
+		sample=&syswide_ctl.cgroup_samples[i];
+
+		if (!sample->elapsed_time)
+			continue;
+
+#ifdef TBS_HRTIMER
+		sample->sampling_period=syswide_ctl.syswide_timer_period;
+#else
+		sample->sampling_period=(u64)jiffies_to_usecs(syswide_ctl.syswide_timer_period)*NSEC_PER_USEC;
+#endif
+		sample->timestamp=raw_ktime(now);
+		if (sbuf)
+			__push_sample_cbuffer_nowakeup(sbuf,sample);
+
+		memset(sample->pmc_counts,0,sizeof(sample->pmc_counts));
+		sample->elapsed_time=0;
+	}
+
+	spin_unlock_irqrestore(&syswide_ctl.cgroup_lock,flags);
+}
+
+/*
+ * Returns non-zero if nothing but the idle task ran on the current CPU
+ * since the last sample, and the counters of the CPU may be left alone
+ * (the cpu_syswide_t lock must be held)
+ */
+static inline int __cpu_stayed_idle(cpu_syswide_t* cur)
+{
+	/* Virtual counters and cgroups must be updated on every period */
+	return syswide_ctl.idle_policy!=PMC_SYSWIDE_IDLE_SAMPLE
+	       && !cur->busy && is_idle_task(current)
+	       && !cur->virt_counter_mask && !cur->cgroup_slots;
+}
+
 /*
  * Gather PMC and virtual-counter samples
- * on the current CPU
+ * on the current CPU. Returns zero if there
+ * is no sample to deliver.
  */
-static void syswide_monitoring_sample_cpu(void* dummy)
+static int syswide_monitoring_sample_cpu(cpu_syswide_t* cur, int cpu)
 {
-	int cpu=smp_processor_id();
-	cpu_syswide_t* cur=&per_cpu(cpu_syswide, cpu);
 	core_experiment_t* core_exp=cur->cur_config;
 	core_experiment_t* next=NULL;
 	int cur_coretype=get_coretype_cpu(cpu);
@@ -133,7 +320,31 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 	/* Grab the spinlock to avoid races when updating "pmc_values" */
 	spin_lock_irqsave(&cur->lock,flags);
 
+	/*
+	 * The counts of an idle period are left in the PMCs, and ref_time
+	 * is not updated, so they are reported in the next regular sample
+	 */
+	if (__cpu_stayed_idle(cur)) {
+		if (syswide_ctl.idle_policy==PMC_SYSWIDE_IDLE_SKIP) {
+			spin_unlock_irqrestore(&cur->lock,flags);
+			return 0;
+		}
+
+		memset(sample,0,sizeof(pmc_sample_t));
+		sample->type=PMC_IDLE_SAMPLE;
+		sample->coretype=cur_coretype;
+		sample->pid=cpu;
+		sample->timestamp=raw_ktime(ktime_get());
+		sample->cpu=cpu;
+		goto set_period;
+	}
+
 	__refresh_counts_cpu(cur);
+	cur->busy=0;
+
+	/* Cgroup-scoped mode: the per-CPU sample is not delivered */
+	if (cur->cgroup_slots)
+		fold_cgroup_slots(cur,core_exp,cur_coretype);
 
 	if (core_exp) {
 		/* Copy and clear samples in prof */
@@ -146,16 +357,25 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 	now=ktime_get();
 
 	/* Generate sample ... */
+	sample->type=PMC_TICK_SAMPLE;
 	sample->coretype=cur_coretype;
 	sample->exp_idx=core_exp?core_exp->exp_idx:0;
 	sample->pmc_mask=core_exp?core_exp->used_pmcs:0;
 	sample->nr_counts=core_exp?core_exp->size:0;
 	sample->virt_mask=0;
 	sample->nr_virt_counts=0;
+	sample->nr_callchain=0;
+	sample->nr_samples=0;
+	sample->time_enabled=sample->time_running=0;
 	sample->pid=cpu; /* In syswide mode -> this field is reused to store the CPU */
 	sample->elapsed_time=raw_ktime(ktime_sub(now,cur->ref_time));
+	sample->timestamp=raw_ktime(now);
+	sample->cpu=cpu;
 	cur->ref_time=now;
 
+	if (core_exp)
+		account_experiment_time(&cur->pmc_config_set,sample);
+
 	/* Call the estimation module if the user requested virtual counters */
 	if (cur->virt_counter_mask)
 		mm_on_syswide_dump_virtual_counters(cpu,cur->virt_counter_mask,sample);
@@ -173,47 +393,96 @@ static void syswide_monitoring_sample_cpu(void* dummy)
 		mc_restart_all_counters(cur->cur_config);
 	}
 
-
+set_period:
+#ifdef TBS_HRTIMER
+	sample->sampling_period=syswide_ctl.syswide_timer_period;
+#else
+	sample->sampling_period=(u64)jiffies_to_usecs(syswide_ctl.syswide_timer_period)*NSEC_PER_USEC;
+#endif
 	spin_unlock_irqrestore(&cur->lock,flags);
+	return 1;
 }
 
-/* Main timer function for the syswide-monitoring mode */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-static void fire_syswide_timer(unsigned long data)
-#else
-static void fire_syswide_timer(struct timer_list *t)
-#endif
+/*
+ * Deliver the samples gathered on the current CPU. With per-CPU rings,
+ * this neither takes a global lock nor depends on the other CPUs.
+ * In cgroup-scoped mode, the other CPUs just fold their counts into
+ * the per-cgroup samples, which are delivered by the leader CPU.
+ */
+static void syswide_monitoring_push_samples(cpu_syswide_t* cur, int cpu, int new_sample)
 {
-	cpu_syswide_t* cur=NULL;
+	pmc_samples_buffer_t* sbuf=syswide_ctl.pmc_samples_buffer;
+	int paused=READ_ONCE(syswide_ctl.pause_syswide_monitor);
 	unsigned long flags;
-	int cpu=0;
 
-	if (!syswide_monitoring_enabled())
+	if (!syswide_ctl.cgroup_samples) {
+		if (new_sample && !paused && sbuf)
+			push_sample_pmc_buffer(sbuf,&cur->last_sample);
 		return;
+	}
 
-	/* Generate per-cpu samples in a distributed way */
-	on_each_cpu(syswide_monitoring_sample_cpu, NULL, 1);
+	if (cpu!=READ_ONCE(syswide_ctl.cgroup_leader))
+		return;
 
-	/* Grab the global lock */
-	spin_lock_irqsave(&syswide_ctl.lock,flags);
+	if (paused || !sbuf) {
+		/* Discard the counts gathered while paused */
+		__push_cgroup_samples(NULL);
+		return;
+	}
 
-	if (!syswide_ctl.pause_syswide_monitor && syswide_monitoring_enabled() &&  syswide_ctl.pmc_samples_buffer) {
-		spin_lock(&syswide_ctl.pmc_samples_buffer->lock);
+	if (!sbuf->cpu_rings)
+		spin_lock_irqsave(&sbuf->lock,flags);
 
-		/* Dump the various samples */
-		for_each_online_cpu(cpu) {
-			cur=&per_cpu(cpu_syswide, cpu);
-			__push_sample_cbuffer_nowakeup(syswide_ctl.pmc_samples_buffer,&cur->last_sample);
-		}
-		/* Wake up monitor ... */
-		__wake_up_monitor_program(syswide_ctl.pmc_samples_buffer);
-		spin_unlock(&syswide_ctl.pmc_samples_buffer->lock);
+	__push_cgroup_samples(sbuf);
+	/* Wake up monitor (if the watermark was reached) ... */
+	__notify_monitor_program(sbuf,0);
+
+	if (!sbuf->cpu_rings)
+		spin_unlock_irqrestore(&sbuf->lock,flags);
+}
+
+/* Per-CPU timer function for the syswide-monitoring mode */
+#ifdef TBS_HRTIMER
+static enum hrtimer_restart fire_syswide_timer(struct hrtimer *t)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+static void fire_syswide_timer(unsigned long data)
+#else
+static void fire_syswide_timer(struct timer_list *t)
+#endif
+{
+	int cpu=smp_processor_id();
+#if !defined(TBS_HRTIMER) && LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	cpu_syswide_t* cur=&per_cpu(cpu_syswide, data);
+#else
+	cpu_syswide_t* cur=container_of(t, cpu_syswide_t, timer);
+#endif
+	int state=READ_ONCE(syswide_ctl.syswide_monitor);
+
+	/*
+	 * Stop if the session is over, or if the timer was moved
+	 * to another CPU (its CPU went offline before the timer
+	 * could be cancelled by syswide_cpu_down_prep())
+	 */
+	if (state<SYSWIDE_MONITORING_STARTING || cur!=this_cpu_ptr(&cpu_syswide)) {
+#ifdef TBS_HRTIMER
+		return HRTIMER_NORESTART;
+#else
+		return;
+#endif
 	}
 
-	if (syswide_monitoring_enabled())
-		mod_timer( &syswide_ctl.syswide_timer, jiffies + syswide_ctl.syswide_timer_period);
+	/* Timers are armed before the session is fully started */
+	if (state!=SYSWIDE_MONITORING_STARTING)
+		syswide_monitoring_push_samples(cur,cpu,syswide_monitoring_sample_cpu(cur,cpu));
 
-	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+#ifdef TBS_HRTIMER
+	/* Advance from the previous expiry to prevent drift */
+	hrtimer_forward(t,hrtimer_cb_get_time(t),ns_to_ktime(syswide_ctl.syswide_timer_period));
+	return HRTIMER_RESTART;
+#else
+	cur->timer.expires=jiffies+syswide_ctl.syswide_timer_period;
+	add_timer_on(&cur->timer,cpu);
+#endif
 }
 
 
@@ -244,6 +513,8 @@ static inline void reset_cpu_syswide_data(cpu_syswide_t* data, int init)
 	data->cur_config=NULL;
 
 	data->virt_counter_mask=0;	// No virtual counters selected so far
+	data->cgroup_slots=NULL;
+	data->busy=0;
 
 	/* Clear sample */
 	memset(&data->last_sample,0,sizeof(pmc_sample_t));
@@ -269,6 +540,87 @@ static int setup_cpu_syswide_data(cpu_syswide_t* data,
 }
 
 
+static void syswide_monitoring_start_cpu(void* dummy);
+static void syswide_monitoring_stop_cpu(void* dummy);
+
+/* Cancel the sampling timer of a CPU (blocking function) */
+static inline void cancel_syswide_timer(cpu_syswide_t* cur)
+{
+#ifdef TBS_HRTIMER
+	hrtimer_cancel(&cur->timer);
+#else
+	del_timer_sync(&cur->timer);
+#endif
+}
+
+/*
+ * CPU hotplug callbacks: a monitored CPU resumes sampling when it comes
+ * back online, and stops when it goes offline. If it was delivering
+ * the per-cgroup samples, another monitored CPU takes over.
+ * Sessions do not start or stop while these run (see get_online_cpus()
+ * in syswide_monitoring_start() and syswide_monitoring_stop()).
+ */
+static int syswide_cpu_online(unsigned int cpu)
+{
+	if (!syswide_monitoring_enabled() || !cpumask_test_cpu(cpu,&syswide_ctl.cpus))
+		return 0;
+
+	if (syswide_ctl.cgroup_samples && syswide_ctl.cgroup_leader<0)
+		WRITE_ONCE(syswide_ctl.cgroup_leader,cpu);
+
+	smp_call_function_single(cpu,syswide_monitoring_start_cpu,NULL,1);
+	return 0;
+}
+
+static int syswide_cpu_down_prep(unsigned int cpu)
+{
+	int new_leader=-1;
+	int i;
+
+	if (!syswide_monitoring_enabled() || !cpumask_test_cpu(cpu,&syswide_ctl.cpus))
+		return 0;
+
+	cancel_syswide_timer(&per_cpu(cpu_syswide, cpu));
+	smp_call_function_single(cpu,syswide_monitoring_stop_cpu,NULL,1);
+
+	if (syswide_ctl.cgroup_samples && syswide_ctl.cgroup_leader==cpu) {
+		for_each_cpu_and(i,&syswide_ctl.cpus,cpu_online_mask) {
+			if (i!=cpu) {
+				new_leader=i;
+				break;
+			}
+		}
+		WRITE_ONCE(syswide_ctl.cgroup_leader,new_leader);
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+static int syswide_cpu_notifier(struct notifier_block *b, unsigned long action,
+                                void *data)
+{
+	unsigned int cpu=(unsigned long)data;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_DOWN_FAILED:
+	case CPU_ONLINE:
+		syswide_cpu_online(cpu);
+		break;
+	case CPU_DOWN_PREPARE:
+		syswide_cpu_down_prep(cpu);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block syswide_cpu_nb = {
+	.notifier_call = syswide_cpu_notifier,
+};
+#else
+static enum cpuhp_state syswide_cpuhp_state;
+#endif
+
 /*
  * Global initialization function for system-wide mode
  * (invoked when the module is loaded in the kernel)
@@ -278,29 +630,56 @@ int syswide_monitoring_init(void)
 
 	int cpu;
 	cpu_syswide_t* cur;
+	int ret;
 
 	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_DISABLED;
 	syswide_ctl.pmc_samples_buffer=NULL;
+	syswide_ctl.nr_cgroups=0;
+	syswide_ctl.cgroup_owner=-1;
+	syswide_ctl.cgroup_slots=NULL;
+	syswide_ctl.cgroup_samples=NULL;
+	syswide_ctl.cgroup_leader=0;
+	cpumask_copy(&syswide_ctl.cpus,cpu_possible_mask);
+	syswide_ctl.cpus_owner=-1;
+	syswide_ctl.idle_policy=PMC_SYSWIDE_IDLE_SAMPLE;
+	spin_lock_init(&syswide_ctl.cgroup_lock);
 	spin_lock_init(&syswide_ctl.lock);
-
-	/* Initialize timer fields but do not activate it yet */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-	init_timer(&syswide_ctl.syswide_timer);
-	syswide_ctl.syswide_timer.expires=0; /* Any default value will do here */
-	syswide_ctl.syswide_timer.data=0;
-	syswide_ctl.syswide_timer.function=fire_syswide_timer;
+#ifdef TBS_HRTIMER
+	syswide_ctl.syswide_timer_period=NSEC_PER_SEC;
 #else
-	timer_setup(&syswide_ctl.syswide_timer, fire_syswide_timer, 0);
-#endif
 	syswide_ctl.syswide_timer_period=HZ;
+#endif
 	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
 
 	for_each_possible_cpu(cpu) {
 		cur=&per_cpu(cpu_syswide, cpu);
 		reset_cpu_syswide_data(cur,1);
+
+		/* Initialize timer fields but do not activate it yet */
+#ifdef TBS_HRTIMER
+		hrtimer_init(&cur->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
+		cur->timer.function=fire_syswide_timer;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+		init_timer(&cur->timer);
+		cur->timer.data=cpu;
+		cur->timer.function=fire_syswide_timer;
+#else
+		timer_setup(&cur->timer, fire_syswide_timer, TIMER_PINNED);
+#endif
 	}
 
-	return 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	register_cpu_notifier(&syswide_cpu_nb);
+	ret=0;
+#else
+	ret=cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "pmctrack/syswide:online",
+	                              syswide_cpu_online, syswide_cpu_down_prep);
+	if (ret<0)
+		return ret;
+	syswide_cpuhp_state=ret;
+	ret=0;
+#endif
+	return ret;
 }
 
 /*
@@ -312,10 +691,18 @@ void syswide_monitoring_cleanup(void)
 	int cpu;
 	cpu_syswide_t* cur;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	unregister_cpu_notifier(&syswide_cpu_nb);
+#else
+	cpuhp_remove_state_nocalls(syswide_cpuhp_state);
+#endif
+
 	for_each_possible_cpu(cpu) {
 		cur=&per_cpu(cpu_syswide, cpu);
 		free_cpu_syswide_data(cur);
 	}
+
+	syswide_monitoring_clear_cgroups();
 }
 
 /* Return nozero if syswide_monitoring was actually disabled */
@@ -330,8 +717,12 @@ int syswide_monitoring_enabled(void)
  */
 int syswide_monitoring_switch_in(int cpu)
 {
-	/* Do nothing on switch in for now */
-	return 0;
+	/*
+	 * PMCs are left to per-thread modes on CPUs where syswide
+	 * monitoring does not use them (e.g., CPUs not selected with
+	 * "cpus"), consistently with syswide_monitoring_switch_out()
+	 */
+	return !per_cpu(cpu_syswide, cpu).cur_config;
 }
 
 /*
@@ -373,10 +764,20 @@ static void syswide_monitoring_start_cpu(void* dummy)
 	}
 
 	cur->ref_time=ktime_get();
+	cur->last_refresh=local_clock();
+	cur->busy=1;
 
 	/* Tell the monitoring module to start syswide monitoring */
 	if (cur->virt_counter_mask)
 		mm_on_syswide_start_monitor(cpu, cur->virt_counter_mask);
+
+	/* Arm the sampling timer of this CPU */
+#ifdef TBS_HRTIMER
+	hrtimer_start(&cur->timer,ns_to_ktime(syswide_ctl.syswide_timer_period),HRTIMER_MODE_REL_PINNED_SOFT);
+#else
+	cur->timer.expires=jiffies+syswide_ctl.syswide_timer_period;
+	add_timer_on(&cur->timer,cpu);
+#endif
 }
 
 /* Stop syswide monitoring on this cpu */
@@ -395,6 +796,202 @@ static void syswide_monitoring_stop_cpu(void* dummy)
 		mm_on_syswide_stop_monitor(cpu, cur->virt_counter_mask);
 }
 
+/*
+ * Forget about the monitored cgroups
+ * (syswide_cgroup_mutex must be held)
+ */
+static void __release_cgroups(void)
+{
+#ifdef SYSWIDE_CGROUPS
+	int i;
+
+	for (i=0; i<syswide_ctl.nr_cgroups; i++) {
+		hash_del(&syswide_cgroups[i].links);
+		cgroup_put(syswide_cgroups[i].cgrp);
+		syswide_cgroups[i].cgrp=NULL;
+	}
+#endif
+	syswide_ctl.nr_cgroups=0;
+	syswide_ctl.cgroup_owner=-1;
+}
+
+/* Select a cgroup to be monitored in the next system-wide session */
+int syswide_monitoring_add_cgroup(const char* path)
+{
+#ifdef SYSWIDE_CGROUPS
+	struct cgroup* cgrp;
+	syswide_cgroup_t* entry;
+	int retval=0;
+	int i;
+
+	mutex_lock(&syswide_cgroup_mutex);
+
+	if (syswide_ctl.syswide_monitor!=SYSWIDE_MONITORING_DISABLED) {
+		retval=-EBUSY;
+		goto out_unlock;
+	}
+
+	/* Left behind by a process that did not start a session */
+	if (syswide_ctl.cgroup_owner!=current->pid)
+		__release_cgroups();
+
+	if (syswide_ctl.nr_cgroups==SYSWIDE_MAX_CGROUPS) {
+		retval=-ENOSPC;
+		goto out_unlock;
+	}
+
+	cgrp=cgroup_get_from_path(path);
+
+	if (IS_ERR(cgrp)) {
+		retval=PTR_ERR(cgrp);
+		goto out_unlock;
+	}
+
+	/* Indexes must match the selection order */
+	for (i=0; i<syswide_ctl.nr_cgroups; i++) {
+		if (syswide_cgroups[i].cgrp==cgrp) {
+			cgroup_put(cgrp);
+			retval=-EEXIST;
+			goto out_unlock;
+		}
+	}
+
+	entry=&syswide_cgroups[syswide_ctl.nr_cgroups];
+	entry->cgrp=cgrp;
+	entry->idx=syswide_ctl.nr_cgroups++;
+	hash_add(syswide_cgroup_table,&entry->links,(unsigned long)cgrp);
+	syswide_ctl.cgroup_owner=current->pid;
+out_unlock:
+	mutex_unlock(&syswide_cgroup_mutex);
+	return retval;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/* Clear the set of monitored cgroups */
+void syswide_monitoring_clear_cgroups(void)
+{
+	mutex_lock(&syswide_cgroup_mutex);
+	if (syswide_ctl.syswide_monitor==SYSWIDE_MONITORING_DISABLED)
+		__release_cgroups();
+	mutex_unlock(&syswide_cgroup_mutex);
+}
+
+/* Select the CPUs to be monitored in the next system-wide session */
+int syswide_monitoring_set_cpus(const char* list)
+{
+	int retval=0;
+
+	mutex_lock(&syswide_cgroup_mutex);
+
+	if (syswide_ctl.syswide_monitor!=SYSWIDE_MONITORING_DISABLED) {
+		retval=-EBUSY;
+		goto out_unlock;
+	}
+
+	/* The mask is not used while syswide monitoring is disabled */
+	if ((retval=cpulist_parse(list,&syswide_ctl.cpus)))
+		goto out_unlock;
+
+	if (!cpumask_intersects(&syswide_ctl.cpus,cpu_online_mask)) {
+		retval=-EINVAL;
+		goto out_unlock;
+	}
+
+	syswide_ctl.cpus_owner=current->pid;
+out_unlock:
+	if (retval)
+		syswide_ctl.cpus_owner=-1;
+	mutex_unlock(&syswide_cgroup_mutex);
+	return retval;
+}
+
+/*
+ * Allocate the per-CPU slots and the per-cgroup samples
+ * for the cgroup-scoped mode (syswide_cgroup_mutex must be held)
+ */
+static int alloc_cgroup_data(cgroup_slot_t** slots, pmc_sample_t** samples)
+{
+	unsigned int nr_cgroups=syswide_ctl.nr_cgroups;
+	int coretype,i;
+	pmc_sample_t* sample;
+
+	*slots=vzalloc(sizeof(cgroup_slot_t)*nr_cgroups*nr_cpu_ids);
+	*samples=vzalloc(sizeof(pmc_sample_t)*nr_cgroups*AMP_MAX_CORETYPES);
+
+	if (!*slots || !*samples) {
+		vfree(*slots);
+		vfree(*samples);
+		return -ENOMEM;
+	}
+
+	for (coretype=0; coretype<AMP_MAX_CORETYPES; coretype++) {
+		for (i=0; i<nr_cgroups; i++) {
+			sample=&(*samples)[coretype*nr_cgroups+i];
+			sample->type=PMC_TICK_SAMPLE;
+			sample->coretype=coretype;
+			sample->pid=i; /* In cgroup-scoped mode -> this field stores the cgroup index */
+			sample->cpu=-1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate a buffer made up of per-CPU rings to replace the monitor's,
+ * so that CPUs need not take the buffer's lock to deliver samples.
+ * Altogether, the rings of the monitored CPUs are as large as the
+ * buffer requested by the monitor. *sbuf is left NULL if the monitor's
+ * buffer must be left as is (e.g., a sample ring is mapped).
+ */
+static int alloc_percpu_samples_buffer(pmon_prof_t* prof, pmc_samples_buffer_t** sbuf)
+{
+	unsigned int ring_size;
+	unsigned int min_size;
+
+	*sbuf=NULL;
+
+	if (!prof->pmc_samples_buffer || prof->pmc_samples_buffer->cpu_rings || prof->pmc_mmap_ring)
+		return 0;
+
+	ring_size=prof->kernel_buffer_size/cpumask_weight(&syswide_ctl.cpus);
+
+	/* The wakeup watermark applies to each ring */
+	min_size=2*prof->wakeup_samples*(sizeof(pmc_ring_record_t)+sizeof(pmc_sample_t));
+	if (ring_size<min_size)
+		ring_size=min_size;
+
+	*sbuf=allocate_pmc_samples_buffer(ring_size,prof->samples_buffer_flags|PMC_BUF_PERCPU);
+
+	if (!*sbuf)
+		return -ENOMEM;
+
+	set_wakeup_pmc_samples_buffer(*sbuf,prof->wakeup_samples,prof->wakeup_bytes,prof->wakeup_latency_ms);
+	return 0;
+}
+
+/*
+ * Replace the monitor's buffer with the one allocated by
+ * alloc_percpu_samples_buffer(). Returns the old buffer,
+ * whose reference must be dropped by the caller.
+ */
+static pmc_samples_buffer_t* install_percpu_samples_buffer(pmon_prof_t* prof, pmc_samples_buffer_t* sbuf)
+{
+	pmc_samples_buffer_t* old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&prof->lock,flags);
+	old=prof->pmc_samples_buffer;
+	prof->pmc_samples_buffer=sbuf;
+	/* Samples cannot be written into a mapped ring from now on */
+	prof->samples_buffer_flags|=PMC_BUF_PERCPU;
+	spin_unlock_irqrestore(&prof->lock,flags);
+
+	return old;
+}
+
 /* Start syswide_monitoring */
 int syswide_monitoring_start(void)
 {
@@ -406,10 +1003,48 @@ int syswide_monitoring_start(void)
 	pmon_prof_t* prof = get_prof(p);
 	cpu_syswide_t* cur;
 	core_experiment_t* experiment=NULL;
+	cgroup_slot_t* cgroup_slots=NULL;
+	pmc_sample_t* cgroup_samples=NULL;
+	pmc_samples_buffer_t* percpu_sbuf=NULL;
+	pmc_samples_buffer_t* old_sbuf=NULL;
 
 	if (!prof)
 		return -EPERM;
 
+	/* Prevent changes in the set of cgroups until the session is over */
+	mutex_lock(&syswide_cgroup_mutex);
+
+	if (syswide_ctl.nr_cgroups && syswide_ctl.syswide_monitor==SYSWIDE_MONITORING_DISABLED) {
+		if (syswide_ctl.cgroup_owner!=p->pid) {
+			__release_cgroups();
+		} else if (prof->virt_counter_mask) {
+			printk(KERN_INFO "Virtual counters can't be used in cgroup-scoped mode\n");
+			retval=-EINVAL;
+			goto exit_unlock_mutex;
+		} else if ((retval=alloc_cgroup_data(&cgroup_slots,&cgroup_samples))) {
+			goto exit_unlock_mutex;
+		}
+	}
+
+	/* Monitor all CPUs unless the monitor selected some of them */
+	if (syswide_ctl.cpus_owner!=p->pid)
+		cpumask_copy(&syswide_ctl.cpus,cpu_possible_mask);
+
+	if (!cpumask_intersects(&syswide_ctl.cpus,cpu_online_mask)) {
+		retval=-EINVAL;
+		goto exit_free_cgroups;
+	}
+
+	/*
+	 * Per-cgroup samples are delivered by a single CPU. The buffer
+	 * is allocated here, as the lock below must not be held to do so,
+	 * but it replaces the monitor's only once the session is set up.
+	 */
+	if (!cgroup_samples && (retval=alloc_percpu_samples_buffer(prof,&percpu_sbuf)))
+		goto exit_free_cgroups;
+
+	/* No CPU can go offline or come online until timers are armed */
+	get_online_cpus();
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
 	/* Make sure system wide is not already in use */
@@ -420,7 +1055,12 @@ int syswide_monitoring_start(void)
 	}
 
 	/* Inherit fields from monitor process */
+#ifdef TBS_HRTIMER
+	syswide_ctl.syswide_timer_period=tbs_sampling_period_ns(prof);
+#else
 	syswide_ctl.syswide_timer_period=prof->pmc_jiffies_interval;
+#endif
+	syswide_ctl.idle_policy=prof->syswide_idle_policy;
 	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_STARTING;
 	smp_mb();
 
@@ -437,6 +1077,12 @@ int syswide_monitoring_start(void)
 		coretype=get_coretype_cpu(cpu);
 		cur=&per_cpu(cpu_syswide, cpu);
 
+		/* Leave the PMCs of this CPU to the per-thread modes */
+		if (!cpumask_test_cpu(cpu,&syswide_ctl.cpus)) {
+			reset_cpu_syswide_data(cur,0);
+			continue;
+		}
+
 		/* Make sure there is a configuration for such a core type */
 		if (!&prof->pmcs_multiplex_cfg[coretype]) {
 			printk(KERN_INFO "No experiments were defined for this core type\n");
@@ -458,8 +1104,18 @@ int syswide_monitoring_start(void)
 			printk(KERN_INFO "Can't setup per-CPU syswide data\n");
 			goto exit_unlock;
 		}
+
+		if (cgroup_slots)
+			cur->cgroup_slots=&cgroup_slots[cpu*syswide_ctl.nr_cgroups];
 	}
 
+	syswide_ctl.cgroup_slots=cgroup_slots;
+	syswide_ctl.cgroup_samples=cgroup_samples;
+	syswide_ctl.cgroup_leader=cpumask_first_and(&syswide_ctl.cpus,cpu_online_mask);
+
+	if (percpu_sbuf)
+		old_sbuf=install_percpu_samples_buffer(prof,percpu_sbuf);
+
 	/* Share buffer ... */
 	syswide_ctl.pmc_samples_buffer=prof->pmc_samples_buffer;
 	/* Increase ref count */
@@ -467,20 +1123,38 @@ int syswide_monitoring_start(void)
 
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
-	/* Initialize counters on each CPU with interrupts enabled */
-	on_each_cpu(syswide_monitoring_start_cpu, NULL, 1);
+	if (old_sbuf)
+		put_pmc_samples_buffer(old_sbuf);
 
-	/* Enable system-wide monitoring and start up timer */
+	/* Initialize counters and arm the timer on each monitored CPU */
+	on_each_cpu_mask(&syswide_ctl.cpus, syswide_monitoring_start_cpu, NULL, 1);
+
+	/* Enable system-wide monitoring (timers start sampling from now on) */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
-	syswide_ctl.syswide_monitor=p->pid;
-	syswide_ctl.syswide_timer.expires=jiffies+syswide_ctl.syswide_timer_period;
 	syswide_ctl.pause_syswide_monitor=0; /* Enabled by default */
-	add_timer(&syswide_ctl.syswide_timer);
+	syswide_ctl.syswide_monitor=p->pid;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	mutex_unlock(&syswide_cgroup_mutex);
 
 	return 0;
 exit_unlock:
+	/* The per-CPU data must not point to the cgroup slots anymore */
+	if (cgroup_slots) {
+		for_each_possible_cpu(cpu)
+			per_cpu(cpu_syswide, cpu).cgroup_slots=NULL;
+		syswide_ctl.cgroup_slots=NULL;
+		syswide_ctl.cgroup_samples=NULL;
+	}
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
+	put_online_cpus();
+	if (percpu_sbuf)
+		put_pmc_samples_buffer(percpu_sbuf);
+exit_free_cgroups:
+	vfree(cgroup_slots);
+	vfree(cgroup_samples);
+exit_unlock_mutex:
+	mutex_unlock(&syswide_cgroup_mutex);
 	return retval; /* TODO */
 }
 
@@ -490,6 +1164,9 @@ int syswide_monitoring_stop(void)
 	int retval=0;
 	unsigned long flags=0;
 	struct task_struct* p=current;
+	int cpu;
+	cgroup_slot_t* cgroup_slots;
+	pmc_sample_t* cgroup_samples;
 
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
 
@@ -500,14 +1177,24 @@ int syswide_monitoring_stop(void)
 	}
 
 	/* Clean up the various fields */
+#ifdef TBS_HRTIMER
+	syswide_ctl.syswide_timer_period=NSEC_PER_SEC;
+#else
 	syswide_ctl.syswide_timer_period=HZ;
+#endif
 	syswide_ctl.syswide_monitor=SYSWIDE_MONITORING_STOPPING;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
-	/* Cancel timer (Blocking function)*/
-	del_timer_sync(&syswide_ctl.syswide_timer);
+	/* Wait for CPU hotplug callbacks that may be arming a timer */
+	get_online_cpus();
+
+	/* Cancel per-CPU timers (Blocking function)*/
+	for_each_possible_cpu(cpu)
+		cancel_syswide_timer(&per_cpu(cpu_syswide, cpu));
+
 	/* Stop counters across CPUs */
 	on_each_cpu(syswide_monitoring_stop_cpu, NULL, 1);
+	put_online_cpus();
 
 	/* Update global status */
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
@@ -516,8 +1203,29 @@ int syswide_monitoring_stop(void)
 	/* Decrease ref count for the shared buffer and forget it ever existed */
 	put_pmc_samples_buffer(syswide_ctl.pmc_samples_buffer);
 	syswide_ctl.pmc_samples_buffer=NULL;
+
+	/*
+	 * Context switches that were using the cgroup slots
+	 * completed before the IPIs above were handled
+	 */
+	for_each_possible_cpu(cpu)
+		per_cpu(cpu_syswide, cpu).cgroup_slots=NULL;
+	cgroup_slots=syswide_ctl.cgroup_slots;
+	cgroup_samples=syswide_ctl.cgroup_samples;
+	syswide_ctl.cgroup_slots=NULL;
+	syswide_ctl.cgroup_samples=NULL;
 	spin_unlock_irqrestore(&syswide_ctl.lock,flags);
 
+	vfree(cgroup_slots);
+	vfree(cgroup_samples);
+
+	/* The cgroups and CPUs must be selected again for the next session */
+	syswide_monitoring_clear_cgroups();
+	mutex_lock(&syswide_cgroup_mutex);
+	if (syswide_ctl.cpus_owner==p->pid)
+		syswide_ctl.cpus_owner=-1;
+	mutex_unlock(&syswide_cgroup_mutex);
+
 	return 0;
 exit_unlock_stop:
 	spin_lock_irqsave(&syswide_ctl.lock,flags);
@@ -15,6 +15,8 @@
 #include <pmc/monitoring_mod.h>
 #include <pmc/vexpress_sensors.h>
 
+extern monitoring_module_t vexpress_sensors_mm;
+
 #define ARM_VERSATILE_SENSORS_STR "ARM vexpress sensors"
 
 
@@ -138,7 +140,7 @@ static int vexpress_sensors_on_fork(unsigned long clone_flags, pmon_prof_t* prof
 	if (prof->monitoring_mod_priv_data!=NULL)
 		return 0;
 
-	data= kmalloc(sizeof (vexpress_sensors_thread_data_t), GFP_KERNEL);
+	data= mm_alloc_thread_data(&vexpress_sensors_mm);
 	if (data == NULL)
 		return -ENOMEM;
 
@@ -206,7 +208,7 @@ static int vexpress_sensors_on_new_sample(pmon_prof_t* prof,int cpu,pmc_sample_t
 static void vexpress_sensors_on_free_task(pmon_prof_t* prof)
 {
 	if (prof->monitoring_mod_priv_data)
-		kfree(prof->monitoring_mod_priv_data);
+		mm_free_thread_data(&vexpress_sensors_mm,prof->monitoring_mod_priv_data);
 }
 
 /* on switch_in callback */
@@ -350,6 +352,7 @@ monitoring_module_t vexpress_sensors_mm = {
 #ifdef CONFIG_PMC_ARM64
 	.on_syswide_start_monitor=vexpress_sensors_on_syswide_start_monitor,
 	.on_syswide_refresh_monitor=vexpress_sensors_on_syswide_refresh_monitor,
-	.on_syswide_dump_virtual_counters=vexpress_sensors_on_syswide_dump_virtual_counters
+	.on_syswide_dump_virtual_counters=vexpress_sensors_on_syswide_dump_virtual_counters,
 #endif
+	.thread_data_size=sizeof(vexpress_sensors_thread_data_t)
 };
@@ -0,0 +1,158 @@
+/*
+ * ebs-sample-bench.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * Microbenchmark that estimates the cost of handling an EBS sample.
+ * A compute-bound loop is run twice: without monitoring and with an EBS
+ * configuration that raises an interrupt every <period> instructions.
+ * The difference in running time divided by the number of samples
+ * approximates the cost of gathering a sample in the kernel, including
+ * the per-sample work of the active monitoring module (e.g., computing
+ * performance metrics).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pmctrack.h>
+
+#define DEFAULT_ITERATIONS 250000000
+#define DEFAULT_PERIOD 100000
+#define MAX_SAMPLES 20000
+
+static volatile unsigned long sink;
+
+static void work(long nr_iterations)
+{
+	long i;
+	unsigned long acum=0;
+
+	for (i=0; i<nr_iterations; i++)
+		acum+=i^(acum>>3);
+
+	sink=acum;
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1000000000.0+(end->tv_nsec-start->tv_nsec);
+}
+
+static void usage(const char* program_name)
+{
+	fprintf(stderr,"Usage: %s [ -n <iterations> ] [ -p <period> ]\n",program_name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	long nr_iterations=DEFAULT_ITERATIONS;
+	int period=DEFAULT_PERIOD;
+	struct timespec start,end;
+	double baseline_ns,monitored_ns;
+	pmctrack_desc_t* desc=NULL;
+	pmc_sample_t* samples;
+	int nr_samples=0;
+	int nr_ebs_samples=0;
+	int lost=0;
+	int i;
+	char cfg[64];
+	const char* strcfg[]= {cfg,NULL};
+
+	while ((opt=getopt(argc,argv,"n:p:"))!=-1) {
+		switch (opt) {
+		case 'n':
+			nr_iterations=atol(optarg);
+			if (nr_iterations<=0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			period=atoi(optarg);
+			if (period<=0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Instructions retired (EBS) and cycles */
+#if defined(__arm__) || defined(__aarch64__)
+	sprintf(cfg,"pmc1=0x08,pmc2=0x11,ebs1=%d",period);
+#elif defined(AMD)
+	sprintf(cfg,"pmc0=0xc0,pmc1=0x76,ebs0=%d",period);
+#else
+	sprintf(cfg,"pmc0,pmc1,ebs0=%d",period);
+#endif
+
+	/* Baseline */
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	work(nr_iterations);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	baseline_ns=elapsed_ns(&start,&end);
+
+	/* Initialize the thread descriptor */
+	if ((desc=pmctrack_init(MAX_SAMPLES))==NULL)
+		exit(1);
+
+	/* Configure counters */
+	if (pmctrack_config_counters(desc,strcfg,NULL,0))
+		exit(1);
+
+	/* Start counting */
+	if (pmctrack_start_counters(desc))
+		exit(1);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	work(nr_iterations);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	monitored_ns=elapsed_ns(&start,&end);
+
+	/* Stop counting */
+	if (pmctrack_stop_counters(desc))
+		exit(1);
+
+	samples=pmctrack_get_samples(desc,&nr_samples);
+
+	for (i=0; i<nr_samples; i++) {
+		if (samples[i].type==PMC_EBS_SAMPLE)
+			nr_ebs_samples++;
+		else if (samples[i].type==PMC_LOST_SAMPLE)
+			lost=1;
+	}
+
+	printf("[baseline] %.3f ms\n",baseline_ns/1000000.0);
+	printf("[monitored] %.3f ms, %d EBS samples\n",monitored_ns/1000000.0,nr_ebs_samples);
+
+	if (lost)
+		printf("Some samples were lost: use a longer period (-p) or fewer iterations (-n)\n");
+	else if (nr_ebs_samples>0)
+		printf("%.1f ns/sample\n",(monitored_ns-baseline_ns)/nr_ebs_samples);
+
+	/* Free up memory */
+	pmctrack_destroy(desc);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+# Cost of handling an EBS sample, including the per-sample work of the
+# active monitoring module (e.g., the evaluation of performance metrics
+# by the IPC sampling module). Run it with the kernel module built before
+# and after a change to compare.
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./ebs-sample-bench
@@ -0,0 +1,149 @@
+/*
+ * fork-exit-bench.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * Microbenchmark that measures the cost of thread and process creation and
+ * teardown. When invoked with -m, the PMCs are configured and started before
+ * spawning the children, so that each of them inherits the monitoring state
+ * (and the kernel module allocates and frees per-thread data on the way).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pmctrack.h>
+
+#define DEFAULT_ITERATIONS 20000
+
+static void* thread_body(void* arg)
+{
+	return arg;
+}
+
+static double elapsed_us(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1000000.0+(end->tv_nsec-start->tv_nsec)/1000.0;
+}
+
+static void usage(const char* program_name)
+{
+	fprintf(stderr,"Usage: %s [ -m ] [ -n <iterations> ]\n",program_name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i=0;
+	int opt;
+	int monitor=0;
+	int nr_iterations=DEFAULT_ITERATIONS;
+	struct timespec start,end;
+	pthread_t thread;
+	pid_t pid;
+	pmctrack_desc_t* desc=NULL;
+	const char* strcfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76"
+#else
+		"pmc0,pmc1"
+#endif
+		,NULL
+	};
+
+	while ((opt=getopt(argc,argv,"mn:"))!=-1) {
+		switch (opt) {
+		case 'm':
+			monitor=1;
+			break;
+		case 'n':
+			nr_iterations=atoi(optarg);
+			if (nr_iterations<=0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (monitor) {
+		/* Initialize the thread descriptor */
+		if ((desc=pmctrack_init(100))==NULL)
+			exit(1);
+
+		/* Configure counters */
+		if (pmctrack_config_counters(desc,strcfg,NULL,0))
+			exit(1);
+
+		/* Start counting (children inherit the configuration) */
+		if (pmctrack_start_counters(desc))
+			exit(1);
+	}
+
+	/* Thread creation/teardown */
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		if (pthread_create(&thread,NULL,thread_body,NULL)) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_join(thread,NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	printf("[%s] pthread_create+join: %.3f us/iteration\n",
+	       monitor?"monitored":"baseline",elapsed_us(&start,&end)/nr_iterations);
+
+	/* Process creation/teardown */
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (i=0; i<nr_iterations; i++) {
+		pid=fork();
+		if (pid<0) {
+			perror("fork");
+			exit(1);
+		} else if (pid==0) {
+			_exit(0);
+		}
+		waitpid(pid,NULL,0);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	printf("[%s] fork+exit+wait: %.3f us/iteration\n",
+	       monitor?"monitored":"baseline",elapsed_us(&start,&end)/nr_iterations);
+
+	if (monitor) {
+		/* Stop counting */
+		if (pmctrack_stop_counters(desc))
+			exit(1);
+
+		/* Free up memory */
+		pmctrack_destroy(desc);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,4 @@
+#!/bin/bash
+# Baseline (no monitoring) vs. threads that inherit PMC monitoring
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./fork-exit-bench
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./fork-exit-bench -m
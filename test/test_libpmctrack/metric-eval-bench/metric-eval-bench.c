@@ -0,0 +1,386 @@
+/*
+ * metric-eval-bench.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * User-space microbenchmark for the evaluation of performance metrics,
+ * which the kernel module carries out for every sample. The metric engine
+ * of the module (hl_events.c) is linked in as is and compared against
+ * the metric-by-metric evaluator it replaced (compute_value() and
+ * get_operands(), reproduced below) over the same metric sets,
+ * including a set of MAX_METRICS_PER_SET metrics as large as a
+ * top-down breakdown. The program also checks that both evaluators
+ * agree on every value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pmc/hl_events.h>
+
+#define DEFAULT_ITERATIONS 2000000
+#define NR_SAMPLE_VECTORS 64
+
+/*
+ * HW events of the samples. Their values are made up, but they
+ * keep the proportions found in real workloads.
+ */
+enum {
+	ev_instr,
+	ev_cycles,
+	ev_uops_issued,
+	ev_uops_retired,
+	ev_fe_bubbles,
+	ev_recovery_cycles,
+	ev_llc_misses,
+	ev_llc_refs,
+	ev_br_misses,
+	ev_branches,
+	ev_mem_stalls,
+	NR_EVENTS
+};
+
+#define H(idx) {hw_event_arg,(idx)}
+#define M(idx) {metric_arg,(idx)}
+#define NO_ARG H(0)
+
+/* Definitions are in dependency order, as the old evaluator requires */
+static pmc_metric_t topdown_metrics[]= {
+	{"IPC",op_rate,H(ev_instr),H(ev_cycles),1000},
+	{"CPI",op_rate,H(ev_cycles),H(ev_instr),1000},
+	{"SLOTS",op_none,H(ev_cycles),NO_ARG,4},
+	{"FE_BOUND",op_rate,H(ev_fe_bubbles),M(2),1000},
+	{"RETIRING",op_rate,H(ev_uops_retired),M(2),1000},
+	{"RECOVERY_SLOTS",op_none,H(ev_recovery_cycles),NO_ARG,4},
+	{"WASTED_SLOTS",op_sum,H(ev_uops_issued),M(5),0},
+	{"BAD_SPEC",op_rate,M(6),M(2),1000},
+	{"FE_RET",op_sum,M(3),M(4),0},
+	{"NON_BE",op_sum,M(8),M(7),0},
+	{"MEM_BOUND",op_rate,H(ev_mem_stalls),H(ev_cycles),1000},
+	{"MEM_SLOTS",op_rate,H(ev_mem_stalls),M(2),1000},
+	{"LLC_MPKI",op_rate,H(ev_llc_misses),H(ev_instr),1000000},
+	{"LLC_MISS_RATIO",op_rate,H(ev_llc_misses),H(ev_llc_refs),1000},
+	{"LLC_RPKI",op_rate,H(ev_llc_refs),H(ev_instr),1000000},
+	{"BR_MPKI",op_rate,H(ev_br_misses),H(ev_instr),1000000},
+	{"BR_MISS_RATIO",op_rate,H(ev_br_misses),H(ev_branches),1000},
+	{"BR_PKI",op_rate,H(ev_branches),H(ev_instr),1000},
+	{"UOPS_PER_INSTR",op_rate,H(ev_uops_retired),H(ev_instr),1000},
+	{"ISSUED_PER_CYCLE",op_rate,H(ev_uops_issued),H(ev_cycles),1000},
+	{"RETIRED_PER_CYCLE",op_rate,H(ev_uops_retired),H(ev_cycles),1000},
+	{"LLC_MISS_PER_KCYCLE",op_rate2,H(ev_llc_misses),H(ev_cycles),1000},
+	{"BR_MISS_PER_KCYCLE",op_rate2,H(ev_br_misses),H(ev_cycles),1000},
+	{"FE_BUBBLES_PER_INSTR",op_division,H(ev_fe_bubbles),H(ev_instr),0},
+	{"STALLS_PER_MISS",op_division,H(ev_mem_stalls),H(ev_llc_misses),0},
+	{"TOTAL_MISSES",op_sum,H(ev_llc_misses),H(ev_br_misses),0},
+	{"MISS_PKI",op_rate,M(25),H(ev_instr),1000000},
+	{"IPC_X_MPKI",op_multiplication,M(0),M(12),0},
+	{"CYCLES",op_none,H(ev_cycles),NO_ARG,1},
+	{"INSTR",op_none,H(ev_instr),NO_ARG,1},
+	{"IPC_CHECK",op_rate,M(29),M(28),1000},
+	{"LLC_BYTES",op_none,H(ev_llc_misses),NO_ARG,64},
+};
+
+/* Metric sets to compare (prefixes of the table above) */
+static struct {
+	const char* name;
+	unsigned int nr_metrics;
+} metric_sets[]= {
+	{"ipc",1},
+	{"ipc+cpi+topdown-l1",8},
+	{"topdown",MAX_METRICS_PER_SET},
+};
+
+/*** Metric-by-metric evaluator of the kernel module before metric programs ***/
+
+/* Metric along with its last computed value */
+typedef struct {
+	pmc_metric_t def;
+	uint64_t count;
+} old_metric_t;
+
+typedef struct {
+	arg_type_t type;
+	uint64_t value;
+} operand_t;
+
+static void get_operands(old_metric_t* metric,
+                         uint64_t* hw_events,
+                         old_metric_t* metric_vector,
+                         operand_t* operands,
+                         unsigned int num_ops
+                        )
+{
+	unsigned int i, ref = 0;
+	pmc_arg_t* argument = &metric->def.arg1;
+
+	for(i=0; i<num_ops; i++) {
+		ref=argument->index;
+		switch(argument->type) {
+		case hw_event_arg:
+			operands[i].type = hw_event_arg;
+			operands[i].value = hw_events[ref];
+			break;
+		case metric_arg:
+			operands[i].type = metric_arg;
+			operands[i].value = metric_vector[ref].count;
+			break;
+		default:
+			operands[i].value = 0;
+			break;
+		}
+		argument=&metric->def.arg2;
+	}
+
+}
+
+/*
+ * As it was, except for op_substract, which always yielded zero,
+ * and op_none, which checked the second operand without retrieving it.
+ */
+static void compute_value(old_metric_t* metric, uint64_t* hw_events, old_metric_t* metric_vector)
+{
+	operand_t operands[2];
+	uint64_t big_buffer = 0;
+	uint64_t aux;
+
+	switch(metric->def.mode) {
+	case op_division:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		if(operands[1].value != 0) {
+			metric->count = operands[0].value;
+			pmc_do_div(metric->count,operands[1].value);
+		} else {
+			/*Division by zero*/
+			metric->count = 0;
+		}
+		break;
+	case op_multiplication:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		metric->count = operands[0].value*operands[1].value;
+		break;
+	case op_sum:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		metric->count = operands[0].value+operands[1].value;
+		break;
+	case op_substract:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		if(operands[0].value >= operands[1].value )
+			metric->count = operands[0].value-operands[1].value;
+		else
+			metric->count=0;
+		break;
+	case op_rate:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		if(operands[1].value != 0) {
+			big_buffer = operands[0].value ;
+			big_buffer *= metric->def.scale_factor;
+			pmc_do_div(big_buffer,operands[1].value); /* big_buffer/=operands[1].value; */
+			metric->count = big_buffer;
+		} else {
+			/*Division by zero*/
+			metric->count=0;
+		}
+		break;
+	case op_rate2:
+		get_operands(metric, hw_events, metric_vector, operands, 2);
+		if(operands[1].value != 0) {
+			aux=operands[1].value;
+			pmc_do_div(aux,metric->def.scale_factor);
+			if (aux == 0) {
+				metric->count=0;
+			} else {
+				big_buffer=operands[0].value;
+				pmc_do_div(big_buffer,aux);
+				metric->count = big_buffer;
+			}
+		} else {
+			/*Division by zero*/
+			metric->count=0;
+		}
+		break;
+	case op_none:
+		get_operands(metric, hw_events, metric_vector, operands, 1);
+		big_buffer = operands[0].value ;
+		big_buffer *= metric->def.scale_factor;
+		metric->count = big_buffer;
+		break;
+	case op_virtual: /* In this case the user should set up the metric values later */
+	default:
+		metric->count = 0;
+		break;
+	}
+}
+
+/* Kept out of line, as it was in the kernel module */
+static void __attribute__((noinline)) old_compute_performance_metrics(uint64_t* hw_events,
+        old_metric_t* metrics, unsigned int nr_metrics)
+{
+	int i=0;
+
+	for (i=0; i<nr_metrics; i++)
+		compute_value(&metrics[i],hw_events,metrics);
+}
+
+/******************************************************************************/
+
+static uint64_t sample_vectors[NR_SAMPLE_VECTORS][MAX_PERFORMANCE_COUNTERS];
+static volatile uint64_t sink;
+
+static void init_sample_vectors(void)
+{
+	int i;
+	uint64_t instr;
+
+	srand(1);
+
+	for (i=0; i<NR_SAMPLE_VECTORS; i++) {
+		uint64_t* ev=sample_vectors[i];
+
+		instr=100000+rand()%1000000;
+		ev[ev_instr]=instr;
+		ev[ev_cycles]=instr/4+rand()%(2*instr);
+		ev[ev_uops_issued]=instr+rand()%(instr/2);
+		ev[ev_uops_retired]=instr+rand()%(instr/4);
+		ev[ev_fe_bubbles]=rand()%ev[ev_cycles];
+		ev[ev_recovery_cycles]=rand()%(ev[ev_cycles]/8+1);
+		ev[ev_llc_refs]=rand()%(instr/20+1);
+		ev[ev_llc_misses]=ev[ev_llc_refs] ? rand()%ev[ev_llc_refs] : 0;
+		ev[ev_branches]=instr/8+rand()%(instr/8);
+		ev[ev_br_misses]=rand()%(ev[ev_branches]/20+1);
+		ev[ev_mem_stalls]=rand()%ev[ev_cycles];
+	}
+
+	/* Exercise the handling of divisions by zero */
+	memset(sample_vectors[NR_SAMPLE_VECTORS-1],0,sizeof(sample_vectors[0]));
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (end->tv_sec-start->tv_sec)*1000000000.0+(end->tv_nsec-start->tv_nsec);
+}
+
+/* Returns the number of values where both evaluators disagree */
+static int check_metric_set(metric_experiment_t* m_exp, old_metric_t* old_metrics,
+                            metric_values_t* values)
+{
+	int i,j;
+	int nr_errors=0;
+
+	for (i=0; i<NR_SAMPLE_VECTORS; i++) {
+		old_compute_performance_metrics(sample_vectors[i],old_metrics,m_exp->size);
+		compute_performance_metrics(sample_vectors[i],m_exp,values);
+
+		for (j=0; j<m_exp->size; j++) {
+			if (old_metrics[j].count!=get_metric_value(values,j)) {
+				fprintf(stderr,"Mismatch in %s (sample %d): %llu (old) vs %llu (new)\n",
+				        m_exp->metrics[j].id,i,
+				        (unsigned long long)old_metrics[j].count,
+				        (unsigned long long)get_metric_value(values,j));
+				nr_errors++;
+			}
+		}
+	}
+
+	return nr_errors;
+}
+
+static void usage(const char* program_name)
+{
+	fprintf(stderr,"Usage: %s [ -n <iterations> ]\n",program_name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	long nr_iterations=DEFAULT_ITERATIONS;
+	struct timespec start,end;
+	double old_ns,new_ns;
+	metric_experiment_t m_exp;
+	metric_values_t values;
+	old_metric_t old_metrics[MAX_METRICS_PER_SET];
+	int nr_errors=0;
+	long it;
+	int i,j;
+
+	while ((opt=getopt(argc,argv,"n:"))!=-1) {
+		switch (opt) {
+		case 'n':
+			nr_iterations=atol(optarg);
+			if (nr_iterations<=0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	init_sample_vectors();
+
+	printf("%-20s %8s %12s %12s %8s\n","SET","METRICS","OLD(ns)","NEW(ns)","SPEEDUP");
+
+	for (i=0; i<sizeof(metric_sets)/sizeof(metric_sets[0]); i++) {
+		init_metric_experiment_t(&m_exp,0);
+		init_metric_values_t(&values);
+
+		for (j=0; j<metric_sets[i].nr_metrics; j++) {
+			m_exp.metrics[j]=topdown_metrics[j];
+			old_metrics[j].def=topdown_metrics[j];
+			old_metrics[j].count=0;
+		}
+		m_exp.size=metric_sets[i].nr_metrics;
+
+		if (compile_metric_experiment_t(&m_exp)) {
+			fprintf(stderr,"Couldn't compile the %s metric set\n",metric_sets[i].name);
+			exit(1);
+		}
+
+		nr_errors+=check_metric_set(&m_exp,old_metrics,&values);
+
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for (it=0; it<nr_iterations; it++) {
+			old_compute_performance_metrics(sample_vectors[it%NR_SAMPLE_VECTORS],old_metrics,m_exp.size);
+			sink+=old_metrics[m_exp.size-1].count;
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		old_ns=elapsed_ns(&start,&end)/nr_iterations;
+
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for (it=0; it<nr_iterations; it++) {
+			compute_performance_metrics(sample_vectors[it%NR_SAMPLE_VECTORS],&m_exp,&values);
+			sink+=get_metric_value(&values,m_exp.size-1);
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		new_ns=elapsed_ns(&start,&end)/nr_iterations;
+
+		printf("%-20s %8u %12.1f %12.1f %7.2fx\n",metric_sets[i].name,m_exp.size,
+		       old_ns,new_ns,old_ns/new_ns);
+	}
+
+	if (nr_errors) {
+		fprintf(stderr,"Both evaluators disagree on %d values\n",nr_errors);
+		exit(1);
+	}
+
+	exit(EXIT_SUCCESS);
+}
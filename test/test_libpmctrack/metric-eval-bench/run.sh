@@ -0,0 +1,5 @@
+#!/bin/bash
+# Per-sample cost of evaluating performance metrics: metric-by-metric
+# evaluator the kernel module used to have vs. the compiled metric
+# programs of hl_events.c (no kernel module or PMUs needed)
+./metric-eval-bench
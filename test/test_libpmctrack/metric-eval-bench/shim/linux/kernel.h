@@ -0,0 +1,11 @@
+/* Minimal user-space replacement for <linux/kernel.h> */
+#ifndef SHIM_LINUX_KERNEL_H
+#define SHIM_LINUX_KERNEL_H
+#include <stdio.h>
+
+/* pmc_do_div() relies on it in 32-bit mode */
+#define do_div(n,base) ({ uint32_t __rem=(n)%(base); (n)=(n)/(base); __rem; })
+
+#define KERN_ALERT ""
+#define printk printf
+#endif
@@ -0,0 +1,5 @@
+/* Minimal user-space replacement for <linux/string.h> */
+#ifndef SHIM_LINUX_STRING_H
+#define SHIM_LINUX_STRING_H
+#include <string.h>
+#endif
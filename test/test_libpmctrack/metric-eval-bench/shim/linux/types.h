@@ -0,0 +1,9 @@
+/*
+ * Minimal user-space replacement for <linux/types.h>, so that
+ * the kernel's metric engine (hl_events.c) can be built in user space.
+ */
+#ifndef SHIM_LINUX_TYPES_H
+#define SHIM_LINUX_TYPES_H
+#include <stdint.h>
+#include <sys/types.h>
+#endif
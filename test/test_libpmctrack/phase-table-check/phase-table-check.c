@@ -0,0 +1,247 @@
+/*
+ * phase-table-check.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2016 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * User-space check of the indexed phase tables of the kernel module
+ * (phase_table.c, linked in as is). Random sequences of insertions
+ * (with evictions once the table is full), lookups, promotions and
+ * in-place updates followed by rekey_table_entry() are applied to
+ * tables of various sizes, including tables with more than 64 entries.
+ * Every lookup must return a phase at the same minimum distance as
+ * a linear scan of all the phases stored in the table. Ties may be
+ * resolved differently, so only the distance is checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/types.h>
+#include <pmc/data_str/phase_table.h>
+
+#define NR_DIMS			4
+#define MAX_COMPONENT	256
+#define DEFAULT_SEEDS	10
+
+typedef struct {
+	int v[NR_DIMS];
+} phase_t;
+
+/* Table geometries under test */
+static const struct {
+	unsigned int max_phases;
+	unsigned int bucket_width;
+} table_configs[]= {
+	{16,4},
+	{64,16},
+	{65,16},
+	{200,8},
+	{1000,32},
+	{1000,1},	/* Most phases end up in the last bucket */
+};
+
+/* Manhattan distance (priv_data counts the calls) */
+static int compare_phases(void* a, void* b, void* priv_data)
+{
+	phase_t* pa=a;
+	phase_t* pb=b;
+	int i,dist=0;
+
+	(*(unsigned long*)priv_data)++;
+
+	for (i=0; i<NR_DIMS; i++)
+		dist+=abs(pa->v[i]-pb->v[i]);
+
+	return dist;
+}
+
+/* Sum of the components: a lower bound of the Manhattan distance */
+static unsigned int phase_key(void* a)
+{
+	phase_t* pa=a;
+	unsigned int i,key=0;
+
+	for (i=0; i<NR_DIMS; i++)
+		key+=pa->v[i];
+
+	return key;
+}
+
+static void random_phase(phase_t* phase)
+{
+	int i;
+
+	for (i=0; i<NR_DIMS; i++)
+		phase->v[i]=rand()%MAX_COMPONENT;
+}
+
+/* Minimum distance between key and the first nr_phases entries of the pool */
+static int linear_scan(phase_t* pool, int nr_phases, phase_t* key)
+{
+	unsigned long dummy=0;
+	int i,sim,sim_min=-1;
+
+	for (i=0; i<nr_phases; i++) {
+		sim=compare_phases(&pool[i],key,&dummy);
+		if (sim_min==-1 || sim<sim_min)
+			sim_min=sim;
+	}
+
+	return sim_min;
+}
+
+/*
+ * Apply a random sequence of operations to an indexed table. Returns
+ * the number of lookups that disagree with the linear scan.
+ */
+static int check_table(unsigned int max_phases, unsigned int bucket_width,
+                       unsigned long* nr_lookups, unsigned long* nr_compares)
+{
+	phase_table_t* table;
+	phase_t* pool=NULL;	/* Table entries (allocated in order while not full) */
+	phase_t phase;
+	phase_t* found;
+	int nr_phases=0;
+	int nr_errors=0;
+	int sim,index,expected;
+	unsigned long op;
+	int i;
+
+	table=create_indexed_phase_table(max_phases,sizeof(phase_t),compare_phases,phase_key,bucket_width);
+
+	if (!table) {
+		fprintf(stderr,"Couldn't create a table of %u phases\n",max_phases);
+		exit(1);
+	}
+
+	for (op=0; op<20*max_phases; op++) {
+		switch (rand()%5) {
+		case 0:
+		case 1:
+			random_phase(&phase);
+			found=insert_phase_in_table(table,&phase);
+			/* The first entry is the beginning of the table's pool */
+			if (!pool)
+				pool=found;
+			if (nr_phases<max_phases)
+				nr_phases++;
+			break;
+		case 2:
+			if (!nr_phases)
+				break;
+			/* Modify a phase in place */
+			i=rand()%nr_phases;
+			random_phase(&pool[i]);
+			if (rekey_table_entry(table,i)) {
+				fprintf(stderr,"rekey_table_entry() failed on entry %d\n",i);
+				nr_errors++;
+			}
+			break;
+		default:
+			random_phase(&phase);
+			/* Look for existing phases every now and then */
+			if (nr_phases && rand()%4==0)
+				phase=pool[rand()%nr_phases];
+
+			found=get_phase_from_table(table,&phase,nr_compares,&sim,&index);
+			expected=linear_scan(pool,nr_phases,&phase);
+			(*nr_lookups)++;
+
+			if (!found) {
+				if (nr_phases) {
+					fprintf(stderr,"No phase found in a table of %d phases\n",nr_phases);
+					nr_errors++;
+				}
+				break;
+			}
+
+			if (sim!=expected || found!=&pool[index]) {
+				fprintf(stderr,"Lookup in table (%u,%u) returned distance %d (entry %d), expected %d\n",
+				        max_phases,bucket_width,sim,index,expected);
+				nr_errors++;
+			}
+
+			if (promote_table_entry(table,index)) {
+				fprintf(stderr,"promote_table_entry() failed on entry %d\n",index);
+				nr_errors++;
+			}
+		}
+	}
+
+	if (rekey_table_entry(table,max_phases)!=-ENOENT) {
+		fprintf(stderr,"rekey_table_entry() accepted an invalid entry\n");
+		nr_errors++;
+	}
+
+	destroy_phase_table(table);
+	return nr_errors;
+}
+
+static void usage(const char* program_name)
+{
+	fprintf(stderr,"Usage: %s [ -s <seeds> ]\n",program_name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int nr_seeds=DEFAULT_SEEDS;
+	unsigned long nr_lookups,nr_compares;
+	int nr_errors=0;
+	int i,seed;
+
+	while ((opt=getopt(argc,argv,"s:"))!=-1) {
+		switch (opt) {
+		case 's':
+			nr_seeds=atoi(optarg);
+			if (nr_seeds<=0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	printf("%-8s %8s %8s %16s\n","PHASES","WIDTH","LOOKUPS","COMPARES/LOOKUP");
+
+	for (i=0; i<sizeof(table_configs)/sizeof(table_configs[0]); i++) {
+		nr_lookups=nr_compares=0;
+
+		for (seed=0; seed<nr_seeds; seed++) {
+			srand(seed);
+			nr_errors+=check_table(table_configs[i].max_phases,table_configs[i].bucket_width,
+			                       &nr_lookups,&nr_compares);
+		}
+
+		printf("%-8u %8u %8lu %16.1f\n",table_configs[i].max_phases,table_configs[i].bucket_width,
+		       nr_lookups,(double)nr_compares/nr_lookups);
+	}
+
+	if (nr_errors) {
+		fprintf(stderr,"%d lookups disagree with the linear scan\n",nr_errors);
+		exit(1);
+	}
+
+	exit(EXIT_SUCCESS);
+}
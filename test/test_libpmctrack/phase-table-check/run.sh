@@ -0,0 +1,5 @@
+#!/bin/bash
+# Check that indexed phase tables find a phase as close to the key phase
+# as a linear scan does, on random tables of various sizes (no kernel
+# module needed)
+./phase-table-check
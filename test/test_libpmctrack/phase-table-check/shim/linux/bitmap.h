@@ -0,0 +1,33 @@
+/* Minimal user-space replacement for <linux/bitmap.h> (non-atomic) */
+#ifndef SHIM_LINUX_BITMAP_H
+#define SHIM_LINUX_BITMAP_H
+#include <string.h>
+
+#define BITS_PER_LONG (8*sizeof(unsigned long))
+#define BITS_TO_LONGS(nr) (((nr)+BITS_PER_LONG-1)/BITS_PER_LONG)
+
+static inline void bitmap_fill(unsigned long* map, unsigned int nbits)
+{
+	memset(map,0xff,BITS_TO_LONGS(nbits)*sizeof(unsigned long));
+}
+
+static inline int test_bit(int nr, const unsigned long* map)
+{
+	return (map[nr/BITS_PER_LONG]>>(nr%BITS_PER_LONG)) & 1;
+}
+
+static inline void clear_bit(int nr, unsigned long* map)
+{
+	map[nr/BITS_PER_LONG]&=~(1UL<<(nr%BITS_PER_LONG));
+}
+
+static inline unsigned long find_first_bit(const unsigned long* map, unsigned long size)
+{
+	unsigned long i;
+
+	for (i=0; i<size; i++)
+		if (test_bit(i,map))
+			return i;
+	return size;
+}
+#endif
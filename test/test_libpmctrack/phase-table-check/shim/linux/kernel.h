@@ -0,0 +1,8 @@
+/* Minimal user-space replacement for <linux/kernel.h> */
+#ifndef SHIM_LINUX_KERNEL_H
+#define SHIM_LINUX_KERNEL_H
+#include <limits.h>
+#include <stddef.h>
+
+#define container_of(ptr,type,member) ((type*)((char*)(ptr)-offsetof(type,member)))
+#endif
@@ -0,0 +1,51 @@
+/* Minimal user-space replacement for <linux/list.h> */
+#ifndef SHIM_LINUX_LIST_H
+#define SHIM_LINUX_LIST_H
+#include <linux/kernel.h>
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head* list)
+{
+	list->next=list;
+	list->prev=list;
+}
+
+static inline void __list_add(struct list_head* new, struct list_head* prev, struct list_head* next)
+{
+	next->prev=new;
+	new->next=next;
+	new->prev=prev;
+	prev->next=new;
+}
+
+static inline void list_add(struct list_head* new, struct list_head* head)
+{
+	__list_add(new,head,head->next);
+}
+
+static inline void list_del(struct list_head* entry)
+{
+	entry->next->prev=entry->prev;
+	entry->prev->next=entry->next;
+	entry->next=entry->prev=NULL;
+}
+
+static inline void list_move(struct list_head* list, struct list_head* head)
+{
+	list_del(list);
+	list_add(list,head);
+}
+
+#define list_entry(ptr,type,member) container_of(ptr,type,member)
+
+#define list_for_each(pos,head) \
+	for (pos=(head)->next; pos!=(head); pos=pos->next)
+
+#define list_for_each_entry(pos,head,member) \
+	for (pos=list_entry((head)->next,typeof(*pos),member); \
+	     &pos->member!=(head); \
+	     pos=list_entry(pos->member.next,typeof(*pos),member))
+#endif
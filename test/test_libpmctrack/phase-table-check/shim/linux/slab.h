@@ -0,0 +1,9 @@
+/* Minimal user-space replacement for <linux/slab.h> */
+#ifndef SHIM_LINUX_SLAB_H
+#define SHIM_LINUX_SLAB_H
+#include <stdlib.h>
+
+#define GFP_KERNEL 0
+#define kmalloc(size,flags) malloc(size)
+#define kfree(ptr) free(ptr)
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Minimal user-space replacement for <linux/types.h>, so that
+ * the kernel's phase table (phase_table.c) can be built in user space.
+ */
+#ifndef SHIM_LINUX_TYPES_H
+#define SHIM_LINUX_TYPES_H
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#endif
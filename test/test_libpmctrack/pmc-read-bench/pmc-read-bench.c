@@ -0,0 +1,178 @@
+/*
+ * pmc-read-bench.c
+ *
+ ******************************************************************************
+ *
+ * Copyright (c) 2015 Juan Carlos Saez <jcsaezal@ucm.es>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ ******************************************************************************
+ *
+ * Microbenchmark that estimates the cost of gathering a PMC sample.
+ * Two threads pinned to the same CPU keep yielding the processor to each
+ * other. In TBS mode, PMCTrack reads all the counters of a thread every
+ * time it is switched out, so the difference in cycles per context switch
+ * between a monitored run (-m) and a baseline run approximates the cost of
+ * reading the counters (plus the associated bookkeeping).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <pmctrack.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_ITERATIONS 200000
+
+static int nr_iterations=DEFAULT_ITERATIONS;
+static int cpu=0;
+
+static void pin_to_cpu(int cpu)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu,&mask);
+
+	if (sched_setaffinity(0,sizeof(mask),&mask)) {
+		perror("sched_setaffinity");
+		exit(1);
+	}
+}
+
+static void* yield_loop(void* arg)
+{
+	int i;
+
+	pin_to_cpu(cpu);
+
+	for (i=0; i<nr_iterations; i++)
+		sched_yield();
+
+	return NULL;
+}
+
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void usage(const char* program_name)
+{
+	fprintf(stderr,"Usage: %s [ -m ] [ -n <iterations> ] [ -c <cpu> ]\n",program_name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int monitor=0;
+	struct timespec start,end;
+	uint64_t start_cycles,end_cycles;
+	double elapsed_ns;
+	unsigned long nr_switches;
+	pthread_t threads[2];
+	int i;
+	pmctrack_desc_t* desc=NULL;
+	const char* strcfg[]= {
+#if defined(__arm__) || defined(__aarch64__)
+		"pmc1=0x11,pmc2=0x08,pmc3=0x13,pmc4=0x03"
+#elif defined(AMD)
+		"pmc0=0xc0,pmc1=0x76,pmc2=0x2e,pmc3=0x41"
+#else
+		"pmc0,pmc1,pmc2,pmc3=0x2e,umask3=0x4f,pmc4=0x2e,umask4=0x41"
+#endif
+		,NULL
+	};
+
+	while ((opt=getopt(argc,argv,"mn:c:"))!=-1) {
+		switch (opt) {
+		case 'm':
+			monitor=1;
+			break;
+		case 'n':
+			nr_iterations=atoi(optarg);
+			if (nr_iterations<=0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			cpu=atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (monitor) {
+		/* Initialize the thread descriptor */
+		if ((desc=pmctrack_init(100))==NULL)
+			exit(1);
+
+		/* TBS mode with a long period: counters are read on every switch out */
+		if (pmctrack_config_counters(desc,strcfg,NULL,1000))
+			exit(1);
+
+		/* Start counting (threads inherit the configuration) */
+		if (pmctrack_start_counters(desc))
+			exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	start_cycles=read_cycles();
+
+	for (i=0; i<2; i++) {
+		if (pthread_create(&threads[i],NULL,yield_loop,NULL)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (i=0; i<2; i++)
+		pthread_join(threads[i],NULL);
+
+	end_cycles=read_cycles();
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	elapsed_ns=(end.tv_sec-start.tv_sec)*1000000000.0+(end.tv_nsec-start.tv_nsec);
+	nr_switches=2UL*nr_iterations;
+
+	printf("[%s] %.1f ns/switch",monitor?"monitored":"baseline",elapsed_ns/nr_switches);
+	if (end_cycles!=start_cycles)
+		printf(", %.1f cycles/switch",(double)(end_cycles-start_cycles)/nr_switches);
+	printf("\n");
+
+	if (monitor) {
+		/* Stop counting */
+		if (pmctrack_stop_counters(desc))
+			exit(1);
+
+		/* Free up memory */
+		pmctrack_destroy(desc);
+	}
+
+	exit(EXIT_SUCCESS);
+}
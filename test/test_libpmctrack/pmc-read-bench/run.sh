@@ -0,0 +1,5 @@
+#!/bin/bash
+# Cost of reading the PMCs on every context switch (TBS mode).
+# Run it with the kernel module built before and after a change to compare.
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./pmc-read-bench
+LD_LIBRARY_PATH=../../../src/lib/libpmctrack ./pmc-read-bench -m